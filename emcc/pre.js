@@ -69,9 +69,11 @@ Module.runWithFiles = (args, config) => {
 }
 
 // Web worker
-onmessage = function(e) {
-  Module.runWithFiles (e.data, { stderr: (progress) => postMessage ({ progress }) })
-    .then ((result) => {
-      postMessage ({ result });
-    })
-}
+// (not in the pthread workers of the SIMD + threads build, which have their own message handler)
+if (typeof(ENVIRONMENT_IS_PTHREAD) === 'undefined' || !ENVIRONMENT_IS_PTHREAD)
+  onmessage = function(e) {
+    Module.runWithFiles (e.data, { stderr: (progress) => postMessage ({ progress }) })
+      .then ((result) => {
+	postMessage ({ result });
+      })
+  }
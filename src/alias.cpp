@@ -0,0 +1,38 @@
+#include "alias.h"
+
+AliasSampler::AliasSampler (const vguard<double>& weights)
+  : prob (weights.size()),
+    alias (weights.size())
+{
+  const size_t n = weights.size();
+  Assert (n > 0, "Empty distribution in AliasSampler");
+  double norm = 0;
+  for (auto w : weights) {
+    Assert (w >= 0, "Negative weights in AliasSampler");
+    norm += w;
+  }
+  Assert (norm > 0, "Zero weights in AliasSampler");
+
+  // scale so the mean column height is 1, then pair each short column with a tall one
+  vguard<size_t> small, large;
+  for (size_t k = 0; k < n; ++k) {
+    prob[k] = weights[k] * n / norm;
+    alias[k] = k;
+    (prob[k] < 1 ? small : large).push_back (k);
+  }
+  while (small.size() && large.size()) {
+    const size_t s = small.back(), l = large.back();
+    small.pop_back();
+    alias[s] = l;
+    prob[l] -= 1 - prob[s];
+    if (prob[l] < 1) {
+      large.pop_back();
+      small.push_back (l);
+    }
+  }
+  // whatever is left is 1, up to rounding error
+  for (auto k : large)
+    prob[k] = 1;
+  for (auto k : small)
+    prob[k] = 1;
+}
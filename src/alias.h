@@ -0,0 +1,48 @@
+#ifndef ALIAS_INCLUDED
+#define ALIAS_INCLUDED
+
+#include <cstddef>
+#include "vguard.h"
+#include "util.h"
+
+using namespace std;
+
+/* Walker's alias method (with Vose's construction).
+   Building the table from K weights is O(K); each draw is then O(1):
+   pick a column uniformly, then either keep it or take its alias.
+   Worth it whenever a distribution is sampled more than a handful of times;
+   for a single draw, random_index is cheaper. */
+class AliasSampler {
+private:
+  vguard<double> prob;  // probability of keeping column k
+  vguard<size_t> alias;
+
+public:
+  AliasSampler() { }
+  AliasSampler (const vguard<double>& weights);
+
+  size_t size() const { return prob.size(); }
+
+  template<class Generator>
+  inline size_t sample (Generator& generator) const {
+    const size_t k = min ((size_t) (random_double(generator) * prob.size()), prob.size() - 1);
+    return random_double(generator) < prob[k] ? k : alias[k];
+  }
+
+  // batched draws
+  template<class Generator>
+  void sample (Generator& generator, size_t n, vguard<size_t>& result) const {
+    result.resize (n);
+    for (auto& k : result)
+      k = sample (generator);
+  }
+
+  template<class Generator>
+  vguard<size_t> sample (Generator& generator, size_t n) const {
+    vguard<size_t> result;
+    sample (generator, n, result);
+    return result;
+  }
+};
+
+#endif /* ALIAS_INCLUDED */
@@ -52,10 +52,12 @@ struct GuideAlignmentEnvelope {
   inline bool initialized() const { return maxDistance >= 0; }
 
   inline bool inRange (SeqIdx pos1, SeqIdx pos2) const {
-    if (!initialized())
-      return true;
-    const int d = cumulativeMatches[row1PosToCol[pos1]] - cumulativeMatches[row2PosToCol[pos2]];
-    return abs(d) <= maxDistance;
+    return !initialized() || distance (pos1, pos2) <= maxDistance;
+  }
+
+  // number of diagonals between (pos1,pos2) and the guide alignment
+  inline int distance (SeqIdx pos1, SeqIdx pos2) const {
+    return abs (cumulativeMatches[row1PosToCol[pos1]] - cumulativeMatches[row2PosToCol[pos2]]);
   }
 };
 
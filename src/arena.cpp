@@ -0,0 +1,40 @@
+#include <algorithm>
+#include "arena.h"
+
+MonotonicArena::MonotonicArena (size_t blockSize)
+  : currentBlock(0), offset(0), blockSize(blockSize), bytesAllocated(0)
+{ }
+
+void* MonotonicArena::allocSlow (size_t bytes, size_t align) {
+  // try the next recycled block, if there is one big enough; otherwise make a new block
+  for (currentBlock = blocks.empty() ? 0 : currentBlock + 1; currentBlock < blocks.size(); ++currentBlock)
+    if (blocks[currentBlock].size >= bytes + align) {
+      offset = 0;
+      return alloc (bytes, align);
+    }
+  Block b;
+  b.size = max (blockSize, bytes + align);
+  b.data.reset (new char[b.size]);
+  blocks.push_back (move (b));
+  currentBlock = blocks.size() - 1;
+  offset = 0;
+  return alloc (bytes, align);
+}
+
+void MonotonicArena::reset() {
+  currentBlock = 0;
+  offset = 0;
+  bytesAllocated = 0;
+}
+
+void MonotonicArena::release() {
+  blocks.clear();
+  reset();
+}
+
+size_t MonotonicArena::bytesReserved() const {
+  size_t total = 0;
+  for (const auto& b : blocks)
+    total += b.size;
+  return total;
+}
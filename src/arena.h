@@ -0,0 +1,73 @@
+#ifndef ARENA_INCLUDED
+#define ARENA_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <memory>
+
+using namespace std;
+
+#define DefaultArenaBlockSize (1 << 20)
+
+/* Monotonic ("bump pointer") arena.
+   Allocation is a pointer increment; individual frees are no-ops;
+   reset() recycles all blocks at once, without returning memory to the system.
+   Objects placed in the arena must not need their destructors called. */
+class MonotonicArena {
+private:
+  struct Block {
+    unique_ptr<char[]> data;
+    size_t size;
+  };
+  vector<Block> blocks;
+  size_t currentBlock, offset, blockSize;
+  size_t bytesAllocated;
+
+  void* allocSlow (size_t bytes, size_t align);
+
+  MonotonicArena (const MonotonicArena&) = delete;
+  MonotonicArena& operator= (const MonotonicArena&) = delete;
+
+public:
+  MonotonicArena (size_t blockSize = DefaultArenaBlockSize);
+
+  inline void* alloc (size_t bytes, size_t align = alignof(max_align_t)) {
+    if (currentBlock < blocks.size()) {
+      const uintptr_t base = (uintptr_t) blocks[currentBlock].data.get();
+      const size_t aligned = ((base + offset + align - 1) & ~(uintptr_t) (align - 1)) - base;
+      if (aligned + bytes <= blocks[currentBlock].size) {
+	offset = aligned + bytes;
+	bytesAllocated += bytes;
+	return (void*) (base + aligned);
+      }
+    }
+    return allocSlow (bytes, align);
+  }
+
+  template<typename T>
+  inline T* allocArray (size_t n) {
+    return (T*) alloc (n * sizeof(T), alignof(T));
+  }
+
+  void reset();    // recycle all blocks
+  void release();  // return all blocks to the system
+
+  size_t bytesInUse() const { return bytesAllocated; }
+  size_t bytesReserved() const;
+};
+
+/* STL-compatible allocator drawing from a MonotonicArena */
+template<typename T>
+struct ArenaAllocator {
+  typedef T value_type;
+  MonotonicArena* arena;
+  ArenaAllocator (MonotonicArena& arena) : arena(&arena) { }
+  template<typename U> ArenaAllocator (const ArenaAllocator<U>& other) : arena(other.arena) { }
+  T* allocate (size_t n) { return arena->allocArray<T> (n); }
+  void deallocate (T*, size_t) { }
+  template<typename U> bool operator== (const ArenaAllocator<U>& other) const { return arena == other.arena; }
+  template<typename U> bool operator!= (const ArenaAllocator<U>& other) const { return arena != other.arena; }
+};
+
+#endif /* ARENA_INCLUDED */
@@ -0,0 +1,99 @@
+#ifndef BINIO_INCLUDED
+#define BINIO_INCLUDED
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <type_traits>
+#include "vguard.h"
+#include "util.h"
+
+using namespace std;
+
+/* Minimal native-endian binary serialization, for scratch & cache files that are
+   written and read back by the same binary (e.g. spilled profiles, compiled models).
+   Not intended as a portable interchange format; use JSON for that. */
+
+template<typename T>
+inline void writeBinary (ostream& out, const T& t) {
+  static_assert (is_trivially_copyable<T>::value, "writeBinary: type is not trivially copyable");
+  out.write ((const char*) &t, sizeof(T));
+}
+
+template<typename T>
+inline void readBinary (istream& in, T& t) {
+  static_assert (is_trivially_copyable<T>::value, "readBinary: type is not trivially copyable");
+  in.read ((char*) &t, sizeof(T));
+  Require (in.gcount() == sizeof(T), "Unexpected end of binary file");
+}
+
+inline void writeBinary (ostream& out, const string& s) {
+  writeBinary (out, (size_t) s.size());
+  out.write (s.data(), s.size());
+}
+
+inline void readBinary (istream& in, string& s) {
+  size_t n;
+  readBinary (in, n);
+  s.resize (n);
+  if (n) {
+    in.read (&s[0], n);
+    Require ((size_t) in.gcount() == n, "Unexpected end of binary file");
+  }
+}
+
+inline void writeBinary (ostream& out, const vguard<bool>& v) {
+  writeBinary (out, (size_t) v.size());
+  for (bool b : v)
+    writeBinary (out, (char) b);
+}
+
+inline void readBinary (istream& in, vguard<bool>& v) {
+  size_t n;
+  readBinary (in, n);
+  v.resize (n);
+  for (size_t i = 0; i < n; ++i) {
+    char c;
+    readBinary (in, c);
+    v[i] = c;
+  }
+}
+
+template<typename T>
+inline void writeBinary (ostream& out, const vguard<T>& v) {
+  writeBinary (out, (size_t) v.size());
+  for (const auto& t : v)
+    writeBinary (out, t);
+}
+
+template<typename T>
+inline void readBinary (istream& in, vguard<T>& v) {
+  size_t n;
+  readBinary (in, n);
+  v.resize (n);
+  for (auto& t : v)
+    readBinary (in, t);
+}
+
+template<typename K,typename V>
+inline void writeBinary (ostream& out, const map<K,V>& m) {
+  writeBinary (out, (size_t) m.size());
+  for (const auto& kv : m) {
+    writeBinary (out, kv.first);
+    writeBinary (out, kv.second);
+  }
+}
+
+template<typename K,typename V>
+inline void readBinary (istream& in, map<K,V>& m) {
+  size_t n;
+  readBinary (in, n);
+  m.clear();
+  for (size_t i = 0; i < n; ++i) {
+    K k;
+    readBinary (in, k);
+    readBinary (in, m[k]);
+  }
+}
+
+#endif /* BINIO_INCLUDED */
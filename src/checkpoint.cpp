@@ -0,0 +1,164 @@
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+#include "util.h"
+
+void CheckpointWriter::writeVarint (uint64_t x) {
+  while (x >= 0x80) {
+    buf.push_back ((char) (0x80 | (x & 0x7f)));
+    x >>= 7;
+  }
+  buf.push_back ((char) x);
+}
+
+void CheckpointWriter::writeString (const string& s) {
+  writeVarint (s.size());
+  buf.append (s);
+}
+
+void CheckpointWriter::writeDouble (double d) {
+  uint64_t bits;
+  memcpy (&bits, &d, sizeof(bits));
+  for (int n = 0; n < 8; ++n)
+    buf.push_back ((char) ((bits >> (8*n)) & 0xff));
+}
+
+void CheckpointWriter::writeDoubles (const vguard<double>& v) {
+  writeVarint (v.size());
+  for (auto d : v)
+    writeDouble (d);
+}
+
+void CheckpointWriter::writeInts (const vguard<int>& v) {
+  writeVarint (v.size());
+  for (auto i : v)
+    writeVarint ((uint64_t) (int64_t) i);
+}
+
+void CheckpointWriter::writeTree (const Tree& tree) {
+  writeVarint (tree.nodes());
+  for (const auto& node : tree.node) {
+    writeString (node.name);
+    writeVarint (node.parent + 1);
+    writeDouble (node.d);
+    writeVarint (node.child.size());
+    for (auto c : node.child)
+      writeVarint (c);
+  }
+}
+
+void CheckpointWriter::writeSeqs (const vguard<FastSeq>& seqs) {
+  writeVarint (seqs.size());
+  for (const auto& fs : seqs) {
+    writeString (fs.name);
+    writeString (fs.seq);
+  }
+}
+
+void CheckpointWriter::save (const string& filename) const {
+  const string tmpFilename = filename + ".tmp";
+  {
+    ofstream out (tmpFilename, ios::binary);
+    Require (out, "Could not open %s", tmpFilename.c_str());
+    out.write (buf.data(), buf.size());
+    out.flush();
+    Require (out, "Error writing %s", tmpFilename.c_str());
+  }
+  Require (rename (tmpFilename.c_str(), filename.c_str()) == 0, "Could not rename %s to %s", tmpFilename.c_str(), filename.c_str());
+}
+
+CheckpointReader::CheckpointReader (const string& filename)
+  : pos (0),
+    filename (filename)
+{
+  ifstream in (filename, ios::binary);
+  Require (in, "Could not open %s", filename.c_str());
+  ostringstream contents;
+  contents << in.rdbuf();
+  buf = contents.str();
+  Require (readString() == CheckpointMagic, "%s is not a historian checkpoint file", filename.c_str());
+}
+
+unsigned char CheckpointReader::readByte() {
+  Require (pos < buf.size(), "Truncated checkpoint file %s", filename.c_str());
+  return (unsigned char) buf[pos++];
+}
+
+uint64_t CheckpointReader::readVarint() {
+  uint64_t x = 0;
+  for (int shift = 0; ; shift += 7) {
+    Require (shift < 64, "Corrupt checkpoint file %s", filename.c_str());
+    const unsigned char c = readByte();
+    x |= ((uint64_t) (c & 0x7f)) << shift;
+    if (!(c & 0x80))
+      break;
+  }
+  return x;
+}
+
+string CheckpointReader::readString() {
+  const size_t len = readVarint();
+  Require (len <= buf.size() - pos, "Truncated checkpoint file %s", filename.c_str());
+  const string s = buf.substr (pos, len);
+  pos += len;
+  return s;
+}
+
+double CheckpointReader::readDouble() {
+  uint64_t bits = 0;
+  for (int n = 0; n < 8; ++n)
+    bits |= ((uint64_t) readByte()) << (8*n);
+  double d;
+  memcpy (&d, &bits, sizeof(d));
+  return d;
+}
+
+vguard<double> CheckpointReader::readDoubles() {
+  vguard<double> v (readVarint());
+  for (auto& d : v)
+    d = readDouble();
+  return v;
+}
+
+vguard<int> CheckpointReader::readInts() {
+  vguard<int> v (readVarint());
+  for (auto& i : v)
+    i = (int) (int64_t) readVarint();
+  return v;
+}
+
+Tree CheckpointReader::readTree() {
+  Tree tree;
+  tree.node = vector<TreeNode> (readVarint());
+  for (auto& node : tree.node) {
+    node.name = readString();
+    node.parent = (TreeNodeIndex) readVarint() - 1;
+    node.d = readDouble();
+    node.child = vguard<TreeNodeIndex> (readVarint());
+    for (auto& c : node.child)
+      c = readVarint();
+  }
+  return tree;
+}
+
+vguard<FastSeq> CheckpointReader::readSeqs() {
+  vguard<FastSeq> seqs (readVarint());
+  for (auto& fs : seqs) {
+    fs.name = readString();
+    fs.seq = readString();
+  }
+  return seqs;
+}
+
+bool checkpointExists (const string& filename) {
+  struct stat st;
+  return stat (filename.c_str(), &st) == 0;
+}
+
+void truncateFile (const string& filename, uint64_t length) {
+  Require (truncate (filename.c_str(), (off_t) length) == 0, "Could not truncate %s", filename.c_str());
+}
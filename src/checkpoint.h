@@ -0,0 +1,65 @@
+#ifndef CHECKPOINT_INCLUDED
+#define CHECKPOINT_INCLUDED
+
+#include <string>
+#include <cstdint>
+#include "vguard.h"
+#include "tree.h"
+#include "fastseq.h"
+
+using namespace std;
+
+#define DefaultMCMCCheckpointInterval 1000
+#define CheckpointMagic "historian-checkpoint-1"
+
+/* Binary checkpoint files.
+
+   Integers are stored as unsigned LEB128 varints, strings as length-prefixed bytes,
+   and doubles as their IEEE 754 bit patterns (little-endian), as in binary traces,
+   so that a restored state is bit-identical to the saved one.
+
+   The file is written to a temporary name and then renamed,
+   so an interrupted write leaves the previous checkpoint intact. */
+
+class CheckpointWriter {
+private:
+  string buf;
+public:
+  CheckpointWriter() { writeString (CheckpointMagic); }
+  void writeVarint (uint64_t x);
+  void writeBool (bool b) { writeVarint (b ? 1 : 0); }
+  void writeString (const string& s);
+  void writeDouble (double d);
+  void writeDoubles (const vguard<double>& v);
+  void writeInts (const vguard<int>& v);
+  void writeTree (const Tree& tree);
+  void writeSeqs (const vguard<FastSeq>& seqs);
+  void save (const string& filename) const;
+};
+
+class CheckpointReader {
+private:
+  string buf;
+  size_t pos;
+  unsigned char readByte();
+public:
+  const string filename;
+  CheckpointReader (const string& filename);
+  uint64_t readVarint();
+  bool readBool() { return readVarint() != 0; }
+  string readString();
+  double readDouble();
+  vguard<double> readDoubles();
+  vguard<int> readInts();
+  Tree readTree();
+  vguard<FastSeq> readSeqs();
+  bool finished() const { return pos == buf.size(); }
+};
+
+// true if the file exists
+bool checkpointExists (const string& filename);
+
+// cut a file back to the given length, e.g. to discard output written after the last checkpoint
+void truncateFile (const string& filename, uint64_t length);
+
+#endif /* CHECKPOINT_INCLUDED */
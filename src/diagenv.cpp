@@ -116,13 +116,16 @@ void DiagonalEnvelope::initSparse (const KmerIndex& yKmerIndex, unsigned int ban
     }
   }
 
-  const UnvalidatedTokSeq xTok = px->unvalidatedTokens (yKmerIndex.alphabet);
+  CompactTokSeq xTokSeq;
+  if (!xTok)
+    xTokSeq = TokenTable(yKmerIndex.alphabet).tokenize (px->seq);
+  const CompactTok* xt = xTok ? xTok : xTokSeq.data();
   const AlphTok alphabetSize = (AlphTok) yKmerIndex.alphabet.size();
   
   map<int,unsigned int> diagKmerCount;
   for (SeqIdx i = 0; i <= xLen - kmerLen; ++i)
-    if (kmerValid (kmerLen, xTok.begin() + i)) {
-      const auto yKmerIndexIter = yKmerIndex.kmerLocations.find (makeKmer (kmerLen, xTok.begin() + i, alphabetSize));
+    if (kmerValid (kmerLen, xt + i)) {
+      const auto yKmerIndexIter = yKmerIndex.kmerLocations.find (makeKmer (kmerLen, xt + i, alphabetSize));
       if (yKmerIndexIter != yKmerIndex.kmerLocations.end())
 	for (auto j : yKmerIndexIter->second)
 	  ++diagKmerCount[get_diag(i,j)];
@@ -35,6 +35,7 @@ struct DiagEnvParams {
 
 struct DiagonalEnvelope {
   const FastSeq *px, *py;
+  const CompactTok *xTok, *yTok;  // pre-tokenized sequences, if available (NULL otherwise)
   const SeqIdx xLen, yLen;
   vguard<int> diagonals, storageDiagonals;   // Sorted ascending. (i,j) is on diagonal d if i-j=d
   vguard<int> storageIndex;  // storageIndex[yLen + storageDiagonals[n]] = n, or -1 if outside envelope
@@ -43,7 +44,9 @@ struct DiagonalEnvelope {
   vguard<size_t> cumulStorageSize;  // cumulStorageSize[j] = sum_{j'=0}^{j-1} storageSize[j]
   size_t totalStorageSize;  // sum_{j=0}^{yLen} storageSize[j]
   DiagonalEnvelope (const FastSeq& x, const FastSeq& y)
-    : px(&x), py(&y), xLen(px->length()), yLen(py->length()) { }
+    : px(&x), py(&y), xTok(NULL), yTok(NULL), xLen(px->length()), yLen(py->length()) { }
+  DiagonalEnvelope (const FastSeq& x, const FastSeq& y, const CompactTok* xTok, const CompactTok* yTok)
+    : px(&x), py(&y), xTok(xTok), yTok(yTok), xLen(px->length()), yLen(py->length()) { }
   void initFull();
   void initSparse (const KmerIndex& yKmerIndex,
 		   unsigned int bandSize = DEFAULT_BAND_SIZE,
@@ -0,0 +1,53 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include "dpscratch.h"
+
+ScratchMapping::ScratchMapping (const string& dir, size_t len)
+  : fd (-1),
+    base (NULL),
+    bytes (max (len, (size_t) 1))
+{
+  string filename = dir + "/historian-dp.XXXXXX";
+  vguard<char> name (filename.begin(), filename.end());
+  name.push_back (0);
+  fd = mkstemp (name.data());
+  Require (fd >= 0, "Could not create DP scratch file in %s", dir.c_str());
+  unlink (name.data());
+  // reserve the space now, so a full disk is an error here rather than a SIGBUS during the fill
+  Require (posix_fallocate (fd, 0, bytes) == 0, "Could not allocate %zu bytes for DP scratch file in %s", bytes, dir.c_str());
+  void* p = mmap (NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  Require (p != MAP_FAILED, "Could not map %zu-byte DP scratch file in %s", bytes, dir.c_str());
+  base = (char*) p;
+}
+
+ScratchMapping::~ScratchMapping() {
+  if (base)
+    munmap (base, bytes);
+  if (fd >= 0)
+    close (fd);
+}
+
+void ScratchMapping::advise (size_t start, size_t end, int advice) const {
+  end = min (bytes, end);
+  if (end > start)
+    madvise (base + start, end - start, advice);
+}
+
+void ScratchMapping::willNeed (size_t offset, size_t len) const {
+  const size_t page = sysconf (_SC_PAGESIZE);
+  advise (offset / page * page, offset + len, MADV_WILLNEED);
+}
+
+void ScratchMapping::evict (size_t offset, size_t len) const {
+  // only whole pages, so as not to drop the edges of neighbouring blocks
+  const size_t page = sysconf (_SC_PAGESIZE);
+  advise ((offset + page - 1) / page * page, (offset + len) / page * page, MADV_DONTNEED);
+}
+
+size_t ScratchMapping::availableBytes (const string& dir) {
+  struct statvfs fs;
+  Require (statvfs (dir.c_str(), &fs) == 0, "Could not stat DP scratch directory %s", dir.c_str());
+  return (size_t) fs.f_bavail * fs.f_frsize;
+}
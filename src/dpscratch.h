@@ -0,0 +1,136 @@
+#ifndef DPSCRATCH_INCLUDED
+#define DPSCRATCH_INCLUDED
+
+#include <string>
+#include <memory>
+#include <new>
+#include "vguard.h"
+#include "util.h"
+
+using namespace std;
+
+#define DefaultDPScratchBlockSize (1 << 24)
+
+/* Memory-mapped scratch file.
+   The file is created in the given directory and unlinked straight away,
+   so it vanishes when the mapping is closed, or if the process dies.
+   Its pages are backed by the file rather than by swap, so the kernel can write them out
+   and reclaim them under memory pressure; willNeed() and evict() pass hints to madvise. */
+class ScratchMapping {
+private:
+  int fd;
+  char* base;
+  size_t bytes;
+
+  void advise (size_t start, size_t end, int advice) const;
+
+  ScratchMapping (const ScratchMapping&) = delete;
+  ScratchMapping& operator= (const ScratchMapping&) = delete;
+
+public:
+  ScratchMapping (const string& dir, size_t bytes);
+  ~ScratchMapping();
+
+  void* data() const { return base; }
+  size_t size() const { return bytes; }
+
+  void willNeed (size_t offset, size_t len) const;  // start reading pages in
+  void evict (size_t offset, size_t len) const;  // drop pages from this process (contents are kept in the file)
+
+  static size_t availableBytes (const string& dir);
+};
+
+/* Out-of-core DP cell storage, as columns of cells in a ScratchMapping.
+   Column x holds a dense band of y's, followed by one slot for each "edge" y
+   (cells that are stored in every column, whether or not they fall inside the band).
+   Columns are laid out in fill order, and grouped into blocks of at least blockSize bytes.
+   visitColumn() keeps the current block and its two neighbours mapped, evicts the rest,
+   and prefetches the next block in the direction of travel,
+   so forward fills and reverse (traceback, Backward, posterior) passes both stream sequentially. */
+template<class Cell>
+class ScratchColumns {
+private:
+  unique_ptr<ScratchMapping> mapping;
+  Cell* cells;
+  vguard<size_t> columnStart;  // index of first cell in each column, plus one past the end
+  vguard<size_t> bandStart, bandEnd;
+  vguard<int> edgeRank;  // slot of each edge y after the band, or -1
+  vguard<size_t> columnBlock, blockStart;  // blockStart has one extra entry past the end
+  mutable size_t currentBlock;
+  mutable bool reverse;
+
+  size_t blockOffset (size_t block) const { return columnStart[blockStart[block]] * sizeof(Cell); }
+  size_t blockBytes (size_t block) const { return blockOffset (block + 1) - blockOffset (block); }
+  size_t blocks() const { return blockStart.size() - 1; }
+
+  void enterBlock (size_t block) const {
+    const size_t prev = currentBlock;
+    currentBlock = block;
+    if (prev < blocks() && block != prev)
+      reverse = block < prev;
+    const size_t lo = block > 0 ? block - 1 : 0, hi = min (block + 1, blocks() - 1);
+    mapping->evict (0, blockOffset (lo));
+    mapping->evict (blockOffset (hi + 1), mapping->size());
+    if (reverse ? block > 0 : block + 1 < blocks()) {
+      const size_t next = reverse ? block - 1 : block + 1;
+      mapping->willNeed (blockOffset (next), blockBytes (next));
+    }
+  }
+
+public:
+  // band[x] = (first y, one past last y) stored densely in column x; edge[y] = true if y is stored in every column
+  ScratchColumns (const string& dir, const vguard<pair<size_t,size_t> >& band, const vguard<bool>& edge, size_t blockSize = DefaultDPScratchBlockSize)
+    : columnStart (band.size() + 1, 0),
+      bandStart (band.size()),
+      bandEnd (band.size()),
+      edgeRank (edge.size(), -1),
+      columnBlock (band.size()),
+      reverse (false)
+  {
+    int edges = 0;
+    for (size_t y = 0; y < edge.size(); ++y)
+      if (edge[y])
+	edgeRank[y] = edges++;
+    blockStart.push_back (0);
+    for (size_t x = 0; x < band.size(); ++x) {
+      bandStart[x] = band[x].first;
+      bandEnd[x] = max (band[x].first, band[x].second);
+      columnStart[x+1] = columnStart[x] + (bandEnd[x] - bandStart[x]) + edges;
+      columnBlock[x] = blockStart.size() - 1;
+      if ((columnStart[x+1] - columnStart[blockStart.back()]) * sizeof(Cell) >= blockSize && x + 1 < band.size())
+	blockStart.push_back (x + 1);
+    }
+    blockStart.push_back (band.size());
+    currentBlock = blocks();
+
+    mapping.reset (new ScratchMapping (dir, columnStart.back() * sizeof(Cell)));
+    cells = (Cell*) mapping->data();
+    for (size_t block = 0; block < blocks(); ++block) {
+      for (size_t n = columnStart[blockStart[block]]; n < columnStart[blockStart[block+1]]; ++n)
+	new (cells + n) Cell();
+      mapping->evict (blockOffset (block), blockBytes (block));
+    }
+  }
+
+  inline Cell* find (size_t x, size_t y) {
+    if (y >= bandStart[x] && y < bandEnd[x])
+      return cells + columnStart[x] + (y - bandStart[x]);
+    if (edgeRank[y] >= 0)
+      return cells + columnStart[x] + (bandEnd[x] - bandStart[x]) + edgeRank[y];
+    return NULL;
+  }
+
+  inline const Cell* find (size_t x, size_t y) const {
+    return const_cast<ScratchColumns<Cell>*> (this)->find (x, y);
+  }
+
+  inline void visitColumn (size_t x) const {
+    if (columnBlock[x] != currentBlock)
+      enterBlock (columnBlock[x]);
+  }
+
+  size_t cellCount() const { return columnStart.back(); }
+  size_t bytes() const { return mapping->size(); }
+};
+
+#endif /* DPSCRATCH_INCLUDED */
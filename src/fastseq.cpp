@@ -25,6 +25,69 @@ UnvalidatedTokSeq tokenize (const string& s, const string& alphabet) {
   return tok;
 }
 
+TokenTable::TokenTable (const string& alphabet) {
+  Assert (alphabet.size() <= CompactTokMaxAlphabetSize, "Alphabet is too large for compact tokens");
+  for (int c = 0; c < 256; ++c)
+    tok[c] = Alignment::isGap(c) ? CompactTokGap : (Alignment::isWildcard(c) ? CompactTokWildcard : CompactTokInvalid);
+  // exact matches take precedence over case-insensitive ones, as in tokenize(char,alphabet)
+  for (size_t n = 0; n < alphabet.size(); ++n)
+    tok[(unsigned char) alphabet[n]] = (CompactTok) n;
+  for (size_t n = 0; n < alphabet.size(); ++n) {
+    const char c = alphabet[n], d = isupper(c) ? tolower(c) : toupper(c);
+    if (!compactTokValid (tok[(unsigned char) d]))
+      tok[(unsigned char) d] = (CompactTok) n;
+  }
+}
+
+CompactTokSeq TokenTable::tokenize (const string& s) const {
+  CompactTokSeq t (s.size());
+  for (size_t n = 0; n < s.size(); ++n)
+    t[n] = (*this) (s[n]);
+  return t;
+}
+
+TokenStore::TokenStore (const vguard<FastSeq>& seqs, const string& alphabet, bool gapped)
+  : alphabet (alphabet),
+    table (alphabet),
+    name (seqs.size()),
+    tok (seqs.size()),
+    posToCol (seqs.size()),
+    colToPos (seqs.size())
+{
+  for (size_t row = 0; row < seqs.size(); ++row) {
+    name[row] = seqs[row].name;
+    const string& s = seqs[row].seq;
+    CompactTokSeq& t = tok[row];
+    vguard<SeqIdx>& p2c = posToCol[row];
+    vguard<SeqIdx>& c2p = colToPos[row];
+    t.reserve (s.size());
+    p2c.reserve (s.size());
+    c2p.reserve (s.size());
+    for (SeqIdx col = 0; col < s.size(); ++col)
+      if (gapped && Alignment::isGap (s[col]))
+	c2p.push_back (TokenStoreGapPos);
+      else {
+	c2p.push_back (t.size());
+	p2c.push_back (col);
+	t.push_back (table (s[col]));
+      }
+  }
+}
+
+void TokenStore::setColumns (size_t row, const vguard<bool>& isResidue) {
+  vguard<SeqIdx>& p2c = posToCol[row];
+  vguard<SeqIdx>& c2p = colToPos[row];
+  p2c.clear();
+  c2p.clear();
+  for (SeqIdx col = 0; col < isResidue.size(); ++col)
+    if (isResidue[col]) {
+      c2p.push_back (p2c.size());
+      p2c.push_back (col);
+    } else
+      c2p.push_back (TokenStoreGapPos);
+  Assert (p2c.size() == tok[row].size(), "Alignment row %u (%s) has %u residues, but the sequence has %u", row, name[row].c_str(), p2c.size(), tok[row].size());
+}
+
 const char FastSeq::minQualityChar = '!';
 const char FastSeq::maxQualityChar = '~';
 const QualScore FastSeq::qualScoreRange = 94;
@@ -161,6 +224,24 @@ Kmer makeKmer (SeqIdx k, vector<int>::const_iterator tok, AlphTok alphabetSize)
   return kmer;
 }
 
+bool kmerValid (SeqIdx k, const CompactTok* tok) {
+  for (SeqIdx j = 0; j < k; ++j)
+    if (!compactTokValid (tok[j]))
+      return false;
+  return true;
+}
+
+Kmer makeKmer (SeqIdx k, const CompactTok* tok, AlphTok alphabetSize) {
+  Kmer kmer = 0, mul = 1;
+  for (SeqIdx j = 0; j < k; ++j) {
+    const CompactTok token = tok[k - j - 1];
+    Assert (compactTokValid (token), "Invalid token in makeKmer");
+    kmer += mul * token;
+    mul *= alphabetSize;
+  }
+  return kmer;
+}
+
 Kmer numberOfKmers (SeqIdx k, AlphTok alphabetSize) {
   Kmer n;
   for (n = 1; k > 0; --k)
@@ -256,13 +337,22 @@ set<string> fastSeqDuplicateNames (const vguard<FastSeq>& seqs) {
 KmerIndex::KmerIndex (const FastSeq& seq, const string& alphabet, SeqIdx kmerLen)
   : seq(seq), alphabet(alphabet), kmerLen(kmerLen)
 {
+  build (TokenTable(alphabet).tokenize(seq.seq).data());
+}
+
+KmerIndex::KmerIndex (const FastSeq& seq, const string& alphabet, const CompactTok* tok, SeqIdx kmerLen)
+  : seq(seq), alphabet(alphabet), kmerLen(kmerLen)
+{
+  build (tok);
+}
+
+void KmerIndex::build (const CompactTok* tok) {
   LogThisAt(5, "Building " << kmerLen << "-mer index for " << seq.name << endl);
-  const UnvalidatedTokSeq tok = seq.unvalidatedTokens (alphabet);
   const AlphTok alphabetSize = (AlphTok) alphabet.size();
   const SeqIdx seqLen = seq.length();
   for (SeqIdx j = 0; j + kmerLen <= seqLen; ++j)
-    if (kmerValid(kmerLen,tok.begin() + j))
-      kmerLocations[makeKmer (kmerLen, tok.begin() + j, alphabetSize)].push_back (j);
+    if (kmerValid(kmerLen,tok + j))
+      kmerLocations[makeKmer (kmerLen, tok + j, alphabetSize)].push_back (j);
 
   if (LoggingThisAt(8)) {
     LogStream (8, "Frequencies of " << kmerLen << "-mers in " << seq.name << ':' << endl);
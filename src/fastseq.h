@@ -30,9 +30,28 @@ UnvalidatedTokSeq tokenize (const string& s, const string& alphabet);
 TokSeq validTokenize (const string& s, const string& alphabet, const char* seqname = NULL);
 string detokenize (const TokSeq& s, const string& alphabet);
 
+// compact one-byte tokens, for alphabets of up to CompactTokMaxAlphabetSize symbols
+typedef unsigned char CompactTok;
+typedef vguard<CompactTok> CompactTokSeq;
+#define CompactTokMaxAlphabetSize 0xfd
+#define CompactTokGap      0xfd
+#define CompactTokWildcard 0xfe
+#define CompactTokInvalid  0xff
+inline bool compactTokValid (CompactTok t) { return t < CompactTokMaxAlphabetSize; }
+
+// constant-time character lookup, equivalent to tokenize(char,alphabet)
+struct TokenTable {
+  CompactTok tok[256];
+  TokenTable (const string& alphabet = string());
+  inline CompactTok operator() (char c) const { return tok[(unsigned char) c]; }
+  CompactTokSeq tokenize (const string& s) const;
+};
+
 // kmers
 bool kmerValid (SeqIdx k, vector<UnvalidatedAlphTok>::const_iterator tok);
 Kmer makeKmer (SeqIdx k, vector<UnvalidatedAlphTok>::const_iterator tok, AlphTok alphabetSize);
+bool kmerValid (SeqIdx k, const CompactTok* tok);
+Kmer makeKmer (SeqIdx k, const CompactTok* tok, AlphTok alphabetSize);
 Kmer numberOfKmers (SeqIdx k, AlphTok alphabetSize);
 string kmerToString (Kmer kmer, SeqIdx k, const string& alphabet);
 
@@ -81,6 +100,38 @@ struct KmerIndex {
   const SeqIdx kmerLen;
   map <Kmer, vector<SeqIdx> > kmerLocations;
   KmerIndex (const FastSeq& seq, const string& alphabet, SeqIdx kmerLen);
+  KmerIndex (const FastSeq& seq, const string& alphabet, const CompactTok* tok, SeqIdx kmerLen);
+private:
+  void build (const CompactTok* tok);
+};
+
+// Sequences tokenized once, for sharing between the routines that scan them.
+// May be built from gapped or ungapped sequences; tokens are stored ungapped,
+// with maps between alignment columns and sequence positions.
+// For ungapped sequences, every character is a position (including any gap characters,
+// which may appear in unaligned input and are tokenized as CompactTokGap),
+// and columns are positions unless the column maps are set from an alignment.
+#define TokenStoreGapPos ((SeqIdx) -1)
+struct TokenStore {
+  string alphabet;
+  TokenTable table;
+  vguard<string> name;  // name[row]
+  vguard<CompactTokSeq> tok;  // tok[row][pos]
+  vguard<vguard<SeqIdx> > posToCol;  // posToCol[row][pos]
+  vguard<vguard<SeqIdx> > colToPos;  // colToPos[row][col], or TokenStoreGapPos
+
+  TokenStore() { }
+  TokenStore (const vguard<FastSeq>& seqs, const string& alphabet, bool gapped = true);
+  void setColumns (size_t row, const vguard<bool>& isResidue);  // isResidue[col]
+
+  inline size_t rows() const { return tok.size(); }
+  inline SeqIdx length (size_t row) const { return (SeqIdx) tok[row].size(); }
+  inline SeqIdx columns (size_t row) const { return (SeqIdx) colToPos[row].size(); }
+  inline const CompactTok* tokens (size_t row) const { return tok[row].data(); }
+  inline CompactTok gappedTok (size_t row, SeqIdx col) const {
+    const SeqIdx pos = colToPos[row][col];
+    return pos == TokenStoreGapPos ? CompactTokGap : tok[row][pos];
+  }
 };
 
 #endif /* KSEQCONTAINER_INCLUDED */
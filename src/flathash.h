@@ -0,0 +1,182 @@
+#ifndef FLATHASH_INCLUDED
+#define FLATHASH_INCLUDED
+
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+#include "vguard.h"
+
+using namespace std;
+
+/* Open-addressing hash tables with 64-bit integer keys.
+   Linear probing in a power-of-two table that is kept at most half full,
+   so a lookup is usually one or two adjacent slots rather than a chain of tree nodes.
+   The all-ones key is reserved to mark empty slots. There is no erase.
+   Iteration order is arbitrary: use sortedKeys() where order matters.
+   Inserting may move the table, invalidating pointers & references to values. */
+class FlatHashBase {
+public:
+  typedef uint64_t key_type;
+  static const key_type EmptyKey = numeric_limits<uint64_t>::max();
+
+protected:
+  size_t nKeys, mask;
+
+  FlatHashBase() : nKeys(0), mask(0) { }
+
+  // murmur3 finalizer: packed keys differ mostly in their low bits
+  static inline size_t hash (key_type k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return (size_t) k;
+  }
+
+  static inline size_t tableSize (size_t n) {
+    size_t s = 16;
+    while (s < 2*n)
+      s *= 2;
+    return s;
+  }
+
+public:
+  size_t size() const { return nKeys; }
+  bool empty() const { return nKeys == 0; }
+};
+
+template<typename V>
+class FlatHashMap : public FlatHashBase {
+private:
+  vguard<key_type> keys;
+  vguard<V> vals;
+
+  inline size_t slot (key_type k) const {
+    size_t i = hash(k) & mask;
+    while (keys[i] != k && keys[i] != EmptyKey)
+      i = (i + 1) & mask;
+    return i;
+  }
+
+  void rehash (size_t newSize) {
+    vguard<key_type> oldKeys (newSize, key_type (EmptyKey));
+    vguard<V> oldVals (newSize);
+    oldKeys.swap (keys);
+    oldVals.swap (vals);
+    mask = newSize - 1;
+    for (size_t i = 0; i < oldKeys.size(); ++i)
+      if (oldKeys[i] != EmptyKey) {
+	const size_t j = slot (oldKeys[i]);
+	keys[j] = oldKeys[i];
+	vals[j] = move (oldVals[i]);
+      }
+  }
+
+public:
+  FlatHashMap (size_t n = 0) { rehash (tableSize (n)); }
+
+  void reserve (size_t n) {
+    if (tableSize(n) > keys.size())
+      rehash (tableSize(n));
+  }
+
+  inline size_t count (key_type k) const { return keys[slot(k)] == k ? 1 : 0; }
+
+  inline V* find (key_type k) {
+    const size_t i = slot(k);
+    return keys[i] == k ? &vals[i] : NULL;
+  }
+  inline const V* find (key_type k) const {
+    const size_t i = slot(k);
+    return keys[i] == k ? &vals[i] : NULL;
+  }
+
+  // inserts a default-constructed value if k is absent
+  inline V& operator[] (key_type k) {
+    size_t i = slot(k);
+    if (keys[i] != k) {
+      if (2 * (nKeys + 1) > keys.size()) {
+	rehash (2 * keys.size());
+	i = slot(k);
+      }
+      keys[i] = k;
+      ++nKeys;
+    }
+    return vals[i];
+  }
+
+  template<class Visitor>
+  void visit (Visitor visitor) const {
+    for (size_t i = 0; i < keys.size(); ++i)
+      if (keys[i] != EmptyKey)
+	visitor (keys[i], vals[i]);
+  }
+
+  vguard<key_type> sortedKeys() const {
+    vguard<key_type> k;
+    k.reserve (nKeys);
+    for (auto key : keys)
+      if (key != EmptyKey)
+	k.push_back (key);
+    sort (k.begin(), k.end());
+    return k;
+  }
+};
+
+class FlatHashSet : public FlatHashBase {
+private:
+  vguard<key_type> keys;
+
+  inline size_t slot (key_type k) const {
+    size_t i = hash(k) & mask;
+    while (keys[i] != k && keys[i] != EmptyKey)
+      i = (i + 1) & mask;
+    return i;
+  }
+
+  void rehash (size_t newSize) {
+    vguard<key_type> oldKeys (newSize, key_type (EmptyKey));
+    oldKeys.swap (keys);
+    mask = newSize - 1;
+    for (auto k : oldKeys)
+      if (k != EmptyKey)
+	keys[slot(k)] = k;
+  }
+
+public:
+  FlatHashSet (size_t n = 0) { rehash (tableSize (n)); }
+
+  void reserve (size_t n) {
+    if (tableSize(n) > keys.size())
+      rehash (tableSize(n));
+  }
+
+  inline size_t count (key_type k) const { return keys[slot(k)] == k ? 1 : 0; }
+
+  // returns true if k was not already present
+  inline bool insert (key_type k) {
+    size_t i = slot(k);
+    if (keys[i] == k)
+      return false;
+    if (2 * (nKeys + 1) > keys.size()) {
+      rehash (2 * keys.size());
+      i = slot(k);
+    }
+    keys[i] = k;
+    ++nKeys;
+    return true;
+  }
+
+  vguard<key_type> sortedKeys() const {
+    vguard<key_type> k;
+    k.reserve (nKeys);
+    for (auto key : keys)
+      if (key != EmptyKey)
+	k.push_back (key);
+    sort (k.begin(), k.end());
+    return k;
+  }
+};
+
+#endif /* FLATHASH_INCLUDED */
@@ -1,4 +1,5 @@
 #include <gsl/gsl_math.h>
+#include <chrono>
 
 #include "forward.h"
 #include "util.h"
@@ -8,8 +9,10 @@
 
 #define FWD_BACK_ERROR_TOLERANCE .01
 
-DPMatrix::DPMatrix (const Profile& x, const Profile& y, const PairHMM& hmm, const GuideAlignmentEnvelope& env)
-  : x(x),
+DPMatrix::DPMatrix (const Profile& x, const Profile& y, const PairHMM& hmm, const GuideAlignmentEnvelope& env, const string& scratchDir)
+  : arena (TaskPool::scratch()),
+    cellStorage (x.size(), XYCellColumn (less<ProfileStateIndex>(), ArenaAllocator<pair<const ProfileStateIndex,XYCell> > (arena))),
+    x(x),
     y(y),
     hmm(hmm),
     alphSize ((AlphTok) hmm.alphabetSize()),
@@ -19,7 +22,6 @@ DPMatrix::DPMatrix (const Profile& x, const Profile& y, const PairHMM& hmm, cons
     ySize (y.size()),
     subx (x.leftMultiply (hmm.l.subMat)),
     suby (y.leftMultiply (hmm.r.subMat)),
-    cellStorage (x.size()),
     absorbScratch (hmm.components(), vguard<LogProb> (hmm.alphabetSize())),
     insx (x.size(), -numeric_limits<double>::infinity()),
     insy (y.size(), -numeric_limits<double>::infinity()),
@@ -31,8 +33,11 @@ DPMatrix::DPMatrix (const Profile& x, const Profile& y, const PairHMM& hmm, cons
     xClosestLeafPos (xSize, 0),
     yClosestLeafPos (ySize, 0),
     xNearStart (xSize, false),
-    yNearEnd (ySize, false)
+    yNearEnd (ySize, false),
+    scratchDir (scratchDir)
 {
+  Assert (xSize <= (1ULL << 32) && ySize <= (1ULL << 28), "Profiles too large for packed cell IDs");
+
   if (env.initialized()) {
     for (ProfileStateIndex i = 1; i < xSize; ++i)
       xClosestLeafPos[i] = x.state[i].seqCoords.at(env.row1);
@@ -63,12 +68,37 @@ DPMatrix::DPMatrix (const Profile& x, const Profile& y, const PairHMM& hmm, cons
   
   for (auto yt : y.end().in)
     yNearEnd[y.trans[yt].src] = true;
+
+  if (!scratchDir.empty())
+    initScratchStorage();
+}
+
+void DPMatrix::initScratchStorage() {
+  // columns near the start are stored in full; others get the band of y's inside the envelope,
+  // with the y's near the end (which are always inside it) stored separately
+  vguard<pair<size_t,size_t> > band (xSize, pair<size_t,size_t> (0, 0));
+  for (ProfileStateIndex i = 0; i < xSize; ++i)
+    if (xNearStart[i])
+      band[i].second = ySize;
+    else {
+      ProfileStateIndex jMin = ySize, jMax = 0;
+      for (ProfileStateIndex j = 0; j < ySize; ++j)
+	if (envelope.inRange (xClosestLeafPos[i], yClosestLeafPos[j])) {
+	  jMin = min (jMin, j);
+	  jMax = j + 1;
+	}
+      if (jMin < jMax)
+	band[i] = pair<size_t,size_t> (jMin, jMax);
+    }
+  scratchStorage.reset (new ScratchColumns<XYCell> (scratchDir, band, yNearEnd));
+  LogThisAt(4,"Storing " << scratchStorage->cellCount() << " DP cells (" << scratchStorage->bytes() << " bytes) in scratch file in " << scratchDir << endl);
 }
 
-ForwardMatrix::ForwardMatrix (const Profile& x, const Profile& y, const PairHMM& hmm, AlignRowIndex parentRowIndex, const GuideAlignmentEnvelope& env, SumProduct* sumProd)
-  : DPMatrix (x, y, hmm, env),
+ForwardMatrix::ForwardMatrix (const Profile& x, const Profile& y, const PairHMM& hmm, AlignRowIndex parentRowIndex, const GuideAlignmentEnvelope& env, SumProduct* sumProd, const string& scratchDir)
+  : DPMatrix (x, y, hmm, env, scratchDir),
     parentRowIndex (parentRowIndex),
-    sumProd (sumProd)
+    sumProd (sumProd),
+    makeProfileNanosecs (0)
 {
   lpStart() = 0;
 
@@ -79,6 +109,7 @@ ForwardMatrix::ForwardMatrix (const Profile& x, const Profile& y, const PairHMM&
     const ProfileState& xState = x.state[i];
 
     plog.logProgress (i / (double) (xSize - 2), "state %d/%d", i + 1, xSize);
+    visitColumn (i);
 
     for (ProfileStateIndex j = 0; j < ySize - 1; ++j) {
       const ProfileState& yState = y.state[j];
@@ -264,6 +295,7 @@ ForwardMatrix::Path ForwardMatrix::sampleTrace (random_engine& generator) {
   CellCoords current;
   while (true) {
     current = sampleCell (clp, generator);
+    visitColumn (current.xpos);
     LogThisAt(6,__func__ << " traceback at " << cellName(current) << " score " << cell(current) << endl);
 
     path.push_front (current);
@@ -275,6 +307,18 @@ ForwardMatrix::Path ForwardMatrix::sampleTrace (random_engine& generator) {
   return path;
 }
 
+void ForwardMatrix::sampleGuideDistances (random_engine& generator, size_t samples) {
+  for (size_t n = 0; n < samples; ++n)
+    sampledGuideDistance.push_back (maxGuideDistance (sampleTrace (generator)));
+}
+
+int ForwardMatrix::maxGuideDistance (const Path& path) const {
+  int d = 0;
+  for (const auto& c : path)
+    d = max (d, guideDistance (c.xpos, c.ypos));
+  return d;
+}
+
 ForwardMatrix::Path ForwardMatrix::bestTrace() {
   Assert (lpEnd > -numeric_limits<double>::infinity(), "Forward likelihood is zero; traceback fail");
   return bestTrace (endCell);
@@ -289,6 +333,7 @@ ForwardMatrix::Path ForwardMatrix::bestTrace (const CellCoords& end) {
     CellCoords current;
     while (true) {
       current = bestCell (clp);
+      visitColumn (current.xpos);
       LogThisAt(6,__func__ << " traceback at " << cellName(current) << " score " << cell(current) << endl);
       
       path.push_front (current);
@@ -401,6 +446,31 @@ DPMatrix::random_engine DPMatrix::newRNG() {
   return random_engine();
 }
 
+vguard<DPMatrix::CellCoords> DPMatrix::CellSet::sorted() const {
+  const vguard<uint64_t> sortedIds = ids.sortedKeys();
+  vguard<CellCoords> cells;
+  cells.reserve (sortedIds.size());
+  for (auto id : sortedIds)
+    cells.push_back (cellCoords (id));
+  return cells;
+}
+
+size_t DPMatrix::cellsStored() const {
+  if (scratchStorage)
+    return scratchStorage->cellCount();
+  size_t cells = 0;
+  for (const auto& column : cellStorage)
+    cells += column.size();
+  return cells;
+}
+
+size_t DPMatrix::storageBytes() const {
+  if (scratchStorage)
+    return min (scratchStorage->bytes(), (size_t) 3 * DefaultDPScratchBlockSize);
+  // each map entry is a red-black tree node: three pointers and a color, plus the key
+  return cellsStored() * (sizeof(XYCell) + 4 * sizeof(void*) + sizeof(ProfileStateIndex));
+}
+
 LogProb DPMatrix::lpCellEmitOrAbsorb (const CellCoords& c) {
   LogProb lp = 0;
 
@@ -683,32 +753,36 @@ AlignPath ForwardMatrix::traceAlignPath (const Path& path) const {
   return p;
 }
 
-Profile ForwardMatrix::makeProfile (const set<CellCoords>& cells, ProfilingStrategy strategy) {
+Profile ForwardMatrix::makeProfile (const CellSet& cellSet, ProfilingStrategy strategy) {
+  const auto before = std::chrono::steady_clock::now();
   Profile prof (hmm.components(), alphSize, parentRowIndex);
   prof.name = Tree::pairParentName (x.name, hmm.l.t, y.name, hmm.r.t);
   prof.meta["node"] = to_string(parentRowIndex);
 
-  Assert (cells.find (startCell) != cells.end(), "Missing SSS");
-  Assert (cells.find (endCell) != cells.end(), "Missing EEE");
+  Assert (cellSet.count (startCell), "Missing SSS");
+  Assert (cellSet.count (endCell), "Missing EEE");
+
+  // cells are hashed while being collected; sort them once here, since states must be in topological order
+  const vguard<CellCoords> cells = cellSet.sorted();
 
   // build states
   // retain only start, end, and absorbing cells
-  map<CellCoords,ProfileStateIndex> profStateIndex;
-  map<CellCoords,int> outgoingTransitionCount;
+  CellMap<ProfileStateIndex> profStateIndex (cells.size());
+  CellMap<int> outgoingTransitionCount (cells.size());
 
   for (const auto& dest : cells)
     for (const auto& src_lp : sourceTransitions (dest))
-      ++outgoingTransitionCount[src_lp.first];
+      ++outgoingTransitionCount[cellId(src_lp.first)];
 
   for (const auto& c : cells)
     if (isAbsorbing(c)
 	|| c == startCell
 	|| c == endCell
-	|| outgoingTransitionCount[c] > 1
+	|| outgoingTransitionCount[cellId(c)] > 1
 	|| (strategy & KeepGapsOpen) != 0
 	|| (strategy & CollapseChains) == 0) {
       // cell is to be retained
-      profStateIndex[c] = prof.state.size();
+      profStateIndex[cellId(c)] = prof.state.size();
       prof.state.push_back (ProfileState());
       if (isAbsorbing(c))
 	switch (c.state) {
@@ -733,10 +807,10 @@ Profile ForwardMatrix::makeProfile (const set<CellCoords>& cells, ProfilingStrat
 
   if (strategy & KeepGapsOpen)
     for (const auto& c : cells)
-      if (!isAbsorbing(c) && profStateIndex.count(c)) {
+      if (!isAbsorbing(c) && profStateIndex.count(cellId(c))) {
 	const auto equiv = equivAbsorbCells (c);
-	if (equiv.size() && profStateIndex.count(equiv.front()))
-	  prof.equivAbsorbState[profStateIndex[c]] = profStateIndex[equiv.front()];
+	if (equiv.size() && profStateIndex.count(cellId(equiv.front())))
+	  prof.equivAbsorbState[profStateIndex[cellId(c)]] = profStateIndex[cellId(equiv.front())];
       }
 
   if (strategy & CollapseChains)
@@ -747,18 +821,19 @@ Profile ForwardMatrix::makeProfile (const set<CellCoords>& cells, ProfilingStrat
   // A path is either a single direct transition (from source cell to destination retained-cell),
   // or a series of transitions starting from the source cell,
   // passing through one or more eliminated-cells, and stopping at the destination retained-cell.
-  map<CellCoords,map<ProfileStateIndex,EffectiveTransition> > effTrans;  // effTrans[srcCell][destStateIdx]
+  CellMap<map<ProfileStateIndex,EffectiveTransition> > effTrans (cells.size());  // effTrans[srcCell][destStateIdx]
   for (auto iter = cells.crbegin(); iter != cells.crend(); ++iter) {
     const CellCoords& iterCell = *iter;
     const map<CellCoords,LogProb>& slp = sourceTransitionsWithoutEmitOrAbsorb (iterCell);
     const LogProb cellLogProbInsert = eliminatedLogProbInsert (iterCell);
-    if (profStateIndex.find(iterCell) != profStateIndex.end()) {
+    const ProfileStateIndex* retainedIdx = profStateIndex.find (cellId(iterCell));
+    if (retainedIdx) {
       // iterCell is to be retained. Incoming & outgoing paths can be kept separate
-      const ProfileStateIndex cellIdx = profStateIndex[iterCell];
+      const ProfileStateIndex cellIdx = *retainedIdx;
       for (const auto slpIter : slp) {
 	const CellCoords& src = slpIter.first;
 	const LogProb srcCellLogProbTrans = slpIter.second;
-	EffectiveTransition& eff = effTrans[src][cellIdx];
+	EffectiveTransition& eff = effTrans[cellId(src)][cellIdx];
 	eff.lpPath = eff.lpBestAlignPath = srcCellLogProbTrans + cellLogProbInsert;
 	eff.bestAlignPath = transitionAlignPath(src,iterCell);
 	if (strategy & (CountSubstEvents | CountIndelEvents))
@@ -768,7 +843,8 @@ Profile ForwardMatrix::makeProfile (const set<CellCoords>& cells, ProfilingStrat
       }
     } else {
       // iterCell is to be eliminated. Connect incoming transitions & outgoing paths, summing iterCell out
-      const auto& cellEffTrans = effTrans[iterCell];
+      const uint64_t iterCellId = cellId(iterCell);
+      effTrans[iterCellId];
       const AlignPath& cap = cellAlignPath (iterCell);
       EigenCounts cellCounts, srcCellCounts;
       if ((strategy & CountSubstEvents) != 0 && sumProd != NULL)
@@ -778,7 +854,8 @@ Profile ForwardMatrix::makeProfile (const set<CellCoords>& cells, ProfilingStrat
 	const LogProb srcCellLogProbTrans = slpIter.second;
 	if (strategy & (CountSubstEvents | CountIndelEvents))
 	  srcCellCounts = transitionEigenCounts (src, iterCell) + cellCounts;
-	auto& srcEffTrans = effTrans[src];
+	auto& srcEffTrans = effTrans[cellId(src)];
+	const auto& cellEffTrans = *effTrans.find (iterCellId);  // look this up after inserting src, which may move the table
 	for (const auto cellEffTransIter : cellEffTrans) {
 	  const ProfileStateIndex& destIdx = cellEffTransIter.first;
 	  const EffectiveTransition& cellDestEffTrans = cellEffTransIter.second;
@@ -807,12 +884,15 @@ Profile ForwardMatrix::makeProfile (const set<CellCoords>& cells, ProfilingStrat
   }
 
   // populate outgoing & incoming transitions for each state
-  for (const auto profStateIter : profStateIndex) {
-    const CellCoords& cell = profStateIter.first;
-    const ProfileStateIndex srcIdx = profStateIter.second;
+  for (const auto& cell : cells) {
+    const ProfileStateIndex* srcIdxPtr = profStateIndex.find (cellId(cell));
+    const map<ProfileStateIndex,EffectiveTransition>* cellEffTrans = effTrans.find (cellId(cell));
+    if (!srcIdxPtr || !cellEffTrans)
+      continue;
+    const ProfileStateIndex srcIdx = *srcIdxPtr;
     vguard<ProfileTransitionIndex>& srcNullOut = prof.state[srcIdx].nullOut;
     vguard<ProfileTransitionIndex>& srcAbsorbOut = prof.state[srcIdx].absorbOut;
-    for (const auto effTransIter : effTrans[cell]) {
+    for (const auto& effTransIter : *cellEffTrans) {
       const ProfileStateIndex destIdx = effTransIter.first;
       const EffectiveTransition& srcDestEffTrans = effTransIter.second;
       vguard<ProfileTransitionIndex>& destIn = prof.state[destIdx].in;
@@ -838,12 +918,13 @@ Profile ForwardMatrix::makeProfile (const set<CellCoords>& cells, ProfilingStrat
   prof.assertPathToEndExists();  // addReadyStates() will check this again
   prof = prof.addReadyStates();
   prof.assertSeqCoordsConsistent();
-  
+
+  makeProfileNanosecs += std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now() - before).count();
   return prof;
 }
 
 Profile ForwardMatrix::sampleProfile (random_engine& generator, size_t profileSamples, size_t maxCells, ProfilingStrategy strategy, size_t minLen, size_t maxLen) {
-  map<CellCoords,size_t> cellCount;
+  CellMap<size_t> cellCount;
 
   Require ((strategy & IncludeBestTrace) || profileSamples > 0, "Must allow at least one sample path in the profile");
 
@@ -851,7 +932,7 @@ Profile ForwardMatrix::sampleProfile (random_engine& generator, size_t profileSa
   if (strategy & IncludeBestTrace) {
     const Path best = bestTrace();
     for (auto& c : best)
-      cellCount[c] = 2;  // avoid dropping these cells
+      cellCount[cellId(c)] = 2;  // avoid dropping these cells
     ++nTraces;
   }
   size_t nAccepted = 0;
@@ -876,21 +957,24 @@ Profile ForwardMatrix::sampleProfile (random_engine& generator, size_t profileSa
     if (ancLen < minLen || ancLen > maxLen)
       break;
     for (auto& c : sampled)
-      ++cellCount[c];
+      ++cellCount[cellId(c)];
+    sampledGuideDistance.push_back (maxGuideDistance (sampled));
     ++nTraces;
     ++nAccepted;
   }
-  set<CellCoords> profCells;
+  CellSet profCells;
   const size_t threshold = (nTraces > 1 && maxCells > 0 && cellCount.size() >= maxCells) ? 2 : 1;
-  for (const auto& cc : cellCount)
-    if (cc.second >= threshold)
-      profCells.insert (cc.first);
+  cellCount.visit ([&] (uint64_t id, size_t count) {
+      if (count >= threshold)
+	profCells.insert (cellCoords (id));
+    });
   return makeProfile (profCells, strategy);
 }
 
 Profile ForwardMatrix::bestProfile (ProfilingStrategy strategy) {
   const Path best = bestTrace();
-  const set<CellCoords> profCells (best.begin(), best.end());
+  CellSet profCells;
+  profCells.insert (best.begin(), best.end());
   return makeProfile (profCells, strategy);
 }
 
@@ -973,7 +1057,7 @@ map<AlignRowIndex,char> ForwardMatrix::getAlignmentColumn (const CellCoords& cel
 }
 
 BackwardMatrix::BackwardMatrix (ForwardMatrix& fwd)
-  : DPMatrix (fwd.x, fwd.y, fwd.hmm, fwd.envelope),
+  : DPMatrix (fwd.x, fwd.y, fwd.hmm, fwd.envelope, fwd.scratchDir),
     fwd (fwd)
 {
   lpEnd = 0;
@@ -1001,6 +1085,7 @@ BackwardMatrix::BackwardMatrix (ForwardMatrix& fwd)
     const ProfileState& xState = x.state[i];
 
     plog.logProgress ((xSize - 2 - i) / (double) (xSize - 2), "state %d/%d", xSize - 1 - i, xSize);
+    visitColumn (i);
 
     for (int j = ySize - 2; j >= 0; --j) {
       const ProfileState& yState = y.state[j];
@@ -1192,6 +1277,8 @@ EigenCounts BackwardMatrix::getCounts() const {
   for (ProfileStateIndex i = 0; i < xSize - 1; ++i) {
     const ProfileState& xState = x.state[i];
     plog.logProgress (i / (double) (xSize - 2), "state %d/%d", i + 1, xSize);
+    visitColumn (i);
+    fwd.visitColumn (i);
 
     for (ProfileStateIndex j = 0; j < ySize - 1; ++j) {
       const ProfileState& yState = y.state[j];
@@ -1291,6 +1378,7 @@ BackwardMatrix::Path BackwardMatrix::bestTrace (const CellCoords& traceStart) {
   while (current.xpos < xSize - 1 && current.ypos < ySize - 1) {
     map<CellCoords,LogProb> clp = destCells (current);
     current = bestCell (clp);
+    visitColumn (current.xpos);
     LogThisAt(6,__func__ << " traceforward at " << cellName(current) << " score " << cell(current) << endl);
     path.push_back (current);
   }
@@ -1304,7 +1392,9 @@ priority_queue<BackwardMatrix::CellPostProb> BackwardMatrix::cellsAbovePostProbT
   const LogProb lppThreshold = log(minPostProb);
   const LogProb fwdEnd = fwd.lpEnd;
   const auto states = hmm.states();
-  for (int i = xSize - 2; i >= 0; --i)
+  for (int i = xSize - 2; i >= 0; --i) {
+    visitColumn (i);
+    fwd.visitColumn (i);
     for (int j = ySize - 2; j >= 0; --j)
       if (inEnvelope(i,j)) {
 	const XYCell& backSrc = xyCell(i,j);
@@ -1315,18 +1405,39 @@ priority_queue<BackwardMatrix::CellPostProb> BackwardMatrix::cellsAbovePostProbT
 	    bc.push (CellPostProb (i, j, s, lpp));
 	}
       }
+  }
   return bc;
 }
 
+double BackwardMatrix::envelopePostProbBeyond (int distance) const {
+  double p = 0;
+  if (envelope.initialized()) {
+    const LogProb fwdEnd = fwd.lpEnd;
+    const auto states = hmm.states();
+    for (int i = xSize - 2; i >= 0; --i) {
+      visitColumn (i);
+      fwd.visitColumn (i);
+      for (int j = ySize - 2; j >= 0; --j)
+	if (guideDistance (i, j) >= distance) {
+	  const XYCell& backSrc = xyCell(i,j);
+	  const XYCell& fwdSrc = fwd.xyCell(i,j);
+	  for (auto s : states)
+	    p += exp (backSrc(s) + fwdSrc(s) - fwdEnd);
+	}
+    }
+  }
+  return p;
+}
+
 Profile BackwardMatrix::bestProfile (ProfilingStrategy strategy) {
-  set<CellCoords> cells;
+  CellSet cells;
   addTrace (endCell, cells, 0, (strategy & KeepGapsOpen) != 0);
   return fwd.makeProfile (cells, strategy);
 }
 
 Profile BackwardMatrix::postProbProfile (double minPostProb, size_t maxCells, ProfilingStrategy strategy) {
   priority_queue<CellPostProb> bc = cellsAbovePostProbThreshold (minPostProb);
-  set<CellCoords> cells;
+  CellSet cells;
   if (bc.empty() || (strategy & IncludeBestTrace))
     addCells (cells, 0, fwd.bestTrace(), list<CellCoords>(), (strategy & KeepGapsOpen) != 0);
   while ((maxCells == 0 || cells.size() < maxCells) && !bc.empty()) {
@@ -1340,8 +1451,8 @@ Profile BackwardMatrix::postProbProfile (double minPostProb, size_t maxCells, Pr
   return fwd.makeProfile (cells, strategy);
 }
 
-bool BackwardMatrix::addCells (set<CellCoords>& cells, size_t maxCells, const list<CellCoords>& fwdTrace, const list<CellCoords>& backTrace, bool keepGapsOpen) {
-  list<CellCoords> newCells;
+bool BackwardMatrix::addCells (CellSet& cells, size_t maxCells, const list<CellCoords>& fwdTrace, const list<CellCoords>& backTrace, bool keepGapsOpen) {
+  CellList newCells = newCellList();
   for (auto cellIter = fwdTrace.rbegin(); cellIter != fwdTrace.rend(); ++cellIter)
     if (cells.count (*cellIter))
       break;
@@ -1371,7 +1482,7 @@ bool BackwardMatrix::addCells (set<CellCoords>& cells, size_t maxCells, const li
   return true;
 }
 
-bool BackwardMatrix::addTrace (const CellCoords& cell, set<CellCoords>& cells, size_t maxCells, bool keepGapsOpen) {
+bool BackwardMatrix::addTrace (const CellCoords& cell, CellSet& cells, size_t maxCells, bool keepGapsOpen) {
   LogThisAt(5,"Starting traceback/forward from " << cellName(cell) << endl);
   const list<CellCoords> fwdTrace = fwd.bestTrace(cell), backTrace = bestTrace(cell);
   return addCells (cells, maxCells, fwdTrace, backTrace, keepGapsOpen);
@@ -7,6 +7,11 @@
 #include "pairhmm.h"
 #include "profile.h"
 #include "sumprod.h"
+#include "rng.h"
+#include "dpscratch.h"
+#include "arena.h"
+#include "taskpool.h"
+#include "flathash.h"
 
 class DPMatrix {
 protected:
@@ -19,8 +24,14 @@ protected:
     LogProb& operator() (PairHMM::State s) { return lp[s]; }
     LogProb operator() (PairHMM::State s) const { return lp[s]; }
   };
-  vguard<map<ProfileStateIndex,XYCell> > cellStorage;  // partial Forward sums by cell
+  // the constructing thread's TaskPool::scratch() arena, backing the sparse cell columns & short-lived cell lists.
+  // Matrices are built, filled & deleted on one thread; once they are all deleted, the caller resets the arena
+  MonotonicArena& arena;
+  typedef map<ProfileStateIndex,XYCell,less<ProfileStateIndex>,ArenaAllocator<pair<const ProfileStateIndex,XYCell> > > XYCellColumn;
+  vguard<XYCellColumn> cellStorage;  // partial Forward sums by cell
+  unique_ptr<ScratchColumns<XYCell> > scratchStorage;  // replaces cellStorage if scratchDir is set
   XYCell emptyCell;  // always -inf
+  XYCell sinkCell;  // out-of-envelope cells in scratchStorage; reset to -inf on every access, writes are discarded
   vguard<LogProb> insx, insy;  // insert-on-branch probabilities by x & y indices
   vguard<LogProb> rootsubx, rootsuby;  // insert-at-root-then-substitute probabilities by x & y indices
   vguard<vguard<LogProb> > absorbScratch;  // scratch space for computing absorb profiles
@@ -46,8 +57,35 @@ public:
 			   DontKeepGapsOpen = 0, KeepGapsOpen = 16 };
 
   typedef list<CellCoords> Path;
-  typedef mt19937 random_engine;
-  static const char* random_engine_name() { return "mt19937"; }
+
+  // packed 64-bit cell IDs, for hashing; these sort in the same order as CellCoords
+  static inline uint64_t cellId (const CellCoords& c) { return (((uint64_t) c.xpos) << 32) | (((uint64_t) c.ypos) << 4) | (uint64_t) c.state; }
+  static inline CellCoords cellCoords (uint64_t id) { return CellCoords (id >> 32, (id >> 4) & 0xfffffff, (PairHMM::State) (id & 0xf)); }
+
+  // hashed set of cells, for profile construction
+  class CellSet {
+  private:
+    FlatHashSet ids;
+  public:
+    size_t size() const { return ids.size(); }
+    size_t count (const CellCoords& c) const { return ids.count (cellId(c)); }
+    bool insert (const CellCoords& c) { return ids.insert (cellId(c)); }
+    template<class InputIterator>
+    void insert (InputIterator begin, InputIterator end) {
+      for (; begin != end; ++begin)
+	insert (*begin);
+    }
+    vguard<CellCoords> sorted() const;  // topological order
+  };
+
+  // hashed map from cells to values
+  template<typename T> using CellMap = FlatHashMap<T>;
+
+  // short-lived list of cells, drawing from the arena
+  typedef list<CellCoords,ArenaAllocator<CellCoords> > CellList;
+  CellList newCellList() { return CellList (ArenaAllocator<CellCoords> (arena)); }
+  typedef PhiloxEngine random_engine;  // counter-based: use stream() to give each task its own generator
+  static const char* random_engine_name() { return PhiloxEngine::name(); }
   
   const Profile& x, y;
   const bool xEmpty, yEmpty;
@@ -61,24 +99,40 @@ public:
   vguard<SeqIdx> xClosestLeafPos, yClosestLeafPos;
   vguard<bool> xNearStart, yNearEnd;
   int maxDistance;
+  const string scratchDir;  // if nonempty, cells are stored out-of-core in a memory-mapped file in this directory
 
-  DPMatrix (const Profile& x, const Profile& y, const PairHMM& hmm, const GuideAlignmentEnvelope& env);
+  DPMatrix (const Profile& x, const Profile& y, const PairHMM& hmm, const GuideAlignmentEnvelope& env, const string& scratchDir = string());
 
   // cell accessors
-  inline XYCell& xyCell (ProfileStateIndex xpos, ProfileStateIndex ypos) { return cellStorage[xpos][ypos]; }
+  inline XYCell& xyCell (ProfileStateIndex xpos, ProfileStateIndex ypos) {
+    if (scratchStorage) {
+      XYCell* c = scratchStorage->find (xpos, ypos);
+      if (c)
+	return *c;
+      sinkCell = emptyCell;
+      return sinkCell;
+    }
+    return cellStorage[xpos][ypos];
+  }
   inline const XYCell& xyCell (ProfileStateIndex xpos, ProfileStateIndex ypos) const {
+    if (scratchStorage) {
+      const XYCell* c = scratchStorage->find (xpos, ypos);
+      return c ? *c : emptyCell;
+    }
     const auto& column = cellStorage[xpos];
     auto iter = column.find(ypos);
     return iter == column.end() ? emptyCell : iter->second;
   }
 
   inline LogProb& cell (ProfileStateIndex xpos, ProfileStateIndex ypos, PairHMM::State state)
-  { return cellStorage[xpos][ypos].lp[state]; }
+  { return xyCell(xpos,ypos).lp[state]; }
   inline LogProb cell (ProfileStateIndex xpos, ProfileStateIndex ypos, PairHMM::State state) const
-  {
-    const auto& column = cellStorage[xpos];
-    auto iter = column.find(ypos);
-    return iter == column.end() ? -numeric_limits<double>::infinity() : iter->second.lp[state];
+  { return xyCell(xpos,ypos).lp[state]; }
+
+  // tell out-of-core storage which column a pass is working on, so it can prefetch & evict
+  inline void visitColumn (ProfileStateIndex xpos) const {
+    if (scratchStorage)
+      scratchStorage->visitColumn (xpos);
   }
 
   inline LogProb& cell (const CellCoords& c) { return cell(c.xpos,c.ypos,c.state); }
@@ -97,6 +151,11 @@ public:
     return atEdge(xpos,ypos) || envelope.inRange (xClosestLeafPos[xpos], yClosestLeafPos[ypos]);
   }
 
+  // distance of a cell from the guide alignment, or 0 for cells that are in the envelope regardless
+  inline int guideDistance (ProfileStateIndex xpos, ProfileStateIndex ypos) const {
+    return atEdge(xpos,ypos) || !envelope.initialized() ? 0 : envelope.distance (xClosestLeafPos[xpos], yClosestLeafPos[ypos]);
+  }
+
   void write (ostream& out, bool edgeOnly = false) const;
   string toString (bool edgeOnly = false) const;
   string cellName (const CellCoords& cell) const;
@@ -105,6 +164,8 @@ public:
   static random_engine newRNG();
 
   static size_t cellSize() { return sizeof(XYCell); }
+  size_t cellsStored() const;
+  size_t storageBytes() const;  // approximate memory used by cells (for scratch storage, the mapped window only)
   
   inline int components() const { return hmm.components(); }
   
@@ -123,6 +184,8 @@ protected:
     return logInnerProduct (hmm.logRoot, absorbScratch);
   }
 
+  void initScratchStorage();
+
   LogProb lpCellEmitOrAbsorb (const CellCoords& c);
   
   bool isAbsorbing (const CellCoords& c) const;
@@ -148,7 +211,7 @@ public:
     EffectiveTransition();
   };
   
-  ForwardMatrix (const Profile& x, const Profile& y, const PairHMM& hmm, AlignRowIndex parentRowIndex, const GuideAlignmentEnvelope& env, SumProduct* sumProd = NULL);
+  ForwardMatrix (const Profile& x, const Profile& y, const PairHMM& hmm, AlignRowIndex parentRowIndex, const GuideAlignmentEnvelope& env, SumProduct* sumProd = NULL, const string& scratchDir = string());
 
   // traceback
   Path sampleTrace (random_engine& generator);
@@ -156,8 +219,20 @@ public:
   Path bestTrace (const CellCoords& end);
   AlignPath bestAlignPath();
 
+  // furthest distance from the guide alignment reached by each trace sampled by sampleProfile or sampleGuideDistances,
+  // used to estimate the posterior mass near the edge of the band without a Backward pass
+  vguard<int> sampledGuideDistance;
+  void sampleGuideDistances (random_engine& generator, size_t samples);
+  int maxGuideDistance (const Path& path) const;
+
   // profile construction
-  Profile makeProfile (const set<CellCoords>& cells, ProfilingStrategy strategy = CollapseChains);
+  double makeProfileNanosecs;  // time spent in makeProfile, reported by reconstruction at -v1
+  Profile makeProfile (const CellSet& cells, ProfilingStrategy strategy = CollapseChains);
+  Profile makeProfile (const set<CellCoords>& cells, ProfilingStrategy strategy = CollapseChains) {
+    CellSet hashedCells;
+    hashedCells.insert (cells.begin(), cells.end());
+    return makeProfile (hashedCells, strategy);
+  }
   Profile sampleProfile (random_engine& generator, size_t profileSamples, size_t maxCells = 0, ProfilingStrategy strategy = CollapseChains, size_t minLen = 0, size_t maxLen = numeric_limits<size_t>::max());  // maxCells=0 to unlimit
   Profile bestProfile (ProfilingStrategy strategy = CollapseChains);
 
@@ -211,6 +286,7 @@ public:
 
   // profile construction
   priority_queue<CellPostProb> cellsAbovePostProbThreshold (double minPostProb) const;
+  double envelopePostProbBeyond (int distance) const;  // expected number of visits to cells at least this far from the guide alignment
   Profile postProbProfile (double minPostProb, size_t maxCells = 0, ProfilingStrategy strategy = CollapseChains);  // maxCells=0 to unlimit
   Profile bestProfile (ProfilingStrategy strategy = CollapseChains);
 
@@ -222,8 +298,8 @@ public:
 private:
   map<CellCoords,LogProb> destCells (const CellCoords& srcCell);
 
-  bool addCells (set<CellCoords>& cells, size_t maxCells, const list<CellCoords>& fwdTrace, const list<CellCoords>& backTrace, bool keepGapsOpen);
-  bool addTrace (const CellCoords& cell, set<CellCoords>& cells, size_t maxCells, bool keepGapsOpen);
+  bool addCells (CellSet& cells, size_t maxCells, const list<CellCoords>& fwdTrace, const list<CellCoords>& backTrace, bool keepGapsOpen);
+  bool addTrace (const CellCoords& cell, CellSet& cells, size_t maxCells, bool keepGapsOpen);
 };
 
 #endif /* FORWARD_INCLUDED */
@@ -92,6 +92,7 @@ ProgressLogger::ProgressLogger (int verbosity, const char* function, const char*
 { }
 
 void ProgressLogger::initProgress (const char* desc, ...) {
+  lock_guard<mutex> lock (progressMutex);
   startTime = std::chrono::system_clock::now();
   lastElapsedSeconds = 0;
   reportInterval = 2;
@@ -120,6 +121,7 @@ ProgressLogger::~ProgressLogger() {
 }
 
 void ProgressLogger::logProgress (double completedFraction, const char* desc, ...) {
+  lock_guard<mutex> lock (progressMutex);
   va_list argptr;
   const std::chrono::system_clock::time_point currentTime = std::chrono::system_clock::now();
   const auto elapsedSeconds = std::chrono::duration_cast<std::chrono::seconds> (currentTime - startTime).count();
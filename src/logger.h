@@ -10,6 +10,7 @@
 #include <chrono>
 #include <iostream>
 #include <sstream>
+#include <mutex>
 #include "util.h"
 #include "vguard.h"
 
@@ -22,6 +23,7 @@ private:
   bool useAnsiColor;
   vguard<string> logAnsiColor;
   string ansiColorOff;
+  mutex printMutex;  // serializes output from concurrent threads
   
 public:
   Logger();
@@ -47,6 +49,7 @@ public:
 
   template<class T>
   void print (const T& t, const char* file, int line, int v) {
+    lock_guard<mutex> lock (printMutex);
     clog << t;
   }
 };
@@ -73,6 +76,7 @@ public:
   int verbosity;
   const char *function, *file;
   int line;
+  mutex progressMutex;  // logProgress may be called from several threads
   ProgressLogger (int verbosity, const char* function, const char* file, int line);
   ~ProgressLogger();
   void initProgress (const char* desc, ...);
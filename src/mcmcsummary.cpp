@@ -0,0 +1,525 @@
+#include <cmath>
+#include "mcmcsummary.h"
+#include "alignpath.h"
+#include "util.h"
+
+OnlineESS::OnlineESS()
+  : n(0), batchSize(1), inBatch(0), mean(0), m2(0), batchSum(0)
+{ }
+
+void OnlineESS::add (double x) {
+  ++n;
+  const double delta = x - mean;
+  mean += delta / n;
+  m2 += delta * (x - mean);
+  batchSum += x;
+  if (++inBatch == batchSize) {
+    batchMean.push_back (batchSum / batchSize);
+    batchSum = 0;
+    inBatch = 0;
+    if (batchMean.size() == 2 * OnlineESSMaxBatches) {
+      // merge adjacent batches
+      for (size_t b = 0; b < OnlineESSMaxBatches; ++b)
+	batchMean[b] = (batchMean[2*b] + batchMean[2*b+1]) / 2;
+      batchMean.resize (OnlineESSMaxBatches);
+      batchSize *= 2;
+    }
+  }
+}
+
+double OnlineESS::variance() const {
+  return n > 1 ? m2 / (n - 1) : 0;
+}
+
+double OnlineESS::ess() const {
+  const size_t nBatches = batchMean.size();
+  if (nBatches < 2)
+    return n;
+  double bMean = 0, bVar = 0;
+  for (auto b : batchMean)
+    bMean += b;
+  bMean /= nBatches;
+  for (auto b : batchMean)
+    bVar += (b - bMean) * (b - bMean);
+  bVar /= nBatches - 1;
+  return bVar > 0 ? (n * variance() / (batchSize * bVar)) : (double) n;
+}
+
+void OnlineESS::saveState (CheckpointWriter& checkpoint) const {
+  checkpoint.writeVarint (n);
+  checkpoint.writeVarint (batchSize);
+  checkpoint.writeVarint (inBatch);
+  checkpoint.writeDouble (mean);
+  checkpoint.writeDouble (m2);
+  checkpoint.writeDouble (batchSum);
+  checkpoint.writeDoubles (batchMean);
+}
+
+void OnlineESS::loadState (CheckpointReader& checkpoint) {
+  n = checkpoint.readVarint();
+  batchSize = checkpoint.readVarint();
+  inBatch = checkpoint.readVarint();
+  mean = checkpoint.readDouble();
+  m2 = checkpoint.readDouble();
+  batchSum = checkpoint.readDouble();
+  batchMean = checkpoint.readDoubles();
+}
+
+mutex MCMCSummary::outMutex;
+
+MCMCSummary::MCMCSummary (const string& name, ostream& out, size_t interval)
+  : steps(0),
+    name(name),
+    out(out),
+    interval(interval)
+{ }
+
+void MCMCSummary::initLeaves (const Sampler::History& history) {
+  for (TreeNodeIndex n = 0; n < history.tree.nodes(); ++n)
+    if (history.tree.isLeaf(n))
+      leafName.push_back (history.gapped[n].name);
+  sort (leafName.begin(), leafName.end());
+  for (size_t l = 0; l < leafName.size(); ++l)
+    leafIndex[leafName[l]] = l;
+  pairState = vguard<vguard<PairState> > (leafName.size());
+  for (size_t r = 0; r < leafName.size(); ++r)
+    pairState[r] = vguard<PairState> (leafName.size() - r - 1);
+}
+
+void MCMCSummary::findLeafNodes (const Sampler::History& history, vguard<TreeNodeIndex>& node) const {
+  node = vguard<TreeNodeIndex> (leafName.size());
+  for (TreeNodeIndex n = 0; n < history.tree.nodes(); ++n)
+    if (history.tree.isLeaf(n))
+      node[leafIndex.at (history.gapped[n].name)] = n;
+}
+
+size_t MCMCSummary::PairState::pairCount (SeqIdx i, SeqIdx j) const {
+  const size_t* c = count.find (pairKey (i, j));
+  return c ? *c : 0;
+}
+
+void MCMCSummary::rebuildClades (const Tree& tree) {
+  // tree is postorder-sorted, so children come before parents
+  nodeClade = vguard<Clade> (tree.nodes(), Clade (leafName.size(), '0'));
+  nodeParent = vguard<TreeNodeIndex> (tree.nodes());
+  set<Clade> splits;
+  for (TreeNodeIndex n = 0; n < tree.nodes(); ++n) {
+    nodeParent[n] = tree.parentNode(n);
+    if (tree.isLeaf(n))
+      nodeClade[n][leafIndex.at (tree.seqName(n))] = '1';
+    else {
+      for (size_t c = 0; c < tree.nChildren(n); ++c) {
+	const Clade& child = nodeClade[tree.getChild(n,c)];
+	for (size_t l = 0; l < child.size(); ++l)
+	  if (child[l] == '1')
+	    nodeClade[n][l] = '1';
+      }
+      if (n != tree.root())
+	splits.insert (nodeClade[n]);
+    }
+  }
+  for (auto iter = splitsSince.begin(); iter != splitsSince.end(); )
+    if (splits.count (iter->first))
+      ++iter;
+    else {
+      splitCount[iter->first] += steps - iter->second;
+      iter = splitsSince.erase (iter);
+    }
+  for (const auto& clade : splits)
+    if (!splitsSince.count (clade))
+      splitsSince[clade] = steps;
+}
+
+void MCMCSummary::updateClades (const Tree& tree, const Sampler::Change& change, vguard<bool>& moved, set<Clade>& dropped) {
+  const TreeNodeIndex nodes = tree.nodes();
+
+  // carry clades over to the new node numbering, and flag nodes that gained or lost a child
+  vguard<Clade> newClade (nodes);
+  vguard<TreeNodeIndex> newIndex (nodes);
+  for (TreeNodeIndex n = 0; n < nodes; ++n) {
+    newClade[n].swap (nodeClade[change.previous(n)]);
+    newIndex[change.previous(n)] = n;
+  }
+  vguard<bool> redo (nodes, false);
+  vguard<TreeNodeIndex> newParent (nodes);
+  for (TreeNodeIndex n = 0; n < nodes; ++n) {
+    const TreeNodeIndex parent = tree.parentNode(n), oldParent = nodeParent[change.previous(n)];
+    if (change.previous(parent) != oldParent) {
+      moved[n] = true;
+      if (parent >= 0)
+	redo[parent] = true;
+      if (oldParent >= 0)
+	redo[newIndex[oldParent]] = true;
+    }
+    newParent[n] = parent;
+  }
+  nodeParent.swap (newParent);
+
+  // recompute clades of those nodes & any ancestors whose clades change as a result.
+  // tree is postorder-sorted, so children come before parents
+  vguard<bool> cladeChanged (nodes, false);
+  vguard<TreeNodeIndex> changed;
+  for (TreeNodeIndex n = 0; n < nodes; ++n)
+    if (!tree.isLeaf(n)) {
+      bool recompute = redo[n];
+      for (size_t c = 0; c < tree.nChildren(n); ++c)
+	recompute = recompute || cladeChanged[tree.getChild(n,c)];
+      if (recompute) {
+	Clade clade (leafName.size(), '0');
+	for (size_t c = 0; c < tree.nChildren(n); ++c) {
+	  const Clade& child = newClade[tree.getChild(n,c)];
+	  for (size_t l = 0; l < child.size(); ++l)
+	    if (child[l] == '1')
+	      clade[l] = '1';
+	}
+	if (clade != newClade[n]) {
+	  dropped.insert (newClade[n]);
+	  newClade[n].swap (clade);
+	  cladeChanged[n] = moved[n] = true;
+	  changed.push_back (n);
+	}
+      }
+    }
+  nodeClade.swap (newClade);
+
+  // a clade can move to another node, so all the old splits are dropped before the new ones are added
+  for (const auto& clade : dropped) {
+    auto iter = splitsSince.find (clade);
+    if (iter != splitsSince.end()) {
+      splitCount[clade] += steps - iter->second;
+      splitsSince.erase (iter);
+    }
+  }
+  for (auto n : changed)
+    if (n != tree.root())
+      splitsSince[nodeClade[n]] = steps;
+}
+
+vguard<int> MCMCSummary::pairPartners (const string& row1, const string& row2) {
+  vguard<int> partner;
+  SeqIdx pos2 = 0;
+  for (size_t col = 0; col < row1.size(); ++col) {
+    const bool res1 = !Alignment::isGap (row1[col]), res2 = !Alignment::isGap (row2[col]);
+    if (res1)
+      partner.push_back (res2 ? (int) pos2 : -1);
+    if (res2)
+      ++pos2;
+  }
+  return partner;
+}
+
+void MCMCSummary::countIndels (const string& parentRow, const string& childRow, int& insertions, int& deletions) {
+  insertions = deletions = 0;
+  enum { Match, Insert, Delete } state = Match;
+  for (size_t col = 0; col < parentRow.size(); ++col) {
+    const bool pRes = !Alignment::isGap (parentRow[col]), cRes = !Alignment::isGap (childRow[col]);
+    if (pRes && cRes)
+      state = Match;
+    else if (cRes) {
+      if (state != Insert)
+	++insertions;
+      state = Insert;
+    } else if (pRes) {
+      if (state != Delete)
+	++deletions;
+      state = Delete;
+    }
+  }
+}
+
+void MCMCSummary::creditPair (PairState& ps) {
+  const size_t weight = steps - ps.since;
+  if (weight)
+    for (SeqIdx i = 0; i < ps.partner.size(); ++i)
+      if (ps.partner[i] >= 0)
+	ps.count[PairState::pairKey (i, ps.partner[i])] += weight;
+  ps.since = steps;
+}
+
+void MCMCSummary::creditBranch (const Clade& clade, BranchState& bs) {
+  const size_t weight = steps - bs.since;
+  BranchTotals& totals = branchTotals[clade];
+  totals.samples += weight;
+  totals.insertions += weight * bs.insertions;
+  totals.deletions += weight * bs.deletions;
+  bs.since = steps;
+}
+
+void MCMCSummary::updatePairs (const Sampler::History& history, const TreeNodeSet& realigned) {
+  // only pairs with a realigned leaf can have changed partners.
+  // Rows are compared in the current history, so unchanged rows need not be copied even if gap columns moved
+  vguard<bool> changed (leafName.size(), false);
+  vguard<size_t> changedLeaves;
+  for (size_t l = 0; l < leafName.size(); ++l)
+    if (realigned.count (leafNode[l])) {
+      changed[l] = true;
+      changedLeaves.push_back (l);
+    }
+  for (auto l : changedLeaves)
+    for (size_t m = 0; m < leafName.size(); ++m)
+      if (m != l && !(changed[m] && m < l)) {
+	const size_t r = min(l,m), s = max(l,m);
+	PairState& ps = pairState[r][s-r-1];
+	const vguard<int> partner = pairPartners (history.gapped[leafNode[r]].seq, history.gapped[leafNode[s]].seq);
+	if (partner != ps.partner) {
+	  creditPair (ps);
+	  ps.partner = partner;
+	}
+      }
+}
+
+void MCMCSummary::updateBranches (const Sampler::History& history, const TreeNodeSet& realigned, const vguard<bool>& moved, const set<Clade>& dropped, bool all) {
+  const Tree& tree = history.tree;
+  for (const auto& clade : dropped) {
+    auto iter = branchState.find (clade);
+    if (iter != branchState.end()) {
+      creditBranch (clade, iter->second);
+      branchState.erase (iter);
+    }
+  }
+  set<Clade> present;
+  for (TreeNodeIndex n = 0; n < tree.nodes(); ++n)
+    if (n != tree.root() && (all || moved[n] || realigned.count(n) || realigned.count(tree.parentNode(n)))) {
+      const Clade& clade = nodeClade[n];
+      int insertions, deletions;
+      countIndels (history.gapped[tree.parentNode(n)].seq, history.gapped[n].seq, insertions, deletions);
+      auto iter = branchState.find (clade);
+      if (iter == branchState.end()) {
+	BranchState& bs = branchState[clade];
+	bs.since = steps;
+	bs.insertions = insertions;
+	bs.deletions = deletions;
+      } else if (insertions != iter->second.insertions || deletions != iter->second.deletions) {
+	BranchState& bs = iter->second;
+	creditBranch (clade, bs);
+	bs.insertions = insertions;
+	bs.deletions = deletions;
+      }
+      if (all)
+	present.insert (clade);
+    }
+  if (all) {
+    for (auto iter = branchState.begin(); iter != branchState.end(); )
+      if (present.count (iter->first))
+	++iter;
+      else {
+	creditBranch (iter->first, iter->second);
+	iter = branchState.erase (iter);
+      }
+  }
+}
+
+void MCMCSummary::logHistory (const Sampler::History& history, LogProb logLikelihood, const Sampler::Change& change) {
+  if (leafName.empty())
+    initLeaves (history);
+
+  // per-node clades are not checkpointed, so the first state after a resume is treated as all-new
+  const TreeNodeIndex nodes = history.tree.nodes();
+  const bool all = change.all || nodeClade.size() != (size_t) nodes;
+  const TreeNodeSet realigned = all ? TreeNodeSet (nodes, true) : (change.alignment ? change.realigned : TreeNodeSet (nodes));
+
+  if (all || change.topology || !change.oldNode.empty())
+    findLeafNodes (history, leafNode);
+  if (all || change.alignment)
+    updatePairs (history, realigned);
+
+  vguard<bool> moved (nodes, false);  // nodes whose clade or parent changed
+  set<Clade> dropped;  // old clades of nodes whose clade changed
+  if (all)
+    rebuildClades (history.tree);
+  else if (change.topology)
+    updateClades (history.tree, change, moved, dropped);
+
+  if (all || change.alignment || change.topology)
+    updateBranches (history, realigned, moved, dropped, all);
+
+  logLike.add (logLikelihood);
+  ++steps;
+
+  if (steps % interval == 0)
+    write (history);
+}
+
+void MCMCSummary::creditAll() {
+  for (auto& row : pairState)
+    for (auto& ps : row)
+      creditPair (ps);
+  for (auto& clade_since : splitsSince) {
+    splitCount[clade_since.first] += steps - clade_since.second;
+    clade_since.second = steps;
+  }
+  for (auto& clade_bs : branchState)
+    creditBranch (clade_bs.first, clade_bs.second);
+}
+
+vguard<double> MCMCSummary::columnSupport (const Sampler::History& history) {
+  creditAll();
+  vguard<TreeNodeIndex> node;
+  findLeafNodes (history, node);
+  vguard<const string*> leafRow;
+  for (auto n : node)
+    leafRow.push_back (&history.gapped[n].seq);
+  const size_t cols = leafRow.empty() ? 0 : leafRow[0]->size();
+  vguard<double> support (cols, -1);
+  vguard<SeqIdx> pos (leafRow.size(), 0);
+  for (size_t col = 0; col < cols; ++col) {
+    double total = 0;
+    size_t pairs = 0;
+    for (size_t r = 0; r < leafRow.size(); ++r)
+      if (!Alignment::isGap ((*leafRow[r])[col]))
+	for (size_t s = r + 1; s < leafRow.size(); ++s)
+	  if (!Alignment::isGap ((*leafRow[s])[col])) {
+	    total += pairState[r][s-r-1].pairCount (pos[r], pos[s]) / (double) steps;
+	    ++pairs;
+	  }
+    if (pairs)
+      support[col] = total / pairs;
+    for (size_t r = 0; r < leafRow.size(); ++r)
+      if (!Alignment::isGap ((*leafRow[r])[col]))
+	++pos[r];
+  }
+  return support;
+}
+
+void MCMCSummary::writeClade (ostream& out, const Clade& clade) const {
+  out << "[";
+  size_t nOut = 0;
+  for (size_t l = 0; l < clade.size(); ++l)
+    if (clade[l] == '1')
+      out << (nOut++ ? "," : "") << quoted_escaped (leafName[l]);
+  out << "]";
+}
+
+void MCMCSummary::write (const Sampler::History& history) {
+  if (!steps)
+    return;
+  const vguard<double> support = columnSupport (history);  // also credits all summaries up to the current step
+  ostringstream record;
+  record << "{\"dataset\": " << quoted_escaped(name)
+         << ", \"samples\": " << steps
+         << ", \"logLikelihood\": {\"mean\": " << logLike.mean << ", \"variance\": " << logLike.variance() << ", \"ess\": " << logLike.ess() << "}";
+  record << ", \"splits\": [";
+  size_t nOut = 0;
+  for (const auto& clade_count : splitCount) {
+    record << (nOut++ ? ", " : "") << "{\"clade\": ";
+    writeClade (record, clade_count.first);
+    record << ", \"support\": " << (clade_count.second / (double) steps) << "}";
+  }
+  record << "], \"branches\": [";
+  nOut = 0;
+  for (const auto& clade_totals : branchTotals) {
+    const BranchTotals& totals = clade_totals.second;
+    if (totals.samples) {
+      record << (nOut++ ? ", " : "") << "{\"clade\": ";
+      writeClade (record, clade_totals.first);
+      record << ", \"support\": " << (totals.samples / (double) steps)
+	  << ", \"insertions\": " << (totals.insertions / (double) totals.samples)
+	  << ", \"deletions\": " << (totals.deletions / (double) totals.samples) << "}";
+    }
+  }
+  record << "], \"columnSupport\": [";
+  for (size_t col = 0; col < support.size(); ++col) {
+    record << (col ? "," : "");
+    if (support[col] < 0)
+      record << "null";
+    else
+      record << support[col];
+  }
+  record << "]}" << endl;
+  // summaries of datasets sampled on different threads share one stream, so each record is written whole
+  lock_guard<mutex> lock (outMutex);
+  out << record.str() << flush;
+}
+
+void MCMCSummary::saveState (CheckpointWriter& checkpoint) {
+  checkpoint.writeVarint (steps);
+  checkpoint.writeVarint (leafName.size());
+  for (size_t l = 0; l < leafName.size(); ++l)
+    checkpoint.writeString (leafName[l]);
+  for (const auto& row : pairState)
+    for (const auto& ps : row) {
+      checkpoint.writeVarint (ps.since);
+      checkpoint.writeInts (ps.partner);
+      checkpoint.writeVarint (ps.count.size());
+      for (auto key : ps.count.sortedKeys()) {
+	checkpoint.writeVarint (key);
+	checkpoint.writeVarint (*ps.count.find (key));
+      }
+    }
+  checkpoint.writeVarint (splitsSince.size());
+  for (const auto& ss : splitsSince) {
+    checkpoint.writeString (ss.first);
+    checkpoint.writeVarint (ss.second);
+  }
+  checkpoint.writeVarint (splitCount.size());
+  for (const auto& sc : splitCount) {
+    checkpoint.writeString (sc.first);
+    checkpoint.writeVarint (sc.second);
+  }
+  checkpoint.writeVarint (branchState.size());
+  for (const auto& cb : branchState) {
+    checkpoint.writeString (cb.first);
+    checkpoint.writeVarint (cb.second.since);
+    checkpoint.writeVarint (cb.second.insertions);
+    checkpoint.writeVarint (cb.second.deletions);
+  }
+  checkpoint.writeVarint (branchTotals.size());
+  for (const auto& cb : branchTotals) {
+    checkpoint.writeString (cb.first);
+    checkpoint.writeVarint (cb.second.samples);
+    checkpoint.writeVarint (cb.second.insertions);
+    checkpoint.writeVarint (cb.second.deletions);
+  }
+  logLike.saveState (checkpoint);
+}
+
+void MCMCSummary::loadState (CheckpointReader& checkpoint) {
+  steps = checkpoint.readVarint();
+  leafName = vguard<string> (checkpoint.readVarint());
+  leafIndex.clear();
+  for (size_t l = 0; l < leafName.size(); ++l) {
+    leafName[l] = checkpoint.readString();
+    leafIndex[leafName[l]] = l;
+  }
+  pairState = vguard<vguard<PairState> > (leafName.size());
+  for (size_t r = 0; r < leafName.size(); ++r) {
+    pairState[r] = vguard<PairState> (leafName.size() - r - 1);
+    for (auto& ps : pairState[r]) {
+      ps.since = checkpoint.readVarint();
+      ps.partner = checkpoint.readInts();
+      const size_t nCounts = checkpoint.readVarint();
+      ps.count = FlatHashMap<size_t> (nCounts);
+      for (size_t k = 0; k < nCounts; ++k) {
+	const uint64_t key = checkpoint.readVarint();
+	ps.count[key] = checkpoint.readVarint();
+      }
+    }
+  }
+  splitsSince.clear();
+  for (size_t nSplits = checkpoint.readVarint(); nSplits > 0; --nSplits) {
+    const Clade clade = checkpoint.readString();
+    splitsSince[clade] = checkpoint.readVarint();
+  }
+  splitCount.clear();
+  for (size_t nSplits = checkpoint.readVarint(); nSplits > 0; --nSplits) {
+    const Clade clade = checkpoint.readString();
+    splitCount[clade] = checkpoint.readVarint();
+  }
+  branchState.clear();
+  for (size_t nBranches = checkpoint.readVarint(); nBranches > 0; --nBranches) {
+    BranchState& bs = branchState[checkpoint.readString()];
+    bs.since = checkpoint.readVarint();
+    bs.insertions = checkpoint.readVarint();
+    bs.deletions = checkpoint.readVarint();
+  }
+  branchTotals.clear();
+  for (size_t nBranches = checkpoint.readVarint(); nBranches > 0; --nBranches) {
+    BranchTotals& bt = branchTotals[checkpoint.readString()];
+    bt.samples = checkpoint.readVarint();
+    bt.insertions = checkpoint.readVarint();
+    bt.deletions = checkpoint.readVarint();
+  }
+  logLike.loadState (checkpoint);
+  nodeClade.clear();
+  nodeParent.clear();
+}
@@ -0,0 +1,109 @@
+#ifndef MCMCSUMMARY_INCLUDED
+#define MCMCSUMMARY_INCLUDED
+
+#include "sampler.h"
+#include "flathash.h"
+
+#define DefaultMCMCSummaryInterval 100
+#define OnlineESSMaxBatches 64
+
+// Streaming mean, variance & effective sample size (by batch means, with the batch size doubled as needed)
+struct OnlineESS {
+  size_t n, batchSize, inBatch;
+  double mean, m2, batchSum;
+  vguard<double> batchMean;
+  OnlineESS();
+  void add (double x);
+  double variance() const;
+  double ess() const;
+  void saveState (CheckpointWriter& checkpoint) const;
+  void loadState (CheckpointReader& checkpoint);
+};
+
+/* Posterior summaries of an MCMC run, accumulated as the sampler runs
+   and written as one JSON record per line every few steps.
+
+   Each summary is a time average over logged states. A state's contribution
+   is credited lazily, when the thing it describes changes (or when a record is written).
+   The Sampler::Change passed with each state says which rows were realigned & whether the tree changed,
+   so only leaf pairs involving a realigned leaf, and only branches & clades touched by the move, are revisited;
+   their rows are read from the logged history, so the work per step scales with the number of realigned leaves.
+
+   Summaries:
+   - support of each aligned pair of leaf residues, reported as the mean over the
+     residue pairs in each column of the current alignment;
+   - per-branch insertion & deletion counts, keyed by the branch's clade;
+   - clade (split) frequencies;
+   - mean, variance & effective sample size of the log-likelihood. */
+class MCMCSummary : public Sampler::Logger {
+private:
+  typedef string Clade;  // one '0' or '1' per leaf, in leafName order
+
+  struct PairState {
+    PairState() : since(0) { }
+    size_t since;
+    vguard<int> partner;  // partner[i] = residue of the second row aligned to residue i of the first, or -1
+    FlatHashMap<size_t> count;  // steps for which residue i of the first row was aligned to residue j of the second, keyed by pairKey(i,j)
+    static inline uint64_t pairKey (SeqIdx i, SeqIdx j) { return (((uint64_t) i) << 32) | (uint64_t) j; }
+    size_t pairCount (SeqIdx i, SeqIdx j) const;
+  };
+
+  struct BranchState {
+    size_t since;
+    int insertions, deletions;
+  };
+
+  struct BranchTotals {
+    size_t samples, insertions, deletions;
+    BranchTotals() : samples(0), insertions(0), deletions(0) { }
+  };
+
+  size_t steps;
+  vguard<string> leafName;
+  map<string,size_t> leafIndex;
+  vguard<TreeNodeIndex> leafNode;  // node of each leaf in the last logged history
+  vguard<vguard<PairState> > pairState;  // pairState[r][s-r-1] for r < s
+
+  vguard<Clade> nodeClade;  // clade of each node in the last logged tree
+  vguard<TreeNodeIndex> nodeParent;  // parent of each node in the last logged tree
+
+  map<Clade,size_t> splitsSince;  // splits in the last logged tree, with the step each one appeared
+  map<Clade,size_t> splitCount;
+
+  map<Clade,BranchState> branchState;
+  map<Clade,BranchTotals> branchTotals;
+
+  OnlineESS logLike;
+
+  void initLeaves (const Sampler::History& history);
+  void findLeafNodes (const Sampler::History& history, vguard<TreeNodeIndex>& node) const;
+  void updatePairs (const Sampler::History& history, const TreeNodeSet& realigned);
+  void updateClades (const Tree& tree, const Sampler::Change& change, vguard<bool>& moved, set<Clade>& dropped);
+  void rebuildClades (const Tree& tree);
+  void updateBranches (const Sampler::History& history, const TreeNodeSet& realigned, const vguard<bool>& moved, const set<Clade>& dropped, bool all);
+  void creditPair (PairState& ps);
+  void creditBranch (const Clade& clade, BranchState& bs);
+  void creditAll();
+
+  static vguard<int> pairPartners (const string& row1, const string& row2);
+  static void countIndels (const string& parentRow, const string& childRow, int& insertions, int& deletions);
+  void writeClade (ostream& out, const Clade& clade) const;
+
+  static mutex outMutex;
+
+public:
+  const string name;
+  ostream& out;
+  const size_t interval;
+
+  MCMCSummary (const string& name, ostream& out, size_t interval = DefaultMCMCSummaryInterval);
+
+  void logHistory (const Sampler::History& history, LogProb logLikelihood, const Sampler::Change& change);
+  void saveState (CheckpointWriter& checkpoint);
+  void loadState (CheckpointReader& checkpoint);
+  size_t samples() const { return steps; }
+  vguard<double> columnSupport (const Sampler::History& history);  // for each column of the last logged leaf alignment; -1 if the column has fewer than two residues
+  void write (const Sampler::History& history);  // history is the last logged state
+};
+
+#endif /* MCMCSUMMARY_INCLUDED */
@@ -9,6 +9,7 @@
 #include <gsl/gsl_complex_math.h>
 
 #include <iomanip>
+#include <fstream>
 #include <algorithm>
 #include <set>
 
@@ -18,6 +19,7 @@
 #include "alignpath.h"
 #include "logger.h"
 #include "sumprod.h"
+#include "binio.h"
 
 #define EIGENMODEL_EPSILON 1e-6
 #define EIGENMODEL_NEAR_EQ(X,Y) (gsl_fcmp (X, Y, EIGENMODEL_EPSILON) == 0)
@@ -279,6 +281,85 @@ void RateModel::writeComponent (int cpt, ostream& out) const {
   out << indent << "}" << endl;
 }
 
+// byte-order check for compiled model files, which are native-endian
+static const uint32_t compiledModelByteOrder = 0x01020304;
+
+void RateModel::writeCompiled (ostream& out) const {
+  writeBinary (out, string (CompiledModelMagic));
+  writeBinary (out, compiledModelByteOrder);
+  writeBinary (out, (int) CompiledModelVersion);
+  writeBinary (out, alphabet);
+  writeBinary (out, wildcard);
+  writeBinary (out, insRate);
+  writeBinary (out, delRate);
+  writeBinary (out, insExtProb);
+  writeBinary (out, delExtProb);
+  writeBinary (out, cptWeight);
+  const EigenModel eigen (*this);
+  for (int cpt = 0; cpt < components(); ++cpt) {
+    vguard<double> ip (alphabetSize()), sr;
+    for (AlphTok i = 0; i < alphabetSize(); ++i) {
+      ip[i] = gsl_vector_get (insProb[cpt], i);
+      for (AlphTok j = 0; j < alphabetSize(); ++j)
+	sr.push_back (gsl_matrix_get (subRate[cpt], i, j));
+    }
+    writeBinary (out, ip);
+    writeBinary (out, sr);
+    eigen.writeEigensystem (cpt, out);
+  }
+}
+
+void RateModel::readCompiled (istream& in) {
+  Assert (subRate.empty(), "RateModel already initialized");
+  string magic;
+  uint32_t byteOrder;
+  int version;
+  readBinary (in, magic);
+  Require (magic == CompiledModelMagic, "Not a compiled model file");
+  readBinary (in, byteOrder);
+  Require (byteOrder == compiledModelByteOrder, "Compiled model file was written on a machine with a different byte order; please recompile it from JSON");
+  readBinary (in, version);
+  Require (version == CompiledModelVersion, "Compiled model file has version %d, expected %d; please recompile it from JSON", version, CompiledModelVersion);
+
+  string alph;
+  char wild;
+  readBinary (in, alph);
+  readBinary (in, wild);
+  initAlphabet (alph, wild);
+  readBinary (in, insRate);
+  readBinary (in, delRate);
+  readBinary (in, insExtProb);
+  readBinary (in, delExtProb);
+  readBinary (in, cptWeight);
+
+  for (int cpt = 0; cpt < components(); ++cpt) {
+    vguard<double> ip, sr;
+    readBinary (in, ip);
+    readBinary (in, sr);
+    Require (ip.size() == alphabetSize() && sr.size() == alphabetSize() * alphabetSize(), "Compiled model has wrong dimensions");
+    insProb.push_back (newAlphabetVector());
+    subRate.push_back (newAlphabetMatrix());
+    for (AlphTok i = 0; i < alphabetSize(); ++i) {
+      gsl_vector_set (insProb.back(), i, ip[i]);
+      for (AlphTok j = 0; j < alphabetSize(); ++j)
+	gsl_matrix_set (subRate.back(), i, j, sr[i * alphabetSize() + j]);
+    }
+    EigenModel::readEigensystem (subRate.back(), in);
+  }
+}
+
+bool RateModel::isCompiledFile (const string& filename) {
+  ifstream in (filename, ios::binary);
+  const string magic (CompiledModelMagic);
+  size_t len = 0;
+  in.read ((char*) &len, sizeof(len));
+  if (!in || len != magic.size())
+    return false;
+  string s (len, ' ');
+  in.read (&s[0], len);
+  return in && s == magic;
+}
+
 gsl_vector* RateModel::getEqmProbVector (gsl_matrix* sr) {
   const size_t alphSize = sr->size1;
   // find eqm via QR decomposition
@@ -319,9 +400,78 @@ gsl_vector* RateModel::getEqmProbVector (gsl_matrix* sr) {
   return eqm;
 }
 
+SparseRateMatrix::SparseRateMatrix (const gsl_matrix* rate)
+  : size (rate->size1),
+    nonzeros (0),
+    maxExitRate (0),
+    uniformized (rate->size1)
+{
+  for (AlphTok i = 0; i < size; ++i)
+    maxExitRate = max (maxExitRate, -gsl_matrix_get (rate, i, i));
+  for (AlphTok i = 0; i < size; ++i)
+    for (AlphTok j = 0; j < size; ++j) {
+      const double r_ij = gsl_matrix_get (rate, i, j);
+      if (r_ij != 0)
+	++nonzeros;
+      const double b_ij = (i == j ? 1 : 0) + (maxExitRate > 0 ? r_ij / maxExitRate : 0);
+      if (b_ij != 0)
+	uniformized[i].push_back (pair<AlphTok,double> (j, b_ij));
+    }
+}
+
+size_t SparseRateMatrix::uniformizationTerms (double t) const {
+  // Poisson(mu*t) tail below ~1e-16
+  const double mut = maxExitRate * t;
+  return (size_t) ceil (mut + 8 * sqrt (mut) + 16);
+}
+
+bool SparseRateMatrix::useUniformization (double t) const {
+  return density() <= MaxUniformizationDensity
+    && uniformizationTerms(t) * nonzeros <= MaxUniformizationCostRatio * (size_t) size * (size_t) size;
+}
+
+gsl_matrix* SparseRateMatrix::exponentiate (double t) const {
+  const double mut = maxExitRate * t;
+  const size_t maxTerms = uniformizationTerms (t);
+  // rows of B^n, all rows at once
+  vguard<double> bn (size * size, 0.), next (size * size);
+  for (AlphTok i = 0; i < size; ++i)
+    bn[i*size + i] = 1;
+  double w = exp (-mut), wTotal = w;
+  vguard<double> p (size * size);
+  for (size_t k = 0; k < p.size(); ++k)
+    p[k] = w * bn[k];
+  for (size_t n = 1; n <= maxTerms && 1 - wTotal > UniformizationTolerance; ++n) {
+    fill (next.begin(), next.end(), 0.);
+    for (AlphTok r = 0; r < size; ++r) {
+      const double* bnRow = &bn[r*size];
+      double* nextRow = &next[r*size];
+      for (AlphTok i = 0; i < size; ++i)
+	if (bnRow[i] != 0)
+	  for (const auto& jb : uniformized[i])
+	    nextRow[jb.first] += bnRow[i] * jb.second;
+    }
+    bn.swap (next);
+    w *= mut / n;
+    wTotal += w;
+    for (size_t k = 0; k < p.size(); ++k)
+      p[k] += w * bn[k];
+  }
+  gsl_matrix* m = gsl_matrix_alloc (size, size);
+  for (AlphTok i = 0; i < size; ++i)
+    for (AlphTok j = 0; j < size; ++j)
+      gsl_matrix_set (m, i, j, p[i*size + j]);
+  return m;
+}
+
 vguard<gsl_matrix*> RateModel::getSubProbMatrix (double t) const {
   vguard<gsl_matrix*> v;
   for (int c = 0; c < components(); ++c) {
+    const SparseRateMatrix sparse (subRate[c]);
+    if (sparse.useUniformization (t)) {
+      v.push_back (sparse.exponentiate (t));
+      continue;
+    }
     gsl_matrix* m = newAlphabetMatrix();
     gsl_matrix* rt = newAlphabetMatrix();
     CheckGsl (gsl_matrix_memcpy (rt, subRate[c]));
@@ -363,6 +513,71 @@ RateModel RateModel::scaleRates (double substMultiplier, double indelMultiplier)
   return model;
 }
 
+static double freeParamLog (double x) {
+  return x > 0 ? max (log (x), (double) MinFreeParamLog) : MinFreeParamLog;
+}
+
+static double freeParamExp (double x) {
+  return x <= MinFreeParamLog ? 0 : exp (x);
+}
+
+vguard<double> RateModel::getFreeParams (bool includeIndelRates, bool includeSubstRates) const {
+  vguard<double> params;
+  if (includeIndelRates) {
+    params.push_back (freeParamLog (insRate));
+    params.push_back (freeParamLog (delRate));
+    params.push_back (freeParamLog (insExtProb) - freeParamLog (1 - insExtProb));
+    params.push_back (freeParamLog (delExtProb) - freeParamLog (1 - delExtProb));
+  }
+  if (includeSubstRates)
+    for (int cpt = 0; cpt < components(); ++cpt) {
+      params.push_back (freeParamLog (cptWeight[cpt]));
+      for (AlphTok i = 0; i < alphabetSize(); ++i)
+	params.push_back (freeParamLog (gsl_vector_get (insProb[cpt], i)));
+      for (AlphTok i = 0; i < alphabetSize(); ++i)
+	for (AlphTok j = 0; j < alphabetSize(); ++j)
+	  if (i != j)
+	    params.push_back (freeParamLog (gsl_matrix_get (subRate[cpt], i, j)));
+    }
+  return params;
+}
+
+void RateModel::setFreeParams (const vguard<double>& params, bool includeIndelRates, bool includeSubstRates) {
+  auto p = params.begin();
+  if (includeIndelRates) {
+    insRate = freeParamExp (*p++);
+    delRate = freeParamExp (*p++);
+    insExtProb = 1 / (1 + exp (-*p++));
+    delExtProb = 1 / (1 + exp (-*p++));
+  }
+  if (includeSubstRates) {
+    for (int cpt = 0; cpt < components(); ++cpt) {
+      cptWeight[cpt] = freeParamExp (*p++);
+      double insNorm = 0;
+      for (AlphTok i = 0; i < alphabetSize(); ++i) {
+	const double p_i = freeParamExp (*p++);
+	gsl_vector_set (insProb[cpt], i, p_i);
+	insNorm += p_i;
+      }
+      CheckGsl (gsl_vector_scale (insProb[cpt], 1 / insNorm));
+      for (AlphTok i = 0; i < alphabetSize(); ++i) {
+	double r_ii = 0;
+	for (AlphTok j = 0; j < alphabetSize(); ++j)
+	  if (i != j) {
+	    const double r_ij = freeParamExp (*p++);
+	    gsl_matrix_set (subRate[cpt], i, j, r_ij);
+	    r_ii -= r_ij;
+	  }
+	gsl_matrix_set (subRate[cpt], i, i, r_ii);
+      }
+    }
+    const double cptNorm = accumulate (cptWeight.begin(), cptWeight.end(), 0.);
+    for (auto& w : cptWeight)
+      w /= cptNorm;
+  }
+  Assert (p == params.end(), "Parameter count mismatch");
+}
+
 double RateModel::expectedInsertionLength() const {
   return 1. / (1. - insExtProb);
 }
@@ -371,15 +586,19 @@ double RateModel::expectedDeletionLength() const {
   return 1. / (1. - delExtProb);
 }
 
-ProbModel::ProbModel (const RateModel& model, double t)
-  : AlphabetOwner (model),
-    t (t),
+IndelProbModel::IndelProbModel (const RateModel& model, double t)
+  : t (t),
     ins (1 - exp (-model.insRate * t)),
     del (1 - exp (-model.delRate * t)),
     insExt (model.insExtProb),
     delExt (model.delExtProb),
     insWait (IndelCounts::decayWaitTime (model.insRate, t)),
-    delWait (IndelCounts::decayWaitTime (model.delRate, t)),
+    delWait (IndelCounts::decayWaitTime (model.delRate, t))
+{ }
+
+ProbModel::ProbModel (const RateModel& model, double t)
+  : AlphabetOwner (model),
+    IndelProbModel (model, t),
     cptWeight (model.cptWeight),
     insVec (model.components()),
     subMat (model.getSubProbMatrix (t))
@@ -397,7 +616,7 @@ ProbModel::~ProbModel() {
     gsl_vector_free (iv);
 }
 
-double ProbModel::transProb (State src, State dest) const {
+double IndelProbModel::transProb (State src, State dest) const {
   switch (src) {
   case Match:
     switch (dest) {
@@ -483,7 +702,7 @@ void ProbModel::writeComponent (int cpt, ostream& out) const {
   out << indent << "}" << endl;
 }
 
-ProbModel::State ProbModel::getState (bool parentUngapped, bool childUngapped) {
+IndelProbModel::State IndelProbModel::getState (bool parentUngapped, bool childUngapped) {
   if (parentUngapped)
     return childUngapped ? Match : Delete;
   return childUngapped ? Insert : End;
@@ -504,17 +723,25 @@ LogProbModel::LogProbModel (const ProbModel& pm)
 }
 
 double RateModel::mlDistance (const FastSeq& x, const FastSeq& y, int maxIterations) const {
-  LogThisAt(7,"Estimating distance from " << x.name << " to " << y.name << endl);
-  map<pair<AlphTok,AlphTok>,int> pairCount;
   Assert (x.length() == y.length(), "Sequences %s and %s have different lengths (%u, %u)", x.name.c_str(), y.name.c_str(), x.length(), y.length());
-  for (size_t col = 0; col < x.length(); ++col) {
-    const char ci = x.seq[col];
-    const char cj = y.seq[col];
-    if (!Alignment::isGap(ci) && !Alignment::isGap(cj) && !Alignment::isWildcard(ci) && !Alignment::isWildcard(cj)) {
-      const UnvalidatedAlphTok toki = tokenize(ci), tokj = tokenize(cj);
-      if (toki >= 0 && tokj >= 0)
-	++pairCount[pair<AlphTok,AlphTok> (tokenizeOrDie(ci), tokenizeOrDie(cj))];
-    }
+  const vguard<FastSeq> xy = { x, y };
+  return mlDistance (TokenStore (xy, alphabet), 0, 1, maxIterations);
+}
+
+double RateModel::mlDistance (const TokenStore& gappedTokens, size_t xRow, size_t yRow, int maxIterations) const {
+  const string& xName = gappedTokens.name[xRow];
+  const string& yName = gappedTokens.name[yRow];
+  LogThisAt(7,"Estimating distance from " << xName << " to " << yName << endl);
+  Assert (gappedTokens.columns(xRow) == gappedTokens.columns(yRow), "Sequences %s and %s have different lengths (%u, %u)", xName.c_str(), yName.c_str(), gappedTokens.columns(xRow), gappedTokens.columns(yRow));
+  map<pair<AlphTok,AlphTok>,int> pairCount;
+  const CompactTok* xTok = gappedTokens.tokens (xRow);
+  const CompactTok* yTok = gappedTokens.tokens (yRow);
+  const vguard<SeqIdx>& xPosToCol = gappedTokens.posToCol[xRow];
+  const vguard<SeqIdx>& yColToPos = gappedTokens.colToPos[yRow];
+  for (SeqIdx xPos = 0; xPos < xPosToCol.size(); ++xPos) {
+    const SeqIdx yPos = yColToPos[xPosToCol[xPos]];
+    if (yPos != TokenStoreGapPos && compactTokValid (xTok[xPos]) && compactTokValid (yTok[yPos]))
+      ++pairCount[pair<AlphTok,AlphTok> (xTok[xPos], yTok[yPos])];
   }
   if (LoggingThisAt(7)) {
     LogThisAt(7,"Counts:");
@@ -524,21 +751,26 @@ double RateModel::mlDistance (const FastSeq& x, const FastSeq& y, int maxIterati
   }
   const DistanceMatrixParams dmp (pairCount, *this);
   const double t = dmp.tML (maxIterations);
-  LogThisAt(6,"Distance from " << x.name << " to " << y.name << " is " << t << endl);
+  LogThisAt(6,"Distance from " << xName << " to " << yName << " is " << t << endl);
   return t;
 }
 
 vguard<vguard<double> > RateModel::distanceMatrix (const vguard<FastSeq>& gappedSeq, int maxIterations) const {
-  vguard<vguard<double> > dist (gappedSeq.size(), vguard<double> (gappedSeq.size()));
+  return distanceMatrix (TokenStore (gappedSeq, alphabet), maxIterations);
+}
+
+vguard<vguard<double> > RateModel::distanceMatrix (const TokenStore& gappedTokens, int maxIterations) const {
+  const size_t rows = gappedTokens.rows();
+  vguard<vguard<double> > dist (rows, vguard<double> (rows));
   ProgressLog (plog, 4);
-  plog.initProgress ("Distance matrix (%d rows)", gappedSeq.size());
-  const size_t pairs = (gappedSeq.size() - 1) * gappedSeq.size() / 2;
+  plog.initProgress ("Distance matrix (%d rows)", rows);
+  const size_t pairs = (rows - 1) * rows / 2;
   size_t n = 0;
-  for (size_t i = 0; i + 1 < gappedSeq.size(); ++i)
-    for (size_t j = i + 1; j < gappedSeq.size(); ++j) {
+  for (size_t i = 0; i + 1 < rows; ++i)
+    for (size_t j = i + 1; j < rows; ++j) {
       plog.logProgress (n / (double) pairs, "computing entry %d/%d", n + 1, pairs);
       ++n;
-      dist[i][j] = dist[j][i] = mlDistance (gappedSeq[i], gappedSeq[j], maxIterations);
+      dist[i][j] = dist[j][i] = mlDistance (gappedTokens, i, j, maxIterations);
     }
   if (LoggingThisAt(3)) {
     LogThisAt(3,"Distance matrix (" << dist.size() << " rows):" << endl);
@@ -845,8 +1077,8 @@ EventCounts EventCounts::operator* (double w) const {
 }
 
 void IndelCounts::accumulateIndelCounts (const RateModel& model, double time, const AlignRowPath& parent, const AlignRowPath& child, double weight) {
-  const double insWait = decayWaitTime (model.insRate, time), delWait = decayWaitTime (model.delRate, time);
-  ProbModel pm (model, time);
+  const IndelProbModel pm (model, time);
+  const double insWait = pm.insWait, delWait = pm.delWait;
   ProbModel::State state, next;
   state = ProbModel::Match;
   for (size_t col = 0; col < parent.size(); ++col) {
@@ -1152,22 +1384,8 @@ EigenModel::EigenModel (const RateModel& model)
     evec[cpt] = gsl_matrix_complex_alloc (model.alphabetSize(), model.alphabetSize());
     evecInv[cpt] = gsl_matrix_complex_alloc (model.alphabetSize(), model.alphabetSize());
 
-    gsl_matrix *R = gsl_matrix_alloc (model.alphabetSize(), model.alphabetSize());
-    gsl_matrix_memcpy (R, model.subRate[cpt]);
-  
-    gsl_eigen_nonsymmv_workspace *workspace = gsl_eigen_nonsymmv_alloc (model.alphabetSize());
-    CheckGsl (gsl_eigen_nonsymmv (R, eval[cpt], evec[cpt], workspace));
-    gsl_eigen_nonsymmv_free (workspace);
-    gsl_matrix_free (R);
-
-    gsl_matrix_complex *LU = gsl_matrix_complex_alloc (model.alphabetSize(), model.alphabetSize());
-    gsl_permutation *perm = gsl_permutation_alloc (model.alphabetSize());
-    int permSig = 0;
-    gsl_matrix_complex_memcpy (LU, evec[cpt]);
-    CheckGsl (gsl_linalg_complex_LU_decomp (LU, perm, &permSig));
-    CheckGsl (gsl_linalg_complex_LU_invert (LU, perm, evecInv[cpt]));
-    gsl_matrix_complex_free (LU);
-    gsl_permutation_free (perm);
+    if (!findPrecomputed (cpt))
+      decompose (cpt);
 
     for (AlphTok i = 0; i < model.alphabetSize(); ++i)
       ev[cpt][i] = gsl_vector_complex_get (eval[cpt], i);
@@ -1198,6 +1416,88 @@ EigenModel::EigenModel (const RateModel& model)
   }
 }
 
+void EigenModel::decompose (int cpt) {
+  gsl_matrix *R = gsl_matrix_alloc (model.alphabetSize(), model.alphabetSize());
+  gsl_matrix_memcpy (R, model.subRate[cpt]);
+
+  gsl_eigen_nonsymmv_workspace *workspace = gsl_eigen_nonsymmv_alloc (model.alphabetSize());
+  CheckGsl (gsl_eigen_nonsymmv (R, eval[cpt], evec[cpt], workspace));
+  gsl_eigen_nonsymmv_free (workspace);
+  gsl_matrix_free (R);
+
+  gsl_matrix_complex *LU = gsl_matrix_complex_alloc (model.alphabetSize(), model.alphabetSize());
+  gsl_permutation *perm = gsl_permutation_alloc (model.alphabetSize());
+  int permSig = 0;
+  gsl_matrix_complex_memcpy (LU, evec[cpt]);
+  CheckGsl (gsl_linalg_complex_LU_decomp (LU, perm, &permSig));
+  CheckGsl (gsl_linalg_complex_LU_invert (LU, perm, evecInv[cpt]));
+  gsl_matrix_complex_free (LU);
+  gsl_permutation_free (perm);
+}
+
+map<string,EigenModel::Eigensystem> EigenModel::precomputed;
+mutex EigenModel::precomputedMutex;
+
+string EigenModel::rateMatrixKey (const gsl_matrix* subRate) {
+  string key;
+  key.reserve (subRate->size1 * subRate->size2 * sizeof(double));
+  for (size_t i = 0; i < subRate->size1; ++i)
+    key.append ((const char*) gsl_matrix_const_ptr (subRate, i, 0), subRate->size2 * sizeof(double));
+  return key;
+}
+
+bool EigenModel::findPrecomputed (int cpt) {
+  lock_guard<mutex> lock (precomputedMutex);
+  if (precomputed.empty())
+    return false;
+  const auto iter = precomputed.find (rateMatrixKey (model.subRate[cpt]));
+  if (iter == precomputed.end())
+    return false;
+  const Eigensystem& es = iter->second;
+  const AlphTok A = model.alphabetSize();
+  for (AlphTok i = 0; i < A; ++i) {
+    gsl_vector_complex_set (eval[cpt], i, gsl_complex_rect (es.eval[2*i], es.eval[2*i+1]));
+    for (AlphTok j = 0; j < A; ++j) {
+      const size_t n = 2 * (i * A + j);
+      gsl_matrix_complex_set (evec[cpt], i, j, gsl_complex_rect (es.evec[n], es.evec[n+1]));
+      gsl_matrix_complex_set (evecInv[cpt], i, j, gsl_complex_rect (es.evecInv[n], es.evecInv[n+1]));
+    }
+  }
+  LogThisAt(7,"Using precomputed eigensystem for component #" << cpt << endl);
+  return true;
+}
+
+void EigenModel::writeEigensystem (int cpt, ostream& out) const {
+  const AlphTok A = model.alphabetSize();
+  Eigensystem es;
+  for (AlphTok i = 0; i < A; ++i) {
+    const gsl_complex e = gsl_vector_complex_get (eval[cpt], i);
+    es.eval.push_back (GSL_REAL(e));
+    es.eval.push_back (GSL_IMAG(e));
+    for (AlphTok j = 0; j < A; ++j) {
+      const gsl_complex v = gsl_matrix_complex_get (evec[cpt], i, j), vInv = gsl_matrix_complex_get (evecInv[cpt], i, j);
+      es.evec.push_back (GSL_REAL(v));
+      es.evec.push_back (GSL_IMAG(v));
+      es.evecInv.push_back (GSL_REAL(vInv));
+      es.evecInv.push_back (GSL_IMAG(vInv));
+    }
+  }
+  writeBinary (out, es.eval);
+  writeBinary (out, es.evec);
+  writeBinary (out, es.evecInv);
+}
+
+void EigenModel::readEigensystem (const gsl_matrix* subRate, istream& in) {
+  const size_t A = subRate->size1;
+  Eigensystem es;
+  readBinary (in, es.eval);
+  readBinary (in, es.evec);
+  readBinary (in, es.evecInv);
+  Require (es.eval.size() == 2*A && es.evec.size() == 2*A*A && es.evecInv.size() == 2*A*A, "Compiled model eigensystem has wrong dimensions");
+  lock_guard<mutex> lock (precomputedMutex);
+  precomputed[rateMatrixKey (subRate)] = es;
+}
+
 EigenModel::~EigenModel() {
   for (auto& e: eval)
     if (e)
@@ -1320,10 +1620,41 @@ double EigenModel::getSubCount (int cpt, AlphTok a, AlphTok b, AlphTok i, AlphTo
   return max (0., (i == j ? 1. : r_ij) * GSL_REAL(c_ij) / p_ab);
 }
 
+// Same sums as getSubCount, but the inner sum over l is shared by all i, making this O(A^3) rather than O(A^4);
+// (i,j) pairs with zero rate (most of them, for sparse models such as codons) are skipped.
 void EigenModel::accumSubCounts (int cpt, vguard<vguard<double> >& count, AlphTok a, AlphTok b, double weight, const gsl_matrix* sub, const gsl_matrix_complex* eSubCount) const {
-  for (AlphTok i = 0; i < model.alphabetSize(); ++i)
-    for (AlphTok j = 0; j < model.alphabetSize(); ++j)
-      count[i][j] += getSubCount (cpt, a, b, i, j, sub, eSubCount) * weight;
+  const AlphTok A = model.alphabetSize();
+  const double p_ab = gsl_matrix_get (sub, a, b);
+  vguard<vguard<gsl_complex> > inner (A, vguard<gsl_complex> (A));  // inner[j][k] = c_ijk, which does not depend on i
+  vguard<gsl_complex> outer (A);  // outer[k] for fixed i
+  for (AlphTok j = 0; j < A; ++j)
+    for (AlphTok k = 0; k < A; ++k) {
+      gsl_complex c_ijk = gsl_complex_rect (0, 0);
+      for (AlphTok l = 0; l < A; ++l)
+	c_ijk = gsl_complex_add
+	  (c_ijk,
+	   gsl_complex_mul
+	   (gsl_complex_mul
+	    (gsl_matrix_complex_get (evec[cpt], j, l),
+	     gsl_matrix_complex_get (evecInv[cpt], l, b)),
+	    gsl_matrix_complex_get (eSubCount, k, l)));
+      inner[j][k] = c_ijk;
+    }
+  for (AlphTok i = 0; i < A; ++i) {
+    for (AlphTok k = 0; k < A; ++k)
+      outer[k] = gsl_complex_mul (gsl_matrix_complex_get (evec[cpt], a, k),
+				  gsl_matrix_complex_get (evecInv[cpt], k, i));
+    for (AlphTok j = 0; j < A; ++j) {
+      const double r_ij = gsl_matrix_get (model.subRate[cpt], i, j);
+      if (i != j && r_ij == 0)
+	continue;
+      gsl_complex c_ij = gsl_complex_rect (0, 0);
+      for (AlphTok k = 0; k < A; ++k)
+	c_ij = gsl_complex_add (c_ij, gsl_complex_mul (outer[k], inner[j][k]));
+      Assert (EIGENMODEL_NEAR_REAL(c_ij), "Count has imaginary part: c=(%g,%g)", GSL_REAL(c_ij), GSL_IMAG(c_ij));
+      count[i][j] += max (0., (i == j ? 1. : r_ij) * GSL_REAL(c_ij) / p_ab) * weight;
+    }
+  }
 }
 
 vguard<gsl_matrix_complex*> EigenModel::eigenSubCount (double t) const {
@@ -1353,23 +1684,32 @@ vguard<vguard<vguard<double> > > EigenModel::getSubCounts (const vguard<vguard<v
   vguard<vguard<vguard<double> > > v;
   for (int cpt = 0; cpt < components(); ++cpt) {
     LogThisAt(8,"Component #" << cpt << " eigencounts matrix:" << endl << complexMatrixToString(eigenCounts[cpt]) << endl);
-    vguard<vguard<double> > counts (model.alphabetSize(), vguard<double> (model.alphabetSize(), 0));
-    for (AlphTok i = 0; i < model.alphabetSize(); ++i)
-      for (AlphTok j = 0; j < model.alphabetSize(); ++j) {
+    const AlphTok A = model.alphabetSize();
+    vguard<vguard<double> > counts (A, vguard<double> (A, 0));
+    // ck[j][k] does not depend on i, so compute it once (O(A^3) rather than O(A^4))
+    vguard<vguard<gsl_complex> > ck (A, vguard<gsl_complex> (A));
+    for (AlphTok j = 0; j < A; ++j)
+      for (AlphTok k = 0; k < A; ++k) {
+	gsl_complex c = gsl_complex_rect (0, 0);
+	for (AlphTok l = 0; l < A; ++l)
+	  c = gsl_complex_add
+	    (c,
+	     gsl_complex_mul (eigenCounts[cpt][k][l],
+			      gsl_matrix_complex_get (evec[cpt], j, l)));
+	ck[j][k] = c;
+      }
+    for (AlphTok i = 0; i < A; ++i)
+      for (AlphTok j = 0; j < A; ++j) {
+	const double r_ij = i == j ? 1 : gsl_matrix_get (model.subRate[cpt], i, j);
+	if (r_ij == 0)
+	  continue;
 	gsl_complex c = gsl_complex_rect (0, 0);
-	for (AlphTok k = 0; k < model.alphabetSize(); ++k) {
-	  gsl_complex ck = gsl_complex_rect (0, 0);
-	  for (AlphTok l = 0; l < model.alphabetSize(); ++l)
-	    ck = gsl_complex_add
-	      (ck,
-	       gsl_complex_mul (eigenCounts[cpt][k][l],
-				gsl_matrix_complex_get (evec[cpt], j, l)));
+	for (AlphTok k = 0; k < A; ++k)
 	  c = gsl_complex_add
 	    (c,
 	     gsl_complex_mul (gsl_matrix_complex_get (evecInv[cpt], k, i),
-			      ck));
-	}
-	counts[i][j] = GSL_REAL(c) * (i == j ? 1 : gsl_matrix_get (model.subRate[cpt], i, j));
+			      ck[j][k]));
+	counts[i][j] = GSL_REAL(c) * r_ij;
       }
     v.push_back (counts);
   }
@@ -1440,6 +1780,7 @@ string CachingRateModel::timeKey (double t) const {
 }
 
 vguard<gsl_matrix*> CachingRateModel::getSubProbMatrix (double t) const {
+  lock_guard<mutex> lock (cacheMutex);
   CachingRateModel* mutableThis = (CachingRateModel*) this;  // cast away const
   auto& mutableCache = mutableThis->cache;
   auto& mutableCount = mutableThis->count;
@@ -1464,3 +1805,41 @@ vguard<gsl_matrix*> CachingRateModel::getSubProbMatrix (double t) const {
   }
   return m;
 }
+
+void CachingRateModel::saveState (CheckpointWriter& checkpoint) const {
+  lock_guard<mutex> lock (cacheMutex);
+  checkpoint.writeVarint (count.size());
+  for (const auto& kc : count) {
+    checkpoint.writeString (kc.first);
+    checkpoint.writeVarint (kc.second);
+  }
+  checkpoint.writeVarint (cache.size());
+  for (const auto& km : cache) {
+    checkpoint.writeString (km.first);
+    checkpoint.writeVarint (km.second.size());
+    for (const auto& cptMatrix : km.second) {
+      checkpoint.writeVarint (cptMatrix.size());
+      for (const auto& row : cptMatrix)
+	checkpoint.writeDoubles (row);
+    }
+  }
+}
+
+void CachingRateModel::loadState (CheckpointReader& checkpoint) {
+  lock_guard<mutex> lock (cacheMutex);
+  count.clear();
+  for (size_t nKeys = checkpoint.readVarint(); nKeys > 0; --nKeys) {
+    const string k = checkpoint.readString();
+    count[k] = checkpoint.readVarint();
+  }
+  cache.clear();
+  for (size_t nKeys = checkpoint.readVarint(); nKeys > 0; --nKeys) {
+    auto& c = cache[checkpoint.readString()];
+    c = vguard<vguard<vguard<double> > > (checkpoint.readVarint());
+    for (auto& cptMatrix : c) {
+      cptMatrix = vguard<vguard<double> > (checkpoint.readVarint());
+      for (auto& row : cptMatrix)
+	row = checkpoint.readDoubles();
+    }
+  }
+}
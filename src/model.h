@@ -4,12 +4,14 @@
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_vector.h>
 #include <string>
+#include <mutex>
 
 #include "jsonutil.h"
 #include "fastseq.h"
 #include "logsumexp.h"
 #include "alignpath.h"
 #include "tree.h"
+#include "checkpoint.h"
 
 using namespace std;
 
@@ -18,6 +20,19 @@ using namespace std;
 #define DefaultCachingRateModelPrecision 5
 #define DefaultCachingRateModelFlushSize 1000
 
+// Uniformization is used for exp(Rt) when R is at most this dense,
+// and the expected cost (terms * nonzeros) is below this multiple of A^2
+#define MaxUniformizationDensity .25
+#define MaxUniformizationCostRatio 8
+#define UniformizationTolerance 1e-15
+
+// Floor for the log of a zero-valued free parameter (see RateModel::getFreeParams)
+#define MinFreeParamLog -700
+
+// Header for compiled (binary) model files; see RateModel::writeCompiled
+#define CompiledModelMagic "historian-compiled-model"
+#define CompiledModelVersion 1
+
 struct AlphabetOwner {
   string alphabet;
   char wildcard;  // internally, wildcards are always represented as Alignment::wildcardChar; they are converted to this character for output
@@ -40,6 +55,21 @@ struct AlphabetOwner {
   vguard<FastSeq> convertWildcards (const vguard<FastSeq>&) const;
 };
 
+// Sparse rate matrix (e.g. codon models allowing only single-nucleotide changes).
+// exp(Rt) = sum_n Poisson(n;mu*t) B^n, where B = I + R/mu and mu is the max exit rate,
+// so for short branches a few sparse products replace a dense matrix exponential.
+struct SparseRateMatrix {
+  AlphTok size;
+  size_t nonzeros;
+  double maxExitRate;
+  vguard<vguard<pair<AlphTok,double> > > uniformized;  // uniformized[i] = nonzero (j,B_ij)
+  SparseRateMatrix (const gsl_matrix* rate);
+  double density() const { return nonzeros / (double) (size * size); }
+  size_t uniformizationTerms (double t) const;
+  bool useUniformization (double t) const;
+  gsl_matrix* exponentiate (double t) const;
+};
+
 struct RateModel : AlphabetOwner {
   double insRate, delRate, insExtProb, delExtProb;
   vguard<double> cptWeight;
@@ -63,6 +93,12 @@ struct RateModel : AlphabetOwner {
   void readComponent (const JsonMap& jm);
   void writeComponent (int cpt, ostream& out) const;
 
+  // compiled models are a native-endian binary dump of the parameters and eigensystems,
+  // written by "historian compile-model"; reading one skips JSON parsing and eigendecomposition
+  void writeCompiled (ostream& out) const;
+  void readCompiled (istream& in);
+  static bool isCompiledFile (const string& filename);
+
   static gsl_vector* getEqmProbVector (gsl_matrix* subRateMatrix);
   virtual vguard<gsl_matrix*> getSubProbMatrix (double t) const;
 
@@ -73,9 +109,16 @@ struct RateModel : AlphabetOwner {
   RateModel normalizeSubstitutionRate() const;
   RateModel scaleRates (double multiplier) const;
   RateModel scaleRates (double substMultiplier, double indelMultiplier) const;
+
+  // free parameters in unconstrained coordinates (log rates, logit extension probabilities,
+  // log probabilities), so that EM updates can be extrapolated without leaving the valid region
+  vguard<double> getFreeParams (bool includeIndelRates = true, bool includeSubstRates = true) const;
+  void setFreeParams (const vguard<double>& params, bool includeIndelRates = true, bool includeSubstRates = true);
   
   double mlDistance (const FastSeq& xGapped, const FastSeq& yGapped, int maxIterations = DefaultDistanceMatrixIterations) const;
+  double mlDistance (const TokenStore& gappedTokens, size_t xRow, size_t yRow, int maxIterations = DefaultDistanceMatrixIterations) const;
   vguard<vguard<double> > distanceMatrix (const vguard<FastSeq>& gappedSeq, int maxIterations = DefaultDistanceMatrixIterations) const;
+  vguard<vguard<double> > distanceMatrix (const TokenStore& gappedTokens, int maxIterations = DefaultDistanceMatrixIterations) const;
 };
 
 class EigenModel {
@@ -103,8 +146,21 @@ public:
   gsl_matrix_complex* evecInv_evec (int component) const;
 
   vguard<vguard<vguard<double> > > getSubCounts (const vguard<vguard<vguard<gsl_complex> > >& eigenCounts) const;
+
+  // eigensystems read from compiled models are reused by any later EigenModel with an identical rate matrix
+  void writeEigensystem (int component, ostream& out) const;
+  static void readEigensystem (const gsl_matrix* subRate, istream& in);
   
 private:
+  struct Eigensystem {
+    vguard<double> eval, evec, evecInv;  // interleaved real & imaginary parts, matrices in row-major order
+  };
+  static map<string,Eigensystem> precomputed;  // keyed by rateMatrixKey
+  static mutex precomputedMutex;
+  static string rateMatrixKey (const gsl_matrix* subRate);
+  bool findPrecomputed (int component);
+  void decompose (int component);
+
   vguard<vguard<gsl_complex> > ev, ev_t, exp_ev_t;
 
   vguard<bool> isReal;
@@ -125,28 +181,39 @@ private:
   map<string,vguard<vguard<vguard<double> > > > cache;
   string timeKey (double t) const;
   EigenModel eigen;
+  mutable mutex cacheMutex;  // guards cache, count & eigen, which are shared by samplers on different threads
 public:
   CachingRateModel (const RateModel& model, size_t precision = DefaultCachingRateModelPrecision, size_t flushSize = DefaultCachingRateModelFlushSize);
   vguard<gsl_matrix*> getSubProbMatrix (double t) const;
+  // cached matrices are keyed by rounded time, so the cache is saved with MCMC checkpoints to make resumed runs exact
+  void saveState (CheckpointWriter& checkpoint) const;
+  void loadState (CheckpointReader& checkpoint);
 };
 
-class ProbModel : public AlphabetOwner {
+// indel part of a branch model: O(1) to construct, no matrix exponential
+class IndelProbModel {
 public:
   typedef enum { Start = 0,
 		 Match = 0, Insert = 1, Delete = 2,
 		 End = 3 } State;
   double t, ins, del, insExt, delExt;
   double insWait, delWait;
+  IndelProbModel (const RateModel& model, double t);
+  double transProb (State src, State dest) const;
+  static State getState (bool parentUngapped, bool childUngapped);
+};
+
+// full branch model: indel part plus substitution matrices
+class ProbModel : public AlphabetOwner, public IndelProbModel {
+public:
   vguard<double> cptWeight;
   vguard<gsl_vector*> insVec;
   vguard<gsl_matrix*> subMat;
   ProbModel (const RateModel& model, double t);
   ~ProbModel();
   int components() const { return cptWeight.size(); }
-  double transProb (State src, State dest) const;
   void write (ostream& out) const;
   void writeComponent (int cpt, ostream& out) const;
-  static State getState (bool parentUngapped, bool childUngapped);
 private:
   ProbModel (const ProbModel&) = delete;
   ProbModel& operator= (const ProbModel&) = delete;
@@ -5,6 +5,7 @@
 #include "forward.h"
 #include "alignpath.h"
 #include "util.h"
+#include "binio.h"
 
 #define WaitStateSuffix  ";"
 #define ReadyStateSuffix "."
@@ -21,6 +22,10 @@ ProfileState::ProfileState (size_t components, AlphTok alphSize)
 { }
 
 Profile::Profile (size_t components, const string& alphabet, const FastSeq& seq, AlignRowIndex rowIndex)
+  : Profile (components, alphabet, seq, TokenTable(alphabet).tokenize(seq.seq).data(), rowIndex)
+{ }
+
+Profile::Profile (size_t components, const string& alphabet, const FastSeq& seq, const CompactTok* tok, AlignRowIndex rowIndex)
   : components (components),
     alphSize ((AlphTok) alphabet.size()),
     state (seq.length() + 2, ProfileState (components, (AlphTok) alphabet.size())),
@@ -51,17 +56,14 @@ Profile::Profile (size_t components, const string& alphabet, const FastSeq& seq,
       state[pos+1].seqCoords[rowIndex] = pos + 1;
       auto& lpAbsorb = state[pos+1].lpAbsorb;
       for (auto& lpa: lpAbsorb)
-	if (Alignment::isWildcard (seq.seq[pos]))
+	if (tok[pos] == CompactTokWildcard)
 	  fill (lpa.begin(), lpa.end(), 0);
-	else {
-	  const UnvalidatedAlphTok tok = tokenize (seq.seq[pos], alphabet);
-	  if (tok < 0) {
-	    invalidChars.insert (seq.seq[pos]);
-	    ++nInvalidToks;
-	    fill (lpa.begin(), lpa.end(), 0);
-	  } else
-	    lpa[tok] = 0;
-	}
+	else if (!compactTokValid (tok[pos])) {
+	  invalidChars.insert (seq.seq[pos]);
+	  ++nInvalidToks;
+	  fill (lpa.begin(), lpa.end(), 0);
+	} else
+	  lpa[tok[pos]] = 0;
     }
   }
   this->seq[rowIndex] = seq.seq;
@@ -209,6 +211,85 @@ string Profile::toJson() const {
   return s.str();
 }
 
+#define ProfileBinaryMagic "HistorianProfile1"
+
+static void writeBinary (ostream& out, const EigenCounts& c) {
+  writeBinary (out, c.indelCounts);
+  writeBinary (out, c.rootCount);
+  writeBinary (out, c.eigenCount);
+}
+
+static void readBinary (istream& in, EigenCounts& c) {
+  readBinary (in, c.indelCounts);
+  readBinary (in, c.rootCount);
+  readBinary (in, c.eigenCount);
+}
+
+void Profile::writeBinary (ostream& out) const {
+  ::writeBinary (out, string (ProfileBinaryMagic));
+  ::writeBinary (out, alphSize);
+  ::writeBinary (out, components);
+  ::writeBinary (out, name);
+  ::writeBinary (out, meta);
+  ::writeBinary (out, (size_t) state.size());
+  for (const auto& st : state) {
+    ::writeBinary (out, st.name);
+    ::writeBinary (out, st.meta);
+    ::writeBinary (out, st.in);
+    ::writeBinary (out, st.nullOut);
+    ::writeBinary (out, st.absorbOut);
+    ::writeBinary (out, st.lpAbsorb);
+    ::writeBinary (out, st.alignPath);
+    ::writeBinary (out, st.seqCoords);
+  }
+  ::writeBinary (out, (size_t) trans.size());
+  for (const auto& tr : trans) {
+    ::writeBinary (out, tr.src);
+    ::writeBinary (out, tr.dest);
+    ::writeBinary (out, tr.lpTrans);
+    ::writeBinary (out, tr.counts);
+    ::writeBinary (out, tr.alignPath);
+  }
+  ::writeBinary (out, seq);
+  ::writeBinary (out, equivAbsorbState);
+  ::writeBinary (out, rootRowIndex);
+}
+
+void Profile::readBinary (istream& in) {
+  string magic;
+  ::readBinary (in, magic);
+  Require (magic == ProfileBinaryMagic, "Not a binary profile file");
+  ::readBinary (in, alphSize);
+  ::readBinary (in, components);
+  ::readBinary (in, name);
+  ::readBinary (in, meta);
+  size_t nStates, nTrans;
+  ::readBinary (in, nStates);
+  state = vguard<ProfileState> (nStates);
+  for (auto& st : state) {
+    ::readBinary (in, st.name);
+    ::readBinary (in, st.meta);
+    ::readBinary (in, st.in);
+    ::readBinary (in, st.nullOut);
+    ::readBinary (in, st.absorbOut);
+    ::readBinary (in, st.lpAbsorb);
+    ::readBinary (in, st.alignPath);
+    ::readBinary (in, st.seqCoords);
+  }
+  ::readBinary (in, nTrans);
+  trans = vguard<ProfileTransition> (nTrans);
+  for (auto& tr : trans) {
+    ::readBinary (in, tr.src);
+    ::readBinary (in, tr.dest);
+    ::readBinary (in, tr.lpTrans);
+    ::readBinary (in, tr.counts);
+    ::readBinary (in, tr.alignPath);
+  }
+  ::readBinary (in, seq);
+  ::readBinary (in, equivAbsorbState);
+  ::readBinary (in, rootRowIndex);
+}
+
 string trans2state (const vguard<ProfileTransition>& trans, const vguard<ProfileTransitionIndex>& idx, bool useSrc) {
   vguard<ProfileStateIndex> v;
   for (auto i: idx)
@@ -54,6 +54,7 @@ struct Profile {
   Profile (size_t components, AlphTok alphSize, AlignRowIndex rowIndex)
     : components(components), alphSize(alphSize), rootRowIndex(rowIndex) { }
   Profile (size_t components, const string& alphabet, const FastSeq& seq, AlignRowIndex rowIndex);
+  Profile (size_t components, const string& alphabet, const FastSeq& seq, const CompactTok* tok, AlignRowIndex rowIndex);  // tok = pre-tokenized seq
   ProfileStateIndex size() const { return state.size(); }
   Profile leftMultiply (const vguard<gsl_matrix*>& sub) const;
   const ProfileState& start() const { return state.front(); }
@@ -63,6 +64,8 @@ struct Profile {
   LogProb calcSumPathAbsorbProbs (const vguard<LogProb>& logCptWeight, const vguard<vguard<LogProb> >& logInsProb, const char* tag = "cumLogProb");
   void writeJson (ostream& out) const;
   string toJson() const;
+  void writeBinary (ostream& out) const;  // lossless, for spilling profiles to disk
+  void readBinary (istream& in);
   string tinyDescription (ProfileStateIndex s) const;  // for debugging
 
   void assertTransitionsConsistent() const;
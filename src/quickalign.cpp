@@ -10,8 +10,8 @@ QuickAlignMatrix::QuickAlignMatrix (const DiagonalEnvelope& env, const RateModel
     py (env.py),
     xLen (px->length()),
     yLen (py->length()),
-    xTok (env.px->unvalidatedTokens (model.alphabet)),
-    yTok (env.py->unvalidatedTokens (model.alphabet)),
+    xTok (env.xTok),
+    yTok (env.yTok),
     cell (env.totalStorageSize * 3, -numeric_limits<double>::infinity()),
     start (-numeric_limits<double>::infinity()),
     end (-numeric_limits<double>::infinity()),
@@ -19,6 +19,14 @@ QuickAlignMatrix::QuickAlignMatrix (const DiagonalEnvelope& env, const RateModel
     model (model),
     time (time)
 {
+  if (!xTok || !yTok) {
+    const TokenTable table (model.alphabet);
+    xTokSeq = table.tokenize (px->seq);
+    yTokSeq = table.tokenize (py->seq);
+    xTok = xTokSeq.data();
+    yTok = yTokSeq.data();
+  }
+
   // compute scores
   ProbModel pm (model, time);
   LogProbModel lpm (pm);
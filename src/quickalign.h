@@ -10,8 +10,9 @@ public:
   enum State { Start, Match, Insert, Delete };
   const DiagonalEnvelope* penv;
   const FastSeq *px, *py;
-  UnvalidatedTokSeq xTok, yTok;
   SeqIdx xLen, yLen, xEnd, yEnd;
+  CompactTokSeq xTokSeq, yTokSeq;  // used only if the envelope has no pre-tokenized sequences
+  const CompactTok *xTok, *yTok;
   vguard<LogProb> cell;
   LogProb start, end, result;
   static double dummy;
@@ -40,8 +41,8 @@ public:
 
   inline double matchEmitScore (SeqIdx i, SeqIdx j) const {
     Assert (i > 0 && j > 0 && i <= xLen && j <= yLen, "Out of range: (i,j)=(%u,%u) (xLen,yLen)=(%u,%u)", i, j, xLen, yLen);
-    const UnvalidatedAlphTok xt = xTok[i-1], yt = yTok[j-1];
-    return (xt < 0 || yt < 0) ? 0 : submat[xTok[i-1]][yTok[j-1]];
+    const CompactTok xt = xTok[i-1], yt = yTok[j-1];
+    return (compactTokValid(xt) && compactTokValid(yt)) ? submat[xt][yt] : 0;
   }
 
   LogProb cellScore (SeqIdx i, SeqIdx j, State state) const;
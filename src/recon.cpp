@@ -1,5 +1,9 @@
 #include <fstream>
 #include <random>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
 #include "recon.h"
 #include "util.h"
 #include "forward.h"
@@ -16,6 +20,7 @@
 #include "memsize.h"
 #include "simulator.h"
 #include "gamma.h"
+#include "binio.h"
 
 const regex nonwhite_re (RE_DOT_STAR RE_NONWHITE_CHAR_CLASS RE_DOT_STAR, regex_constants::basic);
 const regex stockholm_re (RE_WHITE_OR_EMPTY "#" RE_WHITE_OR_EMPTY "STOCKHOLM" RE_DOT_STAR);
@@ -28,13 +33,16 @@ const regex json_re (RE_WHITE_OR_EMPTY "\\{" RE_DOT_STAR);    // '{'
 
 const vguard<string> Reconstructor::fastAliasArgs = ReconFastAliasArgs;
 const vguard<string> Reconstructor::carefulAliasArgs = ReconCarefulAliasArgs;
+const vguard<vguard<string> > Reconstructor::budgetLadderArgs = ReconBudgetLadderArgs;
 
 Reconstructor::Reconstructor()
   : profileSamples (DefaultProfileSamples),
     profileMinLen (0),
     profileMaxLen (numeric_limits<size_t>::max()),
     profileNodeLimit (0),
+    maxCladeSize (0),
     maxDPMemoryFraction (DefaultMaxDPMemoryFraction),
+    maxBandEdgePostProb (DefaultMaxBandEdgePostProb),
     rndSeed (ForwardMatrix::random_engine::default_seed),
     maxDistanceFromGuide (DefaultMaxDistanceFromGuide),
     tokenizeCodons (false),
@@ -46,10 +54,13 @@ Reconstructor::Reconstructor()
     usePosteriorsForProfile (false),
     reconstructRoot (true),
     refineReconstruction (false),
-    accumulateSubstCounts (false),
-    accumulateIndelCounts (false),
     predictAncestralSequence (false),
     reportAncestralSequenceProbability (false),
+    accumulateSubstCounts (false),
+    accumulateIndelCounts (false),
+    accelerateEM (false),
+    warmStartEM (false),
+    adaptGuideBand (false),
     gotPrior (false),
     useLaplacePseudocounts (true),
     usePosteriorsForDot (false),
@@ -60,10 +71,16 @@ Reconstructor::Reconstructor()
     minEMImprovement (DefaultMinEMImprovement),
     runMCMC (false),
     outputTraceMCMC (false),
+    adaptMovesMCMC (false),
+    resumingMCMC (false),
     fixGuideMCMC (false),
     fixTreeMCMC (false),
     fixAlignMCMC (false),
     mcmcSamplesPerSeq (DefaultMCMCSamplesPerSeq),
+    mcmcBurnInPerSeq (DefaultMCMCBurnInPerSeq),
+    mcmcSummaryInterval (DefaultMCMCSummaryInterval),
+    mcmcTraceKeyframeInterval (DefaultTraceKeyframeInterval),
+    mcmcCheckpointInterval (DefaultMCMCCheckpointInterval),
     mcmcTraceFiles (0),
     outputFormat (StockholmFormat),
     outputLeavesOnly (false),
@@ -71,11 +88,25 @@ Reconstructor::Reconstructor()
     simulatorRootSeqLen (-1),
     gammaCategories (0),
     gammaShape (1),
-    normalizeModel (false)
+    normalizeModel (false),
+    budgetTime (0),
+    budgetMem (0),
+    peakDPBytes (0),
+    peakGuideDPBytes (0),
+    totalDPCells (0),
+    totalGuideDPCells (0),
+    emWarmStartBand (DefaultEMWarmStartBand),
+    emSteps (0),
+    emBandWidenings (0),
+    emLogLikelihood (-numeric_limits<double>::infinity())
 { }
 
 int Reconstructor::maxProfileStates() const {
-  return profileNodeLimit ? (int) profileNodeLimit : (int) sqrt (maxDPMemoryFraction * getMemorySize() / DPMatrix::cellSize());
+  // with out-of-core DP storage, the limit is set by scratch disk space rather than RAM
+  size_t dpBytes = dpScratchDir.empty() ? getMemorySize() : ScratchMapping::availableBytes (dpScratchDir);
+  if (budgetMem)
+    dpBytes = min (dpBytes, budgetMem);
+  return profileNodeLimit ? (int) profileNodeLimit : (int) sqrt (maxDPMemoryFraction * dpBytes / DPMatrix::cellSize());
 }
 
 bool Reconstructor::parseAncSeqArgs (deque<string>& argvec) {
@@ -362,6 +393,19 @@ bool Reconstructor::parseProfileArgs (deque<string>& argvec, bool allowReconstru
       argvec.pop_front();
       return true;
 
+    } else if (arg == "-adaptband") {
+      adaptGuideBand = true;
+      argvec.pop_front();
+      return true;
+
+    } else if (arg == "-bandedge") {
+      Require (argvec.size() > 1, "%s must have an argument", arg.c_str());
+      maxBandEdgePostProb = atof (argvec[1].c_str());
+      adaptGuideBand = true;
+      argvec.pop_front();
+      argvec.pop_front();
+      return true;
+
     } else if (arg == "-profsamples") {
       Require (argvec.size() > 1, "%s must have an argument", arg.c_str());
       profileSamples = atoi (argvec[1].c_str());
@@ -407,6 +451,27 @@ bool Reconstructor::parseProfileArgs (deque<string>& argvec, bool allowReconstru
       argvec.pop_front();
       return true;
 
+    } else if (arg == "-maxclade") {
+      Require (argvec.size() > 1, "%s must have an argument", arg.c_str());
+      maxCladeSize = atoi (argvec[1].c_str());
+      argvec.pop_front();
+      argvec.pop_front();
+      return true;
+
+    } else if (arg == "-cladedir") {
+      Require (argvec.size() > 1, "%s must have an argument", arg.c_str());
+      cladeDir = argvec[1];
+      argvec.pop_front();
+      argvec.pop_front();
+      return true;
+
+    } else if (arg == "-dpscratch") {
+      Require (argvec.size() > 1, "%s must have an argument", arg.c_str());
+      dpScratchDir = argvec[1];
+      argvec.pop_front();
+      argvec.pop_front();
+      return true;
+
     } else if (arg == "-nobest") {
       includeBestTraceInProfile = false;
       argvec.pop_front();
@@ -429,6 +494,20 @@ bool Reconstructor::parseProfileArgs (deque<string>& argvec, bool allowReconstru
 	argvec.push_front (*carefulArgIter);
       return true;
 
+    } else if (arg == "-budget-time") {
+      Require (argvec.size() > 1, "%s must have an argument", arg.c_str());
+      budgetTime = atof (argvec[1].c_str());
+      argvec.pop_front();
+      argvec.pop_front();
+      return true;
+
+    } else if (arg == "-budget-mem") {
+      Require (argvec.size() > 1, "%s must have an argument", arg.c_str());
+      budgetMem = ((size_t) atoi (argvec[1].c_str())) << 20;
+      argvec.pop_front();
+      argvec.pop_front();
+      return true;
+
     } else if (arg == "-rndspan") {
       guideAlignTryAllPairs = false;
       argvec.pop_front();
@@ -490,6 +569,16 @@ bool Reconstructor::parseFitArgs (deque<string>& argvec) {
       argvec.pop_front();
       return true;
 
+    } else if (arg == "-accel") {
+      accelerateEM = true;
+      argvec.pop_front();
+      return true;
+
+    } else if (arg == "-warmstart") {
+      warmStartEM = true;
+      argvec.pop_front();
+      return true;
+
     } else if (arg == "-fixgaprates") {
       accumulateIndelCounts = false;
       argvec.pop_front();
@@ -516,6 +605,77 @@ bool Reconstructor::parseSamplerArgs (deque<string>& argvec) {
       argvec.pop_front();
       return true;
 
+    } else if (arg == "-bintrace") {
+      Require (argvec.size() > 1, "%s must have an argument", arg.c_str());
+      mcmcBinaryTraceFilename = argvec[1];
+      runMCMC = true;
+      argvec.pop_front();
+      argvec.pop_front();
+      return true;
+
+    } else if (arg == "-keyframe") {
+      Require (argvec.size() > 1, "%s must have an argument", arg.c_str());
+      const int n = atoi (argvec[1].c_str());
+      Require (n > 0, "%s must be a positive integer", arg.c_str());
+      mcmcTraceKeyframeInterval = n;
+      runMCMC = true;
+      argvec.pop_front();
+      argvec.pop_front();
+      return true;
+
+    } else if (arg == "-summary") {
+      Require (argvec.size() > 1, "%s must have an argument", arg.c_str());
+      mcmcSummaryFilename = argvec[1];
+      runMCMC = true;
+      argvec.pop_front();
+      argvec.pop_front();
+      return true;
+
+    } else if (arg == "-thin") {
+      Require (argvec.size() > 1, "%s must have an argument", arg.c_str());
+      const int n = atoi (argvec[1].c_str());
+      Require (n > 0, "%s must be a positive integer", arg.c_str());
+      mcmcSummaryInterval = n;
+      runMCMC = true;
+      argvec.pop_front();
+      argvec.pop_front();
+      return true;
+
+    } else if (arg == "-burnin") {
+      Require (argvec.size() > 1, "%s must have an argument", arg.c_str());
+      mcmcBurnInPerSeq = atoi (argvec[1].c_str());
+      runMCMC = true;
+      argvec.pop_front();
+      argvec.pop_front();
+      return true;
+
+    } else if (arg == "-mcmccheckpoint") {
+      Require (argvec.size() > 1, "%s must have an argument", arg.c_str());
+      mcmcCheckpointFilename = argvec[1];
+      runMCMC = true;
+      argvec.pop_front();
+      argvec.pop_front();
+      return true;
+
+    } else if (arg == "-checkpointevery") {
+      Require (argvec.size() > 1, "%s must have an argument", arg.c_str());
+      const int n = atoi (argvec[1].c_str());
+      Require (n > 0, "%s must be a positive integer", arg.c_str());
+      mcmcCheckpointInterval = n;
+      argvec.pop_front();
+      argvec.pop_front();
+      return true;
+
+    } else if (arg == "-adapt") {
+      adaptMovesMCMC = true;
+      argvec.pop_front();
+      return true;
+
+    } else if (arg == "-noadapt") {
+      adaptMovesMCMC = false;
+      argvec.pop_front();
+      return true;
+
     } else if (arg == "-fixguide") {
       fixGuideMCMC = true;
       runMCMC = true;
@@ -558,6 +718,20 @@ bool Reconstructor::parseSamplerArgs (deque<string>& argvec) {
   return false;
 }
 
+bool Reconstructor::parseExpandArgs (deque<string>& argvec) {
+  if (argvec.size()) {
+    const string& arg = argvec[0];
+    if (arg == "-expand") {
+      Require (argvec.size() > 1, "%s must have an argument", arg.c_str());
+      expandTraceFilenames.push_back (argvec[1]);
+      argvec.pop_front();
+      argvec.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
 bool Reconstructor::parsePremadeArgs (deque<string>& argvec) {
   if (argvec.size()) {
     const string& arg = argvec[0];
@@ -661,10 +835,16 @@ void Reconstructor::loadModel() {
     LogThisAt(1,"Loading preset model " << presetModelName << endl);
     model = namedModel (presetModelName);
   } else if (modelFilename.size()) {
-    LogThisAt(1,"Loading model from " << modelFilename << endl);
-    ifstream modelFile (modelFilename);
-    ParsedJson pj (modelFile);
-    model.read (pj.value);
+    if (RateModel::isCompiledFile (modelFilename)) {
+      LogThisAt(1,"Loading compiled model from " << modelFilename << endl);
+      ifstream modelFile (modelFilename, ios::binary);
+      model.readCompiled (modelFile);
+    } else {
+      LogThisAt(1,"Loading model from " << modelFilename << endl);
+      ifstream modelFile (modelFilename);
+      ParsedJson pj (modelFile);
+      model.read (pj.value);
+    }
   } else if (tokenizeCodons) {
     LogThisAt(1,"Using default codon model (" << DefaultCodonModel << ")" << endl);
     model = namedModel (string (DefaultCodonModel));
@@ -733,19 +913,232 @@ void Reconstructor::buildTree (Dataset& dataset) {
     useUPGMA = true;
   }
   LogThisAt(1,"Estimating initial tree by " << (useUPGMA ? "UPGMA" : "neighbor-joining") << " (" << dataset.name << ")" << endl);
-  auto dist = model.distanceMatrix (dataset.gappedGuide, jukesCantorDistanceMatrix ? 0 : DefaultDistanceMatrixIterations);
+  auto dist = model.distanceMatrix (dataset.tokens, jukesCantorDistanceMatrix ? 0 : DefaultDistanceMatrixIterations);
   if (useUPGMA)
     dataset.tree.buildByUPGMA (dataset.gappedGuide, dist);
   else
     dataset.tree.buildByNeighborJoining (dataset.gappedGuide, dist);
 }
 
-void Reconstructor::seedGenerator() {
-  generator = ForwardMatrix::newRNG();
-  generator.seed (rndSeed);
+void Reconstructor::buildGuide (Dataset& dataset) {
+  LogThisAt(1,"Building guide alignment (" << dataset.name << ")" << endl);
+  AlignGraph* ag = NULL;
+  if (guideAlignTryAllPairs)
+    ag = new AlignGraph (dataset.seqs, model, 1, diagEnvParams);
+  else {
+    ForwardMatrix::random_engine generator = rngStream (RNGStreamPrealign | (dataset.index & RNGStreamDatasetMask));
+    ag = new AlignGraph (dataset.seqs, model, 1, diagEnvParams, generator);
+  }
+  Alignment align = ag->mstAlign();
+  peakGuideDPBytes = max (peakGuideDPBytes, ag->peakEnvelopeCells * ForwardMatrix::cellSize());
+  totalGuideDPCells += ag->totalEnvelopeCells;
+  delete ag;
+  dataset.guide = align.path;
+  dataset.gappedGuide = align.gapped();
+}
+
+void Reconstructor::tuneToBudget() {
+  Require (seqFilenames.size() + fastaGuideFilenames.size() == 1 && nexusGuideFilenames.empty() && stockholmGuideFilenames.empty(),
+	   "-budget-time and -budget-mem need a single FASTA sequence file or guide alignment");
+  const bool gotGuide = !fastaGuideFilenames.empty();
+  vguard<FastSeq> seqs = readFastSeqs ((gotGuide ? fastaGuideFilenames : seqFilenames).front().c_str());
+  if (tokenizeCodons)
+    seqs = codonTokenizer.tokenize (seqs);
+  if (seqs.size() < 3)
+    return;
+
+  // pilot on an evenly-spaced subset of the sequences, at full length
+  const size_t nSeqs = seqs.size(), nPilot = min (nSeqs, (size_t) DefaultBudgetPilotSeqs);
+  vguard<FastSeq> pilotSeqs;
+  for (size_t n = 0; n < nPilot; ++n)
+    pilotSeqs.push_back (seqs[n * nSeqs / nPilot]);
+  if (gotGuide) {
+    // drop columns that are all gaps in the subset
+    vguard<bool> keep (pilotSeqs[0].length(), false);
+    for (const auto& fs : pilotSeqs)
+      for (size_t col = 0; col < fs.length(); ++col)
+	if (!Alignment::isGap (fs.seq[col]))
+	  keep[col] = true;
+    for (auto& fs : pilotSeqs) {
+      string seq;
+      for (size_t col = 0; col < fs.length(); ++col)
+	if (keep[col])
+	  seq.push_back (fs.seq[col]);
+      fs.seq = seq;
+      fs.qual.clear();
+    }
+  }
+
+  /* Cost model:
+     each node's DP fills a band-limited fraction of the product of its children's profile sizes.
+     Profiles grow with clade size until they reach the profile cap (-profmaxstates or -profmaxmem),
+     so the cost per node grows too. The pilot measures the band fraction, the growth rate and the time per cell,
+     and the full tree is taken to be balanced, with nSeqs/m nodes whose children have m/2 leaves each.
+     Posterior profiles need a Backward pass as well as a Forward pass.
+     Building the guide takes one DiagonalEnvelope-bounded pairwise DP per trial edge of the spanning graph,
+     sized from the envelopes of the pilot's sequence pairs, and building the tree takes time
+     proportional to the number of pairwise distances. */
+
+  // options set on the command line are kept; the ladder only fills in the ones left at their defaults
+  const Reconstructor defaults;
+  auto atDefault = [&] (const string& opt) -> bool {
+    if (opt == "-allspan" || opt == "-rndspan")
+      return guideAlignTryAllPairs == defaults.guideAlignTryAllPairs;
+    if (opt == "-kmatchoff" || opt == "-kmatchn")
+      return diagEnvParams.sparse == defaults.diagEnvParams.sparse
+	&& diagEnvParams.kmerLen == defaults.diagEnvParams.kmerLen
+	&& diagEnvParams.kmerThreshold == defaults.diagEnvParams.kmerThreshold
+	&& diagEnvParams.bandSize == defaults.diagEnvParams.bandSize;
+    if (opt == "-band")
+      return maxDistanceFromGuide == defaults.maxDistanceFromGuide;
+    if (opt == "-profminpost" || opt == "-profsamples")
+      return usePosteriorsForProfile == defaults.usePosteriorsForProfile && profileSamples == defaults.profileSamples && minPostProb == defaults.minPostProb;
+    if (opt == "-profmaxmem" || opt == "-profmaxstates")
+      return maxDPMemoryFraction == defaults.maxDPMemoryFraction && profileNodeLimit == defaults.profileNodeLimit;
+    if (opt == "-refine" || opt == "-norefine")
+      return refineReconstruction == defaults.refineReconstruction;
+    if (opt == "-jc")
+      return jukesCantorDistanceMatrix == defaults.jukesCantorDistanceMatrix;
+    Abort ("Unknown budget setting %s", opt.c_str());
+    return false;
+  };
+  auto ladderArgs = [&] (size_t level) {
+    const vguard<string>& all = budgetLadderArgs[level];
+    vguard<string> args;
+    for (size_t n = 0, next; n < all.size(); n = next) {
+      for (next = n + 1; next < all.size() && all[next][0] != '-'; ++next)
+	{ }
+      if (atDefault (all[n]))
+	args.insert (args.end(), all.begin() + n, all.begin() + next);
+    }
+    return args;
+  };
+  auto applyArgs = [&] (Reconstructor& recon, const vguard<string>& args) {
+    deque<string> argvec (args.begin(), args.end());
+    while (argvec.size())
+      Assert (recon.parseProfileArgs (argvec, false) || recon.parseSamplerArgs (argvec), "Unrecognized budget setting %s", argvec.front().c_str());
+  };
+
+  // one pilot run, at the most accurate settings
+  const vguard<string> pilotArgs = ladderArgs (0);
+  LogThisAt(1,"Tuning settings to " << (budgetTime > 0 ? (to_string(budgetTime) + " seconds") : string("unlimited time")) << " and " << (budgetMem > 0 ? (to_string(budgetMem >> 20) + " MB") : string("unlimited memory")) << ", with a pilot run (" << join (pilotArgs, " ") << ") on " << nPilot << " of " << nSeqs << " sequences" << endl);
+
+  Reconstructor pilot (*this);
+  pilot.datasets.clear();
+  pilot.budgetTime = 0;
+  pilot.budgetMem = 0;
+  pilot.treeFilename.clear();
+  pilot.dotSaveFilename.clear();
+  pilot.cladeDir.clear();
+  pilot.guideFile = NULL;
+  applyArgs (pilot, pilotArgs);
+
+  const auto start = std::chrono::steady_clock::now();
+  Dataset& dataset = pilot.newDataset();
+  dataset.name = "budget pilot";
+  if (gotGuide)
+    dataset.initGuide (pilotSeqs);
+  else {
+    dataset.seqs = pilotSeqs;
+    pilot.buildGuide (dataset);
+  }
+  const auto guideDone = std::chrono::steady_clock::now();
+  dataset.initTokens (model.alphabet);
+  pilot.buildTree (dataset);
+  const auto treeDone = std::chrono::steady_clock::now();
+  dataset.prepareRecon (pilot);
+  pilot.reconstruct (dataset);
+  const auto reconDone = std::chrono::steady_clock::now();
+
+  const double guideTime = std::chrono::duration<double> (guideDone - start).count();
+  const double treeTime = std::chrono::duration<double> (treeDone - guideDone).count();
+  const double reconTime = std::chrono::duration<double> (reconDone - treeDone).count();
+
+  double meanLen = 0;
+  for (const auto& fs : seqs)
+    meanLen += count_if (fs.seq.begin(), fs.seq.end(), [] (char c) { return !Alignment::isGap (c); }) / (double) nSeqs;
+
+  // fit log(profile cells / meanLen^2) = growth * log(children's clade size), through the origin
+  double pilotCells = 0, pilotProfileCells = 0, pilotPeakCells = 0, growthNum = 0, growthDen = 0;
+  for (const auto& node_cells : dataset.dpCells) {
+    const TreeNodeIndex node = node_cells.first;
+    const double profileCells = dataset.dpProfileCells.at (node);
+    size_t leaves = 0;
+    for (auto n : dataset.tree.nodeAndDescendants (node))
+      if (dataset.tree.isLeaf (n))
+	++leaves;
+    pilotCells += node_cells.second;
+    pilotProfileCells += profileCells;
+    pilotPeakCells = max (pilotPeakCells, (double) node_cells.second);
+    const double x = log (leaves / 2.);
+    growthNum += x * log (profileCells / (meanLen * meanLen));
+    growthDen += x * x;
+  }
+  const double bandFill = pilotProfileCells > 0 ? pilotCells / pilotProfileCells : 1;
+  const double growth = growthDen > 0 ? max (0., growthNum / growthDen) : 0;
+  const int pilotPasses = pilot.usePosteriorsForProfile ? 2 : 1;
+  const double secondsPerCell = reconTime / max (1., pilotCells * pilotPasses);
+  const double bytesPerCell = pilot.peakDPBytes / max (1., pilotPeakCells * pilotPasses);
+  const double guideSecondsPerCell = gotGuide ? 0 : guideTime / max (1., (double) pilot.totalGuideDPCells);
+  const double treeScale = nSeqs * (nSeqs - 1.) / (nPilot * (nPilot - 1.));  // the tree is built from all pairwise distances
+  auto bandFraction = [&] (int band) { return band < 0 ? 1. : min (1., (2. * band + 1) / meanLen); };
+  const TokenStore pilotTokens = gotGuide ? TokenStore() : TokenStore (pilotSeqs, model.alphabet, false);
+
+  int chosen = -1;
+  vguard<string> chosenArgs;
+  for (int level = budgetLadderArgs.size() - 1; level >= 0; --level) {
+    const vguard<string> args = ladderArgs (level);
+    Reconstructor settings (*this);
+    applyArgs (settings, args);
+
+    const double fill = min (1., bandFill * bandFraction (settings.maxDistanceFromGuide) / bandFraction (pilot.maxDistanceFromGuide));
+    const double capCells = pow (max ((double) settings.maxProfileStates(), meanLen), 2);  // a profile always holds at least one trace
+    const int passes = settings.usePosteriorsForProfile ? 2 : 1;
+    double cells = 0, peakCells = 0;
+    for (double m = 2; m < 2 * nSeqs; m *= 2) {
+      const double nodeCells = fill * min (capCells, meanLen * meanLen * pow (m / 2, growth));
+      cells += nodeCells * nSeqs / m;
+      peakCells = max (peakCells, nodeCells);
+    }
+
+    double guideCells = 0, guidePeakCells = 0;
+    if (!gotGuide) {
+      for (size_t n = 0; n + 1 < nPilot; ++n) {
+	DiagonalEnvelope env (pilotSeqs[n], pilotSeqs[n+1], pilotTokens.tokens(n), pilotTokens.tokens(n+1));
+	AlignGraph::initEnvelope (env, pilotSeqs[n+1], pilotTokens.tokens(n+1), model.alphabet, settings.diagEnvParams);
+	guideCells += env.totalStorageSize / (nPilot - 1.);
+	guidePeakCells = max (guidePeakCells, (double) env.totalStorageSize);
+      }
+      guideCells *= AlignGraph::trialEdges (nSeqs, settings.guideAlignTryAllPairs);
+    }
+
+    const double mlDistanceTime = settings.jukesCantorDistanceMatrix && !pilot.jukesCantorDistanceMatrix ? 0 : treeTime * treeScale;  // Jukes-Cantor distances take next to no time
+    const double predictedTime = secondsPerCell * cells * passes + guideSecondsPerCell * guideCells + mlDistanceTime;
+    const size_t reconMem = settings.dpScratchDir.empty() ? (size_t) (bytesPerCell * peakCells * passes) : pilot.peakDPBytes;
+    const size_t predictedMem = max (reconMem, (size_t) (guidePeakCells * ForwardMatrix::cellSize()));
+    const bool fits = (budgetTime <= 0 || predictedTime <= budgetTime) && (budgetMem == 0 || predictedMem <= budgetMem);
+    LogThisAt(1,"Settings (" << join (args, " ") << "): predicted " << predictedTime << " seconds, " << (size_t) cells << " DP cells, " << (predictedMem >> 20) << " MB peak DP memory" << (fits ? "" : " (over budget)") << endl);
+    if (!fits)
+      break;
+    chosen = level;
+    chosenArgs = args;
+  }
+
+  if (chosen < 0) {
+    chosenArgs = ladderArgs (budgetLadderArgs.size() - 1);
+    Warn ("No settings are predicted to fit the budget; using the fastest");
+  }
+  applyArgs (*this, chosenArgs);
+  LogThisAt(1,"Chose settings: " << join (chosenArgs, " ") << endl);
+}
+
+ForwardMatrix::random_engine Reconstructor::rngStream (uint32_t streamId, uint32_t node, uint32_t sample) const {
+  return ForwardMatrix::random_engine (rndSeed).stream (streamId, node, sample);
 }
 
 void Reconstructor::loadSeqs() {
+  if (budgetTime > 0 || budgetMem > 0)
+    tuneToBudget();
   if (guideSaveFilename.size())
     guideFile = new ofstream (guideSaveFilename);
   for (const auto& fn : seqFilenames)
@@ -774,6 +1167,7 @@ void Reconstructor::loadSeqs (const string& seqFilename, const string& guideFile
       Dataset& dataset = newDataset();
       dataset.name = stockholmFilename;
       dataset.initGuide (tokenizeCodons ? codonTokenizer.tokenize(stock.gapped) : stock.gapped);
+      dataset.initTokens (model.alphabet);
       if (stock.hasTree())
 	dataset.tree = stock.getTree();
       else
@@ -792,6 +1186,7 @@ void Reconstructor::loadSeqs (const string& seqFilename, const string& guideFile
       nex.convertNexusToAlignment();
       dataset.tree = nex.tree;
       dataset.initGuide (tokenizeCodons ? codonTokenizer.tokenize(nex.gapped) : nex.gapped);
+      dataset.initTokens (model.alphabet);
       dataset.prepareRecon (*this);
 
     } else {
@@ -803,20 +1198,8 @@ void Reconstructor::loadSeqs (const string& seqFilename, const string& guideFile
 	  dataset.seqs = codonTokenizer.tokenize (dataset.seqs);
 	if (maxDistanceFromGuide < 0 && treeFilename.size())
 	  LogThisAt(1,"Don't need guide alignment: banding is turned off and tree is supplied" << endl);
-	else {
-	  LogThisAt(1,"Building guide alignment (" << dataset.name << ")" << endl);
-	  AlignGraph* ag = NULL;
-	  if (guideAlignTryAllPairs)
-	    ag = new AlignGraph (dataset.seqs, model, 1, diagEnvParams);
-	  else {
-	    seedGenerator();
-	    ag = new AlignGraph (dataset.seqs, model, 1, diagEnvParams, generator);
-	  }
-	  Alignment align = ag->mstAlign();
-	  delete ag;
-	  dataset.guide = align.path;
-	  dataset.gappedGuide = align.gapped();
-	}
+	else
+	  buildGuide (dataset);
 
       } else {
 	LogThisAt(1,"Loading guide alignment from " << guideFilename << endl);
@@ -825,6 +1208,7 @@ void Reconstructor::loadSeqs (const string& seqFilename, const string& guideFile
 	dataset.initGuide (tokenizeCodons ? codonTokenizer.tokenize(guide) : guide);
       }
 
+      dataset.initTokens (model.alphabet);
       if (treeFilename.size())
 	loadTree (dataset);
       else
@@ -842,9 +1226,22 @@ void Reconstructor::Dataset::initGuide (const vguard<FastSeq>& gapped) {
   seqs = align.ungapped;
 }
 
+void Reconstructor::Dataset::initTokens (const string& alphabet) {
+  // tokenize the ungapped sequences, so that any gap characters in the input remain positions,
+  // and take the column maps from the guide alignment path
+  tokens = TokenStore (seqs, alphabet, false);
+  if (!gappedGuide.empty()) {
+    Assert (guide.size() == seqs.size(), "Guide alignment has %u rows, but there are %u sequences", guide.size(), seqs.size());
+    for (const auto& row_path : guide)
+      tokens.setColumns (row_path.first, row_path.second);
+  }
+}
+
 Reconstructor::Dataset& Reconstructor::newDataset() {
   datasets.push_back (Dataset());
+  datasets.back().index = datasets.size() - 1;
   datasets.back().name = string("#") + to_string(datasets.size());
+  datasets.back().emGuideBand = -1;
   return datasets.back();
 }
 
@@ -868,8 +1265,9 @@ void Reconstructor::Dataset::prepareRecon (Reconstructor& recon) {
 
   tree.assertBinary();
 
+  const TreeIndex treeIndex (tree);
   AlignPath reorderedGuide;
-  for (TreeNodeIndex node = 0; node < tree.nodes(); ++node)
+  for (TreeNodeIndex node = 0; node < tree.nodes(); ++node) {
     if (tree.isLeaf(node)) {
       Assert (tree.nodeName(node).length() > 0, "Leaf node %d is unnamed", node);
       Assert (seqIndex.find (tree.nodeName(node)) != seqIndex.end(), "Can't find sequence for leaf node %s", tree.nodeName(node).c_str());
@@ -878,28 +1276,13 @@ void Reconstructor::Dataset::prepareRecon (Reconstructor& recon) {
 
       if (!guide.empty())
 	reorderedGuide[node] = guide.at(seqidx);
+    }
 
-      closestLeaf.push_back (node);
-      closestLeafDistance.push_back (0);
-
-      rowName.push_back (tree.seqName(node));
+    closestLeaf.push_back (treeIndex.closestLeaf (node, tree.parentNode(node)));
+    closestLeafDistance.push_back (treeIndex.closestLeafDistance (node, tree.parentNode(node)));
 
-    } else {
-      int cl = -1;
-      double dcl = 0;
-      for (size_t nc = 0; nc < tree.nChildren(node); ++nc) {
-	const TreeNodeIndex c = tree.getChild(node,nc);
-	const double dc = closestLeafDistance[c] + tree.branchLength(c);
-	if (nc == 0 || dc < dcl) {
-	  cl = closestLeaf[c];
-	  dcl = dc;
-	}
-      }
-      closestLeaf.push_back (cl);
-      closestLeafDistance.push_back (dcl);
-
-      rowName.push_back (tree.seqName(node));
-    }
+    rowName.push_back (tree.seqName(node));
+  }
 
   swap (guide, reorderedGuide);
 
@@ -907,13 +1290,23 @@ void Reconstructor::Dataset::prepareRecon (Reconstructor& recon) {
     recon.writeTreeAlignment (tree, gappedGuide, name, *recon.guideFile, false, NULL);
 }
 
+// reads the key at the start of a clade profile file, returning false (without failing) if it differs from the expected key
+static bool readCladeKey (istream& in, const string& expectedKey) {
+  size_t n = 0;
+  in.read ((char*) &n, sizeof(n));
+  if (!in || n != expectedKey.size())
+    return false;
+  string key (n, '\0');
+  in.read (&key[0], n);
+  return (size_t) in.gcount() == n && key == expectedKey;
+}
+
 void Reconstructor::reconstruct (Dataset& dataset) {
   LogThisAt(1,"Starting reconstruction on " << dataset.tree.nodes() << "-node tree" << " (" << dataset.name << ")" << endl);
 
-  if (!usePosteriorsForProfile)
-    seedGenerator();  // re-seed generator, in case it was used during prealignment
-
   vguard<gsl_vector*> rootProb = model.insProb;
+  const bool useEMGuide = !dataset.emGuide.empty();
+  const AlignPath& guide = useEMGuide ? dataset.emGuide : dataset.guide;
   LogProb lpFinalFwd = -numeric_limits<double>::infinity(), lpFinalTrace = -numeric_limits<double>::infinity();
   const ForwardMatrix::ProfilingStrategy strategy =
     (ForwardMatrix::ProfilingStrategy) (ForwardMatrix::CollapseChains
@@ -926,14 +1319,68 @@ void Reconstructor::reconstruct (Dataset& dataset) {
   if (accumulateSubstCounts)
     sumProd = new SumProduct (model, dataset.tree);
 
+  vguard<TreeNodeIndex> cladeRoots;
+  const vguard<TreeNodeIndex> nodeOrder = reconstructionOrder (dataset, cladeRoots);
+
+  // clade-root profiles that have been written to disk (or were found there from a previous run).
+  // Each file holds the full key, the adapted guide bands within the clade, and then the profile;
+  // the filename is only a hash of the key, so a file whose stored key differs is treated as a miss.
+  // Keys are fixed before any node is visited, as they include those bands.
+  map<TreeNodeIndex,string> spilledProfile, cladeFilename, cladeKey;
+  set<TreeNodeIndex> spillOnCompletion;
+  if (!cladeDir.empty()) {
+    if (mkdir (cladeDir.c_str(), 0777) != 0 && errno != EEXIST)
+      Fail ("Could not create clade directory %s: %s", cladeDir.c_str(), strerror(errno));
+    for (auto cladeRoot : cladeRoots)
+      if (!dataset.tree.isLeaf(cladeRoot) && cladeRoot != dataset.tree.root()) {
+	const string& key = cladeKey[cladeRoot] = cladeProfileKey (dataset, cladeRoot);
+	const string filename = cladeFilename[cladeRoot] = cladeProfileFilename (key);
+	ifstream in (filename, ios::binary);
+	if (in && readCladeKey (in, key)) {
+	  LogThisAt(2,"Reusing profile for clade rooted at node #" << cladeRoot << " from " << filename << endl);
+	  map<TreeNodeIndex,int> cladeBand;
+	  ::readBinary (in, cladeBand);
+	  for (const auto& node_band : cladeBand)
+	    dataset.adaptedBand[node_band.first] = node_band.second;
+	  spilledProfile[cladeRoot] = filename;
+	} else {
+	  if (in)
+	    Warn ("Clade profile file %s does not match this clade; overwriting it", filename.c_str());
+	  spillOnCompletion.insert (cladeRoot);
+	}
+      }
+  }
+  set<TreeNodeIndex> skipNodes;
+  for (const auto& node_filename : spilledProfile)
+    for (auto n : dataset.tree.nodeAndDescendants (node_filename.first))
+      skipNodes.insert (n);
+
+  auto unspill = [&] (map<int,Profile>& prof, TreeNodeIndex node) {
+    if (!prof.count(node) && spilledProfile.count(node)) {
+      LogThisAt(3,"Loading profile for node #" << node << " from " << spilledProfile[node] << endl);
+      ifstream in (spilledProfile[node], ios::binary);
+      Require (in, "Could not open %s", spilledProfile[node].c_str());
+      Require (readCladeKey (in, cladeKey[node]), "Clade profile file %s changed during the run", spilledProfile[node].c_str());
+      map<TreeNodeIndex,int> cladeBand;
+      ::readBinary (in, cladeBand);
+      prof[node].readBinary (in);
+    }
+  };
+
   AlignPath path;
   map<int,Profile> prof;
-  for (TreeNodeIndex node = 0; node < dataset.tree.nodes(); ++node) {
+  size_t profilesBuilt = 0;
+  double makeProfileNanosecs = 0;
+  for (TreeNodeIndex node : nodeOrder) {
+    if (skipNodes.count (node))
+      continue;
     if (dataset.tree.isLeaf(node))
-      prof[node] = Profile (model.components(), model.alphabet, dataset.seqs[dataset.nodeToSeqIndex[node]], node);
+      prof[node] = Profile (model.components(), model.alphabet, dataset.seqs[dataset.nodeToSeqIndex[node]], dataset.tokens.tokens(dataset.nodeToSeqIndex[node]), node);
     else {
       const int lChildNode = dataset.tree.getChild(node,0);
       const int rChildNode = dataset.tree.getChild(node,1);
+      unspill (prof, lChildNode);
+      unspill (prof, rChildNode);
       const Profile& lProf = prof[lChildNode];
       const Profile& rProf = prof[rChildNode];
       ProbModel lProbs (model, dataset.tree.branchLength(lChildNode));
@@ -943,9 +1390,10 @@ void Reconstructor::reconstruct (Dataset& dataset) {
       LogThisAt(2,"Aligning node #" << lProf.rootRowIndex << " " << lProf.name << " (" << plural(lProf.state.size(),"state") << ", " << plural(lProf.trans.size(),"transition") << ") and node #" << rProf.rootRowIndex << " " << rProf.name << " (" << plural(rProf.state.size(),"state") << ", " << plural(rProf.trans.size(),"transition") << ") to build profile for node #" << node << endl);
 
       ForwardMatrix* forward = NULL;
-      int maxDist = maxDistanceFromGuide;
+      const bool adaptBand = adaptGuideBand && !useEMGuide && !guide.empty() && maxDistanceFromGuide >= 0;
+      int maxDist = useEMGuide ? dataset.emGuideBand : (adaptBand ? adaptiveGuideBand (dataset, node) : maxDistanceFromGuide);
       while (true) {
-	forward = new ForwardMatrix (lProf, rProf, hmm, node, dataset.guide.empty() ? GuideAlignmentEnvelope() : GuideAlignmentEnvelope (dataset.guide, dataset.closestLeaf[lChildNode], dataset.closestLeaf[rChildNode], maxDist), sumProd);
+	forward = new ForwardMatrix (lProf, rProf, hmm, node, guide.empty() ? GuideAlignmentEnvelope() : GuideAlignmentEnvelope (guide, dataset.closestLeaf[lChildNode], dataset.closestLeaf[rChildNode], maxDist), sumProd, dpScratchDir);
 	if (forward->lpEnd > -numeric_limits<double>::infinity())
 	  break;
 	if (maxDist < 0) {
@@ -953,7 +1401,7 @@ void Reconstructor::reconstruct (Dataset& dataset) {
 	  hmm.write (clog);
 	  Abort ("Zero forward likelihood even in the absence of guide alignment constraints - this is not good");
 	}
-	if (maxDist*2 > alignPathColumns(dataset.guide)) {
+	if (maxDist*2 > alignPathColumns(guide)) {
 	  LogThisAt(2,"Zero forward likelihood with guide alignment band " << maxDist << "; removing guide alignment constraint" << endl);
 	  maxDist = -1;
 	} else if (maxDist == 0) {
@@ -965,6 +1413,7 @@ void Reconstructor::reconstruct (Dataset& dataset) {
 	}
 	delete forward;
 	forward = NULL;
+	TaskPool::scratch().reset();
       }
 
       if (reconstructRoot)
@@ -976,6 +1425,11 @@ void Reconstructor::reconstruct (Dataset& dataset) {
 	backward = new BackwardMatrix (*forward);
       }
 
+      peakDPBytes = max (peakDPBytes, forward->storageBytes() + (backward ? backward->storageBytes() : 0));
+      dataset.dpCells[node] = forward->cellsStored();
+      totalDPCells += dataset.dpCells[node];
+      dataset.dpProfileCells[node] = lProf.state.size() * rProf.state.size();
+
       Profile& nodeProf = prof[node];
       if (node == dataset.tree.root()) {
 
@@ -990,7 +1444,8 @@ void Reconstructor::reconstruct (Dataset& dataset) {
 	    : backward->bestProfile (dotStrategy);
 	  SeqGraph dotSeqGraph (dotProf, model.alphabet, log_vector(model.cptWeight), log_vector_gsl_vector(rootProb), useSeparateSubPosteriorsForDot ? minDotSubPostProb : (usePosteriorsForDot ? minDotPostProb : minPostProb));
 	  ofstream dotFile (dotSaveFilename);
-	  dotSeqGraph.simplify().writeDot (dotFile);
+	  dotSeqGraph.simplify();
+	  dotSeqGraph.writeDot (dotFile);
 	}
 
 	if (reconstructRoot) {
@@ -999,17 +1454,66 @@ void Reconstructor::reconstruct (Dataset& dataset) {
 	}
       } else if (usePosteriorsForProfile)
 	nodeProf = backward->postProbProfile (minPostProb, maxProfileStates(), strategy);
-      else
+      else {
+	ForwardMatrix::random_engine generator = rngStream (RNGStreamProfile | (dataset.index & RNGStreamDatasetMask), node);
 	nodeProf = forward->sampleProfile (generator, profileSamples, maxProfileStates(), strategy);
+      }
 
       if ((accumulateSubstCounts || accumulateIndelCounts) && node == dataset.tree.root())
 	dataset.eigenCounts = backward->getCounts();
-      
+
+      if (adaptBand) {
+	// Grow the band if too much posterior mass is up against its edge.
+	// Shrink it if hardly any lies beyond half its width, so that halving it loses almost nothing.
+	// The posterior mass comes from the Backward matrix if there is one, or else from sampled traces
+	// (with a Backward matrix built only to confirm a shrink, or when the threshold needs too many traces).
+	int band = maxDist;
+	if (band >= 0) {
+	  const int halfBand = max (MinAdaptiveGuideBand, band / 2);
+	  const size_t edgeSamples = (size_t) ceil (BandEdgeSampleHits / maxBandEdgePostProb);
+	  BackwardMatrix* edgeBackward = backward;
+	  if (!edgeBackward && edgeSamples > MaxBandEdgeSamples)
+	    edgeBackward = new BackwardMatrix (*forward);
+	  double edgePostProb, outerPostProb;
+	  if (edgeBackward) {
+	    edgePostProb = edgeBackward->envelopePostProbBeyond (band);
+	    outerPostProb = edgeBackward->envelopePostProbBeyond (halfBand + 1);
+	  } else {
+	    if (forward->sampledGuideDistance.size() < edgeSamples) {
+	      ForwardMatrix::random_engine generator = rngStream (RNGStreamBandEdge | (dataset.index & RNGStreamDatasetMask), node);
+	      forward->sampleGuideDistances (generator, edgeSamples - forward->sampledGuideDistance.size());
+	    }
+	    const vguard<int>& dist = forward->sampledGuideDistance;
+	    edgePostProb = count_if (dist.begin(), dist.end(), [&] (int d) { return d >= band; }) / (double) dist.size();
+	    outerPostProb = count_if (dist.begin(), dist.end(), [&] (int d) { return d > halfBand; }) / (double) dist.size();
+	    // the shrink threshold is far too small to estimate from the sampled traces,
+	    // so if none of them strays beyond the halved band, the exact mass is computed before shrinking
+	    if (outerPostProb == 0 && edgePostProb <= maxBandEdgePostProb && halfBand < band) {
+	      edgeBackward = new BackwardMatrix (*forward);
+	      outerPostProb = edgeBackward->envelopePostProbBeyond (halfBand + 1);
+	    }
+	  }
+	  if (edgeBackward && edgeBackward != backward) {
+	    peakDPBytes = max (peakDPBytes, forward->storageBytes() + edgeBackward->storageBytes());
+	    delete edgeBackward;
+	  }
+	  if (edgePostProb > maxBandEdgePostProb)
+	    band = band*2 > (int) alignPathColumns(guide) ? -1 : max (1, band*2);
+	  else if (outerPostProb <= maxBandEdgePostProb * BandShrinkEdgePostProbRatio && halfBand < band)
+	    band = halfBand;
+	  LogThisAt(3,"Posterior mass at edge of guide band " << maxDist << " is " << edgePostProb << ", and beyond " << halfBand << " is " << outerPostProb << "; band for node #" << node << " and ancestors is now " << band << endl);
+	}
+	dataset.adaptedBand[node] = band;
+      }
+
       if (backward)
 	delete backward;
       
-      if (node == dataset.tree.root())
+      if (node == dataset.tree.root()) {
 	lpFinalFwd = forward->lpEnd;
+	if (warmStartEM && dataset.emGuideBand >= 0)
+	  dataset.emGuide = forward->bestAlignPath();
+      }
 
       if (nodeProf.size()) {
 	const LogProb lpTrace = nodeProf.calcSumPathAbsorbProbs (log_vector(model.cptWeight), log_vector_gsl_vector(rootProb), NULL);
@@ -1021,10 +1525,38 @@ void Reconstructor::reconstruct (Dataset& dataset) {
 	LogThisAt(7,nodeProf.toJson());
       }
 
+      ++profilesBuilt;
+      makeProfileNanosecs += forward->makeProfileNanosecs;
       delete forward;
+      TaskPool::scratch().reset();  // recycles the cell storage of this node's DP matrices
+
+      // child profiles are no longer needed; only the frontier of the traversal is kept in memory
+      prof.erase (lChildNode);
+      prof.erase (rChildNode);
+
+      if (spillOnCompletion.count (node)) {
+	// write to a temporary file first, so an interrupted run cannot leave a partial profile to be reused
+	const string filename = cladeFilename[node], tmpFilename = filename + ".tmp";
+	LogThisAt(3,"Saving profile for clade rooted at node #" << node << " to " << filename << endl);
+	map<TreeNodeIndex,int> cladeBand;
+	for (auto n : dataset.tree.nodeAndDescendants (node))
+	  if (dataset.adaptedBand.count (n))
+	    cladeBand[n] = dataset.adaptedBand.at (n);
+	ofstream out (tmpFilename, ios::binary);
+	Require (out, "Could not write %s", tmpFilename.c_str());
+	::writeBinary (out, cladeKey[node]);
+	::writeBinary (out, cladeBand);
+	nodeProf.writeBinary (out);
+	out.close();
+	Require (!out.fail(), "Error writing %s", tmpFilename.c_str());
+	Require (rename (tmpFilename.c_str(), filename.c_str()) == 0, "Could not rename %s to %s", tmpFilename.c_str(), filename.c_str());
+	spilledProfile[node] = filename;
+	prof.erase (node);
+      }
     }
   }
 
+  LogThisAt(1,"Profile construction: " << profilesBuilt << " profiles, " << (makeProfileNanosecs / 1e9) << " seconds in makeProfile (" << dataset.name << ")" << endl);
   LogThisAt(2,"Final Forward log-likelihood is " << lpFinalFwd << (reconstructRoot ? (string(", final alignment log-likelihood is ") + to_string(lpFinalTrace)) : string()) << endl);
 
   if (reconstructRoot) {
@@ -1044,6 +1576,89 @@ void Reconstructor::reconstruct (Dataset& dataset) {
     delete sumProd;
 }
 
+vguard<TreeNodeIndex> Reconstructor::reconstructionOrder (const Dataset& dataset, vguard<TreeNodeIndex>& cladeRoots) const {
+  const Tree& tree = dataset.tree;
+  tree.assertPostorderSorted();
+  vguard<TreeNodeIndex> order;
+  cladeRoots.clear();
+  if (maxCladeSize == 0 || maxCladeSize >= tree.leafCount()[tree.root()]) {
+    for (TreeNodeIndex node = 0; node < tree.nodes(); ++node)
+      order.push_back (node);
+    return order;
+  }
+
+  // visit each clade in postorder, then the backbone connecting the clade roots
+  cladeRoots = tree.cladeRoots (maxCladeSize);
+  vguard<bool> inClade (tree.nodes(), false);
+  for (auto cladeRoot : cladeRoots) {
+    auto clade = tree.rerootedPreorderSort (cladeRoot, tree.parentNode(cladeRoot));
+    reverse (clade.begin(), clade.end());
+    for (auto node : clade) {
+      order.push_back (node);
+      inClade[node] = true;
+    }
+  }
+  size_t backboneNodes = 0;
+  for (TreeNodeIndex node = 0; node < tree.nodes(); ++node)
+    if (!inClade[node]) {
+      order.push_back (node);
+      ++backboneNodes;
+    }
+
+  LogThisAt(2,"Partitioned tree into " << plural(cladeRoots.size(),"clade") << " of at most " << plural(maxCladeSize,"leaf","leaves") << ", joined by a backbone of " << plural(backboneNodes,"node") << endl);
+  return order;
+}
+
+string Reconstructor::cladeProfileKey (const Dataset& dataset, TreeNodeIndex cladeRoot) const {
+  // key the file on everything that determines the clade-root profile,
+  // including the warm-start EM guide & band, and any guide bands adapted in a previous iteration.
+  // The dataset index & node indices seed the profile's random number streams, so they are part of the key too
+  const AlignPath& guide = dataset.emGuide.empty() ? dataset.guide : dataset.emGuide;
+  ostringstream key;
+  key << dataset.tree.toString (cladeRoot) << endl;
+  key << "dataset " << dataset.index << " nodes " << to_string_join (dataset.tree.nodeAndDescendants (cladeRoot)) << endl;
+  for (auto node : dataset.tree.nodeAndDescendants (cladeRoot)) {
+    if (dataset.tree.isLeaf (node)) {
+      key << dataset.seqs[dataset.nodeToSeqIndex.at(node)].seq << endl;
+      if (!guide.empty())
+	key << to_string_join (guide.at(node), "") << endl;
+    }
+    if (dataset.adaptedBand.count (node))
+      key << "band " << node << ' ' << dataset.adaptedBand.at(node) << endl;
+  }
+  model.write (key);
+  key << profileSamples << ' ' << minPostProb << ' ' << usePosteriorsForProfile << ' ' << maxProfileStates()
+      << ' ' << maxDistanceFromGuide << ' ' << adaptGuideBand << ' ' << maxBandEdgePostProb << ' ' << keepGapsOpen << ' ' << includeBestTraceInProfile
+      << ' ' << accumulateSubstCounts << ' ' << accumulateIndelCounts << ' ' << rndSeed
+      << ' ' << !dataset.emGuide.empty() << ' ' << dataset.emGuideBand << endl;
+  return key.str();
+}
+
+string Reconstructor::cladeProfileFilename (const string& key) const {
+  ostringstream filename;
+  filename << cladeDir << "/clade." << hex << setw(16) << setfill('0') << stable_hash (key) << ".prof";
+  return filename.str();
+}
+
+int Reconstructor::adaptiveGuideBand (const Dataset& dataset, TreeNodeIndex node) const {
+  // use this node's band from a previous iteration, or else the widest of its children's
+  const auto iter = dataset.adaptedBand.find (node);
+  if (iter != dataset.adaptedBand.end())
+    return iter->second;
+  int band = maxDistanceFromGuide;
+  bool gotChildBand = false;
+  for (size_t n = 0; n < dataset.tree.nChildren(node); ++n) {
+    const auto childIter = dataset.adaptedBand.find (dataset.tree.getChild(node,n));
+    if (childIter != dataset.adaptedBand.end()) {
+      if (childIter->second < 0)
+	return -1;
+      band = gotChildBand ? max (band, childIter->second) : childIter->second;
+      gotChildBand = true;
+    }
+  }
+  return band;
+}
+
 void Reconstructor::refine (Dataset& dataset) {
   LogThisAt(1,"Refining parent-child alignments (" << dataset.name << ")" << endl);
   vguard<FastSeq>& gappedRecon = dataset.hasAncestralReconstruction() ? dataset.gappedAncestralRecon : dataset.gappedRecon;
@@ -1195,6 +1810,10 @@ void Reconstructor::writeModel (ostream& out) const {
   model.write (out);
 }
 
+void Reconstructor::writeCompiledModel (ostream& out) const {
+  model.writeCompiled (out);
+}
+
 void Reconstructor::loadRecon() {
   if (fastaReconFilename.size()) {
 
@@ -1288,8 +1907,10 @@ Reconstructor::HistoryLogger::HistoryLogger (Reconstructor& recon, const string&
     out (NULL),
     name (name)
 {
-  if (recon.outputTraceMCMC && recon.mcmcTraceFilename.size())
-    out = new ofstream (recon.mcmcTraceFilename + "." + to_string(++recon.mcmcTraceFiles));
+  if (recon.outputTraceMCMC && recon.mcmcTraceFilename.size()) {
+    filename = recon.mcmcTraceFilename + "." + to_string(++recon.mcmcTraceFiles);
+    out = new ofstream (filename, recon.resumingMCMC ? ios::app : ios::out);
+  }
 }
 
 Reconstructor::HistoryLogger::~HistoryLogger() {
@@ -1297,9 +1918,70 @@ Reconstructor::HistoryLogger::~HistoryLogger() {
     delete out;
 }
 
-void Reconstructor::HistoryLogger::logHistory (const Sampler::History& history) {
-  if (recon->outputTraceMCMC)
-    recon->writeTreeAlignment (history.tree, history.gapped, name, out ? *out : cout, true);
+mutex Reconstructor::HistoryLogger::coutMutex;
+
+void Reconstructor::HistoryLogger::logHistory (const Sampler::History& history, LogProb logLikelihood, const Sampler::Change& change) {
+  if (recon->outputTraceMCMC) {
+    ostringstream o;
+    recon->writeTreeAlignment (history.tree, history.gapped, name, o, true);
+    write (o.str());
+  }
+}
+
+void Reconstructor::HistoryLogger::logMoveRates (const Sampler& sampler) {
+  if (recon->outputTraceMCMC) {
+    // recorded as a comment, where the trace format has them
+    ostringstream o;
+    switch (recon->outputFormat) {
+    case NexusFormat:
+      o << "[MCMC move rates: " << sampler.moveRates() << "]" << endl;
+      break;
+    case StockholmFormat:
+      o << "# MCMC move rates: " << sampler.moveRates() << endl;
+      break;
+    case JsonFormat:
+      {
+	o << "{\"moveRates\": {";
+	const double total = accumulate (sampler.moveRate.begin(), sampler.moveRate.end(), 0.);
+	for (int t = 0; t < (int) Sampler::Move::TotalMoveTypes; ++t)
+	  o << (t ? ", " : "") << "\"" << Sampler::Move::typeName ((Sampler::Move::Type) t) << "\": " << (total > 0 ? sampler.moveRate[t] / total : 0.);
+	o << "}}" << endl;
+      }
+      break;
+    default:
+      break;
+    }
+    write (o.str());
+  }
+}
+
+void Reconstructor::HistoryLogger::saveState (CheckpointWriter& checkpoint) {
+  // the length of the trace file, so that anything written after the checkpoint can be discarded on resuming
+  uint64_t length = 0;
+  if (out) {
+    out->flush();
+    length = (uint64_t) out->tellp() + 1;
+  }
+  checkpoint.writeVarint (length);
+}
+
+void Reconstructor::HistoryLogger::loadState (CheckpointReader& checkpoint) {
+  const uint64_t length = checkpoint.readVarint();
+  if (out && length) {
+    out->close();
+    truncateFile (filename, length - 1);
+    out->open (filename, ios::app);
+  }
+}
+
+void Reconstructor::HistoryLogger::write (const string& s) {
+  if (out)
+    *out << s;
+  else {
+    // samplers on different threads share cout, so each record is written whole
+    lock_guard<mutex> lock (coutMutex);
+    cout << s;
+  }
 }
 
 void Reconstructor::sampleAll() {
@@ -1309,8 +1991,18 @@ void Reconstructor::sampleAll() {
     SimpleTreePrior treePrior;
     vguard<Sampler> samplers;
     vguard<HistoryLogger*> loggers;
+    vguard<MCMCSummary*> summaries;
+    vguard<TraceWriter*> traceWriters;
+    ofstream* summaryFile = NULL;
+    resumingMCMC = mcmcCheckpointFilename.size() && checkpointExists (mcmcCheckpointFilename);
+    if (mcmcSummaryFilename.size()) {
+      summaryFile = new ofstream (mcmcSummaryFilename, resumingMCMC ? ios::app : ios::out);
+      Require (*summaryFile, "Could not open %s", mcmcSummaryFilename.c_str());
+    }
     size_t totalNodes = 0;
-    CachingRateModel cachedModel (model);
+    // each dataset gets its own cache: cached matrices are keyed by rounded time,
+    // so a shared cache would make results depend on how samplers on different threads interleave
+    list<CachingRateModel> cachedModels;
     for (auto& dataset: datasets) {
       if (!dataset.hasReconstruction())
 	reconstruct (dataset);
@@ -1318,10 +2010,19 @@ void Reconstructor::sampleAll() {
 	predictAncestors (dataset);
       vguard<FastSeq>& gappedRecon = dataset.hasAncestralReconstruction() ? dataset.gappedAncestralRecon : dataset.gappedRecon;
       dataset.tree.assignInternalNodeNames (gappedRecon);
-      samplers.push_back (Sampler (cachedModel, treePrior, dataset.gappedGuide));
+      cachedModels.emplace_back (model);
+      samplers.push_back (Sampler (cachedModels.back(), treePrior, dataset.gappedGuide));
       loggers.push_back (new HistoryLogger (*this, dataset.name));
       Sampler& sampler = samplers.back();
       sampler.addLogger (*loggers.back());
+      if (mcmcBinaryTraceFilename.size()) {
+	traceWriters.push_back (new TraceWriter (mcmcBinaryTraceFilename + "." + to_string(traceWriters.size() + 1), dataset.name, mcmcTraceKeyframeInterval, resumingMCMC));
+	sampler.addLogger (*traceWriters.back());
+      }
+      if (summaryFile) {
+	summaries.push_back (new MCMCSummary (dataset.name, *summaryFile, mcmcSummaryInterval));
+	sampler.addLogger (*summaries.back());
+      }
       sampler.useFixedGuide = fixGuideMCMC;
       sampler.sampleAncestralSeqs = dataset.hasAncestralReconstruction();
       Sampler::History history;
@@ -1335,11 +2036,51 @@ void Reconstructor::sampleAll() {
       totalNodes += history.tree.nodes();
     }
 
-    const unsigned int nSamples = mcmcSamplesPerSeq * totalNodes;
+    const unsigned int nSamples = mcmcSamplesPerSeq * totalNodes, nBurnIn = mcmcBurnInPerSeq * totalNodes;
     LogThisAt(1,"Starting MCMC sampler ("
 	      << plural(mcmcSamplesPerSeq,"sample") << " per node, "
-	      << plural(nSamples,"sample") << " in total)" << endl);
-    Sampler::run (samplers, generator, nSamples);
+	      << plural(nSamples,"sample") << " in total"
+	      << (nBurnIn ? (string(", after ") + plural(nBurnIn,"burn-in step")) : string()) << ")" << endl);
+
+    // checkpoints hold the sampler & logger states, preceded by the settings that must match on resuming
+    const vguard<uint64_t> runSettings = { (uint64_t) rndSeed, (uint64_t) nSamples, (uint64_t) nBurnIn, (uint64_t) adaptMovesMCMC,
+					   (uint64_t) samplers.size(), (uint64_t) outputTraceMCMC, (uint64_t) traceWriters.size(), (uint64_t) (summaryFile != NULL) };
+    if (resumingMCMC) {
+      LogThisAt(1,"Resuming MCMC from checkpoint " << mcmcCheckpointFilename << endl);
+      CheckpointReader checkpoint (mcmcCheckpointFilename);
+      for (auto setting: runSettings)
+	Require (checkpoint.readVarint() == setting, "Checkpoint %s was saved by a run with different data, random seed or MCMC options", mcmcCheckpointFilename.c_str());
+      for (auto& cachedModel: cachedModels)
+	cachedModel.loadState (checkpoint);
+      for (auto& sampler: samplers)
+	sampler.loadState (checkpoint);
+      const uint64_t summaryLength = checkpoint.readVarint();
+      if (summaryFile) {
+	summaryFile->close();
+	truncateFile (mcmcSummaryFilename, summaryLength);
+	summaryFile->open (mcmcSummaryFilename, ios::app);
+      }
+      Require (checkpoint.finished(), "Checkpoint %s has unexpected trailing data", mcmcCheckpointFilename.c_str());
+    }
+    auto saveCheckpoint = [&]() {
+      CheckpointWriter checkpoint;
+      for (auto setting: runSettings)
+	checkpoint.writeVarint (setting);
+      for (const auto& cachedModel: cachedModels)
+	cachedModel.saveState (checkpoint);
+      for (const auto& sampler: samplers)
+	sampler.saveState (checkpoint);
+      uint64_t summaryLength = 0;
+      if (summaryFile) {
+	summaryFile->flush();
+	summaryLength = summaryFile->tellp();
+      }
+      checkpoint.writeVarint (summaryLength);
+      checkpoint.save (mcmcCheckpointFilename);
+    };
+
+    Sampler::run (samplers, ForwardMatrix::random_engine (rndSeed), nSamples, nBurnIn, adaptMovesMCMC,
+		  mcmcCheckpointFilename.size() ? mcmcCheckpointInterval : 0, saveCheckpoint);
 
     for (size_t n = 0; n < datasets.size(); ++n) {
       Dataset& dataset = datasets[n];
@@ -1355,6 +2096,26 @@ void Reconstructor::sampleAll() {
 
     for (HistoryLogger* logger: loggers)
       delete logger;
+    for (TraceWriter* traceWriter: traceWriters)
+      delete traceWriter;
+    // summaries, when present, are in the same order as the samplers
+    for (size_t n = 0; n < summaries.size(); ++n) {
+      if (summaries[n]->samples() % summaries[n]->interval)
+	summaries[n]->write (samplers[n].currentHistory);
+      delete summaries[n];
+    }
+    if (summaryFile)
+      delete summaryFile;
+  }
+}
+
+void Reconstructor::expandTraces() {
+  Require (expandTraceFilenames.size(), "Please supply a trace file");
+  for (const auto& filename: expandTraceFilenames) {
+    LogThisAt(1,"Expanding trace " << filename << endl);
+    TraceReader reader (filename);
+    while (reader.next())
+      writeTreeAlignment (reader.history.tree, reader.history.gapped, reader.name, cout, true);
   }
 }
 
@@ -1383,20 +2144,121 @@ void Reconstructor::fit() {
   } else {
     LogProb lpLast = -numeric_limits<double>::infinity();
 
+    // SQUAREM acceleration (Varadhan & Roland, 2008): after two plain EM steps p0->p1->p2,
+    // jump to p0 + 2a(p1-p0) + a^2(p2-2p1+p0), with step length a>=1 capped at maxStep.
+    // If the jump lowers the log-likelihood, fall back to p2.
+    // An accepted jump of step length a lands about as far from p0 as 2a plain EM steps would,
+    // so its E-step stands in for 2a-1 plain steps after p1; plainSteps totals these to report the E-steps saved.
+    vguard<vguard<double> > emPath;
+    vguard<double> fallbackParams;
+    double maxStep = 1, lastStep = 1, plainSteps = 0;
+    size_t extrapolations = 0, rejections = 0;
+    emSteps = emBandWidenings = 0;
+
+    for (auto& ds : datasets) {
+      ds.emGuide.clear();
+      ds.emGuideBand = warmStartEM && (maxDistanceFromGuide < 0 || maxDistanceFromGuide > emWarmStartBand) ? emWarmStartBand : -1;
+    }
+
     priorCounts.indelCounts.lp = 0;
-    for (size_t iter = 0; iter < maxEMIterations; ++iter) {
+    // only accepted E-steps count against maxEMIterations; an E-step that is repeated
+    // (after a rejected extrapolation, or with a wider warm-start band) does not
+    for (size_t iter = 0; iter < maxEMIterations; ) {
+      vguard<AlignPath> lastEMGuide;
+      for (const auto& ds : datasets)
+	lastEMGuide.push_back (ds.emGuide);
       countAll();
+      ++emSteps;
       const LogProb lpData = dataCounts.indelCounts.lp, lpPrior = gotPrior ? priorCounts.logPrior (model, accumulateIndelCounts, accumulateSubstCounts) : 0;
       const LogProb lpWithPrior = lpData + lpPrior;
       LogThisAt (1, "EM iteration #" << iter + 1 << ": log-likelihood" << (gotPrior ? (string(" (") + to_string(lpData) + ") + log-prior (" + to_string(lpPrior) + ")") : string()) << " = " << lpWithPrior << endl);
+      // a plain EM update cannot decrease the log-likelihood, so if it fell after a warm-started E-step,
+      // the band was too tight: widen it (or drop back to the guide alignment) and repeat the E-step
+      if (warmStartEM && fallbackParams.empty() && !(lpWithPrior >= lpLast)) {
+	bool widened = false;
+	for (size_t n = 0; n < datasets.size(); ++n) {
+	  Dataset& ds = datasets[n];
+	  if (!lastEMGuide[n].empty() && ds.emGuideBand >= 0) {
+	    ds.emGuideBand = max (1, ds.emGuideBand * 2);
+	    if ((maxDistanceFromGuide >= 0 && ds.emGuideBand >= maxDistanceFromGuide)
+		|| ds.emGuideBand*2 > (int) alignPathColumns (lastEMGuide[n])) {
+	      LogThisAt(2,"Reverting to guide alignment for E-step (" << ds.name << ")" << endl);
+	      ds.emGuideBand = -1;
+	      ds.emGuide.clear();
+	    } else {
+	      LogThisAt(2,"Widening warm-start band to " << ds.emGuideBand << " (" << ds.name << ")" << endl);
+	      ds.emGuide = lastEMGuide[n];
+	    }
+	    widened = true;
+	  }
+	}
+	if (widened) {
+	  LogThisAt(1,"Log-likelihood fell after warm-started E-step; repeating with wider band" << endl);
+	  ++emBandWidenings;
+	  continue;
+	}
+      }
+      if (!fallbackParams.empty()) {
+	if (!(lpWithPrior >= lpLast)) {
+	  LogThisAt (2, "Extrapolated EM step decreased log-likelihood; reverting to last EM update" << endl);
+	  model.setFreeParams (fallbackParams, accumulateIndelCounts, accumulateSubstCounts);
+	  fallbackParams.clear();
+	  maxStep = max (1., maxStep / SquaremStepGrowth);
+	  ++rejections;
+	  continue;
+	}
+	fallbackParams.clear();
+	plainSteps += 2*lastStep - 2;
+      }
+      ++iter;
+      plainSteps += 1;
+      emLogLikelihood = lpWithPrior;
       if (lpWithPrior <= lpLast + abs(lpLast)*minEMImprovement)
 	break;
+      if (accelerateEM && emPath.empty())
+	emPath.push_back (model.getFreeParams (accumulateIndelCounts, accumulateSubstCounts));
       const LogProb oldExpectedLogLike = dataCounts.expectedLogLikelihood (model) + lpPrior;
       dataPlusPriorCounts.optimize (model, accumulateIndelCounts, accumulateSubstCounts);
       const LogProb newExpectedLogLike = dataCounts.expectedLogLikelihood (model) + (gotPrior ? priorCounts.logPrior (model, accumulateIndelCounts, accumulateSubstCounts) : 0);
       LogThisAt(5, "Expected log-likelihood went from " << oldExpectedLogLike << " to " << newExpectedLogLike << " during M-step" << endl);
       lpLast = lpWithPrior;
+
+      if (accelerateEM) {
+	emPath.push_back (model.getFreeParams (accumulateIndelCounts, accumulateSubstCounts));
+	if (emPath.size() == 3) {
+	  const vguard<double>& p0 (emPath[0]), p1 (emPath[1]), p2 (emPath[2]);
+	  double r2 = 0, v2 = 0;
+	  for (size_t n = 0; n < p0.size(); ++n) {
+	    const double r = p1[n] - p0[n], v = p2[n] - 2*p1[n] + p0[n];
+	    r2 += r*r;
+	    v2 += v*v;
+	  }
+	  const double step = v2 > 0 ? min (maxStep, max (1., sqrt (r2 / v2))) : 1;
+	  if (step > 1) {
+	    vguard<double> p (p0.size());
+	    for (size_t n = 0; n < p0.size(); ++n)
+	      p[n] = p0[n] + 2*step*(p1[n] - p0[n]) + step*step*(p2[n] - 2*p1[n] + p0[n]);
+	    LogThisAt (2, "Extrapolating EM with step length " << step << endl);
+	    fallbackParams = p2;
+	    lastStep = step;
+	    model.setFreeParams (p, accumulateIndelCounts, accumulateSubstCounts);
+	    ++extrapolations;
+	  }
+	  if (step == maxStep)
+	    maxStep *= SquaremStepGrowth;
+	  emPath.clear();
+	}
+      }
     }
+
+    // if the iteration limit was reached before an extrapolated point was checked, keep the plain EM update
+    if (!fallbackParams.empty()) {
+      LogThisAt (2, "Iteration limit reached before extrapolated EM step was checked; keeping last EM update" << endl);
+      model.setFreeParams (fallbackParams, accumulateIndelCounts, accumulateSubstCounts);
+    }
+
+    if (accelerateEM || emBandWidenings)
+      LogThisAt (1, "EM used " << emSteps << " E-steps (" << emBandWidenings << " repeated with a wider band), with " << extrapolations << " extrapolations (" << rejections << " rejected); equivalent to about " << (size_t) round (plainSteps) << " plain EM steps, so about " << (long) round (plainSteps + emBandWidenings - (double) emSteps) << " E-steps saved" << endl);
   }
 }
 
@@ -1479,8 +2341,9 @@ void Reconstructor::simulate() {
     simulatorRootSeqLen = DefaultSimulatorRootSeqLen;
   }
   loadModel();
-  seedGenerator();
+  uint32_t nTree = 0;
   for (const auto& simulatorTreeFilename: simulatorTreeFilenames) {
+    ForwardMatrix::random_engine generator = rngStream (RNGStreamSimulate | (nTree++ & RNGStreamDatasetMask));
     LogThisAt(1,"Loading tree from " << simulatorTreeFilename << endl);
     ifstream treeFile (simulatorTreeFilename);
     if (!treeFile) {
@@ -9,6 +9,8 @@
 #include "forward.h"
 #include "diagenv.h"
 #include "sampler.h"
+#include "mcmcsummary.h"
+#include "trace.h"
 
 #define DefaultProfileSamples 10
 #define DefaultMaxDPMemoryFraction .05
@@ -16,14 +18,32 @@
 #define DefaultMaxDistanceFromGuide 20
 #define DefaultMaxEMIterations 100
 #define DefaultMinEMImprovement .001
+#define SquaremStepGrowth 4
+#define DefaultEMWarmStartBand 4
+
+#define DefaultMaxBandEdgePostProb .01
+#define BandShrinkEdgePostProbRatio .01
+#define MinAdaptiveGuideBand 2
+#define BandEdgeSampleHits 10  // without a Backward matrix, enough traces are sampled to expect this many at the edge of the band at the -bandedge threshold
+#define MaxBandEdgeSamples 200  // a Backward pass costs about as much as sampling this many traces (gp120), so beyond this it is used instead
 
 #define DefaultMCMCSamplesPerSeq 100
+#define DefaultMCMCBurnInPerSeq 10
 
 #define AncestralSequencePostProbTag "PP"
 
 #define ReconCarefulAliasArgs {"-allspan","-kmatchoff","-band","40","-profminpost",".001","-profmaxmem",to_string(100*DefaultMaxDPMemoryFraction),"-refine"}
 #define ReconFastAliasArgs {"-rndspan","-kmatchn","3","-band","10","-profmaxstates","1","-jc","-norefine"}
 
+// candidate settings for -budget-time and -budget-mem, most accurate first
+#define ReconBudgetLadderArgs {						\
+    ReconCarefulAliasArgs,						\
+    {"-allspan","-band","20","-profsamples","20","-profmaxmem",to_string(100*DefaultMaxDPMemoryFraction),"-norefine"}, \
+    {"-rndspan","-band","20","-profsamples",to_string(DefaultProfileSamples),"-profmaxmem",to_string(100*DefaultMaxDPMemoryFraction),"-norefine"}, \
+    {"-rndspan","-band","10","-profsamples","5","-profmaxmem",to_string(100*DefaultMaxDPMemoryFraction),"-norefine"}, \
+    ReconFastAliasArgs }
+#define DefaultBudgetPilotSeqs 8
+
 #define DefaultSimulatorRootSeqLen 100
 
 class Reconstructor {
@@ -32,23 +52,29 @@ public:
 
   static const vguard<string> fastAliasArgs;
   static const vguard<string> carefulAliasArgs;
+  static const vguard<vguard<string> > budgetLadderArgs;
   
   string fastaReconFilename, treeFilename, modelFilename, presetModelName;
-  list<string> seqFilenames, fastaGuideFilenames, nexusGuideFilenames, stockholmGuideFilenames, nexusReconFilenames, stockholmReconFilenames, countFilenames, simulatorTreeFilenames;
+  list<string> seqFilenames, fastaGuideFilenames, nexusGuideFilenames, stockholmGuideFilenames, nexusReconFilenames, stockholmReconFilenames, countFilenames, simulatorTreeFilenames, expandTraceFilenames;
   string treeRoot;
-  string modelSaveFilename, guideSaveFilename, dotSaveFilename, mcmcTraceFilename;
-  size_t profileSamples, profileNodeLimit, maxEMIterations, mcmcSamplesPerSeq;
+  string modelSaveFilename, guideSaveFilename, dotSaveFilename, mcmcTraceFilename, mcmcSummaryFilename, mcmcBinaryTraceFilename, mcmcCheckpointFilename, cladeDir, dpScratchDir;
+  size_t profileSamples, profileNodeLimit, maxEMIterations, mcmcSamplesPerSeq, mcmcBurnInPerSeq, mcmcSummaryInterval, mcmcTraceKeyframeInterval, mcmcCheckpointInterval, maxCladeSize;
   size_t profileMinLen, profileMaxLen;
   int maxDistanceFromGuide, simulatorRootSeqLen, gammaCategories;
-  bool tokenizeCodons, guideAlignTryAllPairs, jukesCantorDistanceMatrix, useUPGMA, includeBestTraceInProfile, keepGapsOpen, usePosteriorsForProfile, reconstructRoot, refineReconstruction, predictAncestralSequence, reportAncestralSequenceProbability, accumulateSubstCounts, accumulateIndelCounts, gotPrior, useLaplacePseudocounts, usePosteriorsForDot, useSeparateSubPosteriorsForDot, keepDotGapsOpen, runMCMC, outputTraceMCMC, fixGuideMCMC, fixTreeMCMC, fixAlignMCMC, outputLeavesOnly, normalizeModel;
-  double minPostProb, maxDPMemoryFraction, minEMImprovement, minDotPostProb, minDotSubPostProb, gammaShape;
+  bool tokenizeCodons, guideAlignTryAllPairs, jukesCantorDistanceMatrix, useUPGMA, includeBestTraceInProfile, keepGapsOpen, usePosteriorsForProfile, reconstructRoot, refineReconstruction, predictAncestralSequence, reportAncestralSequenceProbability, accumulateSubstCounts, accumulateIndelCounts, accelerateEM, warmStartEM, adaptGuideBand, gotPrior, useLaplacePseudocounts, usePosteriorsForDot, useSeparateSubPosteriorsForDot, keepDotGapsOpen, runMCMC, outputTraceMCMC, adaptMovesMCMC, resumingMCMC, fixGuideMCMC, fixTreeMCMC, fixAlignMCMC, outputLeavesOnly, normalizeModel;
+  double minPostProb, maxDPMemoryFraction, maxBandEdgePostProb, minEMImprovement, minDotPostProb, minDotSubPostProb, gammaShape;
+  double budgetTime;  // seconds (0 = no budget)
+  size_t budgetMem;  // bytes (0 = no budget)
+  size_t peakDPBytes, peakGuideDPBytes, totalDPCells, totalGuideDPCells;  // DP high-water marks & totals, used by -budget-time/-budget-mem pilot runs
+  int emWarmStartBand;  // initial band around the previous E-step's alignment, with -warmstart
+  size_t emSteps, emBandWidenings;  // E-steps run by the last fit(), and how many of them repeated a step with a wider warm-start band
+  LogProb emLogLikelihood;  // log-likelihood plus log-prior at the last accepted E-step of fit()
   typedef enum { FastaFormat, GappedFastaFormat, NexusFormat, StockholmFormat, NewickFormat, JsonFormat, UnknownFormat } FileFormat;
   FileFormat outputFormat;
   ofstream* guideFile;
   size_t mcmcTraceFiles;
   map<string,double> modelParam;
   
-  ForwardMatrix::random_engine generator;
   unsigned rndSeed;
 
   DiagEnvParams diagEnvParams;
@@ -57,9 +83,11 @@ public:
 
   struct Dataset {
     string name;
+    size_t index;
     
     Tree tree;
     vguard<FastSeq> seqs, gappedGuide, gappedRecon, gappedAncestralRecon;
+    TokenStore tokens;  // seqs, tokenized once at load; column maps are for gappedGuide, if there is one
     ReconPostProbMap gappedAncestralReconPostProb;
 
     map<string,size_t> seqIndex;
@@ -73,7 +101,18 @@ public:
     Alignment reconstruction;
     EigenCounts eigenCounts;
 
+    // warm start for EM: best alignment from the last E-step, used as a tighter guide (band<0 to disable)
+    AlignPath emGuide;
+    int emGuideBand;
+
+    // adaptive guide band (-adaptband) used for each aligned node, carried over to ancestors & later iterations (-1 = unlimited)
+    map<TreeNodeIndex,int> adaptedBand;
+
+    // DP cells filled at each aligned node, and the product of its children's profile sizes that bounds them (for -budget-time/-budget-mem)
+    map<TreeNodeIndex,size_t> dpCells, dpProfileCells;
+
     void initGuide (const vguard<FastSeq>& gapped);
+    void initTokens (const string& alphabet);
     void prepareRecon (Reconstructor& recon);
     void clearPrep();
     bool hasReconstruction() const { return !gappedRecon.empty(); }
@@ -90,6 +129,7 @@ public:
   bool parseAncSeqArgs (deque<string>& argvec);
   bool parseProfileArgs (deque<string>& argvec, bool allowReconstructions);
   bool parseSamplerArgs (deque<string>& argvec);
+  bool parseExpandArgs (deque<string>& argvec);
   bool parsePremadeArgs (deque<string>& argvec);
   bool parseCountArgs (deque<string>& argvec);
   bool parseSumArgs (deque<string>& argvec);
@@ -118,6 +158,7 @@ public:
   void predictAllAncestors();
   void countAll();
   void sampleAll();
+  void expandTraces();
 
   void reconstruct (Dataset& dataset);
   void refine (Dataset& dataset);
@@ -130,10 +171,16 @@ public:
   struct HistoryLogger : Sampler::Logger {
     Reconstructor* recon;
     ofstream* out;
+    string filename;
     const string& name;
     HistoryLogger (Reconstructor& recon, const string& name);
     ~HistoryLogger();
-    void logHistory (const Sampler::History& history);
+    void logHistory (const Sampler::History& history, LogProb logLikelihood, const Sampler::Change& change);
+    void logMoveRates (const Sampler& sampler);
+    void saveState (CheckpointWriter& checkpoint);
+    void loadState (CheckpointReader& checkpoint);
+    void write (const string& s);
+    static mutex coutMutex;
   };
 
   void writeTreeAlignment (const Tree& tree, const vguard<FastSeq>& gapped, const string& name, ostream& out, bool isReconstruction = false, const ReconPostProbMap* postProb = NULL) const;
@@ -141,6 +188,7 @@ public:
   void writeRecon (ostream& out) const;
   void writeCounts (ostream& out) const;
   void writeModel (ostream& out) const;
+  void writeCompiledModel (ostream& out) const;
 
   void writeJson (const Tree& tree, const vguard<FastSeq>& gapped, ostream& out, const ReconPostProbMap* postProb = NULL) const;
   
@@ -152,11 +200,19 @@ private:
   Dataset& newDataset();
   void loadTree (Dataset& dataset);
   void buildTree (Dataset& dataset);
+  void buildGuide (Dataset& dataset);
+  void tuneToBudget();
 
   Alignment makeAlignment (const Dataset& dataset, const AlignPath& path, TreeNodeIndex root) const;
   string makeAlignmentString (const Dataset& dataset, const AlignPath& path, TreeNodeIndex root, bool assignInternalNodeNames) const;
+
+  vguard<TreeNodeIndex> reconstructionOrder (const Dataset& dataset, vguard<TreeNodeIndex>& cladeRoots) const;
+  string cladeProfileKey (const Dataset& dataset, TreeNodeIndex cladeRoot) const;
+  string cladeProfileFilename (const string& key) const;
+  int adaptiveGuideBand (const Dataset& dataset, TreeNodeIndex node) const;
   
-  void seedGenerator();
+  // independent random number stream for a given task; see rng.h for stream IDs
+  ForwardMatrix::random_engine rngStream (uint32_t streamId, uint32_t node = 0, uint32_t sample = 0) const;
 };
 
 #endif /* PROGALIGN_INCLUDED */
@@ -122,7 +122,7 @@ Refiner::History Refiner::refine (const History& oldHistory, TreeNodeIndex node)
 
   const TreeBranchLength dist = oldHistory.tree.branchLength(parent,node);
   
-  const Alignment oldAlign (oldHistory.gapped);
+  const Alignment& oldAlign = oldHistory.alignment();
   const AlignPath oldBranchPath = branchPath (oldAlign.path, oldHistory.tree, node);
   const GuideAlignmentEnvelope newBranchEnv = makeGuide (oldHistory.tree, oldBranchPath, parent, node);
 
@@ -136,7 +136,7 @@ Refiner::History Refiner::refine (const History& oldHistory, TreeNodeIndex node)
   exclude[node] = parent;
   exclude[parent] = node;
 
-  const auto pwms = getConditionalPWMs (model, oldHistory.tree, oldHistory.gapped, exclude, allExceptNodeAndAncestors(oldHistory.tree,parent), nodeAndAncestors(oldHistory.tree,parent));
+  const auto pwms = getConditionalPWMs (model, oldHistory.tree, oldHistory.gapped, exclude, oldHistory.treeIndex().allExceptNodeAndAncestors(parent), oldHistory.treeIndex().nodeAndAncestors(parent));
   const PosWeightMatrix& pSeq = pwms.at (parent);
   const PosWeightMatrix& nSeq = pwms.at (node);
 
@@ -158,13 +158,7 @@ Refiner::History Refiner::refine (const History& oldHistory, TreeNodeIndex node)
 
   LogThisAt(7,"New full alignment:" << endl << alignPathString(newPath));
 
-  const Alignment newAlign (oldAlign.ungapped, newPath);
-
-  History newHistory;
-  newHistory.tree = oldHistory.tree;
-  newHistory.gapped = newAlign.gapped();
-  
-  return newHistory;
+  return History (oldAlign.ungapped, newPath, oldHistory.tree);
 }
 
 Refiner::History Refiner::refine (const History& oldHistory) const {
@@ -0,0 +1,137 @@
+#ifndef RNG_INCLUDED
+#define RNG_INCLUDED
+
+#include <cstdint>
+#include <iostream>
+
+/* Counter-based random number generator (Philox4x32-10; Salmon et al, SC'11).
+
+   The output is a pure function of (key, counter): the key is the user seed,
+   and the counter is (block, sample, node, stream), where the last three words
+   identify an independent stream and the first counts 128-bit blocks within it.
+   So any task can draw from its own stream without touching shared state,
+   and results are reproducible for a given seed regardless of scheduling.
+
+   Satisfies the C++11 UniformRandomBitGenerator requirements,
+   so it can be used with the <random> distributions. */
+
+class PhiloxEngine {
+public:
+  typedef uint32_t result_type;
+  static constexpr result_type default_seed = 5489u;
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return 0xffffffffu; }
+  static const char* name() { return "philox4x32-10"; }
+
+private:
+  uint32_t key[2];
+  uint32_t ctr[4];  // ctr[0] = block, ctr[1] = sample, ctr[2] = node, ctr[3] = stream
+  uint32_t buf[4];
+  unsigned int bufPos;
+
+  static inline uint32_t mulhilo (uint32_t a, uint32_t b, uint32_t& hi) {
+    const uint64_t p = (uint64_t) a * (uint64_t) b;
+    hi = (uint32_t) (p >> 32);
+    return (uint32_t) p;
+  }
+
+  inline void generateBlock() {
+    uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < 10; ++round) {
+      uint32_t hi0, hi1;
+      const uint32_t lo0 = mulhilo (0xD2511F53u, c0, hi0);
+      const uint32_t lo1 = mulhilo (0xCD9E8D57u, c2, hi1);
+      c0 = hi1 ^ c1 ^ k0;
+      c1 = lo1;
+      c2 = hi0 ^ c3 ^ k1;
+      c3 = lo0;
+      k0 += 0x9E3779B9u;
+      k1 += 0xBB67AE85u;
+    }
+    buf[0] = c0;
+    buf[1] = c1;
+    buf[2] = c2;
+    buf[3] = c3;
+    ++ctr[0];
+    bufPos = 0;
+  }
+
+public:
+  explicit PhiloxEngine (uint64_t s = default_seed) { seed (s); }
+  PhiloxEngine (uint64_t s, uint32_t streamId, uint32_t node, uint32_t sample) {
+    seed (s);
+    ctr[1] = sample;
+    ctr[2] = node;
+    ctr[3] = streamId;
+  }
+
+  void seed (uint64_t s = default_seed) {
+    key[0] = (uint32_t) s;
+    key[1] = (uint32_t) (s >> 32);
+    ctr[0] = ctr[1] = ctr[2] = ctr[3] = 0;
+    bufPos = 4;
+  }
+
+  uint64_t getSeed() const { return ((uint64_t) key[1] << 32) | key[0]; }
+
+  // independent stream with the same seed, identified by (streamId,node,sample)
+  PhiloxEngine stream (uint32_t streamId, uint32_t node = 0, uint32_t sample = 0) const {
+    return PhiloxEngine (getSeed(), streamId, node, sample);
+  }
+
+  inline result_type operator()() {
+    if (bufPos >= 4)
+      generateBlock();
+    return buf[bufPos++];
+  }
+
+  void discard (unsigned long long z) {
+    const unsigned long long inBuf = bufPos >= 4 ? 0 : 4 - bufPos;
+    if (z <= inBuf) {
+      bufPos += z;
+      return;
+    }
+    z -= inBuf;
+    ctr[0] += (uint32_t) (z / 4);
+    bufPos = 4;
+    if (z % 4) {
+      generateBlock();
+      bufPos = z % 4;
+    }
+  }
+
+  bool operator== (const PhiloxEngine& other) const {
+    return key[0] == other.key[0] && key[1] == other.key[1]
+      && ctr[0] == other.ctr[0] && ctr[1] == other.ctr[1] && ctr[2] == other.ctr[2] && ctr[3] == other.ctr[3]
+      && (bufPos >= 4 ? other.bufPos >= 4 : bufPos == other.bufPos);
+  }
+  bool operator!= (const PhiloxEngine& other) const { return !(*this == other); }
+
+  // textual state, as for the standard engines
+  friend std::ostream& operator<< (std::ostream& out, const PhiloxEngine& e) {
+    return out << e.key[0] << ' ' << e.key[1] << ' ' << e.ctr[0] << ' ' << e.ctr[1] << ' ' << e.ctr[2] << ' ' << e.ctr[3] << ' ' << e.bufPos;
+  }
+  friend std::istream& operator>> (std::istream& in, PhiloxEngine& e) {
+    in >> e.key[0] >> e.key[1] >> e.ctr[0] >> e.ctr[1] >> e.ctr[2] >> e.ctr[3] >> e.bufPos;
+    if (e.bufPos < 4) {
+      // regenerate the buffered block
+      const unsigned int pos = e.bufPos;
+      --e.ctr[0];
+      e.generateBlock();
+      e.bufPos = pos;
+    }
+    return in;
+  }
+};
+
+/* Stream identifiers, so that different uses of the same (dataset,node) don't collide.
+   The dataset index occupies the low 24 bits of the stream word. */
+#define RNGStreamDatasetMask 0x00ffffffu
+#define RNGStreamProfile     0x01000000u
+#define RNGStreamPrealign    0x02000000u
+#define RNGStreamMCMC        0x03000000u
+#define RNGStreamSimulate    0x04000000u
+#define RNGStreamBandEdge    0x05000000u
+
+#endif /* RNG_INCLUDED */
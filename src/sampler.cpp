@@ -1,6 +1,8 @@
 #include <gsl/gsl_math.h>
 #include "sampler.h"
 #include "recon.h"
+#include "alias.h"
+#include "taskpool.h"
 #include "util.h"
 
 #define SAMPLER_EPSILON 1e-3
@@ -30,6 +32,36 @@ LogProb SimpleTreePrior::treeLogLikelihood (const Tree& tree) const {
   return lp;
 }
 
+Sampler::History::History (const vguard<FastSeq>& ungapped, const AlignPath& path, const Tree& t)
+  : tree(t),
+    align (new Alignment (ungapped, path))
+{
+  gapped = align->gapped();
+}
+
+const Alignment& Sampler::History::alignment() const {
+  if (!align)
+    align = shared_ptr<const Alignment> (new Alignment (gapped));
+  return *align;
+}
+
+const TreeIndex& Sampler::History::treeIndex() const {
+  if (!index)
+    index = shared_ptr<const TreeIndex> (new TreeIndex (tree));
+  return *index;
+}
+
+void Sampler::Change::renumber (const vguard<TreeNodeIndex>& newOrder) {
+  if (alignment) {
+    TreeNodeSet newRealigned (newOrder.size());
+    for (TreeNodeIndex n = 0; n < (TreeNodeIndex) newOrder.size(); ++n)
+      if (realigned.count (newOrder[n]))
+	newRealigned.insert (n);
+    realigned = newRealigned;
+  }
+  oldNode = newOrder;
+}
+
 Sampler::History Sampler::History::reorder (const vguard<TreeNodeIndex>& newOrder) const {
   LogThisAt(6,"Reordering nodes to maintain preorder sort (" << to_string_join(newOrder) << ")" << endl);
   History newHistory;
@@ -37,6 +69,15 @@ Sampler::History Sampler::History::reorder (const vguard<TreeNodeIndex>& newOrde
   newHistory.gapped.reserve (gapped.size());
   for (auto n : newOrder)
     newHistory.gapped.push_back (gapped[n]);
+  if (align) {
+    Alignment* newAlign = new Alignment();
+    newAlign->ungapped.reserve (newOrder.size());
+    for (TreeNodeIndex n = 0; n < (TreeNodeIndex) newOrder.size(); ++n) {
+      newAlign->ungapped.push_back (align->ungapped[newOrder[n]]);
+      newAlign->path[n] = align->path.at (newOrder[n]);
+    }
+    newHistory.align = shared_ptr<const Alignment> (newAlign);
+  }
   return newHistory;
 }
 
@@ -260,28 +301,6 @@ bool TreeAlignFuncs::subpathUngapped (const AlignPath& path, const vguard<TreeNo
   return true;
 }
 
-set<TreeNodeIndex> TreeAlignFuncs::allNodes (const Tree& tree) {
-  const auto nvec = tree.preorderSort();
-  return set<TreeNodeIndex> (nvec.begin(), nvec.end());
-}
-
-set<TreeNodeIndex> TreeAlignFuncs::allExceptNodeAndAncestors (const Tree& tree, TreeNodeIndex node) {
-  set<TreeNodeIndex> n = allNodes (tree), a = tree.nodeAndAncestors (node);
-  for (auto anc: a)
-    n.erase (anc);
-  return n;
-}
-
-set<TreeNodeIndex> TreeAlignFuncs::nodeAndAncestors (const Tree& tree, TreeNodeIndex node) {
-  return tree.nodeAndAncestors (node);
-}
-
-set<TreeNodeIndex> TreeAlignFuncs::nodesAndAncestors (const Tree& tree, TreeNodeIndex node1, TreeNodeIndex node2) {
-  set<TreeNodeIndex> a = tree.nodeAndAncestors (node1), n2 = tree.nodeAndAncestors (node2);
-  a.insert (n2.begin(), n2.end());
-  return a;
-}
-
 string TreeAlignFuncs::branchConditionalDump (const RateModel& model, const Tree& tree, const vguard<FastSeq>& gapped, TreeNodeIndex parent, TreeNodeIndex node) {
   ostringstream out;
 
@@ -293,8 +312,9 @@ string TreeAlignFuncs::branchConditionalDump (const RateModel& model, const Tree
   exclude[node] = parent;
   exclude[parent] = node;
 
-  const set<TreeNodeIndex> fillUpNodes = allExceptNodeAndAncestors (tree, parent);
-  const set<TreeNodeIndex> fillDownNodes = nodeAndAncestors (tree, parent);
+  const TreeIndex index (tree);
+  const TreeNodeSet fillUpNodes = index.allExceptNodeAndAncestors (parent);
+  const TreeNodeSet fillDownNodes = index.nodeAndAncestors (parent);
 
   const auto pwms = getConditionalPWMs (model, tree, gapped, exclude, fillUpNodes, fillDownNodes, false);
   const PosWeightMatrix& pSeq = pwms.at (parent);
@@ -304,8 +324,9 @@ string TreeAlignFuncs::branchConditionalDump (const RateModel& model, const Tree
   AlignColSumProduct colSumProdBranch (model, tree, gapped);
   AlignColSumProduct colSumProdFull (model, tree, gapped);
 
-  colSumProdBranch.preorder = vguard<TreeNodeIndex> (fillDownNodes.rbegin(), fillDownNodes.rend());
-  colSumProdBranch.postorder = vguard<TreeNodeIndex> (fillUpNodes.begin(), fillUpNodes.end());
+  const vguard<TreeNodeIndex> fillDownOrder = fillDownNodes.toVector();
+  colSumProdBranch.preorder = vguard<TreeNodeIndex> (fillDownOrder.rbegin(), fillDownOrder.rend());
+  colSumProdBranch.postorder = fillUpNodes.toVector();
 
   size_t col = 0, pCol = 0, nCol = 0;
   while (!colSumProdBranch.alignmentDone()) {
@@ -353,11 +374,12 @@ string TreeAlignFuncs::branchConditionalDump (const RateModel& model, const Tree
   return out.str();
 }
 
-map<TreeNodeIndex,TreeAlignFuncs::PosWeightMatrix> TreeAlignFuncs::getConditionalPWMs (const RateModel& model, const Tree& tree, const vguard<FastSeq>& gapped, const map<TreeNodeIndex,TreeNodeIndex>& exclude, const set<TreeNodeIndex>& fillUpNodes, const set<TreeNodeIndex>& fillDownNodes, bool normalize) {
+map<TreeNodeIndex,TreeAlignFuncs::PosWeightMatrix> TreeAlignFuncs::getConditionalPWMs (const RateModel& model, const Tree& tree, const vguard<FastSeq>& gapped, const map<TreeNodeIndex,TreeNodeIndex>& exclude, const TreeNodeSet& fillUpNodes, const TreeNodeSet& fillDownNodes, bool normalize) {
   map<TreeNodeIndex,PosWeightMatrix> pwms;
   AlignColSumProduct colSumProd (model, tree, gapped);
-  colSumProd.preorder = vguard<TreeNodeIndex> (fillDownNodes.rbegin(), fillDownNodes.rend());
-  colSumProd.postorder = vguard<TreeNodeIndex> (fillUpNodes.begin(), fillUpNodes.end());
+  const vguard<TreeNodeIndex> fillDownOrder = fillDownNodes.toVector();
+  colSumProd.preorder = vguard<TreeNodeIndex> (fillDownOrder.rbegin(), fillDownOrder.rend());
+  colSumProd.postorder = fillUpNodes.toVector();
   while (!colSumProd.alignmentDone()) {
     colSumProd.fillUp();
     colSumProd.fillDown();
@@ -380,11 +402,11 @@ LogProb TreeAlignFuncs::rootLogLikelihood (const RateModel& model, const History
 }
 
 LogProb TreeAlignFuncs::indelLogLikelihood (const RateModel& model, const History& history) {
-  const Alignment align (history.gapped);
+  const Alignment& align = history.alignment();
   LogProb lpGaps = 0;
   for (TreeNodeIndex node = 0; node < history.tree.root(); ++node) {
     const TreeNodeIndex parent = history.tree.parentNode (node);
-    const ProbModel probModel (model, history.tree.branchLength (node));
+    const IndelProbModel probModel (model, history.tree.branchLength (node));
     const AlignPath path = pairPath (align.path, parent, node);
     lpGaps += logBranchPathLikelihood (probModel, path, parent, node);
   }
@@ -417,7 +439,6 @@ LogProb TreeAlignFuncs::logLikelihood (const SimpleTreePrior& treePrior, const R
 }
 
 LogProb TreeAlignFuncs::logLikelihood (const RateModel& model, const History& history, const char* suffix) {
-  const Alignment align (history.gapped);
   const LogProb lpRoot = rootLogLikelihood (model, history);
   const LogProb lpGaps = indelLogLikelihood (model, history);
   const LogProb lpSub = substLogLikelihood (model, history);
@@ -436,7 +457,7 @@ LogProb TreeAlignFuncs::logLikelihood (const RateModel& model, const Tree& tree,
   return logLikelihood (model, history, suffix);
 }
 
-LogProb TreeAlignFuncs::logBranchPathLikelihood (const ProbModel& probModel, const AlignPath& path, TreeNodeIndex parent, TreeNodeIndex child) {
+LogProb TreeAlignFuncs::logBranchPathLikelihood (const IndelProbModel& probModel, const AlignPath& path, TreeNodeIndex parent, TreeNodeIndex child) {
   const AlignColIndex cols = alignPathColumns (path);
   ProbModel::State state = ProbModel::Start;
   LogProb lp = 0;
@@ -450,14 +471,46 @@ LogProb TreeAlignFuncs::logBranchPathLikelihood (const ProbModel& probModel, con
 }
 
 TreeAlignFuncs::PosWeightMatrix TreeAlignFuncs::preMultiply (const PosWeightMatrix& child, const vguard<LogProbModel::LogProbMatrix>& submat) {
+  // done in linear space, with each position scaled by its largest entry,
+  // so each entry is a dot product rather than a chain of log-sum-exps
   PosWeightMatrix pwm (child.size(), vguard<vguard<LogProb> > (submat.size(), vguard<LogProb> (submat.front().size(), -numeric_limits<double>::infinity())));
+  vguard<vguard<vguard<double> > > prob (submat.size());
+  for (size_t cpt = 0; cpt < submat.size(); ++cpt)
+    for (const auto& row : submat[cpt]) {
+      prob[cpt].push_back (vguard<double> (row.size()));
+      for (size_t j = 0; j < row.size(); ++j)
+	prob[cpt].back()[j] = exp (row[j]);
+    }
+  vguard<double> v;
   size_t n = 0;
   for (const auto& lpp : child) {
     auto& pre = pwm[n++];
-    for (int cpt = 0; cpt < (int) submat.size(); ++cpt)
-      for (AlphTok i = 0; i < pre[cpt].size(); ++i)
-	for (AlphTok j = 0; j < lpp[cpt].size(); ++j)
-	  log_accum_exp (pre[cpt][i], submat[cpt][i][j] + lpp[cpt][j]);
+    LogProb lppMax = -numeric_limits<double>::infinity();
+    for (const auto& cptLpp : lpp)
+      for (auto lp : cptLpp)
+	lppMax = max (lppMax, lp);
+    if (lppMax == -numeric_limits<double>::infinity())
+      continue;
+    for (int cpt = 0; cpt < (int) submat.size(); ++cpt) {
+      const size_t nTok = lpp[cpt].size();
+      v.resize (nTok);
+      for (AlphTok j = 0; j < nTok; ++j)
+	v[j] = exp (lpp[cpt][j] - lppMax);
+      for (AlphTok i = 0; i < pre[cpt].size(); ++i) {
+	const double* p = prob[cpt][i].data();
+	double p0 = 0, p1 = 0, p2 = 0, p3 = 0;
+	size_t j = 0;
+	for (; j + 4 <= nTok; j += 4) {
+	  p0 += p[j] * v[j];
+	  p1 += p[j+1] * v[j+1];
+	  p2 += p[j+2] * v[j+2];
+	  p3 += p[j+3] * v[j+3];
+	}
+	for (; j < nTok; ++j)
+	  p0 += p[j] * v[j];
+	pre[cpt][i] = lppMax + log ((p0 + p1) + (p2 + p3));
+      }
+    }
   }
   return pwm;
 }
@@ -489,13 +542,21 @@ Sampler::Move::Move (Type type, const History& history, LogProb oldLogLikelihood
 { }
 
 void Sampler::Move::initNewHistory (const Tree& tree, const vguard<FastSeq>& ungapped, const AlignPath& path) {
-  const Alignment newAlign (ungapped, path);
-  initNewHistory (tree, newAlign.gapped());
+  newHistory = History (ungapped, path, tree);
+  if (&tree == &oldHistory.tree)
+    newHistory.copyTreeIndex (oldHistory);
 }
 
 void Sampler::Move::initNewHistory (const Tree& tree, const vguard<FastSeq>& gapped) {
+  newHistory = History (gapped, tree);
+  if (&tree == &oldHistory.tree)
+    newHistory.copyTreeIndex (oldHistory);
+}
+
+void Sampler::Move::initNewHistory (const Tree& tree) {
+  newHistory = oldHistory;
   newHistory.tree = tree;
-  newHistory.gapped = gapped;
+  newHistory.clearTreeIndex();
 }
 
 void Sampler::Move::initRatio (const Sampler& sampler) {
@@ -510,6 +571,7 @@ void Sampler::Move::initRatio (const Sampler& sampler) {
 
 void Sampler::Move::nullify (const char* reason) {
   newHistory = oldHistory;
+  change = Change();
   newLogLikelihood = oldLogLikelihood;
   logAcceptProb = logJacobian = logForwardProposal = logReverseProposal = 0;
   nullified = true;
@@ -566,10 +628,11 @@ Sampler::BranchAlignMove::BranchAlignMove (const History& history, LogProb oldLo
 
   const TreeBranchLength dist = history.tree.branchLength(parent,node);
   
-  const TreeNodeIndex parentClosestLeaf = history.tree.closestLeaf (parent, node);
-  const TreeNodeIndex nodeClosestLeaf = history.tree.closestLeaf (node, parent);
+  const TreeIndex& treeIndex = history.treeIndex();
+  const TreeNodeIndex parentClosestLeaf = treeIndex.closestLeaf (parent, node);
+  const TreeNodeIndex nodeClosestLeaf = treeIndex.closestLeaf (node, parent);
 
-  const Alignment oldAlign (history.gapped);
+  const Alignment& oldAlign = history.alignment();
   const AlignPath oldBranchPath = Sampler::branchPath (oldAlign.path, history.tree, node);
   const GuideAlignmentEnvelope newBranchEnv = sampler.makeGuide (history.tree, parentClosestLeaf, nodeClosestLeaf, oldBranchPath, parent, node);
 
@@ -583,7 +646,7 @@ Sampler::BranchAlignMove::BranchAlignMove (const History& history, LogProb oldLo
   exclude[node] = parent;
   exclude[parent] = node;
 
-  const auto pwms = sampler.getConditionalPWMs (history.tree, history.gapped, exclude, sampler.allExceptNodeAndAncestors(history.tree,parent), sampler.nodeAndAncestors(history.tree,parent));
+  const auto pwms = sampler.getConditionalPWMs (history.tree, history.gapped, exclude, treeIndex.allExceptNodeAndAncestors(parent), treeIndex.nodeAndAncestors(parent));
   const PosWeightMatrix& pSeq = pwms.at (parent);
   const PosWeightMatrix& nSeq = pwms.at (node);
 
@@ -615,6 +678,9 @@ Sampler::BranchAlignMove::BranchAlignMove (const History& history, LogProb oldLo
   logForwardProposal = logPostNewBranchPath;
   logReverseProposal = logPostOldBranchPath;
 
+  change.alignment = true;
+  change.realigned = treeIndex.nodeAndDescendants (node);
+
   initNewHistory (oldHistory.tree, oldAlign.ungapped, newPath);
   initRatio (sampler);
 }
@@ -635,10 +701,11 @@ Sampler::NodeAlignMove::NodeAlignMove (const History& history, LogProb oldLogLik
   const TreeBranchLength lDist = history.tree.branchLength(node,leftChild);
   const TreeBranchLength rDist = history.tree.branchLength(node,rightChild);
   
-  const TreeNodeIndex leftChildClosestLeaf = history.tree.closestLeaf (leftChild, node);
-  const TreeNodeIndex rightChildClosestLeaf = history.tree.closestLeaf (rightChild, node);
+  const TreeIndex& treeIndex = history.treeIndex();
+  const TreeNodeIndex leftChildClosestLeaf = treeIndex.closestLeaf (leftChild, node);
+  const TreeNodeIndex rightChildClosestLeaf = treeIndex.closestLeaf (rightChild, node);
 
-  const Alignment oldAlign (history.gapped);
+  const Alignment& oldAlign = history.alignment();
   const AlignPath oldSiblingPath = Sampler::triplePath (oldAlign.path, leftChild, rightChild, node);
 
   const AlignPath lCladePath = Sampler::cladePath (oldAlign.path, history.tree, leftChild, node);
@@ -656,7 +723,7 @@ Sampler::NodeAlignMove::NodeAlignMove (const History& history, LogProb oldLogLik
     exclude[node] = parent;
     exclude[parent] = node;
   }
-  const auto pwms = sampler.getConditionalPWMs (history.tree, history.gapped, exclude, sampler.allExceptNodeAndAncestors(history.tree,parent>=0?parent:node), parent >= 0 ? sampler.nodeAndAncestors(history.tree,parent) : set<TreeNodeIndex>());
+  const auto pwms = sampler.getConditionalPWMs (history.tree, history.gapped, exclude, treeIndex.allExceptNodeAndAncestors(parent>=0?parent:node), parent >= 0 ? treeIndex.nodeAndAncestors(parent) : TreeNodeSet(treeIndex.nodes()));
   const PosWeightMatrix& lSeq = pwms.at (leftChild);
   const PosWeightMatrix& rSeq = pwms.at (rightChild);
 
@@ -695,8 +762,8 @@ Sampler::NodeAlignMove::NodeAlignMove (const History& history, LogProb oldLogLik
     const PosWeightMatrix& pSeq = pwms.at (parent);
     const TreeBranchLength pDist = history.tree.branchLength(parent,node);
 
-    const TreeNodeIndex nodeClosestLeaf = history.tree.closestLeaf (node, parent);
-    const TreeNodeIndex parentClosestLeaf = history.tree.closestLeaf (parent, node);
+    const TreeNodeIndex nodeClosestLeaf = treeIndex.closestLeaf (node, parent);
+    const TreeNodeIndex parentClosestLeaf = treeIndex.closestLeaf (parent, node);
     const TreeNodeIndex nodeClosestChild = lDist < rDist ? leftChild : rightChild;
     
     const GuideAlignmentEnvelope newBranchEnv = sampler.makeGuide (history.tree, parentClosestLeaf, nodeClosestLeaf, oldAlign.path, parent, nodeClosestChild);
@@ -738,7 +805,10 @@ Sampler::NodeAlignMove::NodeAlignMove (const History& history, LogProb oldLogLik
     nullify("no change");
     return;
   }
-  
+
+  change.alignment = true;
+  change.realigned = treeIndex.nodeAndDescendants (node);
+
   initNewHistory (oldHistory.tree, newUngapped, newPath);
   initRatio (sampler);
 }
@@ -773,7 +843,7 @@ Sampler::PruneAndRegraftMove::PruneAndRegraftMove (const History& history, LogPr
   LogThisAt(4,"Proposing prune-and-regraft move at...\n            node #" << node << ": " << history.tree.seqName(node) << "\n          parent #" << parent << ": " << history.tree.seqName(parent) << "\n     old sibling #" << oldSibling << ": " << history.tree.seqName(oldSibling) << "\n old grandparent #" << oldGrandparent << ": " << history.tree.seqName(oldGrandparent) << "\n     new sibling #" << newSibling << ": " << history.tree.seqName(newSibling) << "\n new grandparent #" << newGrandparent << ": " << history.tree.seqName(newGrandparent) << endl);
 
   const Tree& oldTree = history.tree;
-  const Alignment oldAlign (history.gapped);
+  const Alignment& oldAlign = history.alignment();
   
   const TreeBranchLength oldGranParentDist = oldTree.branchLength(oldGrandparent,parent);
   const TreeBranchLength parentNodeDist = oldTree.branchLength(parent,node);
@@ -802,7 +872,7 @@ Sampler::PruneAndRegraftMove::PruneAndRegraftMove (const History& history, LogPr
   // optimize special case that (oldSibling,parent,oldGrandparent,newGrandparent,newSibling) form a sub-alignment with no gaps
   const vguard<TreeNodeIndex> subpathNodes = { oldSibling, parent, oldGrandparent, newGrandparent, newSibling };
   if (Sampler::subpathUngapped (oldAlign.path, subpathNodes)) {
-    initNewHistory (newTree, history.gapped);
+    initNewHistory (newTree);
 
     logForwardProposal = logFwdSibSelect;
     logReverseProposal = logRevSibSelect;
@@ -821,13 +891,15 @@ Sampler::PruneAndRegraftMove::PruneAndRegraftMove (const History& history, LogPr
 
     const AlignPath oldGranSibPath = Sampler::pairPath (oldAlign.path, oldGrandparent, oldSibling);
     
-    const TreeNodeIndex nodeClosestLeaf = oldTree.closestLeaf (node, parent);
-    const TreeNodeIndex oldSibClosestLeaf = oldTree.closestLeaf (oldSibling, parent);
-    const TreeNodeIndex oldGranClosestLeaf = oldTree.closestLeaf (oldGrandparent, parent);
-    const TreeNodeIndex newSibClosestLeaf = newTree.closestLeaf (newSibling, parent);
-    const TreeNodeIndex newGranClosestLeaf = newTree.closestLeaf (newGrandparent, parent);
-    const TreeNodeIndex oldParentClosestLeaf = oldTree.closestLeaf (parent, oldGrandparent);
-    const TreeNodeIndex newParentClosestLeaf = newTree.closestLeaf (parent, newGrandparent);
+    const TreeIndex& oldIndex = history.treeIndex();
+    const TreeIndex newIndex (newTree);
+    const TreeNodeIndex nodeClosestLeaf = oldIndex.closestLeaf (node, parent);
+    const TreeNodeIndex oldSibClosestLeaf = oldIndex.closestLeaf (oldSibling, parent);
+    const TreeNodeIndex oldGranClosestLeaf = oldIndex.closestLeaf (oldGrandparent, parent);
+    const TreeNodeIndex newSibClosestLeaf = newIndex.closestLeaf (newSibling, parent);
+    const TreeNodeIndex newGranClosestLeaf = newIndex.closestLeaf (newGrandparent, parent);
+    const TreeNodeIndex oldParentClosestLeaf = oldIndex.closestLeaf (parent, oldGrandparent);
+    const TreeNodeIndex newParentClosestLeaf = newIndex.closestLeaf (parent, newGrandparent);
 
     const TreeNodeIndex oldParentClosestChild = parentNodeDist < parentOldSibDist ? node : oldSibling;
     const TreeNodeIndex newParentClosestChild = parentNodeDist < parentNewSibDist ? node : newSibling;
@@ -849,7 +921,7 @@ Sampler::PruneAndRegraftMove::PruneAndRegraftMove (const History& history, LogPr
 
     Tree detachedTree = oldTree;
     detachedTree.detach (node);
-    const auto pwms = sampler.getConditionalPWMs (detachedTree, history.gapped, exclude, sampler.allNodes(history.tree), sampler.nodesAndAncestors(history.tree,oldGrandparent,newGrandparent));
+    const auto pwms = sampler.getConditionalPWMs (detachedTree, history.gapped, exclude, oldIndex.allNodes(), oldIndex.nodeAndAncestors(oldGrandparent) |= oldIndex.nodeAndAncestors(newGrandparent));
 
     const PosWeightMatrix& nodeSeq = pwms.at (node);
     const PosWeightMatrix& oldSibSeq = pwms.at (oldSibling);
@@ -910,16 +982,26 @@ Sampler::PruneAndRegraftMove::PruneAndRegraftMove (const History& history, LogPr
       logReverseProposal += sampler.logSeqPostProb (oldUngapped[parent].seq, oldParentSeq);
     } else
       newUngapped[parent].seq = string (alignPathResiduesInRow (newSiblingPath.at (parent)), Alignment::wildcardChar);
-  
+
+    // the pruned subtree, the new sibling's subtree & the parent are realigned to the rest
+    change.alignment = true;
+    change.realigned = oldIndex.nodeAndDescendants (node);
+    change.realigned |= oldIndex.nodeAndDescendants (newSibling);
+    change.realigned.insert (parent);
+
     initNewHistory (newTree, newUngapped, newPath);
   }
+  change.tree = change.topology = true;
 
   // we need...
   //  newGrandparent > parent
   //  parent > newSibling
   //  parent > node
-  if (parent < newSibling || parent > newGrandparent)
-    newHistory = newHistory.reorder (newHistory.tree.postorderSort());
+  if (parent < newSibling || parent > newGrandparent) {
+    const vguard<TreeNodeIndex> newOrder = newHistory.tree.postorderSort();
+    newHistory = newHistory.reorder (newOrder);
+    change.renumber (newOrder);
+  }
 
   initRatio (sampler);
 }
@@ -971,7 +1053,8 @@ Sampler::NodeHeightMove::NodeHeightMove (const History& history, LogProb oldLogL
     LogThisAt(6,"Sampled coalescence time of #" << leftChild << " and #" << rightChild << ": " << cDistNew << " (previously " << minChildDist << ", maximum " << pDist << ")" << endl);
   }
 
-  initNewHistory (newTree, oldHistory.gapped);
+  change.tree = true;
+  initNewHistory (newTree);
   initRatio (sampler);
 }
 
@@ -998,7 +1081,8 @@ Sampler::RescaleMove::RescaleMove (const History& history, LogProb oldLogLikelih
   logForwardProposal = logReverseProposal = 0;
   logJacobian = logMultiplier;
 
-  initNewHistory (newTree, oldHistory.gapped);
+  change.tree = true;
+  initNewHistory (newTree);
   initRatio (sampler);
 }
 
@@ -1196,57 +1280,21 @@ Sampler::SiblingMatrix::SiblingMatrix (const RateModel& model, const PosWeightMa
     lSub (Sampler::preMultiply (lSeq, lLogProbModel.logSubProb)),
     rSub (Sampler::preMultiply (rSeq, rLogProbModel.logSubProb)),
     lEmit (Sampler::calcInsProbs (lSeq, lLogProbModel.logInsProb, lLogProbModel.logCptWeight)),
-    rEmit (Sampler::calcInsProbs (rSeq, rLogProbModel.logInsProb, rLogProbModel.logCptWeight))
+    rEmit (Sampler::calcInsProbs (rSeq, rLogProbModel.logInsProb, rLogProbModel.logCptWeight)),
+    subStride (model.components() * model.alphabetSize())
 {
   for (int cpt = 0; cpt < model.components(); ++cpt)
     for (AlphTok tok = 0; tok < model.alphabetSize(); ++tok)
       ((vguard<vguard<LogProb> >&)logRoot)[cpt][tok] += log (model.cptWeight[cpt]);
 
-  imm_www = lpTransElimSelfLoopIDD (IMM, WWW);
-  imm_imi = lpTransElimSelfLoopIDD (IMM, IMI);
-  imm_iiw = lpTransElimSelfLoopIDD (IMM, IIW);
-
-  imd_wwx = lpTransElimSelfLoopIDD (IMD, WWX);
-  imd_iix = lpTransElimSelfLoopIDD (IMD, IIX);
+  expRows (lSub, NULL, lSubExp, lSubMax);
+  expRows (rSub, &logRoot, rSubExp, rSubMax);
 
-  idm_wxw = lpTransElimSelfLoopIDD (IDM, WXW);
-  idm_idi = lpTransElimSelfLoopIDD (IDM, IDI);
-
-  idd_imm = lpTransElimSelfLoopIDD (IDD, IMM);
-  idd_imd = lpTransElimSelfLoopIDD (IDD, IMD);
-  idd_idm = lpTransElimSelfLoopIDD (IDD, IDM);
-  idd_eee = lpTransElimSelfLoopIDD (IDD, EEE);
-
-  www_imm = lpTransElimSelfLoopIDD (WWW, IMM);
-  www_imd = lpTransElimSelfLoopIDD (WWW, IMD);
-  www_idm = lpTransElimSelfLoopIDD (WWW, IDM);
-  www_idd = lpTransElimSelfLoopIDD (WWW, IDD);
-  www_eee = lpTransElimSelfLoopIDD (WWW, EEE);
-
-  wwx_imm = lpTransElimSelfLoopIDD (WWX, IMM);
-  wwx_imd = lpTransElimSelfLoopIDD (WWX, IMD);
-  wwx_idm = lpTransElimSelfLoopIDD (WWX, IDM);
-  wwx_idd = lpTransElimSelfLoopIDD (WWX, IDD);
-  wwx_eee = lpTransElimSelfLoopIDD (WWX, EEE);
-
-  wxw_imm = lpTransElimSelfLoopIDD (WXW, IMM);
-  wxw_imd = lpTransElimSelfLoopIDD (WXW, IMD);
-  wxw_idm = lpTransElimSelfLoopIDD (WXW, IDM);
-  wxw_idd = lpTransElimSelfLoopIDD (WXW, IDD);
-  wxw_eee = lpTransElimSelfLoopIDD (WXW, EEE);
-
-  imi_www = lpTransElimSelfLoopIDD (IMI, WWW);
-  imi_imi = lpTransElimSelfLoopIDD (IMI, IMI);
-  imi_iiw = lpTransElimSelfLoopIDD (IMI, IIW);
-
-  iiw_www = lpTransElimSelfLoopIDD (IIW, WWW);
-  iiw_iiw = lpTransElimSelfLoopIDD (IIW, IIW);
-
-  idi_wxw = lpTransElimSelfLoopIDD (IDI, WXW);
-  idi_idi = lpTransElimSelfLoopIDD (IDI, IDI);
-
-  iix_wwx = lpTransElimSelfLoopIDD (IIX, WWX);
-  iix_iix = lpTransElimSelfLoopIDD (IIX, IIX);
+  for (int src = 0; src <= EEE; ++src)
+    for (int dest = 0; dest <= EEE; ++dest) {
+      trans[src][dest] = src == EEE ? -numeric_limits<double>::infinity() : lpTransElimSelfLoopIDD ((State) src, (State) dest);
+      transElimWait[src][dest] = src == EEE ? -numeric_limits<double>::infinity() : lpTransElimWait ((State) src, (State) dest);
+    }
 
   LogThisAt(8,"Left-node profile:\n" << Sampler::profileToString(lSeq)
 	    << "Right-node profile:\n" << Sampler::profileToString(rSeq));
@@ -1254,85 +1302,134 @@ Sampler::SiblingMatrix::SiblingMatrix (const RateModel& model, const PosWeightMa
   ProgressLog (plog, 5);
   plog.initProgress ("Parent proposal matrix (%u*%u)", xSize, ySize);
 
-  lpStart() = 0;
-  cell(0,0,WWW) = imm_www;
+  // The fill runs in linear space, over the transition probabilities t[src][dest] = exp(trans[src][dest]).
+  // The insert emissions are divided out of every cell, so that along a row or column the cells change
+  // only by transition probabilities and match odds; each row is then rescaled by its maximum.
+  // Cell (xpos,ypos) is stored as log(value) + rowScale + lEmitCum[xpos] + rEmitCum[ypos].
+  // Each row is filled in two passes over dense row buffers, where cells outside the envelope stay at zero.
+  // The first pass takes the transitions from the previous row (left & diagonal sources);
+  // its iterations are independent, so they can be pipelined or vectorized.
+  // The second pass takes the transitions along the row (up sources), which must run in order.
+  double t[EEE+1][EEE+1];
+  for (int src = 0; src <= EEE; ++src)
+    for (int dest = 0; dest <= EEE; ++dest)
+      t[src][dest] = exp (trans[src][dest]);
+
+  vguard<LogProb> lEmitCum, rEmitCum;
+  vguard<double> lInsOdds, lMatchOdds, rInsOdds, rMatchOdds;
+  normEmissions (lEmit, lSubMax, lEmitCum, lInsOdds, lMatchOdds);
+  normEmissions (rEmit, rSubMax, rEmitCum, rInsOdds, rMatchOdds);
+
+  const size_t cellStates = EEE;  // all states except eee are stored
+  vguard<double> prevRow (ySize * cellStates), curRow (ySize * cellStates);
+  vguard<bool> inEnv (ySize);
+  LogProb rowScale = 0;
   for (SeqIdx xpos = 0; xpos < xSize; ++xpos) {
 
     plog.logProgress (xpos / (double) (xSize - 1), "row %d/%d", xpos + 1, xSize);
 
     for (SeqIdx ypos = 0; ypos < ySize; ++ypos)
-      if (inEnvelope (xpos, ypos)) {
-	XYCell& dest = xyCell (xpos, ypos);
-
-	if (xpos > 0 && inEnvelope (xpos - 1, ypos)) {
-	  const XYCell& lSrc = xyCell (xpos - 1, ypos);
-	  const LogProb lEmitScore = lEmit[xpos - 1];
+      inEnv[ypos] = inEnvelope (xpos, ypos);
+
+    fill (curRow.begin(), curRow.end(), 0.);
+    if (xpos == 0) {
+      curRow[SSS] = 1;
+      curRow[WWW] = t[IMM][WWW];
+    } else {
+      const double lIns = lInsOdds[xpos], lMatch = lMatchOdds[xpos];
+      for (SeqIdx ypos = 0; ypos < ySize; ++ypos)
+	if (inEnv[ypos]) {
+	  double* dest = curRow.data() + ypos * cellStates;
+	  const double* lSrc = prevRow.data() + ypos * cellStates;
+
+	  dest[IIW] = lIns * (lSrc[IMM] * t[IMM][IIW]
+			      + lSrc[IMI] * t[IMI][IIW]
+			      + lSrc[IIW] * t[IIW][IIW]);
+
+	  dest[IIX] = lIns * (lSrc[IMD] * t[IMD][IIX]
+			      + lSrc[IIX] * t[IIX][IIX]);
+
+	  dest[IMD] = lIns * (lSrc[WWW] * t[WWW][IMD]
+			      + lSrc[WWX] * t[WWX][IMD]
+			      + lSrc[WXW] * t[WXW][IMD]
+			      + lSrc[IDD] * t[IDD][IMD]);
+
+	  dest[WWW] = dest[IIW] * t[IIW][WWW];
+
+	  dest[WWX] = dest[IIX] * t[IIX][WWX]
+	    + dest[IMD] * t[IMD][WWX];
+
+	  if (ypos > 0) {
+	    const double* lrSrc = prevRow.data() + (ypos - 1) * cellStates;
+	    const double toMatch = lrSrc[WWW] * t[WWW][IMM]
+	      + lrSrc[WWX] * t[WWX][IMM]
+	      + lrSrc[WXW] * t[WXW][IMM]
+	      + lrSrc[IDD] * t[IDD][IMM];
+	    if (toMatch > 0)
+	      dest[IMM] = lMatch * rMatchOdds[ypos] * matchDot (xpos, ypos) * toMatch;
+	  }
+	}
+    }
 
-	  dest(IIW) = lEmitScore + log_sum_exp (lSrc(IMM) + imm_iiw,
-						lSrc(IMI) + imi_iiw,
-						lSrc(IIW) + iiw_iiw);
+    double rowMax = 0;
+    for (SeqIdx ypos = 0; ypos < ySize; ++ypos)
+      if (inEnv[ypos]) {
+	double* dest = curRow.data() + ypos * cellStates;
 
-	  dest(IIX) = lEmitScore + log_sum_exp (lSrc(IMD) + imd_iix,
-						lSrc(IIX) + iix_iix);
+	if (ypos > 0 && inEnv[ypos - 1]) {
+	  const double* rSrc = curRow.data() + (ypos - 1) * cellStates;
+	  const double rIns = rInsOdds[ypos];
 
-	  dest(IMD) = lEmitScore + log_sum_exp (lSrc(WWW) + www_imd,
-						lSrc(WWX) + wwx_imd,
-						lSrc(WXW) + wxw_imd,
-						lSrc(IDD) + idd_imd);
+	  dest[IMI] = rIns * (rSrc[IMM] * t[IMM][IMI]
+			      + rSrc[IMI] * t[IMI][IMI]);
 
-	  dest(WWW) = dest(IIW) + iiw_www;
+	  dest[IDI] = rIns * (rSrc[IDM] * t[IDM][IDI]
+			      + rSrc[IDI] * t[IDI][IDI]);
 
-	  dest(WWX) = log_sum_exp (dest(IIX) + iix_wwx,
-				   dest(IMD) + imd_wwx);
-	}
+	  dest[IDM] = rIns * (rSrc[WWW] * t[WWW][IDM]
+			      + rSrc[WWX] * t[WWX][IDM]
+			      + rSrc[WXW] * t[WXW][IDM]
+			      + rSrc[IDD] * t[IDD][IDM]);
 
-      	if (ypos > 0 && inEnvelope (xpos, ypos - 1)) {
-	  const XYCell& rSrc = xyCell (xpos, ypos - 1);
-	  const LogProb rEmitScore = rEmit[ypos - 1];
+	  dest[WWW] += dest[IMI] * t[IMI][WWW];
 
-	  dest(IMI) = rEmitScore + log_sum_exp (rSrc(IMM) + imm_imi,
-						rSrc(IMI) + imi_imi);
-
-	  dest(IDI) = rEmitScore + log_sum_exp (rSrc(IDM) + idm_idi,
-						rSrc(IDI) + idi_idi);
+	  dest[WXW] = dest[IDI] * t[IDI][WXW]
+	    + dest[IDM] * t[IDM][WXW];
+	}
 
-	  dest(IDM) = rEmitScore + log_sum_exp (rSrc(WWW) + www_idm,
-						rSrc(WWX) + wwx_idm,
-						rSrc(WXW) + wxw_idm,
-						rSrc(IDD) + idd_idm);
+	if (xpos > 0 && ypos > 0)
+	  dest[WWW] += dest[IMM] * t[IMM][WWW];
 
-	  dest(WWW) = log_sum_exp (dest(WWW),
-				   dest(IMI) + imi_www);
+	dest[IDD] = dest[WWW] * t[WWW][IDD]
+	  + dest[WWX] * t[WWX][IDD]
+	  + dest[WXW] * t[WXW][IDD];
 
-	  dest(WXW) = log_sum_exp (dest(IDI) + idi_wxw,
-				   dest(IDM) + idm_wxw);
+	XYCell cell;
+	const LogProb offset = rowScale + lEmitCum[xpos] + rEmitCum[ypos];
+	for (size_t s = 0; s < cellStates; ++s) {
+	  rowMax = max (rowMax, dest[s]);
+	  if (dest[s] > 0)
+	    cell(s) = log (dest[s]) + offset;
 	}
+	storeCell (xpos, ypos, cell);
+      }
 
-	if (xpos > 0 && ypos > 0 && inEnvelope (xpos - 1, ypos - 1)) {
-	  const XYCell& lrSrc = xyCell (xpos - 1, ypos - 1);
-	  const LogProb lrEmitScore = logMatch (xpos, ypos);
-	  
-	  dest(IMM) = lrEmitScore + log_sum_exp (lrSrc(WWW) + www_imm,
-						 lrSrc(WWX) + wwx_imm,
-						 lrSrc(WXW) + wxw_imm,
-						 lrSrc(IDD) + idd_imm);
-
-	  dest(WWW) = log_sum_exp (dest(WWW),
-				   dest(IMM) + imm_www);
-	}
+    if (rowMax > 0) {
+      const double rowNorm = 1 / rowMax;
+      for (auto& c : curRow)
+	c *= rowNorm;
+      rowScale += log (rowMax);
+    }
 
-	dest(IDD) = log_sum_exp (dest(WWW) + www_idd,
-				 dest(WWX) + wwx_idd,
-				 dest(WXW) + wxw_idd);
-      }
+    swap (prevRow, curRow);
   }
 
   const XYCell& endCell = xyCell (xSize - 1, ySize - 1);
 
-  lpEnd = log_sum_exp (endCell(IDD) + idd_eee,
-		       endCell(WWW) + www_eee,
-		       endCell(WWX) + wwx_eee,
-		       endCell(WXW) + wxw_eee);
+  lpEnd = log_sum_exp (endCell(IDD) + trans[IDD][EEE],
+		       endCell(WWW) + trans[WWW][EEE],
+		       endCell(WWX) + trans[WWX][EEE],
+		       endCell(WXW) + trans[WXW][EEE]);
 
   if (LoggingThisAt(9))
     writeToLog(9);
@@ -1367,7 +1464,7 @@ AlignPath Sampler::SiblingMatrix::sample (random_engine& generator) const {
     const LogProb e = lpEmit (coords);
     map<CellCoords,LogProb> srcLogProb;
     for (src.state = 0; src.state < (unsigned int) EEE; ++src.state)
-      srcLogProb[src] = srcCell(src.state) + lpTransElimSelfLoopIDD ((State) src.state, (State) coords.state) + e;
+      srcLogProb[src] = srcCell(src.state) + trans[src.state][coords.state] + e;
 
     const double lpTot = log_sum_exp (extract_values (srcLogProb));
     Assert (SAMPLER_NEAR_EQ (lpTot, cell(coords)), "Traceback total (%g) doesn't match stored value (%g) at cell %s", lpTot, cell(coords), coords.toString().c_str());
@@ -1399,18 +1496,47 @@ LogProb Sampler::SiblingMatrix::logPostProb (const AlignPath& lrpPath) const {
       ++c.ypos;
     const State prevState = (State) c.state;
     c.state = getState (prevState, dl, dr, dp);
-    if (!inEnvelope (c.xpos, c.ypos))
+    // cells far below the maximum of their row may have underflowed in the linear-space fill
+    if (!inEnvelope (c.xpos, c.ypos) || cell(c) == -numeric_limits<double>::infinity())
       return -numeric_limits<double>::infinity();
-    lp += lpTransElimWait (prevState, (State) c.state) + lpEmit (c);
+    lp += transElimWait[prevState][c.state] + lpEmit (c);
     Assert (lp <= cell(c) * (1 - SAMPLER_EPSILON), "Positive posterior probability");
     lp = min (lp, cell(c));  // mitigate precision errors
   }
-  lp += lpTransElimWait ((State) c.state, EEE);
+  lp += transElimWait[c.state][EEE];
   Assert (lp <= lpEnd * (1 - SAMPLER_EPSILON), "Positive posterior probability");
   lp = min (lp, lpEnd);
   return lp - lpEnd;
 }
 
+void Sampler::SiblingMatrix::normEmissions (const vguard<LogProb>& emit, const vguard<LogProb>& subMax, vguard<LogProb>& emitCum, vguard<double>& insOdds, vguard<double>& matchOdds) {
+  emitCum = vguard<LogProb> (emit.size() + 1, 0);
+  insOdds = matchOdds = vguard<double> (emit.size() + 1, 0);
+  for (size_t pos = 1; pos <= emit.size(); ++pos) {
+    const LogProb norm = emit[pos-1] > -numeric_limits<double>::infinity() ? emit[pos-1] : 0;
+    emitCum[pos] = emitCum[pos-1] + norm;
+    insOdds[pos] = exp (emit[pos-1] - norm);
+    matchOdds[pos] = exp (subMax[pos-1] - norm);
+  }
+}
+
+void Sampler::SiblingMatrix::expRows (const PosWeightMatrix& sub, const vguard<vguard<LogProb> >* logRoot, vguard<double>& subExp, vguard<LogProb>& subMax) {
+  const size_t stride = sub.empty() ? 0 : sub[0].size() * sub[0][0].size();
+  subExp.resize (sub.size() * stride);
+  subMax = vguard<LogProb> (sub.size(), -numeric_limits<double>::infinity());
+  vguard<double> row (stride);
+  for (size_t pos = 0; pos < sub.size(); ++pos) {
+    size_t n = 0;
+    for (size_t cpt = 0; cpt < sub[pos].size(); ++cpt)
+      for (size_t tok = 0; tok < sub[pos][cpt].size(); ++tok, ++n) {
+	row[n] = sub[pos][cpt][tok] + (logRoot ? (*logRoot)[cpt][tok] : 0);
+	subMax[pos] = max (subMax[pos], row[n]);
+      }
+    for (n = 0; n < stride; ++n)
+      subExp[pos*stride + n] = subMax[pos] > -numeric_limits<double>::infinity() ? exp (row[n] - subMax[pos]) : 0;
+  }
+}
+
 LogProb Sampler::SiblingMatrix::lpEmit (const CellCoords& coords) const {
   switch ((State) coords.state) {
   case IMM: return coords.xpos > 0 && coords.ypos > 0 ? logMatch (coords.xpos, coords.ypos) : -numeric_limits<double>::infinity();
@@ -1607,15 +1733,19 @@ Sampler::PosWeightMatrix Sampler::SiblingMatrix::parentSeq (const AlignPath& lrp
 
 Sampler::Sampler (const RateModel& model, const SimpleTreePrior& treePrior, const vguard<FastSeq>& gappedGuide)
   : model (model),
+    tokenTable (model.alphabet),
     treePrior (treePrior),
     moveRate (Move::TotalMoveTypes, 1.),
+    initialMoveRate (Move::TotalMoveTypes, 1.),
     movesProposed (Move::TotalMoveTypes, 0),
     movesAccepted (Move::TotalMoveTypes, 0),
     moveNanosecs (Move::TotalMoveTypes, 0.),
     useFixedGuide (false),
     sampleAncestralSeqs (false),
     guide (gappedGuide),
-    maxDistanceFromGuide (DefaultMaxDistanceFromGuide)
+    maxDistanceFromGuide (DefaultMaxDistanceFromGuide),
+    stepsDone (0),
+    burnInDone (false)
 {
   for (AlignRowIndex r = 0; r < gappedGuide.size(); ++r) {
     const string& name = gappedGuide[r].name;
@@ -1675,9 +1805,10 @@ void Sampler::fixAlignment() {
   moveRate[Move::NodeAlign] = 0;
 }
 
-void Sampler::sample (random_engine& generator) {
-    // propose
+void Sampler::sample (random_engine& generator, bool logHistory) {
+    // propose. The tree index is built here, once per tree, so that proposals that keep the tree share it
     const std::chrono::system_clock::time_point before = std::chrono::system_clock::now();
+    currentHistory.treeIndex();
     const Move move = proposeMove (currentHistory, currentLogLikelihood, generator);
     const std::chrono::system_clock::time_point after = std::chrono::system_clock::now();
     moveNanosecs[move.type] += std::chrono::duration_cast<std::chrono::nanoseconds> (after - before).count();
@@ -1690,15 +1821,19 @@ void Sampler::sample (random_engine& generator) {
       Warn ("Move generated a non-ultrametric tree");
     
     // accept/reject
-    if (move.accept (generator)) {
+    const bool accepted = move.accept (generator);
+    if (accepted) {
       currentHistory = move.newHistory;
       currentLogLikelihood = move.newLogLikelihood;
       ++movesAccepted[move.type];
     }
 
     // log
-    for (auto& logger : loggers)
-      logger->logHistory (currentHistory);
+    if (logHistory) {
+      const Change noChange;
+      for (auto& logger : loggers)
+	logger->logHistory (currentHistory, currentLogLikelihood, accepted ? move.change : noChange);
+    }
 
     // keep track of best history
     if (move.newLogLikelihood > bestLogLikelihood) {
@@ -1708,24 +1843,117 @@ void Sampler::sample (random_engine& generator) {
     }
 }
 
-void Sampler::run (vguard<Sampler>& samplers, random_engine& generator, unsigned int nSamples) {
+void Sampler::adaptMoveRates() {
+  vguard<double> efficiency (Move::TotalMoveTypes, 0.);
+  double maxEfficiency = 0;
+  for (int t = 0; t < (int) Move::TotalMoveTypes; ++t)
+    if (initialMoveRate[t] > 0 && movesProposed[t] > 0 && moveNanosecs[t] > 0) {
+      // Laplace-smoothed acceptance probability over mean CPU time per proposal
+      const double acceptProb = (movesAccepted[t] + 1.) / (movesProposed[t] + 2.);
+      const double secsPerMove = moveNanosecs[t] / 1e9 / movesProposed[t];
+      efficiency[t] = acceptProb / secsPerMove;
+      maxEfficiency = max (maxEfficiency, efficiency[t]);
+    }
+  if (maxEfficiency <= 0)
+    return;
+  for (int t = 0; t < (int) Move::TotalMoveTypes; ++t)
+    if (initialMoveRate[t] > 0)
+      moveRate[t] = initialMoveRate[t] * (efficiency[t] > 0
+					  ? max (MinAdaptiveMoveRateFactor, efficiency[t] / maxEfficiency)
+					  : 1.);  // not tried yet
+  LogThisAt(6,"Adapted move rates (" << name << "): " << moveRates() << endl);
+}
+
+void Sampler::run (vguard<Sampler>& samplers, const random_engine& seedGenerator, unsigned int nSamples, unsigned int nBurnIn, bool adaptMoves, unsigned int checkpointInterval, const function<void()>& checkpoint) {
   ProgressLog (plog, 2);
   plog.initProgress ("MCMC sampling run");
 
   vguard<double> nodes;
-  for (const auto& sampler: samplers)
+  for (auto& sampler: samplers) {
     nodes.push_back (sampler.currentHistory.tree.nodes());
-  
-  for (unsigned int n = 0; n < nSamples; ++n) {
-    // print progress
-    plog.logProgress (n / (double) (nSamples - 1), "step %u/%u", n + 1, nSamples);
+    if (!sampler.stepsDone)  // a sampler restored from a checkpoint keeps its saved rates
+      sampler.initialMoveRate = sampler.moveRate;
+  }
 
-    // select a sampler, weighted by # of nodes
-    const size_t nSampler = random_index (nodes, generator);
-    LogThisAt(4,"Sampling dataset #" << nSampler+1 << ": " << samplers[nSampler].name << endl);
-    
-    // sample
-    samplers[nSampler].sample (generator);
+  // the scheduler and each sampler have separate random number streams,
+  // and each step of each sampler starts a fresh stream, so a sampler's moves
+  // do not depend on how the other samplers' steps are interleaved with it.
+  // The scheduler is run to completion up front, giving each sampler a budget of
+  // burn-in & sampling steps (proportional to its # of nodes, in expectation);
+  // the samplers then run independently, each on its own thread
+  random_engine scheduler = seedGenerator.stream (RNGStreamMCMC | RNGStreamDatasetMask);
+  const AliasSampler samplerChooser (nodes);
+  vguard<unsigned int> burnInSteps (samplers.size(), 0), sampleSteps (samplers.size(), 0);
+  const unsigned int nSteps = nBurnIn + nSamples;
+  const vguard<size_t> schedule = samplerChooser.sample (scheduler, nSteps);
+  for (unsigned int n = 0; n < nSteps; ++n)
+    ++(n < nBurnIn ? burnInSteps : sampleSteps) [schedule[n]];
+
+  for (size_t nSampler = 0; nSampler < samplers.size(); ++nSampler)
+    LogThisAt(4,"Sampling dataset #" << nSampler+1 << " (" << samplers[nSampler].name << "): "
+	      << plural(burnInSteps[nSampler],"burn-in step") << ", " << plural(sampleSteps[nSampler],"sampling step")
+	      << (samplers[nSampler].stepsDone ? (string(", resuming after ") + plural(samplers[nSampler].stepsDone,"step")) : string()) << endl);
+
+  // start the biggest budgets first, so small datasets fill in around them
+  vguard<size_t> order (samplers.size());
+  iota (order.begin(), order.end(), (size_t) 0);
+  stable_sort (order.begin(), order.end(), [&] (size_t a, size_t b) {
+      return burnInSteps[a] + sampleSteps[a] > burnInSteps[b] + sampleSteps[b];
+    });
+
+  // with checkpoints, the run is split into stages of checkpointInterval steps of the schedule,
+  // with all samplers pausing at the end of each stage so that the saved state is consistent.
+  // stageTarget[n] is the number of steps sampler #n has taken by the end of the current stage
+  vguard<unsigned int> stageTarget (samplers.size(), 0);
+  unsigned int initialStepsDone = 0;
+  for (const auto& sampler: samplers)
+    initialStepsDone += sampler.stepsDone;
+  atomic<unsigned int> totalStepsDone (initialStepsDone);
+
+  for (unsigned int stageEnd = 0; stageEnd < nSteps; ) {
+    const unsigned int stageStart = stageEnd;
+    stageEnd = checkpointInterval ? min (nSteps, stageStart + checkpointInterval) : nSteps;
+    for (unsigned int n = stageStart; n < stageEnd; ++n)
+      ++stageTarget[schedule[n]];
+
+    const unsigned int stageStepsDone = totalStepsDone;
+    taskPool.parallelFor (0, order.size(), [&] (size_t k) {
+	const size_t nSampler = order[k];
+	Sampler& sampler = samplers[nSampler];
+	const unsigned int nSamplerBurnIn = burnInSteps[nSampler], target = max (sampler.stepsDone, stageTarget[nSampler]);
+	while (true) {
+	  const unsigned int step = sampler.stepsDone;
+
+	  // end of burn-in: freeze move rates
+	  if (step == nSamplerBurnIn && !sampler.burnInDone && nBurnIn > 0 && nSamples > 0) {
+	    if (adaptMoves)
+	      sampler.adaptMoveRates();
+	    LogThisAt(2,"Move rates after burn-in (" << sampler.name << "): " << sampler.moveRates() << endl);
+	    for (auto& logger : sampler.loggers)
+	      logger->logMoveRates (sampler);
+	    sampler.burnInDone = true;
+	  }
+	  if (step >= target)
+	    break;
+
+	  // sample
+	  random_engine generator = seedGenerator.stream (RNGStreamMCMC | (nSampler & RNGStreamDatasetMask), 0, step);
+	  sampler.sample (generator, step >= nSamplerBurnIn);
+
+	  if (adaptMoves && step < nSamplerBurnIn && (step + 1) % DefaultMoveRateAdaptInterval == 0)
+	    sampler.adaptMoveRates();
+	  ++sampler.stepsDone;
+
+	  // print progress
+	  const unsigned int n = ++totalStepsDone;
+	  plog.logProgress (n / (double) nSteps, "step %u/%u", n, nSteps);
+	}
+      }, 1);
+
+    if (checkpointInterval && checkpoint && totalStepsDone > stageStepsDone) {
+      LogThisAt(3,"Saving checkpoint after " << plural((unsigned int) totalStepsDone,"step") << endl);
+      checkpoint();
+    }
   }
 
   // log stats
@@ -1733,6 +1961,53 @@ void Sampler::run (vguard<Sampler>& samplers, random_engine& generator, unsigned
     LogThisAt(1,"Dataset #" << nSampler+1 << " (" << samplers[nSampler].name << "):\n" << samplers[nSampler].moveStats());
 }
 
+void Sampler::saveState (CheckpointWriter& out) const {
+  out.writeString (name);
+  out.writeVarint (stepsDone);
+  out.writeBool (burnInDone);
+  out.writeTree (currentHistory.tree);
+  out.writeSeqs (currentHistory.gapped);
+  out.writeDouble (currentLogLikelihood);
+  out.writeTree (bestHistory.tree);
+  out.writeSeqs (bestHistory.gapped);
+  out.writeDouble (bestLogLikelihood);
+  out.writeDoubles (moveRate);
+  out.writeDoubles (initialMoveRate);
+  out.writeDoubles (moveNanosecs);
+  out.writeInts (movesProposed);
+  out.writeInts (movesAccepted);
+  for (auto& logger : loggers)
+    logger->saveState (out);
+}
+
+void Sampler::loadState (CheckpointReader& in) {
+  const string savedName = in.readString();
+  Require (savedName == name, "Checkpoint %s has dataset %s where %s was expected", in.filename.c_str(), savedName.c_str(), name.c_str());
+  stepsDone = in.readVarint();
+  burnInDone = in.readBool();
+  currentHistory.tree = in.readTree();
+  currentHistory.gapped = in.readSeqs();
+  currentHistory.clearAlignment();
+  currentHistory.clearTreeIndex();
+  currentLogLikelihood = in.readDouble();
+  bestHistory.tree = in.readTree();
+  bestHistory.gapped = in.readSeqs();
+  bestHistory.clearAlignment();
+  bestHistory.clearTreeIndex();
+  bestLogLikelihood = in.readDouble();
+  moveRate = in.readDoubles();
+  initialMoveRate = in.readDoubles();
+  moveNanosecs = in.readDoubles();
+  movesProposed = in.readInts();
+  movesAccepted = in.readInts();
+  Require (moveRate.size() == Move::TotalMoveTypes && initialMoveRate.size() == Move::TotalMoveTypes && moveNanosecs.size() == Move::TotalMoveTypes
+	   && movesProposed.size() == Move::TotalMoveTypes && movesAccepted.size() == Move::TotalMoveTypes,
+	   "Checkpoint %s has the wrong number of move types", in.filename.c_str());
+  currentHistory.assertNamesMatch();
+  for (auto& logger : loggers)
+    logger->loadState (in);
+}
+
 string Sampler::moveStats() const {
   ostringstream out;
   for (int t = 0; t < (int) Move::TotalMoveTypes; ++t)
@@ -1745,16 +2020,26 @@ string Sampler::moveStats() const {
   return out.str();
 }
 
+string Sampler::moveRates() const {
+  const double total = accumulate (moveRate.begin(), moveRate.end(), 0.);
+  ostringstream out;
+  for (int t = 0; t < (int) Move::TotalMoveTypes; ++t)
+    out << (t ? ", " : "") << Move::typeName ((Move::Type) t) << ": " << (total > 0 ? moveRate[t] / total : 0.);
+  return out.str();
+}
+
 string Sampler::sampleSeq (const PosWeightMatrix& profile, random_engine& generator) const {
+  // each position's distribution is used once, so an alias table would not pay for itself;
+  // draw by a single inverse-CDF scan, reusing one weight buffer
   string seq (profile.size(), Alignment::wildcardChar);
+  vguard<double> p (model.alphabetSize());
   for (SeqIdx pos = 0; pos < profile.size(); ++pos) {
     const LogProb norm = log_sum_exp (profile[pos]);
-    vguard<double> p (model.alphabetSize(), 0.);
+    fill (p.begin(), p.end(), 0.);
     for (int cpt = 0; cpt < model.components(); ++cpt)
       for (AlphTok tok = 0; tok < model.alphabetSize(); ++tok)
 	p[tok] += exp (profile[pos][cpt][tok] - norm);
-    discrete_distribution<AlphTok> tokDistrib (p.begin(), p.end());
-    seq[pos] = model.alphabet[tokDistrib(generator)];
+    seq[pos] = model.alphabet[min (random_index (p, generator), p.size() - 1)];
   }
   return seq;
 }
@@ -1763,10 +2048,9 @@ LogProb Sampler::logSeqPostProb (const string& seq, const PosWeightMatrix& profi
   Assert (seq.size() == profile.size(), "Sequence length (%d) does not match profile (%d)", seq.size(), profile.size());
   LogProb lp = 0;
   for (SeqIdx pos = 0; pos < profile.size(); ++pos) {
-    const char c = seq[pos];
-    if (!Alignment::isWildcard(c)) {
-      const UnvalidatedAlphTok tok = model.tokenize (c);
-      if (tok < 0)
+    const CompactTok tok = tokenTable (seq[pos]);
+    if (tok != CompactTokWildcard) {
+      if (!compactTokValid (tok))
 	return -numeric_limits<double>::infinity();
       const LogProb norm = log_sum_exp (profile[pos]);
       double lpTok = -numeric_limits<double>::infinity();
@@ -2,11 +2,19 @@
 #define SAMPLER_INCLUDED
 
 #include <iomanip>
+#include <memory>
 #include "model.h"
 #include "tree.h"
 #include "fastseq.h"
 #include "forward.h"
 #include "logger.h"
+#include "checkpoint.h"
+
+// Adaptive move scheduling during burn-in: every few steps, the rate of each move type is
+// reset to its initial rate, scaled by its smoothed acceptance rate per CPU second
+// (relative to the best move type, but not below MinAdaptiveMoveRateFactor)
+#define DefaultMoveRateAdaptInterval 20
+#define MinAdaptiveMoveRateFactor .01
 
 struct SimpleTreePrior {
   double populationSize;
@@ -19,16 +27,29 @@ struct TreeAlignFuncs {
   typedef vguard<vguard<vguard<LogProb> > > PosWeightMatrix;  // pwm[pos][cpt][tok]
 
   // TreeAlignFuncs::History
+  // The alignment path & ungapped sequences are kept alongside the gapped strings,
+  // so that moves need not re-parse the gapped strings. Histories built from a path
+  // carry it from the start; otherwise it is parsed from the gapped strings on first use.
+  // Copies share it. Code that modifies gapped in place must call clearAlignment().
   struct History {
     vguard<FastSeq> gapped;
     Tree tree;
     History() { }
     History (const vguard<FastSeq>& g, const Tree& t) : gapped(g), tree(t) { }
+    History (const vguard<FastSeq>& ungapped, const AlignPath& path, const Tree& t);
     History reorder (const vguard<TreeNodeIndex>& newOrder) const;
     void assertNamesMatch() const;
+    const Alignment& alignment() const;
+    void clearAlignment() { align.reset(); }
+    const TreeIndex& treeIndex() const;
+    void clearTreeIndex() { index.reset(); }
+    void copyTreeIndex (const History& h) { index = h.index; }  // h must have the same tree
+  private:
+    mutable shared_ptr<const Alignment> align;
+    mutable shared_ptr<const TreeIndex> index;
   };
 
-  static map<TreeNodeIndex,PosWeightMatrix> getConditionalPWMs (const RateModel& model, const Tree& tree, const vguard<FastSeq>& gapped, const map<TreeNodeIndex,TreeNodeIndex>& exclude, const set<TreeNodeIndex>& fillUpNodes, const set<TreeNodeIndex>& fillDownNodes, bool normalize = true);
+  static map<TreeNodeIndex,PosWeightMatrix> getConditionalPWMs (const RateModel& model, const Tree& tree, const vguard<FastSeq>& gapped, const map<TreeNodeIndex,TreeNodeIndex>& exclude, const TreeNodeSet& fillUpNodes, const TreeNodeSet& fillDownNodes, bool normalize = true);
 
   static string branchConditionalDump (const RateModel& model, const Tree& tree, const vguard<FastSeq>& gapped, TreeNodeIndex parent, TreeNodeIndex node);
 
@@ -41,14 +62,10 @@ struct TreeAlignFuncs {
 
   static bool subpathUngapped (const AlignPath& path, const vguard<TreeNodeIndex>& nodes);
   
-  static set<TreeNodeIndex> allNodes (const Tree& tree);
-  static set<TreeNodeIndex> allExceptNodeAndAncestors (const Tree& tree, TreeNodeIndex node);
-  static set<TreeNodeIndex> nodeAndAncestors (const Tree& tree, TreeNodeIndex node);
-  static set<TreeNodeIndex> nodesAndAncestors (const Tree& tree, TreeNodeIndex node1, TreeNodeIndex node2);
 
   static vguard<SeqIdx> getGuideSeqPos (const AlignPath& path, AlignRowIndex row, AlignRowIndex guideRow);
 
-  static LogProb logBranchPathLikelihood (const ProbModel& probModel, const AlignPath& path, TreeNodeIndex parent, TreeNodeIndex child);
+  static LogProb logBranchPathLikelihood (const IndelProbModel& probModel, const AlignPath& path, TreeNodeIndex parent, TreeNodeIndex child);
   static double rootExtProb (const RateModel& model) { return model.insExtProb; }
   static vguard<LogProb> calcInsProbs (const PosWeightMatrix& child, const vguard<LogProbModel::LogProbVector>& insvec, const vguard<LogProb>& logCptWeight);
 
@@ -111,6 +128,10 @@ struct TreeAlignFuncs {
 
     // cell accessors
     inline XYCell& xyCell (SeqIdx xpos, SeqIdx ypos) { return cellStorage[xpos][ypos]; }
+    // store a cell computed elsewhere; cells of a row must be stored in increasing ypos order
+    inline void storeCell (SeqIdx xpos, SeqIdx ypos, const XYCell& c) {
+      cellStorage[xpos].emplace_hint (cellStorage[xpos].end(), ypos, c);
+    }
     inline const XYCell& xyCell (SeqIdx xpos, SeqIdx ypos) const {
       const auto& column = cellStorage[xpos];
       auto iter = column.find(ypos);
@@ -237,7 +258,7 @@ struct Sampler : TreeAlignFuncs {
     const LogProbModel lLogProbModel, rLogProbModel;
     const vguard<vguard<LogProb> > logRoot;  // log(cptWeight) factored in
     
-    // Transition log-probabilities.
+    // Transition log-probabilities, as a dense table: trans[src][dest], -inf where there is no transition.
     // The null cycle idd->wxx->idd is prevented by eliminating the state wxx.
     // The outgoing transitions from wxx are folded into outgoing transitions from idd.
     // The self-transition from idd is also eliminated, and factored into outgoing transitions.
@@ -245,17 +266,18 @@ struct Sampler : TreeAlignFuncs {
     // Forward fill order: {emit states}, {www,wwx,wxw}, idd.
     // (35 transitions)
     //  To:     imm      imd      idm      idd      w**      imi      iiw      idi      iix      eee
-    LogProb                                     imm_www, imm_imi, imm_iiw;
-    LogProb                                     imd_wwx,                            imd_iix;
-    LogProb                                     idm_wxw,                   idm_idi;
-    LogProb idd_imm, idd_imd, idd_idm,                                                       idd_eee;
-    LogProb www_imm, www_imd, www_idm, www_idd,                                              www_eee;
-    LogProb wwx_imm, wwx_imd, wwx_idm, wwx_idd,                                              wwx_eee;
-    LogProb wxw_imm, wxw_imd, wxw_idm, wxw_idd,                                              wxw_eee;
-    LogProb                                     imi_www, imi_imi, imi_iiw;
-    LogProb                                     iiw_www,          iiw_iiw;
-    LogProb                                     idi_wxw,                   idi_idi;
-    LogProb                                     iix_wwx,                            iix_iix;
+    //  imm                                         www,     imi,     iiw
+    //  imd                                         wwx,                               iix
+    //  idm                                         wxw,                      idi
+    //  idd     imm,     imd,     idm,                                                          eee
+    //  www     imm,     imd,     idm,     idd,                                                 eee
+    //  wwx     imm,     imd,     idm,     idd,                                                 eee
+    //  wxw     imm,     imd,     idm,     idd,                                                 eee
+    //  imi                                         www,     imi,     iiw
+    //  iiw                                         www,              iiw
+    //  idi                                         wxw,                      idi
+    //  iix                                         wwx,                               iix
+    LogProb trans[EEE+1][EEE+1];
 
     // This is 1.371* faster (48/35) but 1.375* fatter (11/8) than with w** eliminated:
     // (48 transitions)
@@ -268,10 +290,20 @@ struct Sampler : TreeAlignFuncs {
     //    LogProb iiw_imm, iiw_imd, iiw_idm, iiw_idd,          iiw_iiw,                   iiw_eee;
     //    LogProb idi_imm, idi_imd, idi_idm, idi_idd,                   idi_idi,          idi_eee;
     //    LogProb iix_imm, iix_imd, iix_idm, iix_idd,                            iix_iix, iix_eee;
+
+    // Transitions with the wait states also eliminated, as used to score a given path
+    LogProb transElimWait[EEE+1][EEE+1];
     
     AlignRowIndex lRow, rRow, pRow;
     const PosWeightMatrix lSub, rSub;
     const vguard<LogProb> lEmit, rEmit;
+
+    // Match emissions in linear space, for a dot product per cell instead of a log-sum-exp per residue.
+    // lSubExp[pos*subStride + cpt*alphabetSize + tok] = exp(lSub[pos][cpt][tok] - lSubMax[pos]), and likewise
+    // for rSubExp, with logRoot folded in
+    const size_t subStride;
+    vguard<double> lSubExp, rSubExp;
+    vguard<LogProb> lSubMax, rSubMax;
     
     SiblingMatrix (const RateModel& model, const PosWeightMatrix& lSeq, const PosWeightMatrix& rSeq, TreeBranchLength plDist, TreeBranchLength prDist, const GuideAlignmentEnvelope& env, const vguard<SeqIdx>& lEnvPos, const vguard<SeqIdx>& rEnvPos, AlignRowIndex lRow, AlignRowIndex rRow, AlignRowIndex pRow);
 
@@ -314,19 +346,57 @@ struct Sampler : TreeAlignFuncs {
     inline LogProb rNoInsExt() const { return log (1 - rProbModel.insExt); }
     inline LogProb rNoDelExt() const { return log (1 - rProbModel.delExt); }
 
+    // match emission for cell (xpos,ypos), divided by exp(lSubMax[xpos-1] + rSubMax[ypos-1])
+    inline double matchDot (SeqIdx xpos, SeqIdx ypos) const {
+      const double* l = lSubExp.data() + (xpos - 1) * subStride;
+      const double* r = rSubExp.data() + (ypos - 1) * subStride;
+      // independent partial sums, so the compiler can vectorize without reassociating
+      double p0 = 0, p1 = 0, p2 = 0, p3 = 0;
+      size_t n = 0;
+      for (; n + 4 <= subStride; n += 4) {
+	p0 += l[n] * r[n];
+	p1 += l[n+1] * r[n+1];
+	p2 += l[n+2] * r[n+2];
+	p3 += l[n+3] * r[n+3];
+      }
+      for (; n < subStride; ++n)
+	p0 += l[n] * r[n];
+      return (p0 + p1) + (p2 + p3);
+    }
+
     inline LogProb logMatch (SeqIdx xpos, SeqIdx ypos) const {
-      LogProb lp = -numeric_limits<double>::infinity();
-      for (int cpt = 0; cpt < model.components(); ++cpt)
-	log_accum_exp (lp, logInnerProduct (logRoot[cpt], lSub[xpos-1][cpt], rSub[ypos-1][cpt]));
-      return lp;
+      return lSubMax[xpos-1] + rSubMax[ypos-1] + log (matchDot (xpos, ypos));
     }
 
+    static void expRows (const PosWeightMatrix& sub, const vguard<vguard<LogProb> >* logRoot, vguard<double>& subExp, vguard<LogProb>& subMax);
+
+    // Insert emissions, divided out of the linear-space Forward fill.
+    // emitCum[pos] = sum of the (finite) emit[i] for i < pos;
+    // insOdds[pos] = exp(emit[pos-1]) and matchOdds[pos] = exp(subMax[pos-1]), each divided by that factor
+    static void normEmissions (const vguard<LogProb>& emit, const vguard<LogProb>& subMax, vguard<LogProb>& emitCum, vguard<double>& insOdds, vguard<double>& matchOdds);
+
     LogProb lpEmit (const CellCoords& coords) const;
   };
 
+  // Sampler::Change
+  // What one step changed, so that loggers need only revisit the affected nodes & rows
+  struct Change {
+    bool all;  // anything may have changed; the other fields are then ignored
+    bool tree, topology, alignment;  // tree = any node's parent, children or branch length
+    vguard<TreeNodeIndex> oldNode;  // oldNode[n] = index of node n before the step, if nodes were renumbered; empty otherwise
+    TreeNodeSet realigned;  // rows whose alignment to the other rows may have changed; two rows outside this set keep their pairwise alignment
+    Change (bool all = false) : all(all), tree(all), topology(all), alignment(all) { }
+    TreeNodeIndex previous (TreeNodeIndex n) const { return oldNode.empty() || n < 0 ? n : oldNode[n]; }
+    void renumber (const vguard<TreeNodeIndex>& newOrder);
+  };
+
   // Sampler::Logger
   struct Logger {
-    virtual void logHistory (const History& history) = 0;
+    virtual ~Logger() { }
+    virtual void logHistory (const History& history, LogProb logLikelihood, const Change& change) = 0;
+    virtual void logMoveRates (const Sampler& sampler) { }  // called when adapted rates are frozen
+    virtual void saveState (CheckpointWriter& out) { }  // for loggers that must resume where they left off
+    virtual void loadState (CheckpointReader& in) { }
   };
   
   // Sampler::Move
@@ -335,6 +405,7 @@ struct Sampler : TreeAlignFuncs {
     Type type;
     TreeNodeIndex node, parent, leftChild, rightChild, oldGrandparent, newGrandparent, oldSibling, newSibling;  // no single type of move uses all of these
     History oldHistory, newHistory;
+    Change change;  // from oldHistory to newHistory
     LogProb logForwardProposal, logReverseProposal, logJacobian, oldLogLikelihood, newLogLikelihood, logAcceptProb;
     bool nullified;
     string samplerName, comment;
@@ -344,6 +415,7 @@ struct Sampler : TreeAlignFuncs {
     
     void initNewHistory (const Tree& tree, const vguard<FastSeq>& ungapped, const AlignPath& path);
     void initNewHistory (const Tree& tree, const vguard<FastSeq>& gapped);
+    void initNewHistory (const Tree& tree);  // same alignment as oldHistory
     void initRatio (const Sampler& sampler);
     void nullify (const char* reason);
     bool accept (random_engine& generator) const;
@@ -374,9 +446,10 @@ struct Sampler : TreeAlignFuncs {
 
   // Sampler member variables
   const RateModel& model;
+  const TokenTable tokenTable;
   const SimpleTreePrior& treePrior;
   list<Logger*> loggers;
-  vguard<double> moveRate, moveNanosecs;
+  vguard<double> moveRate, initialMoveRate, moveNanosecs;
   vguard<int> movesProposed, movesAccepted;
   bool useFixedGuide, sampleAncestralSeqs;
   const Alignment guide;
@@ -387,6 +460,8 @@ struct Sampler : TreeAlignFuncs {
   History currentHistory, bestHistory;
   LogProb currentLogLikelihood, bestLogLikelihood;
   bool isUltrametric;
+  unsigned int stepsDone;  // steps taken by run()
+  bool burnInDone;  // true once move rates have been frozen
   
   // Sampler constructor
   Sampler (const RateModel& model, const SimpleTreePrior& treePrior, const vguard<FastSeq>& gappedGuide);
@@ -404,12 +479,24 @@ struct Sampler : TreeAlignFuncs {
   
   Move proposeMove (const History& oldHistory, LogProb oldLogLikelihood, random_engine& generator) const;
 
-  void sample (random_engine& generator);
-  
-  static void run (vguard<Sampler>& samplers, random_engine& generator, unsigned int nSamples = 1);
+  void sample (random_engine& generator, bool logHistory = true);
+  void adaptMoveRates();  // re-weight move types by accepted moves per CPU second
+
+  // each sampler draws from its own stream of seedGenerator.
+  // The first nBurnIn steps are not logged; if adaptMoves is set, move rates are adapted
+  // during burn-in and then frozen (so the sampling phase is a fixed, reversible kernel).
+  // If checkpointInterval is nonzero, the samplers pause every checkpointInterval steps (in total)
+  // and checkpoint() is called. Samplers restored by loadState() continue from their saved step
+  static void run (vguard<Sampler>& samplers, const random_engine& seedGenerator, unsigned int nSamples = 1, unsigned int nBurnIn = 0, bool adaptMoves = false,
+		   unsigned int checkpointInterval = 0, const function<void()>& checkpoint = function<void()>());
+
+  // Sampler checkpoint methods: the full state, including that of the loggers
+  void saveState (CheckpointWriter& out) const;
+  void loadState (CheckpointReader& in);
 
   // Sampler summary methods
   string moveStats() const;
+  string moveRates() const;
   
   // Sampler helpers
   static TreeNodeIndex randomInternalNode (const Tree& tree, random_engine& generator);
@@ -425,7 +512,7 @@ struct Sampler : TreeAlignFuncs {
   vguard<SeqIdx> guideSeqPos (const AlignPath& path, AlignRowIndex row, AlignRowIndex fixedGuideRow) const;
   vguard<SeqIdx> guideSeqPos (const AlignPath& path, AlignRowIndex row, AlignRowIndex variableGuideRow, AlignRowIndex fixedGuideRow) const;
 
-  inline map<TreeNodeIndex,PosWeightMatrix> getConditionalPWMs (const Tree& tree, const vguard<FastSeq>& gapped, const map<TreeNodeIndex,TreeNodeIndex>& exclude, const set<TreeNodeIndex>& fillUpNodes, const set<TreeNodeIndex>& fillDownNodes) const {
+  inline map<TreeNodeIndex,PosWeightMatrix> getConditionalPWMs (const Tree& tree, const vguard<FastSeq>& gapped, const map<TreeNodeIndex,TreeNodeIndex>& exclude, const TreeNodeSet& fillUpNodes, const TreeNodeSet& fillDownNodes) const {
     return TreeAlignFuncs::getConditionalPWMs (model, tree, gapped, exclude, fillUpNodes, fillDownNodes);
   }
 
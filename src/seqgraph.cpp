@@ -1,9 +1,12 @@
 #include <algorithm>
+#include <unordered_map>
 #include "seqgraph.h"
 #include "util.h"
 #include "logger.h"
 
-SeqGraph::SeqGraph (const Profile& prof, const string& alphabet, const vguard<LogProb>& logCptWeight, const vguard<vguard<LogProb> >& logInsProb, double minPostProb) {
+SeqGraph::SeqGraph (const Profile& prof, const string& alphabet, const vguard<LogProb>& logCptWeight, const vguard<vguard<LogProb> >& logInsProb, double minPostProb)
+  : maxNullEliminationEdges (DefaultMaxNullEliminationEdges)
+{
   const LogProb minLogPostProb = log (minPostProb);
   vguard<vguard<NodeIndex> > stateNodes (prof.size());
   for (ProfileStateIndex s = 0; s < prof.size(); ++s)
@@ -32,15 +35,42 @@ SeqGraph::SeqGraph (const Profile& prof, const string& alphabet, const vguard<Lo
   for (const auto& trans : prof.trans)
     for (auto s : stateNodes[trans.src])
       for (auto d : stateNodes[trans.dest])
-	edge.insert (Edge (s, d));
+	edge.push_back (Edge (s, d));
   buildIndices();
 }
 
 void SeqGraph::buildIndices() {
+  const size_t nNodes = nodes();
+  // sort edges by (src,dest) with two counting sorts: by dest, then stably by src
+  vguard<size_t> count (nNodes + 1);
+  vguard<Edge> sorted (edge.size(), Edge (0, 0));
+  for (int pass = 0; pass < 2; ++pass) {
+    fill (count.begin(), count.end(), 0);
+    for (const auto& e : edge)
+      ++count[(pass ? e.src : e.dest) + 1];
+    for (size_t n = 0; n < nNodes; ++n)
+      count[n+1] += count[n];
+    for (const auto& e : edge)
+      sorted[count[pass ? e.src : e.dest]++] = e;
+    edge.swap (sorted);
+  }
+  edge.erase (unique (edge.begin(), edge.end()), edge.end());
+
+  outStart = vguard<size_t> (nNodes + 1, 0);
+  inStart = vguard<size_t> (nNodes + 1, 0);
   for (const auto& e : edge) {
-    node[e.src].out.push_back (e);
-    node[e.dest].in.push_back (e);
+    ++outStart[e.src + 1];
+    ++inStart[e.dest + 1];
+  }
+  for (size_t n = 0; n < nNodes; ++n) {
+    outStart[n+1] += outStart[n];
+    inStart[n+1] += inStart[n];
   }
+  inSrc = vguard<NodeIndex> (edge.size());
+  vguard<size_t> inNext (inStart.begin(), inStart.end() - 1);
+  for (const auto& e : edge)
+    inSrc[inNext[e.dest]++] = e.src;
+
   LogThisAt(3,"Sequence graph has " << plural(nodes(),"node") << " and " << plural(edges(),"edge") << endl);
   assertToposort();
 }
@@ -61,200 +91,206 @@ void SeqGraph::assertToposort() const {
   }
 }
 
-vguard<SeqGraph::NodeIndex> SeqGraph::nodeIndices() const {
-  vguard<NodeIndex> nl (nodes());
-  iota (nl.begin(), nl.end(), 0);
-  return nl;
+vguard<SeqGraph::NodeIndex> SeqGraph::identityRedirect() const {
+  vguard<NodeIndex> redirect (nodes());
+  iota (redirect.begin(), redirect.end(), 0);
+  return redirect;
 }
 
-vguard<SeqGraph::NodeIndex> SeqGraph::reverseNodeIndices() const {
-  auto nl = nodeIndices();
-  reverse (nl.begin(), nl.end());
-  return nl;
+void SeqGraph::compact (const vguard<bool>& keep, const vguard<NodeIndex>& redirect) {
+  vguard<NodeIndex> old2new (nodes());
+  NodeIndex nKept = 0;
+  for (NodeIndex n = 0; n < nodes(); ++n)
+    if (keep[n]) {
+      old2new[n] = nKept;
+      if (nKept != n)
+	node[nKept] = move (node[n]);
+      ++nKept;
+    }
+  size_t nEdges = 0;
+  for (const auto& e : edge) {
+    const NodeIndex dest = redirect[e.dest];
+    if (keep[e.src] && keep[dest])
+      edge[nEdges++] = Edge (old2new[e.src], old2new[dest]);
+  }
+  node.resize (nKept);
+  edge.resize (nEdges, Edge (0, 0));
+  buildIndices();
 }
 
-SeqGraph SeqGraph::eliminateNull() const {
-  map<NodeIndex,set<Edge> > elim;
-  set<Edge> keep;
-  for (auto src : reverseNodeIndices()) {
-    set<Edge> srcOut;
-    for (auto& e : node[src].out)
-      if (elim.count (e.dest))
-	for (auto& e2 : elim[e.dest])
-	  srcOut.insert (Edge (src, e2.dest));
+void SeqGraph::eliminateNull() {
+  // Visit nodes in reverse topological order, replacing each edge into an eliminated null node
+  // with edges to that node's (already expanded) successors.
+  // A null node with a in-edges and b out-edges turns a+b edges into a*b, so keep it if that adds too many.
+  const NodeIndex none = nodes();
+  vguard<bool> keep (nodes(), true);
+  vguard<vguard<NodeIndex> > elimDest (nodes());
+  vguard<NodeIndex> lastSrc (nodes(), none);
+  vguard<Edge> keptEdges;
+  vguard<NodeIndex> srcOut;
+  size_t nElim = 0, nNullKept = 0;
+  for (NodeIndex src = nodes(); src-- > 0; ) {
+    srcOut.clear();
+    auto addOut = [&] (NodeIndex d) {
+      if (lastSrc[d] != src) {
+	lastSrc[d] = src;
+	srcOut.push_back (d);
+      }
+    };
+    for (size_t i = outStart[src]; i < outStart[src+1]; ++i) {
+      const NodeIndex dest = edge[i].dest;
+      if (keep[dest])
+	addOut (dest);
       else
-	srcOut.insert (e);
-    if (node[src].isNull())
-      elim[src] = srcOut;
-    else
-      keep.insert (srcOut.begin(), srcOut.end());
+	for (auto d : elimDest[dest])
+	  addOut (d);
+    }
+    const size_t in = inDegree(src), out = srcOut.size();
+    if (node[src].isNull() && in * out <= in + out + maxNullEliminationEdges) {
+      keep[src] = false;
+      elimDest[src] = srcOut;
+      ++nElim;
+    } else {
+      if (node[src].isNull())
+	++nNullKept;
+      for (auto d : srcOut)
+	keptEdges.push_back (Edge (src, d));
+    }
   }
-  SeqGraph g;
-  if (elim.empty())
-    g = *this;
-  else {
-    map<NodeIndex,NodeIndex> old2new;
-    for (auto n : nodeIndices())
-      if (!node[n].isNull()) {
-	old2new[n] = g.node.size();
-	g.node.push_back (Node());
-	g.node.back().seq = node[n].seq;
-      }
-    for (const auto& e : keep)
-      g.edge.insert (Edge (old2new.at(e.src), old2new.at(e.dest)));
-    LogThisAt(3,"Eliminated " << plural(nodes() - g.nodes(),"null node") << endl);
-    g.buildIndices();
+  if (nNullKept)
+    LogThisAt(3,"Kept " << plural(nNullKept,"null node") << " whose elimination would add more than " << plural(maxNullEliminationEdges,"edge") << endl);
+  if (nElim) {
+    LogThisAt(3,"Eliminated " << plural(nElim,"null node") << endl);
+    edge.swap (keptEdges);
+    compact (keep, identityRedirect());
   }
-  return g;
 }
 
-SeqGraph SeqGraph::eliminateDuplicates() const {
-
-  struct SeqGraphNodeSummary {
-    string seq;
-    set<NodeIndex> dest;
-    SeqGraphNodeSummary (const Node& node, const map<NodeIndex,NodeIndex>& equiv)
-      : seq (node.seq)
-    {
-      for (const auto& e : node.out)
-	dest.insert (equiv.count(e.dest) ? equiv.at(e.dest) : e.dest);
-    }
-    bool operator== (const SeqGraphNodeSummary& summ) const {
-      return seq == summ.seq && dest == summ.dest;
-    }
-    bool operator< (const SeqGraphNodeSummary& summ) const {
-      return seq == summ.seq ? (dest < summ.dest) : (seq < summ.seq);
+void SeqGraph::eliminateDuplicates() {
+  // nodes are duplicates if they have the same sequence & the same successors (after merging duplicate successors)
+  vguard<bool> keep (nodes(), true);
+  vguard<NodeIndex> equiv = identityRedirect();
+  unordered_map<string,NodeIndex> unique;
+  const NodeIndex none = nodes();
+  vguard<NodeIndex> lastSrc (nodes(), none), dest;
+  size_t nElim = 0;
+  for (NodeIndex n = nodes(); n-- > 0; ) {
+    dest.clear();
+    for (size_t i = outStart[n]; i < outStart[n+1]; ++i) {
+      const NodeIndex d = equiv[edge[i].dest];
+      if (lastSrc[d] != n) {
+	lastSrc[d] = n;
+	dest.push_back (d);
+      }
     }
-    string str() const {
-      return seq + " " + to_string_join (dest);
+    sort (dest.begin(), dest.end());
+    string key = node[n].seq;
+    key.push_back ('\0');
+    key.append ((const char*) dest.data(), dest.size() * sizeof(NodeIndex));
+    const auto iter_inserted = unique.insert (make_pair (key, n));
+    if (!iter_inserted.second) {
+      equiv[n] = iter_inserted.first->second;
+      keep[n] = false;
+      ++nElim;
     }
-  };
-
-  map<NodeIndex,NodeIndex> equiv, old2new;
-  map<SeqGraphNodeSummary,NodeIndex> unique;
-  for (auto n : reverseNodeIndices()) {
-    const SeqGraphNodeSummary summ (node[n], equiv);
-    if (unique.count(summ))
-      equiv[n] = unique[summ];
-    else
-      unique[summ] = n;
   }
-  SeqGraph g;
-  if (equiv.empty())
-    g = *this;
-  else {
-    for (auto n : nodeIndices())
-      if (!equiv.count(n)) {
-	old2new[n] = g.node.size();
-	g.node.push_back (Node());
-	g.node.back().seq = node[n].seq;
-      }
-    for (auto& e : edge)
-      if (old2new.count(e.src))
-	g.edge.insert (Edge (old2new.at(e.src),
-			     old2new.at (equiv.count(e.dest) ? equiv.at(e.dest) : e.dest)));
-    LogThisAt(3,"Eliminated " << plural(nodes() - g.nodes(),"duplicate node") << endl);
-    g.buildIndices();
+  if (nElim) {
+    LogThisAt(3,"Eliminated " << plural(nElim,"duplicate node") << endl);
+    compact (keep, equiv);
   }
-  return g;
 }
 
-SeqGraph SeqGraph::collapseChains() const {
-  map<NodeIndex,NodeIndex> chainEnd, old2new;
-  map<NodeIndex,string> chainSeq;
-  set<NodeIndex> elim;
+void SeqGraph::collapseChains() {
+  // a node with one successor, which in turn has one predecessor, is merged into that successor
+  const NodeIndex none = nodes();
+  vguard<bool> keep (nodes(), true);
+  vguard<NodeIndex> chainEnd (nodes(), none), chainStart (nodes(), none);
+  size_t nElim = 0;
   NodeIndex dest;
-  for (auto n : reverseNodeIndices())
-    if (node[n].out.size() == 1
-	&& chainEnd.count(dest = node[n].out.front().dest)
-	&& node[dest].in.size() == 1) {
-      chainEnd[n] = chainEnd.at(dest);
-      chainSeq[chainEnd[n]] = node[n].seq + chainSeq[chainEnd[n]];
-      elim.insert (n);
-    } else if (node[n].in.size() == 1) {
+  for (NodeIndex n = nodes(); n-- > 0; )
+    if (outDegree(n) == 1
+	&& chainEnd[dest = edge[outStart[n]].dest] != none
+	&& inDegree(dest) == 1) {
+      chainEnd[n] = chainEnd[dest];
+      chainStart[chainEnd[n]] = n;
+      keep[n] = false;
+      ++nElim;
+    } else if (inDegree(n) == 1)
       chainEnd[n] = n;
-      chainSeq[n] = node[n].seq;
-    }
-  SeqGraph g;
-  if (elim.empty())
-    g = *this;
-  else {
-    for (auto n : nodeIndices())
-      if (!elim.count(n)) {
-	old2new[n] = g.node.size();
-	g.node.push_back (Node());
-	g.node.back().seq = chainSeq.count(n) ? chainSeq.at(n) : node[n].seq;
+  if (nElim) {
+    for (NodeIndex n = 0; n < nodes(); ++n)
+      if (chainStart[n] != none) {
+	string seq;
+	for (NodeIndex c = chainStart[n]; c != n; c = edge[outStart[c]].dest)
+	  seq += node[c].seq;
+	node[n].seq = seq + node[n].seq;
       }
-    for (auto& e : edge)
-      if (old2new.count (e.src))
-	g.edge.insert (Edge (old2new.at(e.src),
-			     old2new.at (chainEnd.count(e.dest) ? chainEnd.at(e.dest) : e.dest)));
-    LogThisAt(3,"Eliminated " << plural(nodes() - g.nodes(),"chained node") << endl);
-    g.buildIndices();
+    vguard<NodeIndex> redirect = identityRedirect();
+    for (NodeIndex n = 0; n < nodes(); ++n)
+      if (chainEnd[n] != none)
+	redirect[n] = chainEnd[n];
+    LogThisAt(3,"Eliminated " << plural(nElim,"chained node") << endl);
+    compact (keep, redirect);
   }
-  return g;
 }
 
-SeqGraph SeqGraph::mergeCharClasses() const {
-
-  struct SeqGraphNodeSummary {
-    set<NodeIndex> src, dest;
-    SeqGraphNodeSummary (const Node& node, const map<NodeIndex,NodeIndex>& equiv)
-    {
-      for (const auto& e : node.in)
-	src.insert (equiv.count(e.src) ? equiv.at(e.src) : e.src);
-      for (const auto& e : node.out)
-	dest.insert (equiv.count(e.dest) ? equiv.at(e.dest) : e.dest);
-    }
-    bool operator== (const SeqGraphNodeSummary& summ) const {
-      return src == summ.src && dest == summ.dest;
-    }
-    bool operator< (const SeqGraphNodeSummary& summ) const {
-      return src == summ.src ? (dest < summ.dest) : (src < summ.src);
-    }
-    string str() const {
-      return to_string_join (src) + " " + to_string_join (dest);
-    }
-  };
-
-  map<NodeIndex,NodeIndex> equiv, old2new;
-  map<SeqGraphNodeSummary,NodeIndex> classRep;
-  map<NodeIndex,string> classChars;
-  for (auto n : reverseNodeIndices())
+void SeqGraph::mergeCharClasses() {
+  // single-character nodes with the same predecessors & successors are merged into one character class
+  vguard<bool> keep (nodes(), true);
+  vguard<NodeIndex> equiv = identityRedirect();
+  unordered_map<string,NodeIndex> classRep;
+  unordered_map<NodeIndex,string> classChars;
+  const NodeIndex none = nodes();
+  vguard<NodeIndex> lastSrc (nodes(), none), lastDest (nodes(), none), src, dest;
+  size_t nElim = 0;
+  for (NodeIndex n = nodes(); n-- > 0; )
     if (node[n].seq.size() == 1) {
-      const SeqGraphNodeSummary summ (node[n], equiv);
-      if (classRep.count(summ)) {
-	equiv[n] = classRep[summ];
-	classChars[classRep[summ]] = node[n].seq + classChars[classRep[summ]];
-      } else {
-	classRep[summ] = n;
+      src.clear();
+      for (size_t i = inStart[n]; i < inStart[n+1]; ++i) {
+	const NodeIndex s = equiv[inSrc[i]];
+	if (lastSrc[s] != n) {
+	  lastSrc[s] = n;
+	  src.push_back (s);
+	}
+      }
+      dest.clear();
+      for (size_t i = outStart[n]; i < outStart[n+1]; ++i) {
+	const NodeIndex d = equiv[edge[i].dest];
+	if (lastDest[d] != n) {
+	  lastDest[d] = n;
+	  dest.push_back (d);
+	}
+      }
+      sort (src.begin(), src.end());
+      sort (dest.begin(), dest.end());
+      const size_t nSrc = src.size();
+      string key ((const char*) &nSrc, sizeof(nSrc));
+      key.append ((const char*) src.data(), src.size() * sizeof(NodeIndex));
+      key.append ((const char*) dest.data(), dest.size() * sizeof(NodeIndex));
+      const auto iter_inserted = classRep.insert (make_pair (key, n));
+      const NodeIndex rep = iter_inserted.first->second;
+      if (iter_inserted.second)
 	classChars[n] = node[n].seq;
+      else {
+	equiv[n] = rep;
+	keep[n] = false;
+	classChars[rep] = node[n].seq + classChars[rep];
+	++nElim;
       }
     }
 
-  SeqGraph g;
-  if (equiv.empty())
-    g = *this;
-  else {
-    for (auto n : nodeIndices())
-      if (!equiv.count(n)) {
-	old2new[n] = g.node.size();
-	g.node.push_back (Node());
-	if (classChars.count(n) && classChars[n].size() > 1)
-	  (g.node.back().seq += "[") += classChars[n] + "]";
-	else
-	  g.node.back().seq = node[n].seq;
-      }
-    for (auto& e : edge)
-      if (old2new.count(e.src) && old2new.count(e.dest))
-	g.edge.insert (Edge (old2new[e.src], old2new[e.dest]));
-    LogThisAt(3,"Eliminated " << plural(nodes() - g.nodes(),"class node") << endl);
-    g.buildIndices();
+  if (nElim) {
+    for (const auto& rep_chars : classChars)
+      if (rep_chars.second.size() > 1)
+	node[rep_chars.first].seq = string("[") + rep_chars.second + "]";
+    LogThisAt(3,"Eliminated " << plural(nElim,"class node") << endl);
+    compact (keep, identityRedirect());
   }
-
-  return g;
 }
 
-SeqGraph SeqGraph::simplify() const {
-  return eliminateNull().eliminateDuplicates().mergeCharClasses().collapseChains();
+void SeqGraph::simplify() {
+  eliminateNull();
+  eliminateDuplicates();
+  mergeCharClasses();
+  collapseChains();
 }
@@ -1,9 +1,15 @@
 #ifndef SEQGRAPH_INCLUDED
 #define SEQGRAPH_INCLUDED
 
-#include <list>
 #include "profile.h"
 
+// null nodes are only eliminated if that adds at most this many edges
+#define DefaultMaxNullEliminationEdges 4096
+
+/* Sequence graph, for posterior dot output.
+   Edges are kept sorted by (src,dest) in a single vector, with compressed (CSR) in- & out-adjacency indices.
+   The simplification passes work in place; each is linear in nodes + edges,
+   apart from eliminateNull, whose fan-out is bounded by maxNullEliminationEdges. */
 struct SeqGraph {
   typedef size_t NodeIndex;
 
@@ -11,38 +17,47 @@ struct SeqGraph {
     NodeIndex src, dest;
     Edge (NodeIndex s, NodeIndex d) : src(s), dest(d) { }
     bool operator< (const Edge& e) const { return src == e.src ? (dest < e.dest) : (src < e.src); }
+    bool operator== (const Edge& e) const { return src == e.src && dest == e.dest; }
   };
 
   struct Node {
-    list<Edge> in, out;
     string seq;
     bool isNull() const { return seq.empty(); }
   };
 
   vguard<Node> node;
-  set<Edge> edge;
-  
-  SeqGraph() { }
+  vguard<Edge> edge;  // sorted & unique after buildIndices()
+  vguard<size_t> outStart, inStart;  // edge[outStart[n]..outStart[n+1]) leave node n; inSrc[inStart[n]..inStart[n+1]) enter it
+  vguard<NodeIndex> inSrc;
+  size_t maxNullEliminationEdges;
+
+  SeqGraph() : maxNullEliminationEdges (DefaultMaxNullEliminationEdges) { }
   SeqGraph (const Profile& prof, const string& alphabet, const vguard<LogProb>& logCptWeight, const vguard<vguard<LogProb> >& logInsProb, double minPostProb);
 
-  void buildIndices();
-  
+  void buildIndices();  // sorts edges, removes duplicates, and builds adjacency indices
+
   NodeIndex nodes() const { return node.size(); }
   NodeIndex edges() const { return edge.size(); }
 
-  vguard<NodeIndex> nodeIndices() const;
-  vguard<NodeIndex> reverseNodeIndices() const;
-  
+  size_t outDegree (NodeIndex n) const { return outStart[n+1] - outStart[n]; }
+  size_t inDegree (NodeIndex n) const { return inStart[n+1] - inStart[n]; }
+
   void assertToposort() const;
-  
-  SeqGraph eliminateNull() const;
-  SeqGraph eliminateDuplicates() const;
-  SeqGraph mergeCharClasses() const;
-  SeqGraph collapseChains() const;
 
-  SeqGraph simplify() const;
+  void eliminateNull();
+  void eliminateDuplicates();
+  void mergeCharClasses();
+  void collapseChains();
+
+  void simplify();
 
   void writeDot (ostream& out) const;
+
+private:
+  // removes nodes that are not kept, renumbers the rest, and redirects each edge to redirect[dest];
+  // edges from removed nodes, or (after redirection) to removed nodes, are dropped
+  void compact (const vguard<bool>& keep, const vguard<NodeIndex>& redirect);
+  vguard<NodeIndex> identityRedirect() const;
 };
 
 #endif /* SEQGRAPH_INCLUDED */
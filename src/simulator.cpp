@@ -1,4 +1,5 @@
 #include "simulator.h"
+#include "alias.h"
 #include "util.h"
 #include "logger.h"
 
@@ -73,15 +74,14 @@ vguard<FastSeq> Simulator::simulateSubsByMatExp (random_engine& generator, const
   vguard<FastSeq> gapped (rows);
   vguard<vguard<AlphTok> > tok (rows, cols);
   vguard<vguard<int> > component (rows, cols);
-  discrete_distribution<int> cptDist (model.cptWeight.begin(), model.cptWeight.end());
-  vguard<discrete_distribution<AlphTok> > cptInsDist (model.components());
-  vguard<vguard<vguard<discrete_distribution<AlphTok> > > > nodeCptCondSubDist (tree.nodes(),
-										vguard<vguard<discrete_distribution<AlphTok> > > (model.components(),
-																  vguard<discrete_distribution<AlphTok> > (model.alphabetSize())));
-  for (size_t c = 0; c < model.components(); ++c) {
-    const auto insProb = gsl_vector_to_stl (model.insProb[c]);
-    cptInsDist[c] = discrete_distribution<AlphTok> (insProb.begin(), insProb.end());
-  }
+  // every distribution is sampled once per column, so build alias tables up front
+  const AliasSampler cptDist (model.cptWeight);
+  vguard<AliasSampler> cptInsDist (model.components());
+  vguard<vguard<vguard<AliasSampler> > > nodeCptCondSubDist (tree.nodes(),
+							      vguard<vguard<AliasSampler> > (model.components(),
+											     vguard<AliasSampler> (model.alphabetSize())));
+  for (size_t c = 0; c < model.components(); ++c)
+    cptInsDist[c] = AliasSampler (gsl_vector_to_stl (model.insProb[c]));
   for (auto node: tree.preorderSort()) {
     gapped[node].name = tree.seqName(node);
     gapped[node].seq = string (cols, Alignment::gapChar);
@@ -89,8 +89,11 @@ vguard<FastSeq> Simulator::simulateSubsByMatExp (random_engine& generator, const
     vguard<gsl_matrix*> subMat = model.getSubProbMatrix (tree.branchLength (node));
     for (size_t c = 0; c < model.components(); ++c) {
       vguard<vguard<double> > cptSubMat = gsl_matrix_to_stl (subMat[c]);
-      for (AlphTok i = 0; i < model.alphabetSize(); ++i)
-	nodeCptCondSubDist[node][c][i] = discrete_distribution<AlphTok> (cptSubMat[i].begin(), cptSubMat[i].end());
+      for (AlphTok i = 0; i < model.alphabetSize(); ++i) {
+	for (auto& p : cptSubMat[i])
+	  p = max (p, 0.);  // the matrix exponential can leave tiny negative rounding errors
+	nodeCptCondSubDist[node][c][i] = AliasSampler (cptSubMat[i]);
+      }
       gsl_matrix_free (subMat[c]);
     }
   }
@@ -101,11 +104,11 @@ vguard<FastSeq> Simulator::simulateSubsByMatExp (random_engine& generator, const
 	const bool isInsertion = parent < 0 || !path.at(parent)[col];
 	int cpt;
 	if (isInsertion) {
-	  cpt = cptDist (generator);
-	  tok[node][col] = cptInsDist[cpt] (generator);
+	  cpt = cptDist.sample (generator);
+	  tok[node][col] = cptInsDist[cpt].sample (generator);
 	} else {
 	  cpt = component[parent][col];
-	  tok[node][col] = nodeCptCondSubDist[node][cpt][tok[parent][col]] (generator);
+	  tok[node][col] = nodeCptCondSubDist[node][cpt][tok[parent][col]].sample (generator);
 	}
 	component[node][col] = cpt;
 	gapped[node].seq[col] = model.alphabet[tok[node][col]];
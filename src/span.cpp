@@ -37,8 +37,11 @@ AlignGraph::AlignGraph (const vguard<FastSeq>& seqs, const RateModel& model, con
     model (model),
     time (time),
     diagEnvParams (diagEnvParams),
+    tokens (seqs, model.alphabet, false),
     edges (seqs.size()),
-    edgePath (seqs.size())
+    edgePath (seqs.size()),
+    peakEnvelopeCells (0),
+    totalEnvelopeCells (0)
 {
   buildSparseRandomGraph (generator);
 }
@@ -48,8 +51,11 @@ AlignGraph::AlignGraph (const vguard<FastSeq>& seqs, const RateModel& model, con
     model (model),
     time (time),
     diagEnvParams (diagEnvParams),
+    tokens (seqs, model.alphabet, false),
     edges (seqs.size()),
-    edgePath (seqs.size())
+    edgePath (seqs.size()),
+    peakEnvelopeCells (0),
+    totalEnvelopeCells (0)
 {
   buildDenseGraph();
 }
@@ -62,12 +68,16 @@ void AlignGraph::buildDenseGraph() {
   buildGraph (e, "all-vs-all");
 }
 
+size_t AlignGraph::trialEdges (size_t nSeqs, bool allPairs) {
+  const size_t allEdges = nSeqs * (nSeqs - 1) / 2;
+  return allPairs ? allEdges : min (allEdges, (size_t) ceil (log(nSeqs) * (double) nSeqs / log(2)));
+}
+
 void AlignGraph::buildSparseRandomGraph (ForwardMatrix::random_engine& generator) {
   list<TrialEdge> trialEdges;
   map<AlignRowIndex,set<AlignRowIndex> > targets;
   Partition part (seqs.size());
-  const size_t nEdges = min ((size_t) (seqs.size() * (seqs.size() - 1) / 2),
-			     (size_t) ceil (log(seqs.size()) * (double) seqs.size() / log(2)));
+  const size_t nEdges = AlignGraph::trialEdges (seqs.size(), false);
   
   uniform_int_distribution<size_t> dist (0, seqs.size() - 1);
   for (size_t n = 0; n < nEdges || part.nSets > 1; ++n) {
@@ -97,12 +107,10 @@ void AlignGraph::buildGraph (const list<TrialEdge>& trialEdges, const string& gr
     ++n;
 
     const size_t src = trialEdge.row1, dest = trialEdge.row2;
-    DiagonalEnvelope env (seqs[src], seqs[dest]);
-    if (diagEnvParams.sparse) {
-      KmerIndex yKmerIndex (seqs[dest], model.alphabet, diagEnvParams.kmerLen);
-      env.initSparse (yKmerIndex, diagEnvParams.bandSize, diagEnvParams.kmerThreshold, ForwardMatrix::cellSize(), diagEnvParams.effectiveMaxSize());
-    } else
-      env.initFull();
+    DiagonalEnvelope env (seqs[src], seqs[dest], tokens.tokens(src), tokens.tokens(dest));
+    initEnvelope (env, seqs[dest], tokens.tokens(dest), model.alphabet, diagEnvParams);
+    peakEnvelopeCells = max (peakEnvelopeCells, env.totalStorageSize);
+    totalEnvelopeCells += env.totalStorageSize;
 
     QuickAlignMatrix mx (env, model, time);
     edgePath[src][dest] = mx.alignPath (src, dest);
@@ -119,6 +127,14 @@ void AlignGraph::buildGraph (const list<TrialEdge>& trialEdges, const string& gr
   }
 }
 
+void AlignGraph::initEnvelope (DiagonalEnvelope& env, const FastSeq& y, const CompactTok* yTok, const string& alphabet, const DiagEnvParams& diagEnvParams) {
+  if (diagEnvParams.sparse) {
+    KmerIndex yKmerIndex (y, alphabet, yTok, diagEnvParams.kmerLen);
+    env.initSparse (yKmerIndex, diagEnvParams.bandSize, diagEnvParams.kmerThreshold, ForwardMatrix::cellSize(), diagEnvParams.effectiveMaxSize());
+  } else
+    env.initFull();
+}
+
 list<AlignPath> AlignGraph::minSpanTree() {
   list<AlignPath> paths;
   Partition part (seqs.size());
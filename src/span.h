@@ -34,16 +34,21 @@ struct AlignGraph {
   const RateModel& model;
   const double time;
   const DiagEnvParams& diagEnvParams;
+  const TokenStore tokens;
 
   vguard<priority_queue<Edge> > edges;
   vguard<map<AlignRowIndex,AlignPath> > edgePath;
+  size_t peakEnvelopeCells;  // largest pairwise DP envelope
+  size_t totalEnvelopeCells;  // summed over all pairwise DP envelopes
   
   AlignGraph (const vguard<FastSeq>& seqs, const RateModel& model, const double time, const DiagEnvParams& diagEnvParams, ForwardMatrix::random_engine& generator);
   AlignGraph (const vguard<FastSeq>& seqs, const RateModel& model, const double time, const DiagEnvParams& diagEnvParams);
 
   void buildSparseRandomGraph (ForwardMatrix::random_engine& generator);
   void buildDenseGraph();
+  static size_t trialEdges (size_t nSeqs, bool allPairs);  // number of pairwise alignments (at least) for a sparse or dense graph
   void buildGraph (const list<TrialEdge>& trialEdges, const string& graphDescription);
+  static void initEnvelope (DiagonalEnvelope& env, const FastSeq& y, const CompactTok* yTok, const string& alphabet, const DiagEnvParams& diagEnvParams);  // sparse or full, as diagEnvParams says
 
   list<AlignPath> minSpanTree();
   AlignPath mstPath();
@@ -9,6 +9,7 @@
 
 SumProductStorage::SumProductStorage (size_t components, size_t nodes, size_t alphabetSize)
   : gappedCol (nodes),
+    gappedTok (nodes),
     E (components, vguard<vguard<double> > (nodes, vguard<double> (alphabetSize))),
     F (components, vguard<vguard<double> > (nodes, vguard<double> (alphabetSize))),
     G (components, vguard<vguard<double> > (nodes, vguard<double> (alphabetSize))),
@@ -22,6 +23,7 @@ SumProduct::SumProduct (const RateModel& model, const Tree& tree)
   : SumProductStorage (model.components(), tree.nodes(), model.alphabetSize()),
     model (model),
     tree (tree),
+    tokenTable (model.alphabet),
     preorder (tree.preorderSort()),
     postorder (tree.postorderSort()),
     eigen (model),
@@ -58,13 +60,16 @@ SumProduct::~SumProduct() {
 void SumProduct::initColumn (const map<AlignRowIndex,char>& seq) {
   ungappedRows.clear();
   gappedCol = vguard<char> (tree.nodes(), Alignment::gapChar);
+  gappedTok = vguard<CompactTok> (tree.nodes(), CompactTokGap);
   vguard<int> ungappedKids (tree.nodes(), 0);
   roots.clear();
   map<size_t,SeqIdx> pos;
   for (TreeNodeIndex r = 0; r < tree.nodes(); ++r)
     if (seq.find(r) != seq.end()) {
       const char c = seq.at(r);
-      gappedCol[r] = model.isValidSymbol(c) ? c : Alignment::wildcardChar;
+      const CompactTok tok = tokenTable (c);
+      gappedCol[r] = compactTokValid(tok) ? c : Alignment::wildcardChar;
+      gappedTok[r] = compactTokValid(tok) ? tok : CompactTokWildcard;
       ungappedRows.push_back(r);
     }
 
@@ -123,7 +128,7 @@ void SumProduct::fillUp() {
 	    logF[cpt][r] += log (Fmax);
 	  }
 	} else {  // !isWild(r)
-	  const AlphTok tok = model.tokenize(c);
+	  const AlphTok tok = gappedTok[r];
 	  double Ftok = 1;
 	  for (size_t nc = 0; nc < tree.nChildren(r); ++nc)
 	    Ftok *= E[cpt][tree.getChild(r,nc)][tok];
@@ -147,12 +152,19 @@ void SumProduct::fillUp() {
 	  cptLogLike[cpt] += logF[cpt][r] + log (inner_product (F[cpt][r].begin(), F[cpt][r].end(), insProb[cpt].begin(), 0.));
 	else {
 	  logE[cpt][r] = logF[cpt][r];
-	  for (AlphTok i = 0; i < model.alphabetSize(); ++i) {
-	    double Ei = 0;
-	    for (AlphTok j = 0; j < model.alphabetSize(); ++j)
-	      Ei += branchSubProb[cpt][r][i][j] * F[cpt][r][j];
-	    E[cpt][r][i] = Ei;
-	  }
+	  if (!Alignment::isWildcard(c)) {
+	    // F is one-hot at tok, so E is just a column of the substitution matrix
+	    const AlphTok tok = gappedTok[r];
+	    const double Ftok = F[cpt][r][tok];
+	    for (AlphTok i = 0; i < model.alphabetSize(); ++i)
+	      E[cpt][r][i] = branchSubProb[cpt][r][i][tok] * Ftok;
+	  } else
+	    for (AlphTok i = 0; i < model.alphabetSize(); ++i) {
+	      double Ei = 0;
+	      for (AlphTok j = 0; j < model.alphabetSize(); ++j)
+		Ei += branchSubProb[cpt][r][i][j] * F[cpt][r][j];
+	      E[cpt][r][i] = Ei;
+	    }
 	}
       }
     }
@@ -218,7 +230,7 @@ vguard<LogProb> SumProduct::logNodePostProb (AlignRowIndex node) const {
 
 vguard<vguard<LogProb> > SumProduct::logNodeExcludedPostProb (TreeNodeIndex node, TreeNodeIndex exclude, bool normalize) const {
   Require (!isGap(node), "Attempt to find posterior probability of sequence at gapped position");
-  const UnvalidatedAlphTok tok = isWild(node) ? -1 : model.tokenize(gappedCol[node]);
+  const UnvalidatedAlphTok tok = isWild(node) ? -1 : (UnvalidatedAlphTok) gappedTok[node];
   vguard<LogProb> lppInit (model.alphabetSize(), isWild(node) ? 0 : -numeric_limits<double>::infinity());
   if (!isWild(node))
     lppInit[tok] = 0;
@@ -283,8 +295,11 @@ void SumProduct::accumulateSubCounts (vguard<vguard<double> >& rootCounts, vguar
       for (int cpt = 0; cpt < components(); ++cpt) {
 	LogThisAt(9,"Accumulating substitution counts, column " << join(gappedCol,"") << " node " << tree.seqName(node) << " component #" << cpt << endl);
 	for (AlphTok a = 0; a < model.alphabetSize(); ++a)
-	  for (AlphTok b = 0; b < model.alphabetSize(); ++b)
-	    eigen.accumSubCounts (cpt, subCounts[cpt], a, b, weight * exp (logBranchPostProb (cpt, node, a, b)), submat[cpt], branchEigenSubCount[cpt][node]);
+	  for (AlphTok b = 0; b < model.alphabetSize(); ++b) {
+	    const double abWeight = weight * exp (logBranchPostProb (cpt, node, a, b));
+	    if (abWeight > 0)  // most (a,b) pairs have zero posterior when either end is observed
+	      eigen.accumSubCounts (cpt, subCounts[cpt], a, b, abWeight, submat[cpt], branchEigenSubCount[cpt][node]);
+	  }
       }
       for (auto& sm: submat)
 	gsl_matrix_free (sm);
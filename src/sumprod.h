@@ -20,6 +20,7 @@ struct SumProductStorage {
   vguard<vguard<LogProb> > logE, logF, logG;  // logs of rescaling factors, used to prevent underflow
   
   vguard<char> gappedCol;
+  vguard<CompactTok> gappedTok;  // tokens for gappedCol, so fillUp() etc don't have to re-tokenize
   vguard<AlignRowIndex> ungappedRows, roots;
 
   vguard<LogProb> cptLogLike;
@@ -36,6 +37,7 @@ private:
 public:
   const RateModel& model;
   const Tree& tree;
+  const TokenTable tokenTable;
 
   vguard<TreeNodeIndex> preorder, postorder;  // modify these to visit only subsets of nodes. postorder for fillUp(), preorder for fillDown()
 
@@ -0,0 +1,301 @@
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include "taskpool.h"
+#include "logger.h"
+#include "util.h"
+
+TaskPool taskPool;
+
+static thread_local size_t taskPoolThreadIndex = 0;
+
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+#define TASKPOOL_SINGLE_THREADED
+#endif
+
+// Under Emscripten with pthreads, TASKPOOL_MAX_THREADS is the size of the prestarted worker pool.
+// A thread beyond that would need a new web worker, which cannot start while the main thread waits on it.
+
+TaskPool::TaskPool()
+  : nThreads(1), queued(0), stopping(false), running(false)
+{
+  queues.push_back (unique_ptr<TaskQueue> (new TaskQueue()));
+  setThreads (defaultThreads());
+}
+
+TaskPool::~TaskPool() {
+  stopWorkers();
+}
+
+// Linux cgroup CPU quota (v2, then v1), or 0 if there is none
+static double cgroupCpuQuota() {
+  ifstream v2 ("/sys/fs/cgroup/cpu.max");
+  if (v2) {
+    string quota;
+    double period = 0;
+    v2 >> quota >> period;
+    if (quota != "max" && period > 0)
+      return atof (quota.c_str()) / period;
+    return 0;
+  }
+  ifstream quotaFile ("/sys/fs/cgroup/cpu/cpu.cfs_quota_us"), periodFile ("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+  double quota = -1, period = 0;
+  if (quotaFile && periodFile) {
+    quotaFile >> quota;
+    periodFile >> period;
+    if (quota > 0 && period > 0)
+      return quota / period;
+  }
+  return 0;
+}
+
+size_t TaskPool::defaultThreads() {
+#ifdef TASKPOOL_SINGLE_THREADED
+  return 1;
+#else
+  size_t cpus = thread::hardware_concurrency();
+#ifdef __linux__
+  cpu_set_t mask;
+  if (sched_getaffinity (0, sizeof(mask), &mask) == 0)
+    cpus = CPU_COUNT (&mask);
+#endif
+  const double quota = cgroupCpuQuota();
+  if (quota > 0)
+    cpus = min (cpus, (size_t) max (1., ceil (quota)));
+#ifdef TASKPOOL_MAX_THREADS
+  cpus = min (cpus, (size_t) TASKPOOL_MAX_THREADS);
+#endif
+  return max (cpus, (size_t) 1);
+#endif
+}
+
+bool TaskPool::parseThreadArgs (deque<string>& argvec) {
+  if (argvec.size()) {
+    const string& arg = argvec[0];
+    if (arg == "-threads") {
+      Require (argvec.size() > 1, "%s must have an argument", arg.c_str());
+      const int n = atoi (argvec[1].c_str());
+      Require (n > 0, "%s must be a positive integer", arg.c_str());
+      setThreads (n);
+      argvec.pop_front();
+      argvec.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+string TaskPool::args() const {
+  return nThreads == defaultThreads() ? string() : (string(" -threads ") + to_string(nThreads));
+}
+
+void TaskPool::setThreads (size_t n) {
+#ifdef TASKPOOL_SINGLE_THREADED
+  n = 1;
+#endif
+#ifdef TASKPOOL_MAX_THREADS
+  n = min (n, (size_t) TASKPOOL_MAX_THREADS);
+#endif
+  stopWorkers();
+  nThreads = max (n, (size_t) 1);
+  while (queues.size() < nThreads)
+    queues.push_back (unique_ptr<TaskQueue> (new TaskQueue()));
+}
+
+void TaskPool::startWorkers() {
+  lock_guard<mutex> lock (configMutex);
+  if (running)
+    return;
+  LogThisAt(3,"Starting " << plural(nThreads-1,"worker thread") << endl);
+  stopping = false;
+  for (size_t i = 1; i < nThreads; ++i)
+    workers.push_back (thread (&TaskPool::workerLoop, this, i));
+  running = true;
+}
+
+void TaskPool::stopWorkers() {
+  lock_guard<mutex> configLock (configMutex);
+  {
+    lock_guard<mutex> lock (sleepMutex);
+    stopping = true;
+  }
+  sleepCondition.notify_all();
+  for (auto& w : workers)
+    if (w.get_id() == this_thread::get_id())
+      w.detach();  // exit() called from a task
+    else
+      w.join();
+  workers.clear();
+  running = false;
+  // anything left over (there shouldn't be) gets run on the calling thread
+  while (runOne (0))
+    { }
+  stopping = false;
+}
+
+size_t TaskPool::threadIndex() {
+  return taskPoolThreadIndex;
+}
+
+size_t TaskPool::currentQueue() const {
+  return taskPoolThreadIndex < queues.size() ? taskPoolThreadIndex : 0;
+}
+
+MonotonicArena& TaskPool::scratch() {
+  static thread_local MonotonicArena arena;
+  return arena;
+}
+
+void TaskPool::submit (const Task& task) {
+  if (nThreads == 1) {
+    task();
+    return;
+  }
+  if (!running)
+    startWorkers();
+  // count the task before it becomes visible, so a worker that takes it at once cannot decrement the count past zero
+  ++queued;
+  TaskQueue& q = *queues[currentQueue()];
+  {
+    lock_guard<mutex> lock (q.mx);
+    q.tasks.push_back (task);
+  }
+  {
+    lock_guard<mutex> lock (sleepMutex);
+  }
+  sleepCondition.notify_one();
+}
+
+bool TaskPool::runOne (size_t index) {
+  Task task;
+  bool found = false;
+  {
+    TaskQueue& own = *queues[index];
+    lock_guard<mutex> lock (own.mx);
+    if (!own.tasks.empty()) {
+      task = move (own.tasks.back());
+      own.tasks.pop_back();
+      found = true;
+    }
+  }
+  for (size_t k = 1; !found && k < queues.size(); ++k) {
+    TaskQueue& victim = *queues[(index + k) % queues.size()];
+    lock_guard<mutex> lock (victim.mx);
+    if (!victim.tasks.empty()) {
+      task = move (victim.tasks.front());
+      victim.tasks.pop_front();
+      found = true;
+    }
+  }
+  if (found) {
+    --queued;
+    task();
+  }
+  return found;
+}
+
+void TaskPool::workerLoop (size_t index) {
+  taskPoolThreadIndex = index;
+  while (true) {
+    if (runOne (index))
+      continue;
+    unique_lock<mutex> lock (sleepMutex);
+    sleepCondition.wait (lock, [&] { return stopping || queued > 0; });
+    if (stopping && queued == 0)
+      break;
+  }
+}
+
+TaskPool::TaskGroup::TaskGroup (TaskPool& pool)
+  : pool(pool), pending(0)
+{ }
+
+TaskPool::TaskGroup::~TaskGroup() {
+  // don't let queued tasks outlive their group
+  if (pending > 0)
+    try { wait(); } catch (...) { }
+}
+
+void TaskPool::TaskGroup::run (const Task& task) {
+  ++pending;
+  pool.submit ([this,task] () {
+      try {
+	task();
+      } catch (...) {
+	lock_guard<mutex> lock (errorMutex);
+	if (!error)
+	  error = current_exception();
+      }
+      --pending;
+    });
+}
+
+void TaskPool::TaskGroup::wait() {
+  const size_t index = pool.currentQueue();
+  while (pending > 0)
+    if (!pool.runOne (index))
+      this_thread::yield();
+  if (error) {
+    exception_ptr e = error;
+    error = nullptr;
+    rethrow_exception (e);
+  }
+}
+
+size_t TaskPool::TaskGraph::add (const Task& task, const vguard<size_t>& prereqs) {
+  const size_t n = node.size();
+  node.push_back (Node());
+  node.back().task = task;
+  node.back().nPrereqs = prereqs.size();
+  for (auto p : prereqs) {
+    Assert (p < n, "Task graph prerequisites must be added before their dependents");
+    node[p].dependents.push_back (n);
+  }
+  return n;
+}
+
+void TaskPool::TaskGraph::launch (TaskGroup& group, size_t n) {
+  group.run ([this,&group,n] () {
+      node[n].task();
+      for (auto d : node[n].dependents)
+	if (--*node[d].remaining == 0)
+	  launch (group, d);
+    });
+}
+
+void TaskPool::TaskGraph::run (TaskPool& pool) {
+  for (auto& nd : node)
+    nd.remaining.reset (new atomic<size_t> (nd.nPrereqs));
+  TaskGroup group (pool);
+  for (size_t n = 0; n < node.size(); ++n)
+    if (node[n].nPrereqs == 0)
+      launch (group, n);
+  group.wait();
+}
+
+void TaskPool::parallelFor (size_t begin, size_t end, const function<void(size_t)>& f, size_t grain) {
+  if (end <= begin)
+    return;
+  const size_t n = end - begin;
+  if (grain == 0)
+    grain = max ((size_t) 1, n / (4 * nThreads));
+  if (nThreads == 1 || n <= grain) {
+    for (size_t i = begin; i < end; ++i)
+      f(i);
+    return;
+  }
+  TaskGroup group (*this);
+  for (size_t chunkBegin = begin; chunkBegin < end; chunkBegin += grain) {
+    const size_t chunkEnd = min (end, chunkBegin + grain);
+    group.run ([&f,chunkBegin,chunkEnd] () {
+	for (size_t i = chunkBegin; i < chunkEnd; ++i)
+	  f(i);
+      });
+  }
+  group.wait();
+}
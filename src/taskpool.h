@@ -0,0 +1,142 @@
+#ifndef TASKPOOL_INCLUDED
+#define TASKPOOL_INCLUDED
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include "vguard.h"
+#include "arena.h"
+
+using namespace std;
+
+/* Small work-stealing task runtime, shared by all subsystems.
+
+   Each thread owns a deque of tasks; it pushes & pops at the back,
+   while idle threads steal from the front of other threads' deques.
+   A thread that waits on a TaskGroup runs queued tasks while it waits,
+   so nested parallelism cannot deadlock.
+
+   With one thread (the default under Emscripten without pthreads),
+   everything runs inline on the calling thread.
+
+   Results of parallelFor & reduce are independent of the number of threads:
+   reduce() splits its range into fixed-size chunks and combines the partial
+   results in chunk order, so floating-point sums are reproducible. */
+
+#define DefaultReduceGrain 64
+
+class TaskPool {
+public:
+  typedef function<void()> Task;
+
+private:
+  struct TaskQueue {
+    mutex mx;
+    deque<Task> tasks;
+  };
+  vector<unique_ptr<TaskQueue> > queues;  // queues[0] is shared by all threads outside the pool
+  vector<thread> workers;
+  size_t nThreads;
+  atomic<size_t> queued;
+  atomic<bool> stopping, running;
+  mutex configMutex, sleepMutex;
+  condition_variable sleepCondition;
+
+  void startWorkers();  // workers are started lazily, on first submission
+  void stopWorkers();
+  void workerLoop (size_t index);
+  bool runOne (size_t index);  // pop own task, or steal one; returns false if nothing to do
+  size_t currentQueue() const;
+
+  TaskPool (const TaskPool&) = delete;
+  TaskPool& operator= (const TaskPool&) = delete;
+
+public:
+  TaskPool();
+  ~TaskPool();
+
+  // configuration
+  bool parseThreadArgs (deque<string>& argvec);
+  void setThreads (size_t n);
+  size_t threads() const { return nThreads; }
+  string args() const;
+  static size_t defaultThreads();  // CPUs available to this process (respects affinity mask & cgroup CPU quota)
+
+  // low-level submission; prefer TaskGroup
+  void submit (const Task& task);
+
+  // index of the calling thread: 0 for threads outside the pool, 1..threads()-1 for workers
+  static size_t threadIndex();
+
+  // per-thread scratch arena, for short-lived allocations that stay on one thread (e.g. DPMatrix cells).
+  // It is never reset automatically: whoever owns the outermost user calls reset() once nothing drawn from it is alive
+  // (Reconstructor::reconstruct does this after each node)
+  static MonotonicArena& scratch();
+
+  // a set of tasks that can be waited on together
+  class TaskGroup {
+  private:
+    TaskPool& pool;
+    atomic<size_t> pending;
+    mutex errorMutex;
+    exception_ptr error;
+    TaskGroup (const TaskGroup&) = delete;
+    TaskGroup& operator= (const TaskGroup&) = delete;
+  public:
+    TaskGroup (TaskPool& pool);
+    ~TaskGroup();
+    void run (const Task& task);
+    void wait();  // runs queued tasks until all tasks in this group are done; rethrows the first exception
+  };
+
+  // dependency graph of tasks; each task runs once all its prerequisites are done
+  class TaskGraph {
+  private:
+    struct Node {
+      Task task;
+      vguard<size_t> dependents;
+      size_t nPrereqs;
+      unique_ptr<atomic<size_t> > remaining;
+    };
+    vguard<Node> node;
+    void launch (TaskGroup& group, size_t n);
+  public:
+    size_t add (const Task& task, const vguard<size_t>& prereqs = vguard<size_t>());
+    size_t size() const { return node.size(); }
+    void run (TaskPool& pool);
+  };
+
+  // call f(i) for each i in [begin,end), in chunks of (at least) grain
+  void parallelFor (size_t begin, size_t end, const function<void(size_t)>& f, size_t grain = 0);
+
+  // init op f(begin) op ... op f(end-1), evaluated as an ordered combination of fixed-size chunks
+  template<typename T>
+  T reduce (size_t begin, size_t end, const T& init, const function<T(size_t)>& f, const function<T(const T&,const T&)>& op, size_t grain = DefaultReduceGrain) {
+    if (end <= begin)
+      return init;
+    const size_t nChunks = (end - begin + grain - 1) / grain;
+    vguard<T> partial (nChunks);
+    parallelFor (0, nChunks, [&] (size_t chunk) {
+	const size_t chunkBegin = begin + chunk * grain, chunkEnd = min (end, chunkBegin + grain);
+	T acc = f (chunkBegin);
+	for (size_t i = chunkBegin + 1; i < chunkEnd; ++i)
+	  acc = op (acc, f(i));
+	partial[chunk] = acc;
+      }, 1);
+    T result = init;
+    for (const auto& p : partial)
+      result = op (result, p);
+    return result;
+  }
+};
+
+extern TaskPool taskPool;
+
+#endif /* TASKPOOL_INCLUDED */
@@ -0,0 +1,263 @@
+#include <cstring>
+#include "trace.h"
+#include "util.h"
+
+static void appendVarint (string& buf, uint64_t x) {
+  while (x >= 0x80) {
+    buf.push_back ((char) (0x80 | (x & 0x7f)));
+    x >>= 7;
+  }
+  buf.push_back ((char) x);
+}
+
+static void appendString (string& buf, const string& s) {
+  appendVarint (buf, s.size());
+  buf.append (s);
+}
+
+static void appendDouble (string& buf, double d) {
+  uint64_t bits;
+  memcpy (&bits, &d, sizeof(bits));
+  for (int n = 0; n < 8; ++n)
+    buf.push_back ((char) ((bits >> (8*n)) & 0xff));
+}
+
+static void appendNode (string& buf, const TreeNode& node) {
+  appendString (buf, node.name);
+  appendVarint (buf, node.parent + 1);
+  appendDouble (buf, node.d);
+  appendVarint (buf, node.child.size());
+  for (auto c : node.child)
+    appendVarint (buf, c);
+}
+
+static bool nodesEqual (const TreeNode& a, const TreeNode& b) {
+  return a.parent == b.parent && a.d == b.d && a.name == b.name && a.child == b.child;
+}
+
+TraceWriter::TraceWriter (const string& filename, const string& name, size_t keyframeInterval, bool append)
+  : keyframeInterval (max (keyframeInterval, (size_t) 1)),
+    steps (0),
+    filename (filename)
+{
+  fp = gzopen (filename.c_str(), append ? "ab" : "wb");
+  Require (fp != NULL, "Could not open %s", filename.c_str());
+  if (!append) {
+    appendString (buf, TraceMagic);
+    appendString (buf, name);
+    flush();
+  }
+}
+
+TraceWriter::~TraceWriter() {
+  gzclose (fp);
+}
+
+void TraceWriter::flush() {
+  if (buf.size())
+    Require (gzwrite (fp, buf.data(), buf.size()) == (int) buf.size(), "Error writing %s", filename.c_str());
+  buf.clear();
+}
+
+void TraceWriter::writeTree (const Tree& tree, bool keyframe, const Sampler::Change& change) {
+  if (keyframe) {
+    appendVarint (buf, tree.nodes());
+    for (const auto& node : tree.node)
+      appendNode (buf, node);
+    previousTree = tree;
+  } else {
+    vguard<TreeNodeIndex> changed;
+    if (change.all || change.tree)
+      for (TreeNodeIndex n = 0; n < tree.nodes(); ++n)
+	if (!nodesEqual (tree.node[n], previousTree.node[n]))
+	  changed.push_back (n);
+    appendVarint (buf, changed.size());
+    for (auto n : changed) {
+      appendVarint (buf, n);
+      appendNode (buf, tree.node[n]);
+      previousTree.node[n] = tree.node[n];
+    }
+  }
+}
+
+void TraceWriter::writeRows (const vguard<FastSeq>& gapped, bool keyframe, const Sampler::Change& change) {
+  if (keyframe) {
+    appendVarint (buf, gapped.size());
+    for (const auto& fs : gapped) {
+      appendString (buf, fs.name);
+      appendString (buf, fs.seq);
+    }
+    previousRows = gapped;
+  } else {
+    // a realignment can add or remove gap columns in any row, so then every row is compared;
+    // if nodes were only renumbered, just the rows that moved can differ
+    vguard<size_t> changed;
+    const bool realigned = change.all || change.alignment;
+    if (realigned || !change.oldNode.empty())
+      for (size_t r = 0; r < gapped.size(); ++r)
+	if ((realigned || change.previous(r) != (TreeNodeIndex) r)
+	    && (gapped[r].name != previousRows[r].name || gapped[r].seq != previousRows[r].seq))
+	  changed.push_back (r);
+    appendVarint (buf, changed.size());
+    for (auto r : changed) {
+      const string& oldSeq = previousRows[r].seq;
+      const string& newSeq = gapped[r].seq;
+      const bool nameChanged = gapped[r].name != previousRows[r].name;
+      appendVarint (buf, r);
+      buf.push_back ((char) (nameChanged ? 1 : 0));
+      if (nameChanged)
+	appendString (buf, gapped[r].name);
+      const size_t maxCommon = min (oldSeq.size(), newSeq.size());
+      size_t prefix = 0, suffix = 0;
+      while (prefix < maxCommon && oldSeq[prefix] == newSeq[prefix])
+	++prefix;
+      while (suffix < maxCommon - prefix && oldSeq[oldSeq.size() - 1 - suffix] == newSeq[newSeq.size() - 1 - suffix])
+	++suffix;
+      appendVarint (buf, prefix);
+      appendVarint (buf, suffix);
+      appendString (buf, newSeq.substr (prefix, newSeq.size() - prefix - suffix));
+      previousRows[r] = gapped[r];
+    }
+  }
+}
+
+void TraceWriter::logHistory (const Sampler::History& history, LogProb logLikelihood, const Sampler::Change& change) {
+  const bool keyframe = steps % keyframeInterval == 0
+    || history.tree.nodes() != previousTree.nodes()
+    || history.gapped.size() != previousRows.size();
+  buf.push_back (keyframe ? 'K' : 'D');
+  appendVarint (buf, steps);
+  appendDouble (buf, logLikelihood);
+  writeTree (history.tree, keyframe, change);
+  writeRows (history.gapped, keyframe, change);
+  flush();
+  ++steps;
+}
+
+void TraceWriter::saveState (CheckpointWriter& checkpoint) {
+  flush();
+  Require (gzflush (fp, Z_FINISH) == Z_OK, "Error writing %s", filename.c_str());
+  checkpoint.writeVarint (steps);
+  checkpoint.writeVarint (gzoffset (fp));
+  checkpoint.writeTree (previousTree);
+  checkpoint.writeSeqs (previousRows);
+}
+
+void TraceWriter::loadState (CheckpointReader& checkpoint) {
+  steps = checkpoint.readVarint();
+  const uint64_t length = checkpoint.readVarint();
+  previousTree = checkpoint.readTree();
+  previousRows = checkpoint.readSeqs();
+  gzclose (fp);
+  truncateFile (filename, length);
+  fp = gzopen (filename.c_str(), "ab");
+  Require (fp != NULL, "Could not open %s", filename.c_str());
+}
+
+TraceReader::TraceReader (const string& filename)
+  : filename (filename),
+    step (0),
+    logLikelihood (-numeric_limits<double>::infinity())
+{
+  fp = gzopen (filename.c_str(), "rb");
+  Require (fp != NULL, "Could not open %s", filename.c_str());
+  Require (readString() == TraceMagic, "%s is not a historian trace file", filename.c_str());
+  name = readString();
+}
+
+TraceReader::~TraceReader() {
+  gzclose (fp);
+}
+
+int TraceReader::readByte() {
+  return gzgetc (fp);
+}
+
+uint64_t TraceReader::readVarint() {
+  uint64_t x = 0;
+  for (int shift = 0; ; shift += 7) {
+    const int c = readByte();
+    Require (c >= 0 && shift < 64, "Truncated or corrupt trace file %s", filename.c_str());
+    x |= ((uint64_t) (c & 0x7f)) << shift;
+    if (!(c & 0x80))
+      break;
+  }
+  return x;
+}
+
+string TraceReader::readString() {
+  const size_t len = readVarint();
+  string s (len, '\0');
+  if (len)
+    Require (gzread (fp, &s[0], len) == (int) len, "Truncated trace file %s", filename.c_str());
+  return s;
+}
+
+double TraceReader::readDouble() {
+  uint64_t bits = 0;
+  for (int n = 0; n < 8; ++n) {
+    const int c = readByte();
+    Require (c >= 0, "Truncated trace file %s", filename.c_str());
+    bits |= ((uint64_t) c) << (8*n);
+  }
+  double d;
+  memcpy (&d, &bits, sizeof(d));
+  return d;
+}
+
+void TraceReader::readTree (bool keyframe) {
+  vector<TreeNode>& node = history.tree.node;
+  if (keyframe)
+    node = vector<TreeNode> (readVarint());
+  const size_t nNodes = keyframe ? node.size() : readVarint();
+  for (size_t k = 0; k < nNodes; ++k) {
+    const size_t n = keyframe ? k : readVarint();
+    Require (n < node.size(), "Bad node index in trace file %s", filename.c_str());
+    TreeNode& tn = node[n];
+    tn.name = readString();
+    tn.parent = (TreeNodeIndex) readVarint() - 1;
+    tn.d = readDouble();
+    tn.child = vguard<TreeNodeIndex> (readVarint());
+    for (auto& c : tn.child)
+      c = readVarint();
+  }
+}
+
+void TraceReader::readRows (bool keyframe) {
+  vguard<FastSeq>& gapped = history.gapped;
+  if (keyframe) {
+    gapped = vguard<FastSeq> (readVarint());
+    for (auto& fs : gapped) {
+      fs.name = readString();
+      fs.seq = readString();
+    }
+  } else {
+    const size_t nChanged = readVarint();
+    for (size_t k = 0; k < nChanged; ++k) {
+      const size_t r = readVarint();
+      Require (r < gapped.size(), "Bad row index in trace file %s", filename.c_str());
+      if (readByte() == 1)
+	gapped[r].name = readString();
+      string& seq = gapped[r].seq;
+      const size_t prefix = readVarint(), suffix = readVarint();
+      Require (prefix + suffix <= seq.size(), "Bad row edit in trace file %s", filename.c_str());
+      seq = seq.substr (0, prefix) + readString() + seq.substr (seq.size() - suffix);
+    }
+  }
+}
+
+bool TraceReader::next() {
+  const int type = readByte();
+  if (type < 0)
+    return false;
+  Require (type == 'K' || type == 'D', "Bad record in trace file %s", filename.c_str());
+  const bool keyframe = type == 'K';
+  Require (keyframe || history.gapped.size(), "Trace file %s does not start with a keyframe", filename.c_str());
+  step = readVarint();
+  logLikelihood = readDouble();
+  readTree (keyframe);
+  readRows (keyframe);
+  history.clearAlignment();
+  history.clearTreeIndex();
+  return true;
+}
@@ -0,0 +1,76 @@
+#ifndef TRACE_INCLUDED
+#define TRACE_INCLUDED
+
+#include <zlib.h>
+#include "sampler.h"
+
+#define DefaultTraceKeyframeInterval 100
+#define TraceMagic "historian-trace-1"
+
+/* Compressed binary MCMC trace.
+
+   A gzip stream holding a header (magic string & dataset name) followed by one record per state.
+   Every K-th record is a keyframe holding the full tree & alignment;
+   the others hold only what changed since the previous record,
+   looking only at the parts of the state that the step's Sampler::Change says may differ:
+   - tree nodes whose name, parent, branch length or children changed;
+   - alignment rows whose name or sequence changed, with each changed sequence
+     stored as (common prefix length, common suffix length, replaced middle).
+
+   Integers are stored as unsigned LEB128 varints, strings as length-prefixed bytes,
+   and doubles as their IEEE 754 bit patterns (little-endian).
+
+   When checkpointing, the gzip stream is finished at each checkpoint, so that on resuming
+   the file can be cut back to that point and a new gzip member appended. */
+
+class TraceWriter : public Sampler::Logger {
+private:
+  gzFile fp;
+  const size_t keyframeInterval;
+  size_t steps;
+  Tree previousTree;  // the last logged state
+  vguard<FastSeq> previousRows;
+  string buf;  // current record
+
+  void writeTree (const Tree& tree, bool keyframe, const Sampler::Change& change);
+  void writeRows (const vguard<FastSeq>& gapped, bool keyframe, const Sampler::Change& change);
+  void flush();
+
+  TraceWriter (const TraceWriter&) = delete;
+  TraceWriter& operator= (const TraceWriter&) = delete;
+
+public:
+  const string filename;
+  TraceWriter (const string& filename, const string& name, size_t keyframeInterval = DefaultTraceKeyframeInterval, bool append = false);
+  ~TraceWriter();
+  void logHistory (const Sampler::History& history, LogProb logLikelihood, const Sampler::Change& change);
+  void saveState (CheckpointWriter& checkpoint);
+  void loadState (CheckpointReader& checkpoint);
+};
+
+class TraceReader {
+private:
+  gzFile fp;
+  string readString();
+  uint64_t readVarint();
+  double readDouble();
+  int readByte();
+  void readTree (bool keyframe);
+  void readRows (bool keyframe);
+
+  TraceReader (const TraceReader&) = delete;
+  TraceReader& operator= (const TraceReader&) = delete;
+
+public:
+  const string filename;
+  string name;
+  size_t step;
+  Sampler::History history;
+  LogProb logLikelihood;
+
+  TraceReader (const string& filename);
+  ~TraceReader();
+  bool next();  // reads the next state into history; returns false at end of file
+};
+
+#endif /* TRACE_INCLUDED */
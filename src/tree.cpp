@@ -603,6 +603,28 @@ TreeNodeIndex Tree::mostRecentCommonAncestor (TreeNodeIndex node1, TreeNodeIndex
   return node2;
 }
 
+vguard<size_t> Tree::leafCount() const {
+  assertPostorderSorted();
+  vguard<size_t> count (nodes(), 0);
+  for (TreeNodeIndex n = 0; n < nodes(); ++n) {
+    if (isLeaf(n))
+      count[n] = 1;
+    if (parentNode(n) >= 0)
+      count[parentNode(n)] += count[n];
+  }
+  return count;
+}
+
+vguard<TreeNodeIndex> Tree::cladeRoots (size_t maxLeaves) const {
+  Assert (maxLeaves > 0, "Clades must contain at least one leaf");
+  const auto count = leafCount();
+  vguard<TreeNodeIndex> roots;
+  for (TreeNodeIndex n = 0; n < nodes(); ++n)
+    if (count[n] <= maxLeaves && (parentNode(n) < 0 || count[parentNode(n)] > maxLeaves))
+      roots.push_back (n);
+  return roots;
+}
+
 vguard<TreeNodeIndex> Tree::rerootedPreorderSort (TreeNodeIndex newRoot, TreeNodeIndex parentOfRoot) const {
   vguard<TreeNodeIndex> pre;
   std::function<void(TreeNodeIndex,TreeNodeIndex)> visit;
@@ -733,3 +755,179 @@ bool Tree::hasGrandchildren() const {
       return true;
   return false;
 }
+
+TreeNodeSet::TreeNodeSet (TreeNodeIndex nodes, bool full)
+  : bits ((nodes + 63) / 64, 0),
+    nNodes (nodes)
+{
+  if (full)
+    *this = complement();
+}
+
+TreeNodeSet& TreeNodeSet::operator|= (const TreeNodeSet& s) {
+  Assert (s.nNodes == nNodes, "Node set size mismatch");
+  for (size_t w = 0; w < bits.size(); ++w)
+    bits[w] |= s.bits[w];
+  return *this;
+}
+
+TreeNodeSet TreeNodeSet::complement() const {
+  TreeNodeSet c (*this);
+  for (auto& w : c.bits)
+    w = ~w;
+  if (nNodes & 63)
+    c.bits.back() &= (((uint64_t) 1) << (nNodes & 63)) - 1;
+  return c;
+}
+
+size_t TreeNodeSet::size() const {
+  size_t n = 0;
+  for (auto w : bits)
+    n += __builtin_popcountll (w);
+  return n;
+}
+
+vguard<TreeNodeIndex> TreeNodeSet::toVector() const {
+  vguard<TreeNodeIndex> v;
+  for (size_t w = 0; w < bits.size(); ++w)
+    for (uint64_t b = bits[w]; b; b &= b - 1)
+      v.push_back ((TreeNodeIndex) (w * 64 + __builtin_ctzll (b)));
+  return v;
+}
+
+TreeIndex::TreeIndex (const Tree& tree)
+  : rootNode (tree.root()),
+    parent (tree.nodes()),
+    branchLength (tree.nodes()),
+    depth (tree.nodes()),
+    rootDistance (tree.nodes()),
+    preorderStart (tree.nodes()),
+    preorderEnd (tree.nodes()),
+    eulerFirst (tree.nodes()),
+    downLeaf (tree.nodes(), -1),
+    upLeaf (tree.nodes(), -1),
+    downLeafDistance (tree.nodes(), 0),
+    upLeafDistance (tree.nodes(), 0),
+    child (tree.nodes())
+{
+  for (TreeNodeIndex n = 0; n < tree.nodes(); ++n) {
+    parent[n] = tree.parentNode(n);
+    branchLength[n] = tree.branchLength(n);
+    for (size_t c = 0; c < tree.nChildren(n); ++c)
+      child[n].push_back (tree.getChild(n,c));
+  }
+
+  // preorder intervals, depths and Euler tour
+  vguard<TreeNodeIndex> euler;
+  euler.reserve (2 * tree.nodes());
+  function<void(TreeNodeIndex)> visit;
+  visit = [&] (TreeNodeIndex n) -> void {
+    preorderStart[n] = preorder.size();
+    preorder.push_back (n);
+    eulerFirst[n] = euler.size();
+    euler.push_back (n);
+    for (auto c : child[n]) {
+      depth[c] = depth[n] + 1;
+      rootDistance[c] = rootDistance[n] + max (0., branchLength[c]);
+      visit (c);
+      euler.push_back (n);
+    }
+    preorderEnd[n] = preorder.size();
+  };
+  depth[rootNode] = 0;
+  rootDistance[rootNode] = 0;
+  visit (rootNode);
+  Assert (preorder.size() == parent.size(), "Tree is not connected");
+
+  // sparse table for range-minimum queries on the Euler tour
+  eulerMin.push_back (euler);
+  for (size_t k = 1; ((size_t) 1 << k) <= euler.size(); ++k) {
+    const vguard<TreeNodeIndex>& prev = eulerMin[k-1];
+    const size_t half = (size_t) 1 << (k-1);
+    vguard<TreeNodeIndex> next (euler.size() + 1 - 2*half);
+    for (size_t i = 0; i < next.size(); ++i)
+      next[i] = shallower (prev[i], prev[i + half]);
+    eulerMin.push_back (next);
+  }
+
+  // closest leaves: ties go to the first candidate, visiting children in order and then the parent, as in Tree::closestLeaf
+  for (auto iter = preorder.rbegin(); iter != preorder.rend(); ++iter) {
+    const TreeNodeIndex n = *iter;
+    if (child[n].empty())
+      downLeaf[n] = n;
+    else
+      for (size_t c = 0; c < child[n].size(); ++c) {
+	const TreeBranchLength d = downLeafDistance[child[n][c]] + branchLength[child[n][c]];
+	if (downLeaf[n] < 0 || d < downLeafDistance[n]) {
+	  downLeaf[n] = downLeaf[child[n][c]];
+	  downLeafDistance[n] = d;
+	}
+      }
+  }
+  for (auto p : preorder)
+    for (auto n : child[p])
+      for (size_t c = 0; c <= child[p].size(); ++c) {
+	TreeNodeIndex leaf;
+	TreeBranchLength d;
+	if (c < child[p].size()) {
+	  if (child[p][c] == n)
+	    continue;
+	  leaf = downLeaf[child[p][c]];
+	  d = downLeafDistance[child[p][c]] + branchLength[child[p][c]];
+	} else if (parent[p] >= 0) {
+	  leaf = upLeaf[p];
+	  d = upLeafDistance[p] + branchLength[p];
+	} else
+	  break;
+	if (upLeaf[n] < 0 || d < upLeafDistance[n]) {
+	  upLeaf[n] = leaf;
+	  upLeafDistance[n] = d;
+	}
+      }
+}
+
+TreeNodeIndex TreeIndex::mostRecentCommonAncestor (TreeNodeIndex node1, TreeNodeIndex node2) const {
+  size_t i = eulerFirst[node1], j = eulerFirst[node2];
+  if (i > j)
+    swap (i, j);
+  size_t k = 0;
+  while (((size_t) 2 << k) <= j + 1 - i)
+    ++k;
+  return shallower (eulerMin[k][i], eulerMin[k][j + 1 - ((size_t) 1 << k)]);
+}
+
+TreeBranchLength TreeIndex::distance (TreeNodeIndex node1, TreeNodeIndex node2) const {
+  return rootDistance[node1] + rootDistance[node2] - 2 * rootDistance[mostRecentCommonAncestor(node1,node2)];
+}
+
+TreeNodeSet TreeIndex::nodeAndAncestors (TreeNodeIndex node) const {
+  TreeNodeSet s (nodes());
+  for (; node >= 0; node = parent[node])
+    s.insert (node);
+  return s;
+}
+
+TreeNodeSet TreeIndex::nodeAndDescendants (TreeNodeIndex node) const {
+  TreeNodeSet s (nodes());
+  for (size_t i = preorderStart[node]; i < preorderEnd[node]; ++i)
+    s.insert (preorder[i]);
+  return s;
+}
+
+pair<TreeNodeIndex,TreeBranchLength> TreeIndex::closest (TreeNodeIndex node, TreeNodeIndex par) const {
+  if (par >= 0 && par == parent[node])
+    return pair<TreeNodeIndex,TreeBranchLength> (downLeaf[node], downLeafDistance[node]);
+  if (par >= 0) {
+    Assert (parent[par] == node, "Nodes %d and %d are not connected by a branch", node, par);
+    return pair<TreeNodeIndex,TreeBranchLength> (upLeaf[par], upLeafDistance[par]);
+  }
+  if (child[node].empty())
+    return pair<TreeNodeIndex,TreeBranchLength> (node, 0);
+  pair<TreeNodeIndex,TreeBranchLength> best (downLeaf[node], downLeafDistance[node]);
+  if (parent[node] >= 0) {
+    const TreeBranchLength d = upLeafDistance[node] + branchLength[node];
+    if (d < best.second)
+      best = pair<TreeNodeIndex,TreeBranchLength> (upLeaf[node], d);
+  }
+  return best;
+}
@@ -3,6 +3,7 @@
 
 #include <string>
 #include <set>
+#include <cstdint>
 #include "vguard.h"
 #include "fastseq.h"
 
@@ -46,6 +47,9 @@ struct Tree {
   set<TreeNodeIndex> nodeAndAncestors (TreeNodeIndex node) const;
   set<TreeNodeIndex> nodeAndDescendants (TreeNodeIndex node) const;
   TreeNodeIndex mostRecentCommonAncestor (TreeNodeIndex node1, TreeNodeIndex node2) const;
+
+  vguard<size_t> leafCount() const;  // number of leaves descended from each node (requires postorder-sorted tree)
+  vguard<TreeNodeIndex> cladeRoots (size_t maxLeaves) const;  // roots of maximal disjoint clades with at most maxLeaves leaves each
   
   TreeNodeIndex findNode (const string& name) const;
   bool hasNode (const string& name) const;
@@ -120,4 +124,72 @@ struct Tree {
   TreeNodeIndex closestLeaf (TreeNodeIndex node, TreeNodeIndex parent = -1) const;
 };
 
+// Set of tree nodes, as a bitset over node indices
+class TreeNodeSet {
+private:
+  vguard<uint64_t> bits;
+  TreeNodeIndex nNodes;
+public:
+  TreeNodeSet() : nNodes(0) { }
+  TreeNodeSet (TreeNodeIndex nodes, bool full = false);
+
+  inline bool count (TreeNodeIndex n) const { return (bits[n >> 6] >> (n & 63)) & 1; }
+  inline void insert (TreeNodeIndex n) { bits[n >> 6] |= ((uint64_t) 1) << (n & 63); }
+  inline void erase (TreeNodeIndex n) { bits[n >> 6] &= ~(((uint64_t) 1) << (n & 63)); }
+
+  TreeNodeSet& operator|= (const TreeNodeSet& s);
+  TreeNodeSet complement() const;
+
+  size_t size() const;
+  bool empty() const { return size() == 0; }
+  vguard<TreeNodeIndex> toVector() const;  // in increasing order of node index
+};
+
+// Immutable index of a tree's topology and branch lengths.
+// Ancestor tests and most recent common ancestors (via a sparse table over the Euler tour) take O(1),
+// closest leaves in either direction along a branch are precomputed, and node sets are bitsets.
+// Build a new index whenever the tree changes.
+class TreeIndex {
+private:
+  TreeNodeIndex rootNode;
+  vguard<TreeNodeIndex> parent;
+  vguard<TreeBranchLength> branchLength;
+  vguard<int> depth;  // number of branches between node and root
+  vguard<TreeBranchLength> rootDistance;
+  vguard<size_t> preorderStart, preorderEnd;  // node's descendants occupy [preorderStart,preorderEnd) in preorder
+  vguard<TreeNodeIndex> preorder;
+  vguard<size_t> eulerFirst;  // first visit to each node in Euler tour
+  vguard<vguard<TreeNodeIndex> > eulerMin;  // eulerMin[k][i] = shallowest node in Euler tour positions [i,i+2^k)
+  // closest leaf below each node, and (for non-root nodes) closest leaf reachable from the parent without passing through the node
+  vguard<TreeNodeIndex> downLeaf, upLeaf;
+  vguard<TreeBranchLength> downLeafDistance, upLeafDistance;
+  vguard<vguard<TreeNodeIndex> > child;
+
+  inline TreeNodeIndex shallower (TreeNodeIndex a, TreeNodeIndex b) const { return depth[b] < depth[a] ? b : a; }
+  pair<TreeNodeIndex,TreeBranchLength> closest (TreeNodeIndex node, TreeNodeIndex parent) const;
+
+public:
+  TreeIndex() : rootNode(-1) { }
+  TreeIndex (const Tree& tree);
+
+  TreeNodeIndex nodes() const { return parent.size(); }
+  TreeNodeIndex root() const { return rootNode; }
+
+  // true if anc is node, or one of node's ancestors
+  inline bool isAncestor (TreeNodeIndex anc, TreeNodeIndex node) const {
+    return preorderStart[anc] <= preorderStart[node] && preorderEnd[node] <= preorderEnd[anc];
+  }
+  TreeNodeIndex mostRecentCommonAncestor (TreeNodeIndex node1, TreeNodeIndex node2) const;
+  TreeBranchLength distance (TreeNodeIndex node1, TreeNodeIndex node2) const;
+
+  TreeNodeSet allNodes() const { return TreeNodeSet (nodes(), true); }
+  TreeNodeSet nodeAndAncestors (TreeNodeIndex node) const;
+  TreeNodeSet nodeAndDescendants (TreeNodeIndex node) const;
+  TreeNodeSet allExceptNodeAndAncestors (TreeNodeIndex node) const { return nodeAndAncestors(node).complement(); }
+
+  // same as Tree::closestLeaf, for parent adjacent to node (or -1 for no parent)
+  TreeNodeIndex closestLeaf (TreeNodeIndex node, TreeNodeIndex parent = -1) const { return closest(node,parent).first; }
+  TreeBranchLength closestLeafDistance (TreeNodeIndex node, TreeNodeIndex parent = -1) const { return closest(node,parent).second; }
+};
+
 #endif /* TREE_INCLUDED */
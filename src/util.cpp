@@ -106,3 +106,12 @@ std::string quoted_escaped (std::string const& s) {
   write_quoted_escaped (s, back_inserter(q));
   return q;
 }
+
+uint64_t stable_hash (const std::string& s) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
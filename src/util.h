@@ -11,6 +11,7 @@
 #include <cassert>
 #include <mutex>
 #include <iomanip>
+#include <cstdint>
 #include <sys/stat.h>
 
 /* uncomment to enable NaN checks */
@@ -135,10 +136,14 @@ OutIter write_quoted_escaped(std::string const& s, OutIter out) {
 
 std::string quoted_escaped (std::string const& s);
 
+/* stable_hash: 64-bit FNV-1a.
+   Unlike std::hash, the value is the same across runs & builds, so it can key files on disk */
+uint64_t stable_hash (const std::string& s);
+
 /* random_double */
 template<class Generator>
 double random_double (Generator& generator) {
-  return generator() / (((double) std::numeric_limits<typename Generator::result_type>::max()) + 1);
+  return (generator() - Generator::min()) / (((double) Generator::max() - (double) Generator::min()) + 1);
 }
 
 /* extract_keys */
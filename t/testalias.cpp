@@ -0,0 +1,51 @@
+#include <iostream>
+#include <cmath>
+#include <stdlib.h>
+#include "../src/alias.h"
+#include "../src/rng.h"
+
+using namespace std;
+
+// draws n samples and checks each outcome's frequency is within 5 standard errors of its probability
+bool frequenciesOk (const vguard<double>& weights, PhiloxEngine& generator, size_t n) {
+  const AliasSampler sampler (weights);
+  double norm = 0;
+  for (auto w : weights)
+    norm += w;
+  vguard<size_t> count (weights.size(), 0);
+  for (auto k : sampler.sample (generator, n)) {
+    if (k >= weights.size())
+      return false;
+    ++count[k];
+  }
+  for (size_t k = 0; k < weights.size(); ++k) {
+    const double p = weights[k] / norm;
+    if (p == 0 ? count[k] > 0 : abs ((double) count[k] / n - p) > 5 * sqrt (p * (1 - p) / n))
+      return false;
+  }
+  return true;
+}
+
+int main (int argc, char **argv) {
+  if (argc != 2) {
+    cout << "Usage: " << argv[0] << " <seed>\n";
+    exit (EXIT_FAILURE);
+  }
+  PhiloxEngine generator (strtoull (argv[1], NULL, 10));
+
+  cout << "single: " << (frequenciesOk (vguard<double> ({ 3 }), generator, 1000) ? "ok" : "failed") << endl;
+  cout << "uniform: " << (frequenciesOk (vguard<double> (20, 1.), generator, 100000) ? "ok" : "failed") << endl;
+  cout << "skewed: " << (frequenciesOk (vguard<double> ({ .5, 1e-3, 0, 10, 2, 0, 7.25 }), generator, 100000) ? "ok" : "failed") << endl;
+
+  // batched draws match one-at-a-time draws from the same stream
+  const AliasSampler sampler (vguard<double> ({ 1, 2, 3, 4 }));
+  PhiloxEngine g1 = generator.stream (1), g2 = generator.stream (1);
+  const vguard<size_t> batch = sampler.sample (g1, 50);
+  bool same = true;
+  for (auto k : batch)
+    if (k != sampler.sample (g2))
+      same = false;
+  cout << "batch: " << (same ? "ok" : "failed") << endl;
+
+  exit (EXIT_SUCCESS);
+}
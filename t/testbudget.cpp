@@ -0,0 +1,42 @@
+#include <iostream>
+#include <stdlib.h>
+#include "../src/recon.h"
+
+// chooses settings for a budget as "historian recon" does, and reports the ones the budget ladder controls
+void tune (const string& label, const string& seqsFilename, const string& modelFilename, deque<string> argvec) {
+  Reconstructor recon;
+  argvec.push_front (seqsFilename);
+  argvec.push_front ("-seqs");
+  argvec.push_back ("-model");
+  argvec.push_back (modelFilename);
+  while (recon.parseReconArgs (argvec)
+	 || recon.parseModelArgs (argvec)
+	 || recon.parseProfileArgs (argvec, false)
+	 || recon.parseSamplerArgs (argvec))
+    { }
+  Assert (argvec.empty(), "Unknown option %s", argvec.front().c_str());
+
+  recon.loadModel();
+  recon.loadSeqs();
+
+  cout << label << ": -band " << recon.maxDistanceFromGuide
+       << (recon.guideAlignTryAllPairs ? " -allspan" : " -rndspan")
+       << (recon.usePosteriorsForProfile ? " posterior profiles" : (" -profsamples " + to_string(recon.profileSamples)))
+       << (recon.profileNodeLimit ? (" -profmaxstates " + to_string(recon.profileNodeLimit)) : string())
+       << (recon.refineReconstruction ? " -refine" : " -norefine")
+       << endl;
+}
+
+int main (int argc, char **argv) {
+  if (argc != 3) {
+    cout << "Usage: " << argv[0] << " <seqs> <model>\n";
+    exit (EXIT_FAILURE);
+  }
+
+  tune ("generous", argv[1], argv[2], { "-budget-time", "1e9" });
+  tune ("tiny", argv[1], argv[2], { "-budget-time", "1e-9" });
+  tune ("tiny, explicit -band & -profsamples", argv[1], argv[2], { "-budget-time", "1e-9", "-band", "7", "-profsamples", "3" });
+  tune ("generous, explicit -profmaxstates", argv[1], argv[2], { "-budget-time", "1e9", "-profmaxstates", "50" });
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,145 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../src/trace.h"
+#include "../src/mcmcsummary.h"
+#include "../src/checkpoint.h"
+#include "../src/jsonutil.h"
+
+string readFile (const string& filename) {
+  ifstream in (filename, ios::binary);
+  ostringstream contents;
+  contents << in.rdbuf();
+  return contents.str();
+}
+
+string expandTrace (const string& filename) {
+  TraceReader reader (filename);
+  ostringstream out;
+  out << reader.name << endl;
+  while (reader.next()) {
+    out << reader.step << ' ' << reader.logLikelihood << ' ' << reader.history.tree.toString() << endl;
+    for (const auto& fs : reader.history.gapped)
+      out << fs.name << ' ' << fs.seq << endl;
+  }
+  return out.str();
+}
+
+string tempFilename() {
+  char filename[] = "/tmp/testcheckpointXXXXXX";
+  const int fd = mkstemp (filename);
+  Assert (fd >= 0, "Could not create temporary file");
+  close (fd);
+  return string (filename);
+}
+
+int main (int argc, char **argv) {
+  if (argc != 4) {
+    cout << "Usage: " << argv[0] << " <alignment> <tree> <alternate tree>\n";
+    exit (EXIT_FAILURE);
+  }
+
+  vguard<FastSeq> gapped = readFastSeqs (argv[1]);
+  ifstream treeStream (argv[2]), altTreeStream (argv[3]);
+  const Tree tree (JsonUtil::readStringFromStream (treeStream));
+  const Tree altTree (JsonUtil::readStringFromStream (altTreeStream));
+  tree.reorderSeqs (gapped);
+
+  // a sequence of states alternating between two trees, with some realigned rows
+  vguard<Sampler::History> states;
+  states.push_back (Sampler::History (gapped, tree));
+  Sampler::History h = states.back();
+  swap (h.gapped[0].seq[0], h.gapped[0].seq[1]);
+  states.push_back (h);
+  vguard<FastSeq> altGapped = h.gapped;
+  altTree.reorderSeqs (altGapped);
+  states.push_back (Sampler::History (altGapped, altTree));
+  states.push_back (states[0]);
+  states.push_back (states[2]);
+  states.push_back (states[1]);
+  states.push_back (states[2]);
+  const size_t checkpointStep = 3, crashStep = 5;
+
+  // checkpoint encoding round trip
+  const string checkpointFilename = tempFilename();
+  {
+    CheckpointWriter writer;
+    writer.writeVarint (300);
+    writer.writeInts (vguard<int> ({ -1, 0, 7 }));
+    writer.writeDouble (-0.1);
+    writer.writeTree (tree);
+    writer.writeSeqs (gapped);
+    writer.save (checkpointFilename);
+  }
+  {
+    CheckpointReader reader (checkpointFilename);
+    const bool ok = reader.readVarint() == 300
+      && reader.readInts() == vguard<int> ({ -1, 0, 7 })
+      && reader.readDouble() == -0.1
+      && reader.readTree().toString() == tree.toString();
+    const vguard<FastSeq> seqs = reader.readSeqs();
+    cout << "encoding: " << (ok && seqs.size() == gapped.size() && seqs[0].seq == gapped[0].seq && reader.finished() ? "ok" : "failed") << endl;
+  }
+
+  // uninterrupted run
+  const string traceFilename = tempFilename(), summaryFilename = tempFilename();
+  {
+    TraceWriter trace (traceFilename, "test", 2);
+    ofstream summaryFile (summaryFilename);
+    MCMCSummary summary ("test", summaryFile, 2);
+    for (size_t n = 0; n < states.size(); ++n) {
+      trace.logHistory (states[n], -(double) n, Sampler::Change (true));
+      summary.logHistory (states[n], -(double) n, Sampler::Change (true));
+    }
+  }
+
+  // run that checkpoints, carries on logging, then stops before the end
+  const string resumedTraceFilename = tempFilename(), resumedSummaryFilename = tempFilename();
+  {
+    TraceWriter trace (resumedTraceFilename, "test", 2);
+    ofstream summaryFile (resumedSummaryFilename);
+    MCMCSummary summary ("test", summaryFile, 2);
+    for (size_t n = 0; n < crashStep; ++n) {
+      if (n == checkpointStep) {
+	CheckpointWriter checkpoint;
+	trace.saveState (checkpoint);
+	summary.saveState (checkpoint);
+	summaryFile.flush();
+	checkpoint.writeVarint (summaryFile.tellp());
+	checkpoint.save (checkpointFilename);
+      }
+      trace.logHistory (states[n], -(double) n, Sampler::Change (true));
+      summary.logHistory (states[n], -(double) n, Sampler::Change (true));
+    }
+  }
+
+  // resume from the checkpoint
+  {
+    TraceWriter trace (resumedTraceFilename, "test", 2, true);
+    CheckpointReader checkpoint (checkpointFilename);
+    trace.loadState (checkpoint);
+    ofstream summaryFile (resumedSummaryFilename, ios::app);
+    MCMCSummary summary ("test", summaryFile, 2);
+    summary.loadState (checkpoint);
+    summaryFile.close();
+    truncateFile (resumedSummaryFilename, checkpoint.readVarint());
+    summaryFile.open (resumedSummaryFilename, ios::app);
+    Assert (checkpoint.finished(), "Unexpected trailing data in checkpoint");
+    for (size_t n = checkpointStep; n < states.size(); ++n) {
+      trace.logHistory (states[n], -(double) n, Sampler::Change (true));
+      summary.logHistory (states[n], -(double) n, Sampler::Change (true));
+    }
+  }
+
+  cout << "trace: " << (expandTrace (traceFilename) == expandTrace (resumedTraceFilename) ? "ok" : "failed") << endl;
+  cout << "summary: " << (readFile (summaryFilename) == readFile (resumedSummaryFilename) ? "ok" : "failed") << endl;
+
+  unlink (checkpointFilename.c_str());
+  unlink (traceFilename.c_str());
+  unlink (summaryFilename.c_str());
+  unlink (resumedTraceFilename.c_str());
+  unlink (resumedSummaryFilename.c_str());
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,40 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#include "../src/model.h"
+#include "../src/jsonutil.h"
+#include "../src/sumprod.h"
+
+int main (int argc, char **argv) {
+  if (argc != 2 && argc != 3) {
+    cout << "Usage: " << argv[0] << " <modelfile> [<time>]\n";
+    exit (EXIT_FAILURE);
+  }
+
+  RateModel rates;
+  ifstream in (argv[1]);
+  ParsedJson pj (in);
+  rates.read (pj.value);
+
+  stringstream compiled;
+  rates.writeCompiled (compiled);
+
+  RateModel loaded;
+  loaded.readCompiled (compiled);
+
+  if (argc == 2)
+    loaded.write (cout);
+  else {
+    // the EigenModel constructor picks up the eigensystem read from the compiled model
+    const double t = atof (argv[2]);
+    ProbModel probs (loaded, t);
+    EigenModel eigen (loaded);
+    for (auto& sm: probs.subMat)
+      gsl_matrix_free (sm);
+    probs.subMat = eigen.getSubProbMatrix (t);
+    probs.write (cout);
+  }
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,67 @@
+#include <iostream>
+#include <map>
+#include <set>
+#include <stdlib.h>
+#include "../src/flathash.h"
+#include "../src/forward.h"
+#include "../src/rng.h"
+
+using namespace std;
+
+int main (int argc, char **argv) {
+  if (argc != 2) {
+    cout << "Usage: " << argv[0] << " <seed>\n";
+    exit (EXIT_FAILURE);
+  }
+  PhiloxEngine generator (strtoull (argv[1], NULL, 10));
+
+  // random keys, with repeats, checked against std::map & std::set
+  FlatHashMap<int> hashMap;
+  FlatHashSet hashSet;
+  map<uint64_t,int> refMap;
+  bool mapOk = true, setOk = true;
+  for (int n = 0; n < 20000; ++n) {
+    const uint64_t k = generator() % 5000;
+    ++hashMap[k];
+    ++refMap[k];
+    if (hashSet.insert (k) != (refMap[k] == 1))
+      setOk = false;
+  }
+  if (hashMap.size() != refMap.size() || hashSet.size() != refMap.size())
+    mapOk = setOk = false;
+  for (const auto& kv : refMap) {
+    const int* v = hashMap.find (kv.first);
+    if (!v || *v != kv.second || !hashSet.count (kv.first))
+      mapOk = setOk = false;
+  }
+  if (hashMap.find (5000) || hashMap.count (5000) || hashSet.count (5000))
+    mapOk = setOk = false;
+  size_t visited = 0;
+  hashMap.visit ([&] (uint64_t k, int v) { if (refMap[k] == v) ++visited; });
+  cout << "map: " << (mapOk && visited == refMap.size() ? "ok" : "failed") << endl;
+  cout << "set: " << (setOk ? "ok" : "failed") << endl;
+
+  vguard<uint64_t> refKeys;
+  for (const auto& kv : refMap)
+    refKeys.push_back (kv.first);
+  cout << "sorted: " << (hashMap.sortedKeys() == refKeys && hashSet.sortedKeys() == refKeys ? "ok" : "failed") << endl;
+
+  // packed cell IDs round-trip, and sort in the same order as CellCoords
+  set<DPMatrix::CellCoords> refCells;
+  DPMatrix::CellSet cells;
+  for (int n = 0; n < 5000; ++n) {
+    const DPMatrix::CellCoords c (generator() % 3000, generator() % 3000, (PairHMM::State) (generator() % (PairHMM::EEE + 1)));
+    refCells.insert (c);
+    cells.insert (c);
+  }
+  const vguard<DPMatrix::CellCoords> sortedCells = cells.sorted();
+  bool cellsOk = sortedCells.size() == refCells.size() && cells.size() == refCells.size();
+  if (cellsOk)
+    cellsOk = equal (refCells.begin(), refCells.end(), sortedCells.begin());
+  for (const auto& c : refCells)
+    if (!(DPMatrix::cellCoords (DPMatrix::cellId (c)) == c) || !cells.count (c))
+      cellsOk = false;
+  cout << "cells: " << (cellsOk ? "ok" : "failed") << endl;
+
+  exit (EXIT_SUCCESS);
+}
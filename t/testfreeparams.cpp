@@ -0,0 +1,36 @@
+#include <iostream>
+#include <fstream>
+#include <string.h>
+#include "../src/model.h"
+#include "../src/jsonutil.h"
+#include "../src/util.h"
+
+// sets the model from its own free parameters, then checks that they read back unchanged
+void roundTrip (RateModel& rates, bool includeIndelRates, bool includeSubstRates) {
+  const vguard<double> all = rates.getFreeParams();
+  rates.setFreeParams (rates.getFreeParams (includeIndelRates, includeSubstRates), includeIndelRates, includeSubstRates);
+  const vguard<double> after = rates.getFreeParams();
+  Assert (all.size() == after.size(), "Parameter count changed");
+  for (size_t n = 0; n < all.size(); ++n)
+    Assert (abs (all[n] - after[n]) < 1e-9, "Free parameter #%u changed from %g to %g", n, all[n], after[n]);
+}
+
+int main (int argc, char **argv) {
+  if (argc != 2) {
+    cout << "Usage: " << argv[0] << " <modelfile>\n";
+    exit (EXIT_FAILURE);
+  }
+
+  RateModel rates;
+  ifstream in (argv[1]);
+  ParsedJson pj (in);
+  rates.read (pj.value);
+
+  roundTrip (rates, true, true);
+  roundTrip (rates, true, false);
+  roundTrip (rates, false, true);
+
+  rates.write (cout);
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,92 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../src/mcmcsummary.h"
+#include "../src/trace.h"
+#include "../src/jsonutil.h"
+
+// passes each state on as if everything had changed, so the logger takes its slow path
+struct FullChangeLogger : Sampler::Logger {
+  Sampler::Logger& logger;
+  FullChangeLogger (Sampler::Logger& logger) : logger (logger) { }
+  void logHistory (const Sampler::History& history, LogProb logLikelihood, const Sampler::Change& change) {
+    logger.logHistory (history, logLikelihood, Sampler::Change (true));
+  }
+};
+
+string expandTrace (const string& filename) {
+  TraceReader reader (filename);
+  ostringstream out;
+  while (reader.next()) {
+    out << reader.step << ' ' << reader.logLikelihood << ' ' << reader.history.tree.toString() << endl;
+    for (const auto& fs : reader.history.gapped)
+      out << fs.name << ' ' << fs.seq << endl;
+  }
+  return out.str();
+}
+
+string tempFilename() {
+  char filename[] = "/tmp/testlogchangeXXXXXX";
+  const int fd = mkstemp (filename);
+  Assert (fd >= 0, "Could not create temporary file");
+  close (fd);
+  return string (filename);
+}
+
+int main (int argc, char **argv) {
+  if (argc != 5) {
+    cout << "Usage: " << argv[0] << " <model> <alignment> <tree> <steps>\n";
+    exit (EXIT_FAILURE);
+  }
+
+  RateModel model;
+  ifstream in (argv[1]);
+  ParsedJson pj (in);
+  model.read (pj.value);
+
+  vguard<FastSeq> gapped = readFastSeqs (argv[2]);
+  ifstream treeStream (argv[3]);
+  Tree tree (JsonUtil::readStringFromStream (treeStream));
+  tree.assignInternalNodeNames (gapped);
+  const size_t steps = atoi (argv[4]);
+
+  SimpleTreePrior treePrior;
+  Sampler sampler (model, treePrior, gapped);
+
+  ostringstream incrementalOut, fullOut;
+  MCMCSummary incremental ("test", incrementalOut, 10), full ("test", fullOut, 10);
+  FullChangeLogger fullChange (full);
+  sampler.addLogger (incremental);
+  sampler.addLogger (fullChange);
+
+  const string incrementalTraceFilename = tempFilename(), fullTraceFilename = tempFilename();
+  TraceWriter* incrementalTrace = new TraceWriter (incrementalTraceFilename, "test", 50);
+  TraceWriter* fullTrace = new TraceWriter (fullTraceFilename, "test", 50);
+  FullChangeLogger fullTraceChange (*fullTrace);
+  sampler.addLogger (*incrementalTrace);
+  sampler.addLogger (fullTraceChange);
+
+  sampler.initialize (Sampler::History (gapped, tree), "test");
+  Sampler::random_engine generator;
+  for (size_t n = 0; n < steps; ++n)
+    sampler.sample (generator);
+  incremental.write (sampler.currentHistory);
+  full.write (sampler.currentHistory);
+  delete incrementalTrace;
+  delete fullTrace;
+  const string incrementalStates = expandTrace (incrementalTraceFilename), fullStates = expandTrace (fullTraceFilename);
+  unlink (incrementalTraceFilename.c_str());
+  unlink (fullTraceFilename.c_str());
+
+  // the test is only meaningful if the tree & alignment both changed
+  const bool treeMoved = sampler.movesAccepted[Sampler::Move::PruneAndRegraft] > 0;
+  const bool realigned = sampler.movesAccepted[Sampler::Move::BranchAlign] + sampler.movesAccepted[Sampler::Move::NodeAlign] > 0;
+
+  cout << "summary: " << (incrementalOut.str() == fullOut.str() && incrementalOut.str().size() ? "ok" : "failed") << endl;
+  cout << "trace: " << (incrementalStates == fullStates && incrementalStates.size() ? "ok" : "failed") << endl;
+  cout << "tree & alignment changed: " << (treeMoved && realigned ? "yes" : "no") << endl;
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,53 @@
+#include <iostream>
+#include <fstream>
+#include <stdlib.h>
+#include "../src/mcmcsummary.h"
+#include "../src/jsonutil.h"
+
+int main (int argc, char **argv) {
+  if (argc != 4) {
+    cout << "Usage: " << argv[0] << " <alignment> <tree> <alternate tree>\n";
+    exit (EXIT_FAILURE);
+  }
+
+  vguard<FastSeq> gapped = readFastSeqs (argv[1]);
+  ifstream treeStream (argv[2]), altTreeStream (argv[3]);
+  const Tree tree (JsonUtil::readStringFromStream (treeStream));
+  const Tree altTree (JsonUtil::readStringFromStream (altTreeStream));
+
+  tree.reorderSeqs (gapped);
+  Sampler::History history (gapped, tree);
+
+  // same tree, but the last residue of the last leaf shifted one column right
+  Sampler::History realigned (history);
+  TreeNodeIndex lastLeaf = 0;
+  for (TreeNodeIndex n = 0; n < tree.nodes(); ++n)
+    if (tree.isLeaf(n))
+      lastLeaf = n;
+  string& row = realigned.gapped[lastLeaf].seq;
+  const size_t lastRes = row.find_last_not_of ("-");
+  Assert (lastRes + 1 < row.size(), "Last residue of %s is in the last column", tree.seqName(lastLeaf).c_str());
+  swap (row[lastRes], row[lastRes+1]);
+
+  vguard<FastSeq> altGapped = gapped;
+  altTree.reorderSeqs (altGapped);
+  Sampler::History rearranged (altGapped, altTree);
+
+  // what the sampler would report for each step
+  const Sampler::Change anyChange (true), noChange;
+  Sampler::Change lastLeafRealigned;
+  lastLeafRealigned.alignment = true;
+  lastLeafRealigned.realigned = TreeNodeSet (tree.nodes());
+  lastLeafRealigned.realigned.insert (lastLeaf);
+
+  MCMCSummary summary ("test", cout, 4);
+  summary.logHistory (history, -10, anyChange);
+  summary.logHistory (history, -11, noChange);
+  summary.logHistory (realigned, -12, lastLeafRealigned);
+  summary.logHistory (history, -10, lastLeafRealigned);  // writes a record
+  summary.logHistory (rearranged, -14, anyChange);
+  summary.logHistory (rearranged, -13, noChange);
+  summary.write (rearranged);
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,35 @@
+#include <iostream>
+#include <stdlib.h>
+#include "../src/seqgraph.h"
+#include "../src/rng.h"
+
+using namespace std;
+
+// random DAG with null nodes, duplicate nodes, single-character nodes & chains
+int main (int argc, char **argv) {
+  if (argc != 3) {
+    cout << "Usage: " << argv[0] << " <seed> <nodes>\n";
+    exit (EXIT_FAILURE);
+  }
+  PhiloxEngine generator (strtoull (argv[1], NULL, 10));
+  const size_t nodes = atoi (argv[2]);
+  const char* seqs[] = { "", "", "A", "C", "G", "T", "AC" };
+
+  SeqGraph g;
+  for (size_t n = 0; n < nodes; ++n) {
+    g.node.push_back (SeqGraph::Node());
+    g.node.back().seq = seqs[generator() % 7];
+  }
+  for (size_t n = 0; n + 1 < nodes; ++n) {
+    const size_t out = 1 + generator() % 3;
+    for (size_t k = 0; k < out; ++k) {
+      const size_t dest = n + 1 + generator() % min ((size_t) 6, nodes - n - 1);
+      g.edge.push_back (SeqGraph::Edge (n, dest));
+    }
+  }
+  g.buildIndices();
+  g.simplify();
+  g.writeDot (cout);
+
+  exit (EXIT_SUCCESS);
+}
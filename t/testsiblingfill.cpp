@@ -0,0 +1,158 @@
+#include <iostream>
+#include <fstream>
+#include <stdlib.h>
+#include "../src/sampler.h"
+#include "../src/jsonutil.h"
+
+typedef Sampler::SiblingMatrix SM;
+
+// exact log(exp(a)+exp(b)), so the reference does not inherit the lookup-table error of log_sum_exp
+LogProb logAdd (LogProb a, LogProb b) {
+  if (a < b)
+    swap (a, b);
+  return b == -numeric_limits<double>::infinity() ? a : a + log1p (exp (b - a));
+}
+
+LogProb logAdd (LogProb a, LogProb b, LogProb c) { return logAdd (logAdd (a, b), c); }
+LogProb logAdd (LogProb a, LogProb b, LogProb c, LogProb d) { return logAdd (logAdd (a, b, c), d); }
+
+struct Cell {
+  LogProb lp[SM::EEE];
+  Cell() { fill (lp, lp + SM::EEE, -numeric_limits<double>::infinity()); }
+  LogProb& operator() (SM::State s) { return lp[s]; }
+  LogProb operator() (SM::State s) const { return lp[s]; }
+};
+
+// the Forward fill in log space, cell by cell, as it was before the linear-space fill
+struct LogSpaceFill {
+  const SM& m;
+  map<pair<SeqIdx,SeqIdx>,Cell> cells;
+  Cell empty;
+  LogProb lpEnd;
+
+  const Cell& at (SeqIdx xpos, SeqIdx ypos) const {
+    const auto iter = cells.find (pair<SeqIdx,SeqIdx> (xpos, ypos));
+    return iter == cells.end() ? empty : iter->second;
+  }
+
+  LogSpaceFill (const SM& m, SeqIdx xSize, SeqIdx ySize) : m(m) {
+    auto t = [&] (SM::State src, SM::State dest) { return m.trans[src][dest]; };
+    for (SeqIdx xpos = 0; xpos < xSize; ++xpos)
+      for (SeqIdx ypos = 0; ypos < ySize; ++ypos)
+	if (m.inEnvelope (xpos, ypos)) {
+	  Cell& dest = cells[pair<SeqIdx,SeqIdx> (xpos, ypos)];
+	  if (xpos == 0 && ypos == 0) {
+	    dest(SM::SSS) = 0;
+	    dest(SM::WWW) = t(SM::IMM,SM::WWW);
+	  }
+	  if (xpos > 0) {
+	    const Cell& lSrc = at (xpos - 1, ypos);
+	    const LogProb e = m.lEmit[xpos - 1];
+	    dest(SM::IIW) = e + logAdd (lSrc(SM::IMM) + t(SM::IMM,SM::IIW), lSrc(SM::IMI) + t(SM::IMI,SM::IIW), lSrc(SM::IIW) + t(SM::IIW,SM::IIW));
+	    dest(SM::IIX) = e + logAdd (lSrc(SM::IMD) + t(SM::IMD,SM::IIX), lSrc(SM::IIX) + t(SM::IIX,SM::IIX));
+	    dest(SM::IMD) = e + logAdd (lSrc(SM::WWW) + t(SM::WWW,SM::IMD), lSrc(SM::WWX) + t(SM::WWX,SM::IMD), lSrc(SM::WXW) + t(SM::WXW,SM::IMD), lSrc(SM::IDD) + t(SM::IDD,SM::IMD));
+	    dest(SM::WWW) = dest(SM::IIW) + t(SM::IIW,SM::WWW);
+	    dest(SM::WWX) = logAdd (dest(SM::IIX) + t(SM::IIX,SM::WWX), dest(SM::IMD) + t(SM::IMD,SM::WWX));
+	  }
+	  if (ypos > 0) {
+	    const Cell& rSrc = at (xpos, ypos - 1);
+	    const LogProb e = m.rEmit[ypos - 1];
+	    dest(SM::IMI) = e + logAdd (rSrc(SM::IMM) + t(SM::IMM,SM::IMI), rSrc(SM::IMI) + t(SM::IMI,SM::IMI));
+	    dest(SM::IDI) = e + logAdd (rSrc(SM::IDM) + t(SM::IDM,SM::IDI), rSrc(SM::IDI) + t(SM::IDI,SM::IDI));
+	    dest(SM::IDM) = e + logAdd (rSrc(SM::WWW) + t(SM::WWW,SM::IDM), rSrc(SM::WWX) + t(SM::WWX,SM::IDM), rSrc(SM::WXW) + t(SM::WXW,SM::IDM), rSrc(SM::IDD) + t(SM::IDD,SM::IDM));
+	    dest(SM::WWW) = logAdd (dest(SM::WWW), dest(SM::IMI) + t(SM::IMI,SM::WWW));
+	    dest(SM::WXW) = logAdd (dest(SM::IDI) + t(SM::IDI,SM::WXW), dest(SM::IDM) + t(SM::IDM,SM::WXW));
+	  }
+	  if (xpos > 0 && ypos > 0) {
+	    const Cell& lrSrc = at (xpos - 1, ypos - 1);
+	    dest(SM::IMM) = m.logMatch (xpos, ypos) + logAdd (lrSrc(SM::WWW) + t(SM::WWW,SM::IMM), lrSrc(SM::WWX) + t(SM::WWX,SM::IMM), lrSrc(SM::WXW) + t(SM::WXW,SM::IMM), lrSrc(SM::IDD) + t(SM::IDD,SM::IMM));
+	    dest(SM::WWW) = logAdd (dest(SM::WWW), dest(SM::IMM) + t(SM::IMM,SM::WWW));
+	  }
+	  dest(SM::IDD) = logAdd (dest(SM::WWW) + t(SM::WWW,SM::IDD), dest(SM::WWX) + t(SM::WWX,SM::IDD), dest(SM::WXW) + t(SM::WXW,SM::IDD));
+	}
+    const Cell& endCell = at (xSize - 1, ySize - 1);
+    lpEnd = logAdd (endCell(SM::IDD) + t(SM::IDD,SM::EEE), endCell(SM::WWW) + t(SM::WWW,SM::EEE), endCell(SM::WWX) + t(SM::WWX,SM::EEE), endCell(SM::WXW) + t(SM::WXW,SM::EEE));
+  }
+};
+
+bool near (LogProb a, LogProb b) {
+  if (a == -numeric_limits<double>::infinity() || b == -numeric_limits<double>::infinity())
+    return a == b;
+  return abs (a - b) <= 1e-6 * max (1., abs (a));
+}
+
+int main (int argc, char **argv) {
+  if (argc != 5) {
+    cout << "Usage: " << argv[0] << " <model> <alignment> <tree> <band>\n";
+    exit (EXIT_FAILURE);
+  }
+
+  RateModel model;
+  ifstream in (argv[1]);
+  ParsedJson pj (in);
+  model.read (pj.value);
+
+  vguard<FastSeq> gapped = readFastSeqs (argv[2]);
+  ifstream treeStream (argv[3]);
+  Tree tree (JsonUtil::readStringFromStream (treeStream));
+  tree.assignInternalNodeNames (gapped);
+
+  SimpleTreePrior treePrior;
+  Sampler sampler (model, treePrior, gapped);
+  sampler.maxDistanceFromGuide = atoi (argv[4]);
+
+  const Sampler::History history (gapped, tree);
+  const TreeIndex& treeIndex = history.treeIndex();
+  const Alignment& align = history.alignment();
+  Sampler::random_engine generator;
+
+  size_t nodes = 0, cells = 0, mismatches = 0, badPaths = 0;
+  for (TreeNodeIndex node = 0; node < tree.nodes(); ++node)
+    if (tree.nChildren(node) == 2) {
+      const TreeNodeIndex leftChild = tree.getChild (node, 0), rightChild = tree.getChild (node, 1);
+      const TreeNodeIndex parent = tree.parentNode (node);
+      const TreeNodeIndex leftChildClosestLeaf = treeIndex.closestLeaf (leftChild, node);
+      const TreeNodeIndex rightChildClosestLeaf = treeIndex.closestLeaf (rightChild, node);
+      const AlignPath siblingPath = Sampler::triplePath (align.path, leftChild, rightChild, node);
+
+      map<TreeNodeIndex,TreeNodeIndex> exclude;
+      exclude[leftChild] = node;
+      exclude[rightChild] = node;
+      if (parent >= 0) {
+	exclude[node] = parent;
+	exclude[parent] = node;
+      }
+      const auto pwms = sampler.getConditionalPWMs (tree, gapped, exclude, treeIndex.allExceptNodeAndAncestors(parent>=0?parent:node), parent >= 0 ? treeIndex.nodeAndAncestors(parent) : TreeNodeSet(treeIndex.nodes()));
+
+      const vguard<SeqIdx> lEnvPos = sampler.guideSeqPos (align.path, leftChild, leftChildClosestLeaf);
+      const vguard<SeqIdx> rEnvPos = sampler.guideSeqPos (align.path, rightChild, rightChildClosestLeaf);
+      const GuideAlignmentEnvelope env = sampler.makeGuide (tree, leftChildClosestLeaf, rightChildClosestLeaf, siblingPath, leftChild, rightChild);
+
+      const SM linear (model, pwms.at(leftChild), pwms.at(rightChild), tree.branchLength(node,leftChild), tree.branchLength(node,rightChild), env, lEnvPos, rEnvPos, leftChild, rightChild, node);
+      const LogSpaceFill reference (linear, lEnvPos.size(), rEnvPos.size());
+
+      for (const auto& xy_cell : reference.cells) {
+	for (size_t s = 0; s < (size_t) SM::EEE; ++s)
+	  if (!near (linear.cell (xy_cell.first.first, xy_cell.first.second, s), xy_cell.second.lp[s])) {
+	    if (++mismatches <= 10)
+	      cout << "node " << node << " cell (" << xy_cell.first.first << "," << xy_cell.first.second << ") state " << s << ": " << linear.cell (xy_cell.first.first, xy_cell.first.second, s) << " != " << xy_cell.second.lp[s] << endl;
+	  }
+	++cells;
+      }
+      if (!near (linear.lpEnd, reference.lpEnd)) {
+	++mismatches;
+	cout << "node " << node << " end: " << linear.lpEnd << " != " << reference.lpEnd << endl;
+      }
+
+      const LogProb lpOld = linear.logPostProb (siblingPath), lpSampled = linear.logPostProb (linear.sample (generator));
+      if (!(lpOld <= 0 && lpSampled <= 0 && lpSampled > -numeric_limits<double>::infinity()))
+	++badPaths;
+      ++nodes;
+    }
+
+  cout << "nodes: " << (nodes == (size_t) (tree.nodes() - 1) / 2 ? "ok" : "failed") << endl;
+  cout << "cells: " << (cells > 0 && mismatches == 0 ? "ok" : "failed") << endl;
+  cout << "paths: " << (badPaths == 0 ? "ok" : "failed") << endl;
+
+  exit (EXIT_SUCCESS);
+}
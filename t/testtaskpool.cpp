@@ -0,0 +1,68 @@
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <stdlib.h>
+#include "../src/taskpool.h"
+#include "../src/vguard.h"
+
+using namespace std;
+
+int main (int argc, char **argv) {
+  if (argc != 2) {
+    cout << "Usage: " << argv[0] << " <threads>\n";
+    exit (EXIT_FAILURE);
+  }
+
+  taskPool.setThreads (atoi (argv[1]));
+
+  // parallel-for
+  const size_t n = 10000;
+  vguard<double> v (n);
+  taskPool.parallelFor (0, n, [&] (size_t i) { v[i] = sqrt ((double) i); });
+  size_t bad = 0;
+  for (size_t i = 0; i < n; ++i)
+    if (v[i] != sqrt ((double) i))
+      ++bad;
+  cout << "parallelFor mismatches: " << bad << endl;
+
+  // deterministic reduction (printed to full precision, so any reordering would show)
+  const double sum = taskPool.reduce<double> (0, n, 0., [&] (size_t i) { return 1. / (1. + v[i]); }, [] (const double& a, const double& b) { return a + b; });
+  cout << "reduce: " << setprecision(17) << sum << endl;
+
+  // task graph: a diamond, run many times
+  bool orderOk = true;
+  for (int rep = 0; rep < 100; ++rep) {
+    vguard<int> done (4, 0);
+    TaskPool::TaskGraph graph;
+    const size_t a = graph.add ([&] { done[0] = 1; });
+    const size_t b = graph.add ([&] { if (!done[0]) orderOk = false; done[1] = 1; }, { a });
+    const size_t c = graph.add ([&] { if (!done[0]) orderOk = false; done[2] = 1; }, { a });
+    graph.add ([&] { if (!done[1] || !done[2]) orderOk = false; done[3] = 1; }, { b, c });
+    graph.run (taskPool);
+    if (!done[3])
+      orderOk = false;
+  }
+  cout << "task graph order: " << (orderOk ? "ok" : "violated") << endl;
+
+  // nested parallelism
+  vguard<size_t> rowSum (64, 0);
+  taskPool.parallelFor (0, rowSum.size(), [&] (size_t row) {
+      rowSum[row] = taskPool.reduce<size_t> (0, 1000, 0, [&] (size_t col) { return row * col; }, [] (const size_t& a, const size_t& b) { return a + b; });
+    }, 1);
+  size_t total = 0;
+  for (auto s : rowSum)
+    total += s;
+  cout << "nested total: " << total << endl;
+
+  // per-thread scratch arena
+  MonotonicArena& arena = TaskPool::scratch();
+  int* ints = arena.allocArray<int> (1000);
+  for (int i = 0; i < 1000; ++i)
+    ints[i] = i;
+  double* big = arena.allocArray<double> (1 << 20);
+  big[(1 << 20) - 1] = 1;
+  cout << "arena: " << ints[999] << " " << big[(1 << 20) - 1] << " " << (((uintptr_t) big) % alignof(double)) << endl;
+  arena.reset();
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,71 @@
+#include <iostream>
+#include <fstream>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../src/trace.h"
+#include "../src/jsonutil.h"
+
+bool historiesEqual (const Sampler::History& a, const Sampler::History& b) {
+  if (a.tree.toString() != b.tree.toString() || a.gapped.size() != b.gapped.size())
+    return false;
+  for (size_t n = 0; n < a.gapped.size(); ++n)
+    if (a.gapped[n].name != b.gapped[n].name || a.gapped[n].seq != b.gapped[n].seq)
+      return false;
+  return true;
+}
+
+int main (int argc, char **argv) {
+  if (argc != 4) {
+    cout << "Usage: " << argv[0] << " <alignment> <tree> <alternate tree>\n";
+    exit (EXIT_FAILURE);
+  }
+
+  vguard<FastSeq> gapped = readFastSeqs (argv[1]);
+  ifstream treeStream (argv[2]), altTreeStream (argv[3]);
+  const Tree tree (JsonUtil::readStringFromStream (treeStream));
+  const Tree altTree (JsonUtil::readStringFromStream (altTreeStream));
+  tree.reorderSeqs (gapped);
+
+  // a sequence of states: realigned rows, an extra column, a rearranged tree
+  vguard<Sampler::History> states;
+  states.push_back (Sampler::History (gapped, tree));
+  Sampler::History h = states.back();
+  swap (h.gapped[0].seq[0], h.gapped[0].seq[1]);
+  states.push_back (h);
+  states.push_back (h);
+  for (auto& fs : h.gapped)
+    fs.seq.insert (3, 1, '-');
+  states.push_back (h);
+  vguard<FastSeq> altGapped = h.gapped;
+  altTree.reorderSeqs (altGapped);
+  states.push_back (Sampler::History (altGapped, altTree));
+  h = states.back();
+  h.tree.node[0].d *= 2;
+  states.push_back (h);
+
+  char filename[] = "/tmp/testtraceXXXXXX";
+  const int fd = mkstemp (filename);
+  Assert (fd >= 0, "Could not create temporary file");
+  close (fd);
+
+  {
+    TraceWriter writer (filename, "test", 4);
+    for (size_t n = 0; n < states.size(); ++n)
+      writer.logHistory (states[n], -(double) n, Sampler::Change (true));
+  }
+
+  TraceReader reader (filename);
+  cout << "name: " << reader.name << endl;
+  size_t n = 0;
+  bool ok = true;
+  while (reader.next()) {
+    if (n >= states.size() || reader.step != n || reader.logLikelihood != -(double) n || !historiesEqual (reader.history, states[n]))
+      ok = false;
+    ++n;
+  }
+  cout << "states: " << n << endl;
+  cout << "round trip: " << (ok && n == states.size() ? "ok" : "failed") << endl;
+
+  unlink (filename);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,51 @@
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include "../src/tree.h"
+#include "../src/jsonutil.h"
+
+// checks every TreeIndex query against the corresponding Tree method
+int main (int argc, char **argv) {
+  if (argc != 2) {
+    cout << "Usage: " << argv[0] << " <treefile>\n";
+    exit (EXIT_FAILURE);
+  }
+
+  ifstream in (argv[1]);
+  const Tree tree (JsonUtil::readStringFromStream (in));
+  const TreeIndex index (tree);
+  const TreeNodeIndex nodes = tree.nodes();
+
+  bool setsOk = true, ancOk = true, lcaOk = true, distOk = true, leafOk = true;
+  for (TreeNodeIndex n = 0; n < nodes; ++n) {
+    const set<TreeNodeIndex> anc = tree.nodeAndAncestors (n), desc = tree.nodeAndDescendants (n);
+    if (index.nodeAndAncestors(n).toVector() != vguard<TreeNodeIndex> (anc.begin(), anc.end())
+	|| index.nodeAndDescendants(n).toVector() != vguard<TreeNodeIndex> (desc.begin(), desc.end())
+	|| index.allExceptNodeAndAncestors(n).size() != nodes - anc.size())
+      setsOk = false;
+
+    const auto dist = tree.distanceFrom (n);
+    for (TreeNodeIndex m = 0; m < nodes; ++m) {
+      if (index.isAncestor (n, m) != (tree.nodeAndAncestors(m).count(n) > 0))
+	ancOk = false;
+      if (index.mostRecentCommonAncestor (n, m) != tree.mostRecentCommonAncestor (n, m))
+	lcaOk = false;
+      if (abs (index.distance (n, m) - dist[m]) > 1e-9)
+	distOk = false;
+    }
+
+    if (index.closestLeaf (n) != tree.closestLeaf (n))
+      leafOk = false;
+    const TreeNodeIndex p = tree.parentNode (n);
+    if (p >= 0 && (index.closestLeaf (n, p) != tree.closestLeaf (n, p) || index.closestLeaf (p, n) != tree.closestLeaf (p, n)))
+      leafOk = false;
+  }
+
+  cout << "sets: " << (setsOk ? "ok" : "failed") << endl;
+  cout << "ancestors: " << (ancOk ? "ok" : "failed") << endl;
+  cout << "lca: " << (lcaOk ? "ok" : "failed") << endl;
+  cout << "distance: " << (distOk ? "ok" : "failed") << endl;
+  cout << "closest leaf: " << (leafOk ? "ok" : "failed") << endl;
+
+  exit (EXIT_SUCCESS);
+}
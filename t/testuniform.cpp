@@ -0,0 +1,47 @@
+#include <iostream>
+#include <stdlib.h>
+#include <gsl/gsl_linalg.h>
+#include "../src/model.h"
+#include "../src/presets.h"
+
+// compares the uniformized matrix exponential of a sparse (codon) rate matrix to GSL's Pade approximant
+int main (int argc, char **argv) {
+  if (argc != 3) {
+    cout << "Usage: " << argv[0] << " <modelname> <time>\n";
+    exit (EXIT_FAILURE);
+  }
+
+  const RateModel rates = namedModel (argv[1]);
+  const double t = atof (argv[2]);
+
+  for (int cpt = 0; cpt < rates.components(); ++cpt) {
+    const SparseRateMatrix sparse (rates.subRate[cpt]);
+    cout << "Component #" << cpt << " sparse: " << (sparse.density() <= MaxUniformizationDensity ? "yes" : "no")
+	 << ", uniformized: " << (sparse.useUniformization (t) ? "yes" : "no") << endl;
+
+    gsl_matrix* unif = sparse.exponentiate (t);
+    gsl_matrix* pade = rates.newAlphabetMatrix();
+    gsl_matrix* rt = rates.newAlphabetMatrix();
+    gsl_matrix_memcpy (rt, rates.subRate[cpt]);
+    gsl_matrix_scale (rt, t);
+    gsl_linalg_exponential_ss (rt, pade, GSL_PREC_DOUBLE);
+
+    double maxDiff = 0, maxRowSumErr = 0;
+    for (AlphTok i = 0; i < rates.alphabetSize(); ++i) {
+      double rowSum = 0;
+      for (AlphTok j = 0; j < rates.alphabetSize(); ++j) {
+	maxDiff = max (maxDiff, abs (gsl_matrix_get (unif, i, j) - gsl_matrix_get (pade, i, j)));
+	rowSum += gsl_matrix_get (unif, i, j);
+      }
+      maxRowSumErr = max (maxRowSumErr, abs (rowSum - 1));
+    }
+    cout << "Component #" << cpt << " agrees with Pade: " << (maxDiff < 1e-12 ? "ok" : "failed") << endl;
+    cout << "Component #" << cpt << " rows sum to 1: " << (maxRowSumErr < 1e-12 ? "ok" : "failed") << endl;
+
+    gsl_matrix_free (unif);
+    gsl_matrix_free (pade);
+    gsl_matrix_free (rt);
+  }
+
+  exit (EXIT_SUCCESS);
+}
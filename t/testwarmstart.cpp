@@ -0,0 +1,52 @@
+#include <iostream>
+#include <stdlib.h>
+#include "../src/recon.h"
+
+// fits a model as "historian fit" does, with a given warm-start band (<0 for no warm start).
+// The model is already at an EM fixed point, so any probability lost to the band shows up as a drop in log-likelihood
+LogProb fitModel (const string& modelFilename, const string& guideFilename, const string& treeFilename, int warmStartBand, size_t& widenings) {
+  Reconstructor recon;
+  recon.reconstructRoot = false;
+  recon.accumulateSubstCounts = true;
+  recon.accumulateIndelCounts = true;
+
+  deque<string> argvec = { "-model", modelFilename, "-guide", guideFilename, "-tree", treeFilename, "-maxiter", "3" };
+  while (recon.parseModelArgs (argvec)
+	 || recon.parseProfileArgs (argvec, true)
+	 || recon.parseFitArgs (argvec))
+    { }
+  Assert (argvec.empty(), "Unknown option %s", argvec.front().c_str());
+
+  recon.warmStartEM = warmStartBand >= 0;
+  recon.emWarmStartBand = warmStartBand;
+
+  recon.loadModel();
+  recon.loadSeqs();
+  recon.loadRecon();
+  recon.loadCounts();
+  recon.fit();
+
+  widenings = recon.emBandWidenings;
+  return recon.emLogLikelihood;
+}
+
+bool near (LogProb a, LogProb b) {
+  return abs (a - b) < 1e-3 * abs (a);
+}
+
+int main (int argc, char **argv) {
+  if (argc != 4) {
+    cout << "Usage: " << argv[0] << " <model> <guide> <tree>\n";
+    exit (EXIT_FAILURE);
+  }
+
+  size_t plainWidenings, warmWidenings, narrowWidenings;
+  const LogProb plain = fitModel (argv[1], argv[2], argv[3], -1, plainWidenings);
+  const LogProb warm = fitModel (argv[1], argv[2], argv[3], DefaultEMWarmStartBand, warmWidenings);
+  fitModel (argv[1], argv[2], argv[3], 0, narrowWidenings);
+
+  cout << "warm start matches plain EM: " << (near (plain, warm) ? "yes" : "no") << endl;
+  cout << "narrow band widened: " << (narrowWidenings > 0 ? "yes" : "no") << endl;
+
+  exit (EXIT_SUCCESS);
+}
@@ -8,6 +8,7 @@
 #include "../src/vguard.h"
 #include "../src/optparser.h"
 #include "../src/recon.h"
+#include "../src/taskpool.h"
 
 // GNU --version
 #define HISTORIAN_PROGNAME "historian"
@@ -18,7 +19,7 @@ struct ProgUsage : OptParser {
 };
 
 ProgUsage::ProgUsage (int argc, char** argv)
-  : OptParser (argc, argv, HISTORIAN_PROGNAME, "{recon,count,fit,mcmc,generate,help,version} [options]")
+  : OptParser (argc, argv, HISTORIAN_PROGNAME, "{recon,count,fit,mcmc,generate,expand,compile-model,help,version} [options]")
 {
   text = briefText
     + "\n"
@@ -39,9 +40,17 @@ ProgUsage::ProgUsage (int argc, char** argv)
     + "  " + prog + " fit seqs.fa >newmodel.json\n"
     + "  " + prog + " fit -counts counts.json >newmodel.json\n"
     + "\n"
+    + "Model compilation (binary, with precomputed eigensystems, for fast loading):\n"
+    + "  " + prog + " compile-model model.json >model.bin\n"
+    + "  " + prog + " recon seqs.fa -model model.bin >reconstruction.stk\n"
+    + "\n"
     + "Simulation:\n"
     + "  " + prog + " generate [-model model.json] [-rootlen N] tree.nh >sim.stk\n"
     + "\n"
+    + "MCMC trace expansion:\n"
+    + "  " + prog + " mcmc seqs.fa -bintrace trace.bin >reconstruction.stk\n"
+    + "  " + prog + " expand [-model model.json] trace.bin.1 >trace.stk\n"
+    + "\n"
     + "Commands can be abbreviated to single letters, like so:\n"
     + "  " + prog + " r seqs.fa >reconstruction.stk\n"
     + "  " + prog + " c seqs.fa >counts.json\n"
@@ -56,7 +65,8 @@ ProgUsage::ProgUsage (int argc, char** argv)
     + "\n"
     + "Model specification options\n"
     + "~~~~~~~~~~~~~~~~~~~~~~~~~~~\n"
-    + "  -model <file>   Load substitution & indel model from file (JSON)\n"
+    + "  -model <file>   Load substitution & indel model from file\n"
+    + "                   (JSON, or binary from compile-model)\n"
     + "  -preset <name>  Select preset model by name\n"
     + "                   (jc, jcrna, dayhoff, jtt, wag, lg, ECMrest, ECMunrest)\n"
     + "\n"
@@ -100,6 +110,10 @@ ProgUsage::ProgUsage (int argc, char** argv)
     + "\n"
     + "  -band <n>       Size of band around guide alignment (default " + to_string(DefaultMaxDistanceFromGuide) + ")\n"
     + "  -noband         Unlimit band, removing dependence on guide alignment\n"
+    + "  -adaptband      Adapt band to each subtree, starting from -band: widen it when\n"
+    + "                   posterior mass at its edge is high, halve it when hardly any\n"
+    + "                   lies outside the halved band\n"
+    + "  -bandedge <P>   Target posterior mass at edge of adaptive band (default " + to_string(DefaultMaxBandEdgePostProb) + ")\n"
     + "\n"
     + "The reconstructed parent profile is a weighted finite-state transducer\n"
     + "sampled from the posterior distribution implied by the children. The\n"
@@ -113,6 +127,20 @@ ProgUsage::ProgUsage (int argc, char** argv)
     + "  -profmaxstates <S>, -profmaxmem <M>\n"
     + "                  Limit profile to at most S states, or to use at most M% of\n"
     + "                   memory for DP matrix (default is -profmaxmem " + to_string(DefaultMaxDPMemoryFraction) + ")\n"
+    + "\n"
+    + "Very large trees can be reconstructed by divide-and-conquer: the tree is\n"
+    + "partitioned into clades of bounded size, each clade is reconstructed in\n"
+    + "turn, and the clade-root profiles are then aligned along the backbone.\n"
+    + "Clade-root profiles can be saved to disk, and reused by later runs.\n"
+    + "\n"
+    + "  -maxclade <n>   Partition tree into clades of at most n leaves\n"
+    + "  -cladedir <d>   Save clade-root profiles to (and reuse them from) directory d\n"
+    + "\n"
+    + "DP matrices too big for memory can be kept in a memory-mapped scratch file\n"
+    + "on disk instead. This is slower, but limits profile size (-profmaxmem) by\n"
+    + "free disk space rather than by RAM.\n"
+    + "\n"
+    + "  -dpscratch <d>  Store DP matrices in scratch files in directory d\n"
     //    + "  -profminlen <L>, -profmaxlen <L>\n"
     //    + "                  Constrain permissible range of ancestral sequence lengths\n"
     //    + "                   (use with care; extreme/unreachable values may cause program to hang!)\n"
@@ -132,6 +160,20 @@ ProgUsage::ProgUsage (int argc, char** argv)
     + "  -mcmc           Run MCMC sampler after reconstruction\n"
     + "  -samples <N>    Number of MCMC iterations per sequence (default " + to_string(DefaultMCMCSamplesPerSeq) + ")\n"
     + "  -trace <file>   Specify MCMC trace filename\n"
+    + "  -summary <file> Write streaming MCMC summaries (split frequencies, per-branch indel\n"
+    + "                   counts, alignment column support, log-likelihood ESS) to file\n"
+    + "  -bintrace <file>\n"
+    + "                  Write compressed binary MCMC trace (expand with '" + prog + " expand')\n"
+    + "  -keyframe <K>   Write a full state to binary trace every K samples (default " + to_string(DefaultTraceKeyframeInterval) + ")\n"
+    + "  -thin <N>       Steps per dataset between summary records (default " + to_string(DefaultMCMCSummaryInterval) + ")\n"
+    + "  -burnin <N>     Number of unlogged burn-in iterations per sequence (default " + to_string(DefaultMCMCBurnInPerSeq) + ")\n"
+    + "  -adapt          Adapt move rates during burn-in (adapted rates depend on\n"
+    + "                   timings, so runs are no longer reproducible from -seed)\n"
+    + "  -mcmccheckpoint <file>\n"
+    + "                  Periodically save MCMC state to file; if the file exists, resume from it\n"
+    + "                   (the run must use the same data, seed & MCMC options)\n"
+    + "  -checkpointevery <N>\n"
+    + "                  MCMC iterations between checkpoints (default " + to_string(DefaultMCMCCheckpointInterval) + ")\n"
     + "  -fixtree        Fix tree during MCMC (sample alignment only)\n"
     + "  -fixalign       Fix alignment during MCMC (sample tree only)\n"
     //    + "  -fixguide       Fix guide alignment during MCMC\n"
@@ -176,6 +218,11 @@ ProgUsage::ProgUsage (int argc, char** argv)
     + "  -fast           Run in fast mode. Shorthand for the following:\n"
     + "                   " + join(Reconstructor::fastAliasArgs," ") + "\n"
     + "\n"
+    + "  -budget-time <S>, -budget-mem <M>\n"
+    + "                  Choose settings to fit in S seconds and M megabytes of DP\n"
+    + "                   memory, by timing a pilot run on a subset of the sequences.\n"
+    + "                   Options given explicitly are left as they are\n"
+    + "\n"
     + "Model-fitting and event-counting options\n"
     + "~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n"
     + "In reconstruction mode, any supplied alignment will be interpreted as a hint,\n"
@@ -189,6 +236,8 @@ ProgUsage::ProgUsage (int argc, char** argv)
     + "  -mininc <n>     EM convergence threshold as relative log-likelihood increase\n"
     + "                   (default is " + TOSTRING(DefaultMinEMImprovement) + ")\n"
     + "  -maxiter <n>    Max number of EM iterations (default " + to_string(DefaultMaxEMIterations) + ")\n"
+    + "  -accel          Accelerate EM by SQUAREM extrapolation between E-steps\n"
+    + "  -warmstart      Band each EM E-step around the previous E-step's alignment\n"
     + "  -nolaplace      Do not add Laplace +1 pseudocounts during model-fitting\n"
     + "  -fixsubrates    Do not estimate substitution rates or initial composition\n"
     + "  -fixgaprates    Do not estimate indel rates or length distributions\n"
@@ -202,6 +251,8 @@ ProgUsage::ProgUsage (int argc, char** argv)
     + "  -V, --version   Print GNU-style version info\n"
     + "  -h, --help      Print help message\n"
     + "  -seed <n>       Seed random number generator (" + DPMatrix::random_engine_name() + "; default seed " + to_string(DPMatrix::random_engine::default_seed) + ")\n"
+    + "  -threads <n>    Number of threads (default is the number of available CPUs).\n"
+    + "                   Only MCMC uses them, to sample several datasets in parallel\n"
     + "\n"
     + "REFERENCES\n"
     + "\n"
@@ -253,6 +304,7 @@ int main (int argc, char** argv) {
       usage.unlimitImplicitSwitches = true;
 
       while (logger.parseLogArgs (argvec)
+	     || taskPool.parseThreadArgs (argvec)
 	     || recon.parseReconArgs (argvec)
 	     || recon.parseModelArgs (argvec)
 	     || recon.parseProfileArgs (argvec, false)
@@ -280,6 +332,7 @@ int main (int argc, char** argv) {
     usage.unlimitImplicitSwitches = true;
 
     while (logger.parseLogArgs (argvec)
+	   || taskPool.parseThreadArgs (argvec)
 	   || recon.parseSimulatorArgs (argvec)
 	   || recon.parseModelArgs (argvec)
 	   || usage.parseUnknown())
@@ -299,6 +352,7 @@ int main (int argc, char** argv) {
     usage.unlimitImplicitSwitches = true;
 
     while (logger.parseLogArgs (argvec)
+	   || taskPool.parseThreadArgs (argvec)
 	   || recon.parsePremadeArgs (argvec)
 	   || recon.parseModelArgs (argvec)
 	   || recon.parseProfileArgs (argvec, true)
@@ -314,6 +368,20 @@ int main (int argc, char** argv) {
     recon.sampleAll();
     recon.writeRecon (cout);
 
+  } else if (command == "expand" || command == "e") {
+
+    usage.implicitSwitches.push_back (string ("-expand"));
+    usage.unlimitImplicitSwitches = true;
+
+    while (logger.parseLogArgs (argvec)
+	   || recon.parseExpandArgs (argvec)
+	   || recon.parseModelArgs (argvec)
+	   || usage.parseUnknown())
+      { }
+
+    recon.loadModel();
+    recon.expandTraces();
+
   } else if (command == "count" || command == "c") {
 
     recon.reconstructRoot = false;
@@ -324,6 +392,7 @@ int main (int argc, char** argv) {
     usage.unlimitImplicitSwitches = true;
 
     while (logger.parseLogArgs (argvec)
+	   || taskPool.parseThreadArgs (argvec)
 	   || recon.parsePremadeArgs (argvec)
 	   || recon.parseModelArgs (argvec)
 	   || recon.parseProfileArgs (argvec, true)
@@ -348,6 +417,7 @@ int main (int argc, char** argv) {
     usage.unlimitImplicitSwitches = true;
     
     while (logger.parseLogArgs (argvec)
+	   || taskPool.parseThreadArgs (argvec)
 	   || recon.parseSumArgs (argvec)
 	   || usage.parseUnknown())
       { }
@@ -365,6 +435,7 @@ int main (int argc, char** argv) {
     usage.unlimitImplicitSwitches = true;
     
     while (logger.parseLogArgs (argvec)
+	   || taskPool.parseThreadArgs (argvec)
 	   || recon.parsePremadeArgs (argvec)
 	   || recon.parseModelArgs (argvec)
 	   || recon.parseProfileArgs (argvec, true)
@@ -381,6 +452,18 @@ int main (int argc, char** argv) {
     recon.fit();
     recon.writeModel (cout);
     
+  } else if (command == "compile-model") {
+
+    usage.implicitSwitches.push_back (string ("-model"));
+
+    while (logger.parseLogArgs (argvec)
+	   || recon.parseModelArgs (argvec)
+	   || usage.parseUnknown())
+      { }
+
+    recon.loadModel();
+    recon.writeCompiledModel (cout);
+    
   } else if (!usage.parseUnknownCommand (command, HISTORIAN_VERSION, false)) {
 
     // default: reconstruct
@@ -0,0 +1,68 @@
+#!/usr/bin/env node
+// Times historian builds on the same command, e.g. to compare the scalar
+// (make emscripten) and SIMD + threads (make emscripten-simd) WebAssembly builds.
+// Run from the top-level directory:
+//   node wasm/bench.js [-runs N] [build ...] [-- historian args]
+// Builds are wasm/*.js files (run via wasm/cmdwrap.js) or native binaries.
+// By default it times whichever of wasm/historian.js, wasm/historian-simd.js & bin/historian exist,
+// on "recon data/gp120.fa". Each run includes module load & compile time.
+// recon does not use the thread pool (only mcmc does, across datasets),
+// so on the default command the two WebAssembly builds differ by SIMD alone.
+
+var fs = require ('fs')
+var child_process = require ('child_process')
+
+var args = process.argv.slice(2)
+var runs = 3, builds = [], histArgs = ['recon', 'data/gp120.fa']
+while (args.length) {
+  var arg = args.shift()
+  if (arg === '-runs')
+    runs = parseInt (args.shift())
+  else if (arg === '--') {
+    histArgs = args
+    args = []
+  } else
+    builds.push (arg)
+}
+if (!builds.length)
+  builds = ['wasm/historian.js', 'wasm/historian-simd.js', 'bin/historian'].filter ((b) => fs.existsSync(b))
+if (!builds.length) {
+  console.error ('No builds found: try "make emscripten" and "make emscripten-simd"')
+  process.exit (1)
+}
+
+var timeRun = (build) => {
+  var isWasm = build.match(/\.js$/)
+  var cmd = isWasm ? process.execPath : build
+  var cmdArgs = isWasm ? ['wasm/cmdwrap.js', build].concat(histArgs) : histArgs
+  var start = process.hrtime()
+  var result = child_process.spawnSync (cmd, cmdArgs, { encoding: 'utf8', maxBuffer: 1 << 30 })
+  var elapsed = process.hrtime (start)
+  if (result.status !== 0) {
+    console.error (build + ' failed:\n' + result.stderr)
+    process.exit (1)
+  }
+  return { seconds: elapsed[0] + elapsed[1] / 1e9, stdout: result.stdout }
+}
+
+console.log ('Command: historian ' + histArgs.join(' ') + ' (' + runs + ' runs per build)')
+var baseline = null, baselineStdout = null
+builds.forEach ((build) => {
+  var times = [], stdout = null
+  for (var n = 0; n < runs; ++n) {
+    var r = timeRun (build)
+    times.push (r.seconds)
+    stdout = r.stdout
+  }
+  times.sort ((a, b) => a - b)
+  var median = times[Math.floor (times.length / 2)]
+  if (baseline === null) {
+    baseline = median
+    baselineStdout = stdout
+  }
+  console.log (build
+	       + ': median ' + median.toFixed(3) + 's'
+	       + ', min ' + times[0].toFixed(3) + 's'
+	       + ', speedup ' + (baseline / median).toFixed(2) + 'x'
+	       + (stdout === baselineStdout ? '' : ' (output differs from ' + builds[0] + ')'))
+})